@@ -37,6 +37,7 @@ typedef void (*AudioServerSocPTSError)( void *userData, unsigned count );
 typedef void (*AudioServerSocUnderflow)( void *userData, unsigned count, unsigned bufferedBytes, unsigned queuedFrames );
 typedef void (*AudioServerSocEOS)( void *userData );
 typedef void (*AudioServerSocCaptureData)( void *userData, AudSrvCaptureParameters *params, unsigned char *data, int datalen );
+typedef void (*AudioServerSocHandleRelease)( void *userData, unsigned long long dataHandle );
 
 bool AudioServerSocInit();
 void AudioServerSocTerm();
@@ -58,11 +59,14 @@ bool AudioServerSocAudioDataHandle( AudSrvSocClient audsrvsocclient, unsigned lo
 bool AudioServerSocMute( AudSrvSocClient audsrvsocclient, bool mute );
 bool AudioServerSocVolume( AudSrvSocClient audsrvsocclient, float volume );
 bool AudioServerSocGetStatus( AudSrvSoc audsrvsoc, AudSrvSocClient audsrvsocclient, AudSrvSessionStatus *status );
+bool AudioServerSocGetBufferLevel( AudSrvSocClient audsrvsocclient, unsigned *bufferedBytes );
+bool AudioServerSocGetLatency( AudSrvSocClient audsrvsocclient, AudSrvLatency *latency );
 void AudioServerSocEnableEOSDetection( AudSrvSocClient audsrvsocclient, AudioServerSocEOS cb, void *userData );
 void AudioServerSocDisableEOSDetection( AudSrvSocClient audsrvsocclient );
 void AudioServerSocSetFirstAudioFrameCallback( AudSrvSocClient audsrvsocclient, AudioServerSocFirstAudio cb, void *userData );
 void AudioServerSocSetPTSErrorCallback( AudSrvSocClient audsrvsocclient, AudioServerSocPTSError cb, void *userData );
 void AudioServerSocSetUnderflowCallback( AudSrvSocClient audsrvsocclient, AudioServerSocUnderflow cb, void *userData );
+void AudioServerSocSetHandleReleaseCallback( AudSrvSocClient audsrvsocclient, AudioServerSocHandleRelease cb, void *userData );
 bool AudioServerSocSetCaptureCallback( AudSrvSocClient audsrvsocclient, const char *sessionName, AudioServerSocCaptureData cb, AudSrvCaptureParameters *params, void *userData );
 
 #endif
@@ -20,6 +20,7 @@
 #ifndef _AUDIOSERVER_H
 #define _AUDIOSERVER_H
 
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -53,6 +54,8 @@ typedef enum _AUDSRV_SESSION_EVENT
 
 #define AUDSRV_MAX_SESSION_NAME_LEN (255)
 
+#define AUDSRV_INVALID_SESSION_HANDLE (0)
+
 typedef struct _AudSrvSessionInfo
 {
    int pid;
@@ -60,6 +63,12 @@ typedef struct _AudSrvSessionInfo
    char sessionName[AUDSRV_MAX_SESSION_NAME_LEN+1];
 } AudSrvSessionInfo;
 
+typedef struct _AudSrvSessionHandleInfo
+{
+   AudSrvSessionInfo info;
+   unsigned sessionHandle;
+} AudSrvSessionHandleInfo;
+
 typedef struct _AudSrvSessionStatus
 {
    bool globalMuted;
@@ -72,6 +81,37 @@ typedef struct _AudSrvSessionStatus
    char sessionName[AUDSRV_MAX_SESSION_NAME_LEN+1];
 } AudSrvSessionStatus;
 
+typedef struct _AudSrvLatency
+{
+   long long timestamp;
+   unsigned clientBytes;
+   unsigned serverBytes;
+   unsigned serverFrames;
+   unsigned socBytes;
+   unsigned socFrames;
+   unsigned sampleRate;
+   unsigned outputDelay;
+} AudSrvLatency;
+
+/*
+ * Header of a memory region shared with the server for playback data.  The
+ * data area of size bytes follows the header.  The server sets consumed to the
+ * sequence number of each AudioServerAudioDataRing commit once the committed
+ * range has been passed to the SoC and may be reused.
+ */
+typedef struct _AudSrvDataRing
+{
+   unsigned magic;
+   unsigned size;
+   unsigned char pad0[56];
+   volatile unsigned long long consumed;
+   unsigned char pad1[56];
+} AudSrvDataRing;
+
+#define AUDSRV_DATA_RING_MAGIC (0x41534452) // 'ASDR'
+#define AUDSRV_DATA_RING_DATA(r) (((unsigned char*)(r))+sizeof(AudSrvDataRing))
+#define AUDSRV_DATA_RING_MAX_SIZE (16*1024*1024)
+
 #define AUDSRV_MAX_MIME_LEN (255)
 typedef struct _AudSrvAudioInfo
 {
@@ -95,15 +135,47 @@ typedef struct _AudSrvCaptureParameters
    unsigned fifoSize;
 } AudSrvCaptureParameters;
 
+#define AUDSRV_SESSIONCONTROL_Volume (0x0001)
+#define AUDSRV_SESSIONCONTROL_Mute (0x0002)
+#define AUDSRV_SESSIONCONTROL_Global (0x0004)
+
+#define AUDSRV_MAX_SESSION_CONTROLS (16)
+#define AUDSRV_MAX_SUBSESSIONS (16)
+
+#define AUDSRV_RESULT_Timeout (-1)
+#define AUDSRV_RESULT_Cancelled (-2)
+#define AUDSRV_RESULT_Error (-3)
+
+#define AUDSRV_PCM_FORMAT_S16LE (0)
+#define AUDSRV_PCM_FORMAT_S24_32LE (1)
+#define AUDSRV_PCM_FORMAT_S32LE (2)
+#define AUDSRV_PCM_FORMAT_F32LE (3)
+
+typedef struct _AudSrvSessionControl
+{
+   unsigned flags;
+   const char *sessionName;
+   bool mute;
+   float volume;
+} AudSrvSessionControl;
+
 typedef void (*AudioServerEnumSessions)( void *userData, int result, int count, AudSrvSessionInfo *sessionInfo );
+typedef void (*AudioServerEnumSessionHandles)( void *userData, int result, int count, AudSrvSessionHandleInfo *sessionInfo );
 typedef void (*AudioServerSessionStatus)( void *userData, int result, AudSrvSessionStatus *sessionStatus );
+typedef void (*AudioServerLatency)( void *userData, int result, AudSrvLatency *latency );
 typedef void (*AudioServerSessionEvent)( void *userData, int event, AudSrvSessionInfo *sessionInfo );
+typedef void (*AudioServerSessionHandleEvent)( void *userData, int event, AudSrvSessionHandleInfo *sessionInfo );
 typedef void (*AudioServerFirstAudio)( void *userData );
 typedef void (*AudioServerPTSError)( void *userData, unsigned count );
 typedef void (*AudioServerUnderflow)( void *userData, unsigned count, unsigned bufferedBytes, unsigned queuedFrames );
+typedef void (*AudioServerDataRequest)( void *userData, unsigned credit, unsigned bufferedBytes );
+typedef void (*AudioServerDiscontinuity)( void *userData, bool connected );
 typedef void (*AudioServerEOS)( void *userData );
 typedef void (*AudioServerCapture)( void *userData, AudSrvCaptureParameters *params, unsigned char *data, int dataLen );
 typedef void (*AudioServerCaptureDone)( void *userData );
+typedef void (*AudioServerCaptureOverrun)( void *userData, unsigned long long position, unsigned droppedBytes );
+typedef void (*AudioServerHandleRelease)( void *userData, unsigned count, unsigned long long *dataHandles );
+typedef void (*AudioServerFlushAck)( void *userData, unsigned generation );
 
 /**
  * AudioServerInit
@@ -127,6 +199,17 @@ void AudioServerTerm( void );
  */
 AudSrv AudioServerConnect( const char *name );
 
+/**
+ * AudioServerConnectSubSession
+ *
+ * Establish an additional session that shares the connection, socket and receive thread of an existing
+ * session obtained from AudioServerConnect.  The returned handle is used with the rest of this API like
+ * any other session and is closed with AudioServerDisconnect.  Disconnecting the session that owns the
+ * connection also closes its sub-sessions, after which their handles must not be used.  At most
+ * AUDSRV_MAX_SUBSESSIONS sub-sessions may be open on one connection at a time.
+ */
+AudSrv AudioServerConnectSubSession( AudSrv audsrv );
+
 /**
  * AudioServerDisconnect
  *
@@ -158,14 +241,34 @@ bool AudioServerGetSessionType( AudSrv audsrv, int *sessionType );
  */
 bool AudioServerGetSessionIsPrivate( AudSrv audsrv, bool *sessionIsPrivate );
 
+/**
+ * AudioServerGetSessionHandle
+ *
+ * Obtain the handle the server assigned to this session.  The handle is delivered asynchronously after
+ * AudioServerInitSession so this returns false until it has arrived.  A session handle identifies exactly
+ * one session for as long as that session exists and can be passed to other clients in place of the
+ * session name.
+ */
+bool AudioServerGetSessionHandle( AudSrv audsrv, unsigned *sessionHandle );
+
 /**
  * AudioServerSessionAttach
  *
  * Attach an observer session to an existing named session.  While attached to an existing session, the 
  * obserer session can perform actions such as mute and volume control on the attached session. 
+ * The name is resolved to a session handle once in the background when it identifies exactly one session.
+ * Requests carry the name as well so they still reach a later session of that name once the resolved one ends.
  */
 bool AudioServerSessionAttach( AudSrv audsrv, const char *sessionName );
 
+/**
+ * AudioServerSessionAttachByHandle
+ *
+ * Attach an observer session to an existing session identified by a session handle as reported by
+ * AudioServerEnumerateSessionHandles, a session handle event, or AudioServerGetSessionHandle.
+ */
+bool AudioServerSessionAttachByHandle( AudSrv audsrv, unsigned sessionHandle );
+
 /**
  * AudioServerSessionDetach
  *
@@ -181,6 +284,16 @@ bool AudioServerSessionDetach( AudSrv audsrv );
  */
 bool AudioServerSetAudioInfo( AudSrv audsrv, AudSrvAudioInfo *info );
 
+/**
+ * AudioServerSetPcmFormat
+ *
+ * Declare the sample format, one of AUDSRV_PCM_FORMAT_*, of PCM sent with AudioServerAudioData
+ * and AudioServerAudioDataRing.  The server converts S24_32LE, S32LE and F32LE samples to S16LE
+ * with dither so clients can pass decoder output through unchanged.  The default is
+ * AUDSRV_PCM_FORMAT_S16LE.
+ */
+bool AudioServerSetPcmFormat( AudSrv audsrv, unsigned format );
+
 /**
  * AudioServerBasetime
  *
@@ -212,10 +325,30 @@ bool AudioServerPause( AudSrv audsrv, bool pause );
 /**
  * AudioServerFlush
  *
- * Flush any buffered audio data
+ * Flush any buffered audio data.  Each flush starts a new flush generation: data sent before
+ * the flush that the server has not yet played is discarded without reaching the SoC, even
+ * when it is still queued behind the flush.
  */
 bool AudioServerFlush( AudSrv audsrv );
 
+/**
+ * AudioServerGetFlushGeneration
+ *
+ * Get the flush generation started by the most recent AudioServerFlush, 0 before any flush.
+ * Returns false if that flush was sent without a generation, as happens with servers that
+ * do not support flush generations; no flush acknowledgement will follow in that case.
+ */
+bool AudioServerGetFlushGeneration( AudSrv audsrv, unsigned *generation );
+
+/**
+ * AudioServerSetFlushAckCallback
+ *
+ * Provide a callback to be invoked with the generation of each flush once the server has
+ * completed it.  From then on data of that generation is played.  Pass NULL to cancel
+ * registration.
+ */
+void AudioServerSetFlushAckCallback( AudSrv audsrv, AudioServerFlushAck cb, void *userData );
+
 /**
  * AudioServerAudioSync
  *
@@ -230,6 +363,43 @@ bool AudioServerAudioSync( AudSrv audsrv, long long nowMicros, long long stc );
  */
 bool AudioServerAudioData( AudSrv audsrv, unsigned char *data, unsigned len );
 
+/**
+ * AudioServerAudioDataNonBlocking
+ *
+ * Pass a chunk of audio data for playback without blocking.  Returns the number of bytes accepted,
+ * which may be less than len, or 0 if the connection can accept nothing now (would block), or -1 on
+ * error.  After a would block result wait for the descriptor from AudioServerGetPollFd to become
+ * writable, or call AudioServerWaitWritable, before trying again.
+ */
+int AudioServerAudioDataNonBlocking( AudSrv audsrv, unsigned char *data, unsigned len );
+
+/**
+ * AudioServerAudioDataV
+ *
+ * Pass several chunks of audio data for playback.  Each iovec entry is delivered to the server
+ * as its own chunk, exactly as if passed to AudioServerAudioData in order, but the whole set is
+ * sent with as few system calls as possible.
+ */
+bool AudioServerAudioDataV( AudSrv audsrv, const struct iovec *iov, int count );
+
+/**
+ * AudioServerGetPollFd
+ *
+ * Get a descriptor that may be added to a main loop to wait for POLLOUT after
+ * AudioServerAudioDataNonBlocking reports would block.  The descriptor must only be polled: never
+ * read, written or closed.  Returns -1 on error.
+ */
+int AudioServerGetPollFd( AudSrv audsrv );
+
+/**
+ * AudioServerWaitWritable
+ *
+ * Wait up to timeoutMs milliseconds (-1 to wait indefinitely) until audio data can be accepted
+ * without blocking.  Returns true if the connection is writable, and false without waiting
+ * while another call is sending on the connection.
+ */
+bool AudioServerWaitWritable( AudSrv audsrv, int timeoutMs );
+
 /**
  * AudioServerAudioDataHandle
  *
@@ -237,6 +407,39 @@ bool AudioServerAudioData( AudSrv audsrv, unsigned char *data, unsigned len );
  */
 bool AudioServerAudioDataHandle( AudSrv audsrv, unsigned long long dataHandle );
 
+/**
+ * AudioServerEnableDataRing
+ *
+ * Share a memory region with the server so audio data can be passed by offset with
+ * AudioServerAudioDataRing instead of being copied over the connection.  fd must be a memfd
+ * sealed with F_SEAL_SHRINK holding an AudSrvDataRing header, with magic and size filled in,
+ * followed by the data area.  The caller keeps ownership of fd and of its own mapping; the
+ * library keeps a duplicate so the region can be shared again with a restarted server.  Pass
+ * -1 to stop sharing.
+ */
+bool AudioServerEnableDataRing( AudSrv audsrv, int fd );
+
+/**
+ * AudioServerAudioDataRing
+ *
+ * Pass len bytes of audio data for playback found at offset in the data area of the region
+ * shared by AudioServerEnableDataRing.  On success sequence receives a number that the
+ * server stores in the consumed field of the ring header once the range may be reused.
+ * Sequence numbers increase by one with each commit.
+ */
+bool AudioServerAudioDataRing( AudSrv audsrv, unsigned offset, unsigned len, unsigned long long *sequence );
+
+/**
+ * AudioServerSetHandleReleaseCallback
+ *
+ * Provide a callback to be invoked with the data handles passed to AudioServerAudioDataHandle
+ * once the SoC has finished with them.  Handles are batched, with at most one callback per
+ * server period unless a batch fills, and handles discarded by a flush are returned as soon as
+ * the flush completes.  Handles outstanding when the connection to the server is lost are
+ * never returned and should be reclaimed by the caller.  Pass NULL to cancel registration.
+ */
+bool AudioServerSetHandleReleaseCallback( AudSrv audsrv, AudioServerHandleRelease cb, void *userData );
+
 /**
  * AudioServerGlobalMute
  *
@@ -265,20 +468,85 @@ bool AudioServerGlobalVolume( AudSrv audsrv, float volume );
  */
 bool AudioServerVolume( AudSrv audsrv, float volume );
 
+/**
+ * AudioServerSessionControl
+ *
+ * Apply a list of volume and mute operations as a single transaction.  Each entry selects the
+ * operations to perform with AUDSRV_SESSIONCONTROL_* flags.  An entry flagged as global applies to
+ * the global level, otherwise it applies to the named session, or to the attached session when no
+ * name is given.  The server applies all entries together so the intermediate states are never heard.
+ * At most AUDSRV_MAX_SESSION_CONTROLS entries may be passed.
+ */
+bool AudioServerSessionControl( AudSrv audsrv, int count, AudSrvSessionControl *controls );
+
 /**
  * AudioServerEnumerateSessions
  *
- * Get a list of all sessions.
+ * Get a list of all sessions.  If the server does not reply within 5 seconds the callback is invoked
+ * with result AUDSRV_RESULT_Timeout and no session list.  Requests still pending at AudioServerDisconnect
+ * complete with result AUDSRV_RESULT_Cancelled.
  */
 bool AudioServerEnumerateSessions( AudSrv audsrv, AudioServerEnumSessions cb, void *userData );
 
+/**
+ * AudioServerEnumerateSessionHandles
+ *
+ * Get a list of all sessions with their session handles.  Results are as for AudioServerEnumerateSessions.
+ * Session handles are reported as AUDSRV_INVALID_SESSION_HANDLE when the server predates them or when
+ * called before AudioServerGetSessionHandle succeeds.
+ */
+bool AudioServerEnumerateSessionHandles( AudSrv audsrv, AudioServerEnumSessionHandles cb, void *userData );
+
+/**
+ * AudioServerEnumerateSessionsSync
+ *
+ * Get a list of all sessions with their session handles, waiting up to timeoutMs for the reply.  On
+ * entry count gives the number of entries available in sessionInfo; on return it gives the number of
+ * sessions, of which at most the original count are stored.  Returns the result the callback form
+ * would receive, 0 on success, or AUDSRV_RESULT_Error if the request could not be sent.  May be called
+ * from a callback, in which case the reply is dispatched on the calling thread, but not from a capture
+ * data callback.
+ */
+int AudioServerEnumerateSessionsSync( AudSrv audsrv, AudSrvSessionHandleInfo *sessionInfo, int *count, int timeoutMs );
+
 /**
  * AudioServerGetSessionStatus
  *
- * Get status of session.
+ * Get status of session.  Timeout and cancellation are reported as for AudioServerEnumerateSessions,
+ * with a NULL status.
  */
 bool AudioServerGetSessionStatus( AudSrv audsrv, AudioServerSessionStatus cb, void *userData );
 
+/**
+ * AudioServerGetSessionStatusSync
+ *
+ * Get status of session, waiting up to timeoutMs for the reply.  Results and restrictions are as for
+ * AudioServerEnumerateSessionsSync.
+ */
+int AudioServerGetSessionStatusSync( AudSrv audsrv, AudSrvSessionStatus *sessionStatus, int timeoutMs );
+
+/**
+ * AudioServerGetLatency
+ *
+ * Get a report of how much audio is queued between AudioServerAudioData and the output.  The levels
+ * are sampled together at timestamp (CLOCK_MONOTONIC microseconds): clientBytes not yet sent by
+ * this library, serverBytes of this session's audio received by the server but not yet passed to
+ * the SoC, socBytes and socFrames queued in the SoC, and outputDelay, the fixed delay in
+ * microseconds after the SoC queue.  serverFrames is derived from the SoC byte to frame ratio.
+ * Frame counts and sampleRate are 0 when the SoC cannot report them, for example for compressed
+ * data before decode.  Timeout and cancellation are reported as for AudioServerEnumerateSessions,
+ * with a NULL report.
+ */
+bool AudioServerGetLatency( AudSrv audsrv, AudioServerLatency cb, void *userData );
+
+/**
+ * AudioServerGetLatencySync
+ *
+ * Get a latency report, waiting up to timeoutMs for the reply.  Results and restrictions are as for
+ * AudioServerEnumerateSessionsSync.
+ */
+int AudioServerGetLatencySync( AudSrv audsrv, AudSrvLatency *latency, int timeoutMs );
+
 /**
  * AudioServerEnableSessionEvent
  *
@@ -287,6 +555,14 @@ bool AudioServerGetSessionStatus( AudSrv audsrv, AudioServerSessionStatus cb, vo
  */
 bool AudioServerEnableSessionEvent( AudSrv audsrv, AudioServerSessionEvent cb, void *userData );
 
+/**
+ * AudioServerEnableSessionHandleEvent
+ *
+ * As AudioServerEnableSessionEvent, with the session handle of each added or removed session.  Replaces
+ * any callback registered with AudioServerEnableSessionEvent and vice versa.
+ */
+bool AudioServerEnableSessionHandleEvent( AudSrv audsrv, AudioServerSessionHandleEvent cb, void *userData );
+
 /**
  * AudioServerDisableSessionEvent
  *
@@ -332,6 +608,28 @@ void AudioServerSetPTSErrorCallback( AudSrv audsrv, AudioServerPTSError cb, void
  */
 void AudioServerSetUnderflowCallback( AudSrv audsrv, AudioServerUnderflow cb, void *userData );
 
+/**
+ * AudioServerSetDataRequestCallback
+ *
+ * Enable pull mode delivery.  Whenever the amount of audio data queued for the session drops below
+ * watermark bytes the server invokes the callback with a byte credit: the amount the client should
+ * supply via AudioServerAudioData to bring the queued level back up to twice the watermark.  Pass
+ * NULL or a watermark of 0 to return to push mode.
+ */
+bool AudioServerSetDataRequestCallback( AudSrv audsrv, AudioServerDataRequest cb, unsigned watermark, void *userData );
+
+/**
+ * AudioServerSetDiscontinuityCallback
+ *
+ * Provide a callback to be invoked when the connection to the server is lost (connected false) and
+ * again once it has been re-established (connected true).  While disconnected the library retries
+ * with backoff; on reconnecting it restores the session: init, attach, audio info, basetime, volume,
+ * mute, EOS detection, session events, data requests, capture and play/pause state.  Audio data
+ * submitted while disconnected is lost, as are pending enumerate and status requests, which complete
+ * with AUDSRV_RESULT_Cancelled.  Pass NULL to cancel registration.
+ */
+void AudioServerSetDiscontinuityCallback( AudSrv audsrv, AudioServerDiscontinuity cb, void *userData );
+
 /**
  * AudioServerStartCapture
  *
@@ -341,6 +639,14 @@ void AudioServerSetUnderflowCallback( AudSrv audsrv, AudioServerUnderflow cb, vo
  */ 
 bool AudioServerStartCapture( AudSrv audsrv, const char *sessionName, AudioServerCapture cb, AudSrvCaptureParameters *params, void *userData );
 
+/**
+ * AudioServerStartCaptureByHandle
+ *
+ * Start an audio capture session of the private session identified by a session handle.  Otherwise the
+ * same as AudioServerStartCapture.
+ */
+bool AudioServerStartCaptureByHandle( AudSrv audsrv, unsigned sessionHandle, AudioServerCapture cb, AudSrvCaptureParameters *params, void *userData );
+
 /**
  * AudioServerStopCapture
  *
@@ -350,10 +656,51 @@ bool AudioServerStartCapture( AudSrv audsrv, const char *sessionName, AudioServe
  */
 bool AudioServerStopCapture( AudSrv audsrv, AudioServerCaptureDone cb, void *userData );
 
+/**
+ * AudioServerEnableCaptureRing
+ *
+ * Have the server write captured data into a shared memory ring of at least ringSize bytes instead of
+ * passing it to the capture callback, which may then be NULL.  The client drains the ring at its own
+ * pace with AudioServerCaptureRead; only parameter changes and overruns are carried on the connection.
+ * Call before AudioServerStartCapture.  Pass a ringSize of 0 to return to callback delivery.  Returns 0
+ * on success, AUDSRV_RESULT_Timeout if the server did not respond within timeoutMs, or
+ * AUDSRV_RESULT_Error.
+ */
+int AudioServerEnableCaptureRing( AudSrv audsrv, unsigned ringSize, int timeoutMs );
+
+/**
+ * AudioServerGetCaptureFd
+ *
+ * Get a descriptor that polls readable when the server has written to the capture ring, or -1 if no
+ * ring is enabled.  The descriptor stays the same across reconnection.  It must not be closed or read
+ * by the caller: AudioServerCaptureRead consumes its events.
+ */
+int AudioServerGetCaptureFd( AudSrv audsrv );
+
+/**
+ * AudioServerCaptureRead
+ *
+ * Copy up to len bytes of captured data from the capture ring.  Returns the number of bytes copied,
+ * which may be 0, or -1 if no ring is enabled.  A single read never spans a change of capture parameters:
+ * if params is not NULL it receives the parameters that apply to the data returned.  The capture fd
+ * stays readable while a read leaves data behind that the next read can return.
+ */
+int AudioServerCaptureRead( AudSrv audsrv, unsigned char *data, int len, AudSrvCaptureParameters *params );
+
+/**
+ * AudioServerSetCaptureOverrunCallback
+ *
+ * Provide a callback to be invoked when the server had to drop captured data because the capture ring
+ * was full.  position is the ring position of the gap and droppedBytes the amount of data lost there.
+ * Pass NULL to cancel registration.
+ */
+void AudioServerSetCaptureOverrunCallback( AudSrv audsrv, AudioServerCaptureOverrun cb, void *userData );
+
 /**
  * AudioServerGetSessionStatus
  *
- * Get status of session.
+ * Get status of session.  Timeout and cancellation are reported as for AudioServerEnumerateSessions,
+ * with a NULL status.
  */
 bool AudioServerGetCaptureSessionStatus( AudSrv audsrv, const char *sessionName, AudioServerSessionStatus cb, void *userData );
 
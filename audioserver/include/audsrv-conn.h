@@ -27,8 +27,16 @@
 #ifndef _AUDSRV_CONN_H
 #define _AUDSRV_CONN_H
 
+#include <pthread.h>
+
+#define AUDSRV_CONN_MAX_FDS (4)
+
 typedef struct _AudsrvConn
 {
+   struct _AudsrvConn *parent; // sub-session: shares the parent's socket and receive buffer
+   unsigned sessionId;
+   unsigned sendSessionId; // session selected by the last message sent
+   pthread_mutex_t sendMutex;
    int fdSocket;
    unsigned sendCapacity;
    unsigned char *sendbuff;
@@ -37,25 +45,44 @@ typedef struct _AudsrvConn
    int head; // read from head
    int tail; // write to tail
    int count;
+   unsigned long long recvTotal; // bytes received since init or reset
    bool peerDisconnected;
+   unsigned pendCapacity;
+   unsigned char *pendbuff;
+   int pendOffset;
+   int pendCount;
+   int fdCount; // descriptors received with SCM_RIGHTS and not yet claimed
+   int fds[AUDSRV_CONN_MAX_FDS];
 } AudsrvConn;
 
 
 AudsrvConn* audsrv_conn_init( int fd, unsigned sendBufferSize, unsigned recvBufferSize );
+AudsrvConn* audsrv_conn_init_sub( AudsrvConn *parent, unsigned sessionId, unsigned sendBufferSize );
 void audsrv_conn_term( AudsrvConn *conn );
+void audsrv_conn_reset( AudsrvConn *conn );
 int audsrv_conn_put_u16( unsigned char *p, unsigned short n );
 int audsrv_conn_put_u32( unsigned char *p, unsigned n );
 int audsrv_conn_put_u64( unsigned char *p, unsigned long long n );
 int audsrv_conn_put_string( unsigned char *p, const char *s );
 int audsrv_conn_send( AudsrvConn *conn, unsigned char *data1, int len1, unsigned char *data2, int len2 );
+int audsrv_conn_sendv( AudsrvConn *conn, struct iovec *iov, int count );
+int audsrv_conn_send_fds( AudsrvConn *conn, unsigned char *data, int len, int *fds, int fdCount );
+int audsrv_conn_send_nonblocking( AudsrvConn *conn, unsigned char *data1, int len1, unsigned char *data2, int len2 );
+int audsrv_conn_flush( AudsrvConn *conn, bool block );
+int audsrv_conn_send_pending( AudsrvConn *conn );
 void audsrv_conn_get_buffer( AudsrvConn *conn, int maxlen, unsigned char **data, unsigned *datalen );
 void audsrv_conn_get_string( AudsrvConn *conn, char *s );
 unsigned audsrv_conn_get_u16( AudsrvConn *conn );
 unsigned audsrv_conn_get_u32( AudsrvConn *conn );
 unsigned audsrv_conn_peek_u32( AudsrvConn *conn );
+unsigned audsrv_conn_peek_u32_at( AudsrvConn *conn, int offset );
+int audsrv_conn_peek_at( AudsrvConn *conn, int offset, unsigned char *data, int len );
 unsigned long long audsrv_conn_get_u64( AudsrvConn *conn );
 void audsrv_conn_skip( AudsrvConn *conn, int n );
+int audsrv_conn_recv_count( AudsrvConn *conn );
 int audsrv_conn_recv( AudsrvConn *conn );
+int audsrv_conn_recv_nonblocking( AudsrvConn *conn );
+int audsrv_conn_get_fd( AudsrvConn *conn );
 
 #endif
 
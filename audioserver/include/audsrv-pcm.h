@@ -0,0 +1,51 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2017 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/**
+* @defgroup audioserver
+* @{
+* @defgroup audsrv-pcm
+* @{
+**/
+
+#ifndef _AUDSRV_PCM_H
+#define _AUDSRV_PCM_H
+
+/*
+ * PCM format conversion
+ *
+ * The SoC path takes S16LE PCM.  A converter reduces S24_32LE, S32LE or F32LE samples to
+ * S16LE with TPDF dither, using SSE2 or NEON where the build enables them.  Every supported
+ * input format has four byte samples; a sample split across calls is carried over to the
+ * next call so the data may arrive in arbitrary pieces.  The converted samples are held in a
+ * buffer owned by the converter and remain valid until the next call.
+ * audsrv_pcm_input_bytes maps a byte count at the SoC back to the client's format.
+ */
+
+typedef struct _AudsrvPcm AudsrvPcm;
+
+AudsrvPcm* audsrv_pcm_create( unsigned format );
+void audsrv_pcm_destroy( AudsrvPcm *pcm );
+unsigned audsrv_pcm_get_format( AudsrvPcm *pcm );
+void audsrv_pcm_reset( AudsrvPcm *pcm );
+unsigned audsrv_pcm_convert( AudsrvPcm *pcm, unsigned char *data, unsigned len, unsigned char **out );
+unsigned audsrv_pcm_input_bytes( unsigned format, unsigned bytes );
+
+#endif
+
@@ -66,11 +66,79 @@
   audio sync
   LEN:4 ID:4 VERSION:4 Time:U64 STC:U64
   
+  flush
+  LEN:4 ID:4 VERSION:4 Generation:U32
+
   audio data
-  LEN:4 ID:4 VERSION:4 Buffer
+  LEN:4 ID:4 VERSION:4 Generation:U32 Buffer
   
   audio datahandle
-  LEN:4 ID:4 VERSION:4 DataHandle:U64
+  LEN:4 ID:4 VERSION:4 DataHandle:U64 Generation:U32
+
+  session control
+  LEN:4 ID:4 VERSION:4 Count:U32 [Flags:U16 Mute:U16 VolNum:U32 VolDenom:U32 SessionName:String]*Count
+
+  session handle
+  LEN:4 ID:4 VERSION:4 Reason:U16 SessionHandle:U32 SessionName:String
+
+  enable data request
+  LEN:4 ID:4 VERSION:4 Watermark:U32
+
+  data request
+  LEN:4 ID:4 VERSION:4 Credit:U32 BufferedBytes:U32
+
+  select session
+  LEN:4 ID:4 VERSION:4 SessionId:U32
+
+  release session
+  LEN:4 ID:4 VERSION:4 SessionId:U32
+
+  enable capture ring
+  LEN:4 ID:4 VERSION:4 Token:U64 RingSize:U32
+
+  capture ring
+  LEN:4 ID:4 VERSION:4 Token:U64 Result:U16 RingSize:U32 (+ memfd, eventfd as SCM_RIGHTS)
+
+  capture overrun
+  LEN:4 ID:4 VERSION:4 Position:U64 DroppedBytes:U32
+
+  get latency
+  LEN:4 ID:4 VERSION:4 Token:U64
+
+  get latency results
+  LEN:4 ID:4 VERSION:4 Token:U64 Result:U16 Timestamp:U64 ServerBytes:U32 ServerFrames:U32 SocBytes:U32 SocFrames:U32 SampleRate:U32 OutputDelay:U32
+
+  enable handle release
+  LEN:4 ID:4 VERSION:4 Enable:U16
+
+  handle release
+  LEN:4 ID:4 VERSION:4 Count:U32 [DataHandle:U64]*Count
+
+  enable data ring
+  LEN:4 ID:4 VERSION:4 Enable:U16 Sequence:U64 (+ memfd as SCM_RIGHTS when Enable is non-zero)
+
+  audio data ring
+  LEN:4 ID:4 VERSION:4 Offset:U32 Len:U32 Sequence:U64 Generation:U32
+
+  set pcm format
+  LEN:4 ID:4 VERSION:4 Format:U32
+
+  flush ack
+  LEN:4 ID:4 VERSION:4 Generation:U32
+
+  Version 2 of start capture replaces the trailing SessionName:String parameter with
+  SessionHandle:U32.  Version 2 of mute, unmute, volume and get status insert SessionHandle:U32
+  before SessionName:String; the server falls back to the name when no session has the handle
+  and the name is not empty.  Version 2 of enum sessions results
+  and session event append SessionHandle:U32 to each session entry and are only sent to
+  clients that made the corresponding request with version 2.  Version 2 of capture parameters
+  appends Position:U64 and is only sent to clients with a capture ring enabled.  Version 1 of
+  flush, audio data, audio datahandle and audio data ring carry no Generation parameter.
+
+  Servers ignore messages with a version newer than they support, so clients send session
+  handle and generation versions only once the server has sent them a session handle.  Data
+  without a Generation belongs to the current generation and is never discarded by a flush
+  queued behind it.
  ------------------------------------------------------------------------ */
 
 typedef enum _AUDSRV_TYPE
@@ -115,9 +183,33 @@ typedef enum _AUDSRV_MSG
    AUDSRV_MSG_GetStatusResults,
    AUDSRV_MSG_EnableSessionEvent,
    AUDSRV_MSG_DisableSessionEvent,
-   AUDSRV_MSG_SessionEvent
+   AUDSRV_MSG_SessionEvent,
+   AUDSRV_MSG_SessionControl,
+   AUDSRV_MSG_ResolveSession,
+   AUDSRV_MSG_SessionHandle,
+   AUDSRV_MSG_EnableDataRequest,
+   AUDSRV_MSG_DataRequest,
+   AUDSRV_MSG_SelectSession,
+   AUDSRV_MSG_ReleaseSession,
+   AUDSRV_MSG_EnableCaptureRing,
+   AUDSRV_MSG_CaptureRing,
+   AUDSRV_MSG_CaptureOverrun,
+   AUDSRV_MSG_GetLatency,
+   AUDSRV_MSG_GetLatencyResults,
+   AUDSRV_MSG_EnableHandleRelease,
+   AUDSRV_MSG_HandleRelease,
+   AUDSRV_MSG_EnableDataRing,
+   AUDSRV_MSG_AudioDataRing,
+   AUDSRV_MSG_SetPcmFormat,
+   AUDSRV_MSG_FlushAck
 } AUDSRV_MSG;
 
+typedef enum _AUDSRV_SESSIONHANDLE_REASON
+{
+   AUDSRV_SESSIONHANDLE_Init= 0,
+   AUDSRV_SESSIONHANDLE_Resolve
+} AUDSRV_SESSIONHANDLE_REASON;
+
 #define AUDSRV_MSG_HDR_LEN (4+4+4)
 #define AUDSRV_MSG_TYPE_HDR_LEN (4+4)
 #define AUDSRV_MSG_BUFFER_LEN(n) (n)
@@ -126,6 +218,29 @@ typedef enum _AUDSRV_MSG
 #define AUDSRV_MSG_U32_LEN (4)
 #define AUDSRV_MSG_U64_LEN (8)
 
+#define AUDSRV_SELECT_SESSION_LEN (AUDSRV_MSG_HDR_LEN+AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U32_LEN)
+
+// Header of the shared memory capture ring.  The server owns writePos and the client owns
+// readPos; both are running byte counts and the data offset of a position is position % size.
+// Data from paramsPos onward was captured with capture parameters version paramsVersion.
+// The fields each side writes are kept on their own cache line.
+typedef struct _AudsrvCaptureRing
+{
+   unsigned magic;
+   unsigned size;
+   unsigned char pad0[56];
+   volatile unsigned long long writePos;
+   volatile unsigned long long paramsPos;
+   volatile unsigned paramsVersion;
+   unsigned char pad1[44];
+   volatile unsigned long long readPos;
+   unsigned char pad2[56];
+} AudsrvCaptureRing;
+
+#define AUDSRV_CAPTURE_RING_MAGIC (0x41534352) // 'ASCR'
+#define AUDSRV_CAPTURE_RING_DATA(r) (((unsigned char*)(r))+sizeof(AudsrvCaptureRing))
+#define AUDSRV_CAPTURE_RING_MAX_SIZE (4*1024*1024)
+
 #define AUDSRV_MSG_Init_Version (1)
 #define AUDSRV_MSG_AudioInfo_Version (1)
 #define AUDSRV_MSG_Basetime_Version (1)
@@ -133,31 +248,79 @@ typedef enum _AUDSRV_MSG
 #define AUDSRV_MSG_Stop_Version (1)
 #define AUDSRV_MSG_Pause_Version (1)
 #define AUDSRV_MSG_UnPause_Version (1)
-#define AUDSRV_MSG_Flush_Version (1)
+#define AUDSRV_MSG_Flush_Version (2)
+#define AUDSRV_MSG_Flush_Version_Plain (1)
+#define AUDSRV_MSG_Flush_Version_Generation (2)
 #define AUDSRV_MSG_AudioSync_Version (1)
-#define AUDSRV_MSG_AudioData_Version (1)
-#define AUDSRV_MSG_AudioDataHandle_Version (1)
-#define AUDSRV_MSG_Mute_Version (1)
-#define AUDSRV_MSG_UnMute_Version (1)
-#define AUDSRV_MSG_Volume_Version (1)
+#define AUDSRV_MSG_AudioData_Version (2)
+#define AUDSRV_MSG_AudioData_Version_Plain (1)
+#define AUDSRV_MSG_AudioData_Version_Generation (2)
+#define AUDSRV_MSG_AudioDataHandle_Version (2)
+#define AUDSRV_MSG_AudioDataHandle_Version_Plain (1)
+#define AUDSRV_MSG_AudioDataHandle_Version_Generation (2)
+#define AUDSRV_MSG_Mute_Version (2)
+#define AUDSRV_MSG_Mute_Version_Name (1)
+#define AUDSRV_MSG_Mute_Version_Handle (2)
+#define AUDSRV_MSG_UnMute_Version (2)
+#define AUDSRV_MSG_UnMute_Version_Name (1)
+#define AUDSRV_MSG_UnMute_Version_Handle (2)
+#define AUDSRV_MSG_Volume_Version (2)
+#define AUDSRV_MSG_Volume_Version_Name (1)
+#define AUDSRV_MSG_Volume_Version_Handle (2)
 #define AUDSRV_MSG_EnableEOS_Version (1)
 #define AUDSRV_MSG_DisableEOS_Version (1)
-#define AUDSRV_MSG_StartCapture_Version (1)
+#define AUDSRV_MSG_StartCapture_Version (2)
+#define AUDSRV_MSG_StartCapture_Version_Name (1)
+#define AUDSRV_MSG_StartCapture_Version_Handle (2)
 #define AUDSRV_MSG_StopCapture_Version (1)
 #define AUDSRV_MSG_EOSDetected_Version (1)
 #define AUDSRV_MSG_FirstAudio_Version (1)
 #define AUDSRV_MSG_PtsError_Version (1)
 #define AUDSRV_MSG_Underflow_Version (1)
-#define AUDSRV_MSG_CaptureParameters_Version (1)
+#define AUDSRV_MSG_CaptureParameters_Version (2)
+#define AUDSRV_MSG_CaptureParameters_Version_Callback (1)
+#define AUDSRV_MSG_CaptureParameters_Version_Ring (2)
 #define AUDSRV_MSG_CaptureData_Version (1)
 #define AUDSRV_MSG_CaptureDone_Version (1)
-#define AUDSRV_MSG_EnumSessions_Version (1)
-#define AUDSRV_MSG_EnumSessionsResults_Version (1)
-#define AUDSRV_MSG_GetStatus_Version (1)
+#define AUDSRV_MSG_EnumSessions_Version (2)
+#define AUDSRV_MSG_EnumSessions_Version_Name (1)
+#define AUDSRV_MSG_EnumSessions_Version_Handle (2)
+#define AUDSRV_MSG_EnumSessionsResults_Version (2)
+#define AUDSRV_MSG_EnumSessionsResults_Version_Name (1)
+#define AUDSRV_MSG_EnumSessionsResults_Version_Handle (2)
+#define AUDSRV_MSG_GetStatus_Version (2)
+#define AUDSRV_MSG_GetStatus_Version_Name (1)
+#define AUDSRV_MSG_GetStatus_Version_Handle (2)
 #define AUDSRV_MSG_GetStatusResults_Version (1)
-#define AUDSRV_MSG_EnableSessionEvent_Version (1)
+#define AUDSRV_MSG_EnableSessionEvent_Version (2)
+#define AUDSRV_MSG_EnableSessionEvent_Version_Name (1)
+#define AUDSRV_MSG_EnableSessionEvent_Version_Handle (2)
 #define AUDSRV_MSG_DisableSessionEvent_Version (1)
-#define AUDSRV_MSG_SessionEvent_Version (1)
+#define AUDSRV_MSG_SessionEvent_Version (2)
+#define AUDSRV_MSG_SessionEvent_Version_Name (1)
+#define AUDSRV_MSG_SessionEvent_Version_Handle (2)
+#define AUDSRV_MSG_SessionControl_Version (1)
+#define AUDSRV_MSG_ResolveSession_Version (1)
+#define AUDSRV_MSG_SessionHandle_Version (1)
+#define AUDSRV_MSG_EnableDataRequest_Version (1)
+#define AUDSRV_MSG_DataRequest_Version (1)
+#define AUDSRV_MSG_SelectSession_Version (1)
+#define AUDSRV_MSG_ReleaseSession_Version (1)
+#define AUDSRV_MSG_EnableCaptureRing_Version (1)
+#define AUDSRV_MSG_CaptureRing_Version (1)
+#define AUDSRV_MSG_CaptureOverrun_Version (1)
+#define AUDSRV_MSG_GetLatency_Version (1)
+#define AUDSRV_MSG_GetLatencyResults_Version (1)
+#define AUDSRV_MSG_EnableHandleRelease_Version (1)
+#define AUDSRV_MSG_HandleRelease_Version (1)
+#define AUDSRV_MSG_EnableDataRing_Version (1)
+#define AUDSRV_MSG_AudioDataRing_Version (2)
+#define AUDSRV_MSG_AudioDataRing_Version_Plain (1)
+#define AUDSRV_MSG_AudioDataRing_Version_Generation (2)
+#define AUDSRV_MSG_SetPcmFormat_Version (1)
+#define AUDSRV_MSG_FlushAck_Version (1)
+
+#define AUDSRV_MAX_RELEASED_HANDLES (64)
 
 /* 
  * AUDSRV_MSG_Init
@@ -217,30 +380,40 @@ typedef enum _AUDSRV_MSG
  * AUDSRV_MSG_AudioData
  *
  * LEN ID VERSION Buffer
+ * version 2:
+ * LEN ID VERSION generation:U32 Buffer
  */
 
 /* 
  * AUDSRV_MSG_AudioDataHandle
  *
  * LEN ID VERSION U64
+ * version 2:
+ * LEN ID VERSION U64 generation:U32
  */
 
 /* 
  * AUDSRV_MSG_Mute
  *
  * LEN ID VERSION global:U16 sessionName:String
+ * version 2:
+ * LEN ID VERSION global:U16 sessionHandle:U32 sessionName:String
  */
 
 /* 
  * AUDSRV_MSG_UnMute
  *
  * LEN ID VERSION global:U16 sessionName:String
+ * version 2:
+ * LEN ID VERSION global:U16 sessionHandle:U32 sessionName:String
  */
 
 /* 
  * AUDSRV_MSG_Volume
  *
- * LEN ID VERSION U32 U32 sessionName:String
+ * LEN ID VERSION U32 U32 global:U16 sessionName:String
+ * version 2:
+ * LEN ID VERSION U32 U32 global:U16 sessionHandle:U32 sessionName:String
  */
 
 /* 
@@ -258,7 +431,9 @@ typedef enum _AUDSRV_MSG
 /* 
  * AUDSRV_MSG_StartCapture
  *
- * LEN ID VERSION
+ * LEN ID VERSION U16 U16 U16 U32 U32 U32 sessionName:String
+ * version 2:
+ * LEN ID VERSION U16 U16 U16 U32 U32 U32 sessionHandle:U32
  */
 
 /* 
@@ -295,6 +470,10 @@ typedef enum _AUDSRV_MSG
  * AUDSRV_MSG_CaptureParameters
  *
  * LEN ID VERSION version:U32 num_channels:U16 bits_per_sample:U16 sample_rate:U32 output_delay:U32
+ * version 2:
+ * LEN ID VERSION version:U32 num_channels:U16 bits_per_sample:U16 sample_rate:U32 output_delay:U32 position:U64
+ *
+ * Position is the capture ring write position from which the parameters apply.
  */
 
 /* 
@@ -319,12 +498,16 @@ typedef enum _AUDSRV_MSG
  * AUDSRV_MSG_EnumSessionsResults
  *
  * LEN ID VERSIOM token:U64 result:U16 session-count:U32 [pid:U32, session-type:U16, name:String]*session-count
+ * version 2:
+ * LEN ID VERSIOM token:U64 result:U16 session-count:U32 [pid:U32, session-type:U16, name:String, handle:U32]*session-count
  */
 
 /* 
  * AUDSRV_MSG_GetStatus
  *
  * LEN ID VERSION token:U64 sessionName:String
+ * version 2:
+ * LEN ID VERSION token:U64 sessionHandle:U32 sessionName:String
  */
 
 /*
@@ -349,6 +532,193 @@ typedef enum _AUDSRV_MSG
  *  AUDSRV_MSG_SessionEvent
  *
  * LEN ID VERSION event:U16 pid:U32 session-type:U16 name:String
+ * version 2:
+ * LEN ID VERSION event:U16 pid:U32 session-type:U16 name:String handle:U32
+ */
+
+/*
+ * AUDSRV_MSG_SessionControl
+ *
+ * LEN ID VERSION count:U32 [flags:U16 mute:U16 vol_num:U32 vol_denom:U32 sessionName:String]*count
+ *
+ * All operations in the list are applied by the server under a single pass of its session
+ * registry so that no intermediate mix state is observable.
+ */
+
+/*
+ * AUDSRV_MSG_ResolveSession
+ *
+ * LEN ID VERSION sessionName:String
+ *
+ * Answered with AUDSRV_MSG_SessionHandle with reason AUDSRV_SESSIONHANDLE_Resolve.  The handle
+ * is 0 unless exactly one session has the requested name.
+ */
+
+/*
+ * AUDSRV_MSG_SessionHandle
+ *
+ * LEN ID VERSION reason:U16 sessionHandle:U32 sessionName:String
+ *
+ * Sent with reason AUDSRV_SESSIONHANDLE_Init once a session has been initialized and
+ * with reason AUDSRV_SESSIONHANDLE_Resolve in response to AUDSRV_MSG_ResolveSession.
+ * Session handles are never 0 and are not reused while the session they name exists.
+ */
+
+/*
+ * AUDSRV_MSG_EnableDataRequest
+ *
+ * LEN ID VERSION watermark:U32
+ *
+ * Enables pull mode for the session when watermark is non-zero and disables it otherwise.
+ */
+
+/*
+ * AUDSRV_MSG_DataRequest
+ *
+ * LEN ID VERSION credit:U32 buffered_bytes:U32
+ *
+ * Sent whenever the session's queued level drops below the watermark.  Credit is the number of
+ * bytes the client may send to bring the level up to twice the watermark, less any credit already
+ * granted but not yet used.
+ */
+
+/*
+ * AUDSRV_MSG_SelectSession
+ *
+ * LEN ID VERSION sessionId:U32
+ *
+ * Sent in either direction.  Messages that follow on the connection in the same direction apply
+ * to sub-session sessionId until the next select session.  Session id 0 is the session owned by
+ * the connection itself and is selected when a connection is opened.  The server creates a
+ * sub-session the first time a client selects its id; a connection may carry up to
+ * AUDSRV_MAX_SUBSESSIONS sub-sessions.
+ */
+
+/*
+ * AUDSRV_MSG_ReleaseSession
+ *
+ * LEN ID VERSION sessionId:U32
+ *
+ * Closes sub-session sessionId as if it were a client that disconnected.
+ */
+
+/*
+ * AUDSRV_MSG_EnableCaptureRing
+ *
+ * LEN ID VERSION token:U64 ringSize:U32
+ *
+ * Requests that captured data be written to a shared memory ring of at least ringSize bytes
+ * instead of being sent as AUDSRV_MSG_CaptureData.  A ringSize of 0 returns to message delivery.
+ * Answered with AUDSRV_MSG_CaptureRing.
+ */
+
+/*
+ * AUDSRV_MSG_CaptureRing
+ *
+ * LEN ID VERSION token:U64 result:U16 ringSize:U32
+ *
+ * On success (result 0) with a non-zero ringSize the message carries two descriptors as
+ * SCM_RIGHTS ancillary data: a memory fd to be mapped shared with length
+ * sizeof(AudsrvCaptureRing)+ringSize, and a non-blocking eventfd the server signals each time
+ * it advances writePos.  Only parameter changes and overruns are reported on the socket.
+ */
+
+/*
+ * AUDSRV_MSG_CaptureOverrun
+ *
+ * LEN ID VERSION position:U64 dropped_bytes:U32
+ *
+ * Sent when the server resumes writing to a capture ring after dropping dropped_bytes of
+ * captured data because the ring was full.  The gap lies at ring position position.
+ */
+
+/*
+ * AUDSRV_MSG_GetLatency
+ *
+ * LEN ID VERSION token:U64
+ */
+
+/*
+ * AUDSRV_MSG_GetLatencyResults
+ *
+ * LEN ID VERSION token:U64 result:U16 timestamp:U64 server_bytes:U32 server_frames:U32 soc_bytes:U32 soc_frames:U32 sample_rate:U32 output_delay:U32
+ *
+ * Result is 0 if the session has a SoC client that reported its levels.  Timestamp is the
+ * server's CLOCK_MONOTONIC time in microseconds at which the levels were sampled.  Server bytes
+ * count this session's queued audio payload, including data still in the socket, not yet passed
+ * to the SoC.  Output delay is in microseconds.
+ */
+
+/*
+ * AUDSRV_MSG_EnableHandleRelease
+ *
+ * LEN ID VERSION enable:U16
+ *
+ * Requests AUDSRV_MSG_HandleRelease notifications for handles passed with
+ * AUDSRV_MSG_AudioDataHandle when enable is non-zero and stops them otherwise.
+ */
+
+/*
+ * AUDSRV_MSG_HandleRelease
+ *
+ * LEN ID VERSION count:U32 [data_handle:U64]*count
+ *
+ * Returns data handles the SoC has finished with.  Handles released during a period are batched
+ * into one message of at most AUDSRV_MAX_RELEASED_HANDLES handles; a flush sends the handles it
+ * released immediately.
+ */
+
+/*
+ * AUDSRV_MSG_EnableDataRing
+ *
+ * LEN ID VERSION enable:U16 sequence:U64
+ *
+ * When enable is non-zero the message carries a memfd as SCM_RIGHTS ancillary data holding an
+ * AudSrvDataRing header followed by the data area.  The server maps it, sets consumed to
+ * sequence, the last sequence number the client has issued, and then accepts
+ * AUDSRV_MSG_AudioDataRing.  The memfd must be sealed against shrinking.
+ */
+
+/*
+ * AUDSRV_MSG_AudioDataRing
+ *
+ * LEN ID VERSION offset:U32 len:U32 sequence:U64
+ * version 2:
+ * LEN ID VERSION offset:U32 len:U32 sequence:U64 generation:U32
+ *
+ * Plays len bytes at offset in the data area of the shared ring, then sets consumed in the
+ * ring header to sequence.
+ */
+
+/*
+ * AUDSRV_MSG_SetPcmFormat
+ *
+ * LEN ID VERSION format:U32
+ *
+ * Declares the sample format of PCM that follows in AUDSRV_MSG_AudioData and
+ * AUDSRV_MSG_AudioDataRing as one of AUDSRV_PCM_FORMAT_*.  The server converts formats other
+ * than AUDSRV_PCM_FORMAT_S16LE to S16LE before passing the data to the SoC.
+ */
+
+/*
+ * AUDSRV_MSG_Flush
+ *
+ * LEN ID VERSION generation:U32
+ *
+ * Starts flush generation generation.  Data messages carry the generation current when they
+ * were sent; the server looks ahead through data already received for a flush and discards
+ * data of earlier generations without passing it to the SoC.  The server replies with
+ * AUDSRV_MSG_FlushAck once the flush is complete.  Version 1 carries no generation and is
+ * not acknowledged.
+ */
+
+/*
+ * AUDSRV_MSG_FlushAck
+ *
+ * LEN ID VERSION generation:U32
+ *
+ * Acknowledges AUDSRV_MSG_Flush: all data of earlier generations has been discarded and data
+ * of this generation will be played.
  */
  
  #endif
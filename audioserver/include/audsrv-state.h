@@ -0,0 +1,52 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2017 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/**
+* @defgroup audioserver
+* @{
+* @defgroup audsrv-state
+* @{
+**/
+
+#ifndef _AUDSRV_STATE_H
+#define _AUDSRV_STATE_H
+
+/*
+ * Persisted mixer state
+ *
+ * Global and per-session-name volume and mute are kept in a memory mapped file
+ * ($XDG_RUNTIME_DIR/<server name>.state) so a restarted server can restore the mix
+ * without any client round trips.  Each record carries its own checksum: a record
+ * torn by a crash during an update is discarded on the next start rather than the
+ * whole file.  A NULL sessionName addresses the global state.
+ */
+
+#define AUDSRV_STATE_Volume (0x0001)
+#define AUDSRV_STATE_Mute (0x0002)
+
+typedef struct _AudsrvState AudsrvState;
+
+AudsrvState* audsrv_state_open( const char *serverName );
+void audsrv_state_close( AudsrvState *state );
+unsigned audsrv_state_get( AudsrvState *state, const char *sessionName, float *volume, bool *muted );
+void audsrv_state_set_volume( AudsrvState *state, const char *sessionName, float volume );
+void audsrv_state_set_mute( AudsrvState *state, const char *sessionName, bool muted );
+
+#endif
+
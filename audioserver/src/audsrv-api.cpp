@@ -25,18 +25,21 @@
 **/
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
-#include <vector>
-
 #include "audioserver.h"
 #include "audioserver-soc.h"
 #include "audsrv-logger.h"
@@ -45,43 +48,116 @@
 
 #define LEVEL_DENOMINATOR (1000000)
 
+typedef enum _AUDSRV_CBTYPE
+{
+   AUDSRV_CBTYPE_None= 0,
+   AUDSRV_CBTYPE_EnumSessions,
+   AUDSRV_CBTYPE_GetStatus,
+   AUDSRV_CBTYPE_CaptureRing,
+   AUDSRV_CBTYPE_GetLatency
+} AUDSRV_CBTYPE;
+
+typedef struct _AudsrvSyncWait
+{
+   bool done;
+   int result;
+   int maxCount;
+   int count;
+   AudSrvSessionHandleInfo *sessionInfo;
+   AudSrvSessionStatus *sessionStatus;
+   AudSrvLatency *latency;
+} AudsrvSyncWait;
+
 typedef struct _AudsrvCBCtx
 {
    union
    {
       AudioServerEnumSessions enumsess;
+      AudioServerEnumSessionHandles enumhandles;
       AudioServerSessionStatus getstatus;
+      AudioServerLatency getlatency;
    } cb;
    void *userData;
+   AudsrvSyncWait *sync;
+   bool withHandles;
+   int type;
+   unsigned generation;
+   long long expiry;
 } AudsrvCBCtx;
 
+// Request tokens are (generation<<32)|slot so a reply resolves by direct indexing and
+// a late reply to an expired request never matches a later request in the same slot
+#define AUDSRV_MAX_PENDING_CALLBACKS (32)
+#define AUDSRV_PENDING_CALLBACK_TIMEOUT (5000)
+#define AUDSRV_TOKEN_SLOT(t) ((unsigned)((t)&0xFFFFFFFFULL))
+#define AUDSRV_TOKEN_GENERATION(t) ((unsigned)((t)>>32))
+
 #define AUDSRV_MAX_MSG (1024)
 #define AUDSRV_RCVBUFFSIZE (80*1024)
+#define AUDSRV_READY_TIMEOUT (5)
+#define AUDSRV_MAX_NONBLOCKING_DATA (64*1024)
+#define AUDSRV_MAX_DATAV_CHUNKS (64)
+#define AUDSRV_DATA_GEN_LEN (AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U32_LEN)
+#define AUDSRV_DATA_HDR_LEN (AUDSRV_MSG_HDR_LEN+AUDSRV_DATA_GEN_LEN+AUDSRV_MSG_TYPE_HDR_LEN)
+#define AUDSRV_RECONNECT_MIN_DELAY (10)
+#define AUDSRV_RECONNECT_MAX_DELAY (1000)
+#define AUDSRV_MAX_CAPTURE_PARAMS_PENDING (4)
+
+typedef struct _AudsrvCaptureParamsChange
+{
+   unsigned long long position;
+   AudSrvCaptureParameters params;
+} AudsrvCaptureParamsChange;
+
 typedef struct _AudsrvApiContext
 {
    char *serverName;
    struct sockaddr_un addr;
+   socklen_t addrSize;
    int fdSocket;
    AudsrvConn *conn;
    pthread_mutex_t mutexSend;
    pthread_t threadId;
    pthread_mutex_t mutexRecv;
+   pthread_cond_t condReady;
    bool receiveThreadStopRequested;
    bool receiveThreadStarted;
    bool receiveThreadReady;
    AudSrvCaptureParameters captureParameters;
 
-   std::vector<AudsrvCBCtx*> pendingCallbacks;
+   AudsrvCBCtx pendingCallbacks[AUDSRV_MAX_PENDING_CALLBACKS];
+   int pendingCount;
+   int fdWake;
+   pthread_cond_t condSync;
+   int inlineDispatch;
 
    bool inCallback;
+   bool inCaptureData;
    bool discPending;
 
+   // Sub-sessions share the socket and receive thread of the connection that opened them.
+   // The receive thread holds mutexDispatch while delivering messages and callbacks.
+   struct _AudsrvApiContext *parent;
+   unsigned subSessionId;
+   unsigned recvSessionId;
+   unsigned nextSubSessionId;
+   struct _AudsrvApiContext *subSessions[AUDSRV_MAX_SUBSESSIONS];
+   pthread_mutex_t mutexDispatch;
+
    bool isPrivate;
    unsigned sessionType;
+   unsigned sessionHandle;
+   // Attachment, guarded by mutexSend.  The handle is a cache: requests carry the name as well.
+   unsigned sessionHandleAttached;
    char *sessionNameAttached;
+   // Set once the server has sent us a session handle, meaning it accepts the handle
+   // versions of requests.  Older servers drop them.  Guarded by mutexSend.
+   bool serverHandles;
+   unsigned sessionEventVersion;
    char *sessionNamePrivate;
 
    AudioServerSessionEvent sessionEventCB;
+   AudioServerSessionHandleEvent sessionHandleEventCB;
    void *sessionEventUserData;
    AudioServerFirstAudio firstAudioCB;
    void *firstAudioUserData;
@@ -89,16 +165,73 @@ typedef struct _AudsrvApiContext
    void *ptsErrorUserData;
    AudioServerUnderflow underflowCB;
    void *underflowUserData;
+   AudioServerDataRequest dataRequestCB;
+   void *dataRequestUserData;
+   AudioServerHandleRelease handleReleaseCB;
+   void *handleReleaseUserData;
+   AudioServerFlushAck flushAckCB;
+   void *flushAckUserData;
    AudioServerEOS eosCB;
    void *eosUserData;
    AudioServerCapture captureCB;
    void *captureUserData;
    AudioServerCaptureDone captureDoneCB;
    void *captureDoneUserData;
+   AudioServerDiscontinuity discontinuityCB;
+   void *discontinuityUserData;
+
+   // Session state replayed after reconnecting to a restarted server
+   bool sessionInitialized;
+   char *sessionNameInit;
+   bool audioInfoSet;
+   AudSrvAudioInfo audioInfo;
+   bool pcmFormatSet;
+   unsigned pcmFormat;
+   // Generation of the last flush, carried by data messages once it is non-zero.  Guarded by mutexSend.
+   unsigned flushGeneration;
+   bool flushGenerationSent;
+   bool basetimeSet;
+   long long basetime;
+   bool playing;
+   bool paused;
+   bool volumeSet;
+   float volume;
+   bool muteSet;
+   bool muted;
+   unsigned dataRequestWatermark;
+   char *captureSessionName;
+   unsigned captureSessionHandle;
+   AudSrvCaptureParameters captureRequest;
+   bool captureStarted;
+
+   // Capture ring: captureRingParams apply to the data at readPos and the pending list holds
+   // later changes in ring position order.  Guarded by mutexSend.
+   unsigned captureRingSize;
+   AudsrvCaptureRing *captureRing;
+   unsigned captureRingMapSize;
+   int captureRingEventFd;
+   AudSrvCaptureParameters captureRingParams;
+   AudsrvCaptureParamsChange captureParamsPending[AUDSRV_MAX_CAPTURE_PARAMS_PENDING];
+   int captureParamsPendingCount;
+   AudioServerCaptureOverrun captureOverrunCB;
+   void *captureOverrunUserData;
+
+   // Playback data ring supplied by the caller.  Guarded by mutexSend.
+   int dataRingFd;
+   unsigned long long dataRingSequence;
 } AudsrvApiContext;
 
 static bool audsrv_connect_socket( AudsrvApiContext *ctx );
 static void* audsrv_receive_thread( void *arg );
+static bool audsrv_reconnect( AudsrvApiContext *ctx );
+static void audsrv_replay_session( AudsrvApiContext *ctx );
+static void audsrv_notify_discontinuity( AudsrvApiContext *ctx, bool connected );
+static void audsrv_sessions_lost( AudsrvApiContext *ctx );
+static void audsrv_sessions_restored( AudsrvApiContext *ctx );
+static int audsrv_pending_expire( AudsrvApiContext *ctx );
+static AudsrvApiContext* audsrv_find_sub_session( AudsrvApiContext *ctx, unsigned sessionId );
+static bool audsrv_release_sub_session( AudsrvApiContext *ctx );
+static void audsrv_complete_disconnect( AudsrvApiContext *ctx );
 static int audsrv_process_message( AudsrvApiContext *ctx );
 static int audsrv_process_session_event( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
 static int audsrv_process_eosdetected( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
@@ -110,6 +243,273 @@ static int audsrv_process_capture_data( AudsrvApiContext *ctx, unsigned msglen,
 static int audsrv_process_capture_done( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
 static int audsrv_process_enum_sessions_results( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
 static int audsrv_process_getstatus_results( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static int audsrv_process_getlatency_results( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static int audsrv_process_session_handle( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static int audsrv_process_data_request( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static int audsrv_process_handle_release( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static int audsrv_process_flush_ack( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static int audsrv_process_select_session( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static int audsrv_process_capture_ring( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static int audsrv_process_capture_overrun( AudsrvApiContext *ctx, unsigned msglen, unsigned version );
+static void audsrv_capture_ring_unmap( AudsrvApiContext *ctx );
+static bool audioServerStartCapture( AudsrvApiContext *ctx, const char *sessionName, unsigned sessionHandle, AudioServerCapture cb, AudSrvCaptureParameters *params, void *userData );
+static AudsrvCBCtx* audsrv_pending_alloc( AudsrvApiContext *ctx, int type, int timeout, unsigned long long *token );
+static void audsrv_pending_free( AudsrvApiContext *ctx, AudsrvCBCtx *pCBCtx );
+static AudsrvCBCtx* audsrv_pending_find( AudsrvApiContext *ctx, int type, unsigned long long token );
+static void audsrv_pending_cancel( AudsrvApiContext *ctx, int result, long long now );
+static int audsrv_pending_timeout( AudsrvApiContext *ctx );
+static void audsrv_sync_wait( AudsrvApiContext *ctx, AudsrvSyncWait *wait, int type, unsigned long long token, int timeout );
+static bool audsrv_send_getlatency( AudsrvApiContext *ctx, AudioServerLatency cb, void *userData, AudsrvSyncWait *sync, int timeout, unsigned long long *token );
+static bool audsrv_send_enable_data_ring( AudsrvApiContext *ctx );
+static bool audsrv_enable_session_event( AudsrvApiContext *ctx, AudioServerSessionEvent cb, AudioServerSessionHandleEvent handleCB, void *userData );
+static bool audsrv_send_enable_session_event( AudsrvApiContext *ctx );
+static bool audsrv_server_has_handles( AudsrvApiContext *ctx );
+static bool audsrv_send_generation( AudsrvApiContext *ctx );
+
+static long long getCurrentTimeMillis()
+{
+   struct timespec tm;
+
+   clock_gettime( CLOCK_MONOTONIC, &tm );
+
+   return tm.tv_sec*1000LL + tm.tv_nsec/1000000LL;
+}
+
+// Must be called with mutexSend held
+static AudsrvCBCtx* audsrv_pending_alloc( AudsrvApiContext *ctx, int type, int timeout, unsigned long long *token )
+{
+   AudsrvCBCtx *pCBCtx= 0;
+
+   for( int i= 0; i < AUDSRV_MAX_PENDING_CALLBACKS; ++i )
+   {
+      if ( ctx->pendingCallbacks[i].type == AUDSRV_CBTYPE_None )
+      {
+         pCBCtx= &ctx->pendingCallbacks[i];
+         pCBCtx->type= type;
+         if ( ++pCBCtx->generation == 0 )
+         {
+            pCBCtx->generation= 1;
+         }
+         pCBCtx->expiry= getCurrentTimeMillis() + timeout;
+         *token= (((unsigned long long)pCBCtx->generation) << 32) | (unsigned)i;
+
+         if ( ctx->pendingCount++ == 0 )
+         {
+            // Have the receive thread start timing this request
+            eventfd_write( ctx->fdWake, 1 );
+         }
+         break;
+      }
+   }
+
+   if ( !pCBCtx )
+   {
+      ERROR("too many pending requests (%d)", ctx->pendingCount);
+   }
+
+   return pCBCtx;
+}
+
+// Must be called with mutexSend held
+static void audsrv_pending_free( AudsrvApiContext *ctx, AudsrvCBCtx *pCBCtx )
+{
+   pCBCtx->type= AUDSRV_CBTYPE_None;
+   pCBCtx->cb.enumsess= 0;
+   pCBCtx->userData= 0;
+   pCBCtx->sync= 0;
+   pCBCtx->withHandles= false;
+   --ctx->pendingCount;
+}
+
+// Must be called with mutexSend held
+static AudsrvCBCtx* audsrv_pending_find( AudsrvApiContext *ctx, int type, unsigned long long token )
+{
+   AudsrvCBCtx *pCBCtx= 0;
+   unsigned slot= AUDSRV_TOKEN_SLOT(token);
+
+   if ( slot < AUDSRV_MAX_PENDING_CALLBACKS )
+   {
+      AudsrvCBCtx *pCBCtxSlot= &ctx->pendingCallbacks[slot];
+      if ( (pCBCtxSlot->type == type) &&
+           (pCBCtxSlot->generation == AUDSRV_TOKEN_GENERATION(token)) )
+      {
+         pCBCtx= pCBCtxSlot;
+      }
+   }
+
+   return pCBCtx;
+}
+
+// Complete pending requests with an error result: those expired at time now, or all
+// of them if now is 0.  Must be called without mutexSend held.
+static void audsrv_pending_cancel( AudsrvApiContext *ctx, int result, long long now )
+{
+   AudsrvCBCtx expired[AUDSRV_MAX_PENDING_CALLBACKS];
+   int expiredCount= 0;
+
+   pthread_mutex_lock( &ctx->mutexSend );
+   for( int i= 0; (i < AUDSRV_MAX_PENDING_CALLBACKS) && (ctx->pendingCount > 0); ++i )
+   {
+      AudsrvCBCtx *pCBCtx= &ctx->pendingCallbacks[i];
+
+      if ( (pCBCtx->type != AUDSRV_CBTYPE_None) && (!now || (pCBCtx->expiry <= now)) )
+      {
+         TRACE1("pending request type %d slot %d generation %u: result %d", pCBCtx->type, i, pCBCtx->generation, result);
+         if ( pCBCtx->sync )
+         {
+            pCBCtx->sync->result= result;
+            pCBCtx->sync->done= true;
+            pthread_cond_broadcast( &ctx->condSync );
+         }
+         else
+         {
+            expired[expiredCount++]= *pCBCtx;
+         }
+         audsrv_pending_free( ctx, pCBCtx );
+      }
+   }
+   pthread_mutex_unlock( &ctx->mutexSend );
+
+   for( int i= 0; i < expiredCount; ++i )
+   {
+      ctx->inCallback= true;
+      switch( expired[i].type )
+      {
+         case AUDSRV_CBTYPE_EnumSessions:
+            if ( expired[i].withHandles )
+            {
+               expired[i].cb.enumhandles( expired[i].userData, result, 0, 0 );
+            }
+            else
+            {
+               expired[i].cb.enumsess( expired[i].userData, result, 0, 0 );
+            }
+            break;
+         case AUDSRV_CBTYPE_GetStatus:
+            expired[i].cb.getstatus( expired[i].userData, result, 0 );
+            break;
+         case AUDSRV_CBTYPE_GetLatency:
+            expired[i].cb.getlatency( expired[i].userData, result, 0 );
+            break;
+      }
+      ctx->inCallback= false;
+   }
+}
+
+// Milliseconds until the next pending request expires, or -1 if none are pending.
+// Must be called with mutexSend held.
+static int audsrv_pending_timeout( AudsrvApiContext *ctx )
+{
+   long long expiry= 0;
+   int timeout= -1;
+
+   if ( ctx->pendingCount > 0 )
+   {
+      for( int i= 0; i < AUDSRV_MAX_PENDING_CALLBACKS; ++i )
+      {
+         AudsrvCBCtx *pCBCtx= &ctx->pendingCallbacks[i];
+
+         if ( (pCBCtx->type != AUDSRV_CBTYPE_None) && (!expiry || (pCBCtx->expiry < expiry)) )
+         {
+            expiry= pCBCtx->expiry;
+         }
+      }
+      if ( expiry )
+      {
+         long long now= getCurrentTimeMillis();
+         timeout= (expiry > now) ? (int)(expiry-now) : 0;
+      }
+   }
+
+   return timeout;
+}
+
+// Wait for a synchronous request to complete or time out.  When called from a callback on
+// the receive thread the reply is dispatched here instead.  Must be called with mutexSend held.
+static void audsrv_sync_wait( AudsrvApiContext *ctx, AudsrvSyncWait *wait, int type, unsigned long long token, int timeout )
+{
+   AudsrvApiContext *recvCtx= (ctx->parent ? ctx->parent : ctx);
+   long long deadline= getCurrentTimeMillis() + timeout;
+
+   if ( pthread_equal( pthread_self(), recvCtx->threadId ) )
+   {
+      bool inCallback= ctx->inCallback;
+
+      ++ctx->inlineDispatch;
+      if ( recvCtx != ctx )
+      {
+         ++recvCtx->inlineDispatch;
+      }
+      while( !wait->done )
+      {
+         struct pollfd pfd;
+         int remaining= (int)(deadline - getCurrentTimeMillis());
+         int rc, len= 0;
+
+         if ( remaining <= 0 )
+         {
+            break;
+         }
+
+         pthread_mutex_unlock( &ctx->mutexSend );
+         pfd.fd= recvCtx->fdSocket;
+         pfd.events= POLLIN;
+         pfd.revents= 0;
+         rc= poll( &pfd, 1, remaining );
+         if ( rc > 0 )
+         {
+            len= audsrv_conn_recv( recvCtx->conn );
+            if ( len > 0 )
+            {
+               while( audsrv_process_message( recvCtx ) > 0 );
+            }
+         }
+         pthread_mutex_lock( &ctx->mutexSend );
+
+         if ( (rc > 0) && (len <= 0) )
+         {
+            break;
+         }
+      }
+      if ( recvCtx != ctx )
+      {
+         --recvCtx->inlineDispatch;
+      }
+      --ctx->inlineDispatch;
+      ctx->inCallback= inCallback;
+   }
+   else
+   {
+      struct timespec ts;
+
+      clock_gettime( CLOCK_REALTIME, &ts );
+      ts.tv_sec += timeout/1000;
+      ts.tv_nsec += (timeout%1000)*1000000;
+      if ( ts.tv_nsec >= 1000000000 )
+      {
+         ts.tv_sec += 1;
+         ts.tv_nsec -= 1000000000;
+      }
+      while( !wait->done )
+      {
+         if ( pthread_cond_timedwait( &ctx->condSync, &ctx->mutexSend, &ts ) == ETIMEDOUT )
+         {
+            break;
+         }
+      }
+   }
+
+   if ( !wait->done )
+   {
+      AudsrvCBCtx *pCBCtx= audsrv_pending_find( ctx, type, token );
+      if ( pCBCtx )
+      {
+         audsrv_pending_free( ctx, pCBCtx );
+      }
+      wait->result= AUDSRV_RESULT_Timeout;
+      wait->done= true;
+   }
+}
 
 bool AudioServerInit( void )
 {
@@ -154,8 +554,17 @@ AudSrv AudioServerConnect( const char *name )
    }
    
    ctx->fdSocket= -1;
+   ctx->fdWake= -1;
    ctx->captureParameters.version= (unsigned)-1;
-   ctx->pendingCallbacks= std::vector<AudsrvCBCtx*>();
+   ctx->captureRingEventFd= -1;
+   ctx->dataRingFd= -1;
+   ctx->fdWake= eventfd( 0, EFD_CLOEXEC|EFD_NONBLOCK );
+   if ( ctx->fdWake < 0 )
+   {
+      ERROR("Unable to create wake event: errno %d", errno);
+      error= true;
+      goto exit;
+   }
    
    ctx->serverName= strdup( name );
    if ( !ctx->serverName )
@@ -167,6 +576,9 @@ AudSrv AudioServerConnect( const char *name )
    
    pthread_mutex_init( &ctx->mutexSend, 0 );
    pthread_mutex_init( &ctx->mutexRecv, 0 );
+   pthread_mutex_init( &ctx->mutexDispatch, 0 );
+   pthread_cond_init( &ctx->condReady, 0 );
+   pthread_cond_init( &ctx->condSync, 0 );
    
    if ( !audsrv_connect_socket( ctx ) )
    {
@@ -187,23 +599,27 @@ AudSrv AudioServerConnect( const char *name )
    if ( !rc )
    {
       bool ready;
-      
-      for( int i= 0; i < 500; ++i )
-      {
-         pthread_mutex_lock( &ctx->mutexRecv );
-         ready= ctx->receiveThreadReady;
-         pthread_mutex_unlock( &ctx->mutexRecv );
+      struct timespec deadline;
 
-         if ( ready )
+      clock_gettime( CLOCK_REALTIME, &deadline );
+      deadline.tv_sec += AUDSRV_READY_TIMEOUT;
+
+      pthread_mutex_lock( &ctx->mutexRecv );
+      while( !ctx->receiveThreadReady )
+      {
+         if ( pthread_cond_timedwait( &ctx->condReady, &ctx->mutexRecv, &deadline ) == ETIMEDOUT )
          {
-            TRACE1("ctx %p receive thread ready", ctx);
             break;
          }
-
-         usleep( 10000 );
       }
+      ready= ctx->receiveThreadReady;
+      pthread_mutex_unlock( &ctx->mutexRecv );
       
-      if ( !ready )
+      if ( ready )
+      {
+         TRACE1("ctx %p receive thread ready", ctx);
+      }
+      else
       {
          error= true;
          ERROR("client thread failed to become ready");
@@ -211,6 +627,7 @@ AudSrv AudioServerConnect( const char *name )
    }
    else
    {
+      error= true;
       ERROR("error creating thread for ctx %p fd %d", ctx, ctx->fdSocket );
    }
 
@@ -225,6 +642,11 @@ exit:
             audsrv_conn_term( ctx->conn );
             ctx->conn= 0;
          }
+         if ( ctx->fdWake >= 0 )
+         {
+            close( ctx->fdWake );
+            ctx->fdWake= -1;
+         }
          if ( ctx->serverName )
          {
             free( ctx->serverName );
@@ -240,6 +662,104 @@ exit:
    return (AudSrv)ctx;   
 }
 
+AudSrv AudioServerConnectSubSession( AudSrv audsrv )
+{
+   AudsrvApiContext *parent= (AudsrvApiContext*)audsrv;
+   AudsrvApiContext *ctx= 0;
+   bool onReceiveThread;
+   int slot= -1;
+
+   TRACE1( "AudioServerConnectSubSession: enter: audsrv %p", audsrv );
+
+   if ( !parent || parent->parent )
+   {
+      ERROR("sub-sessions must be opened on a connection from AudioServerConnect");
+      goto exit;
+   }
+
+   ctx= (AudsrvApiContext*)calloc( 1, sizeof(AudsrvApiContext) );
+   if ( !ctx )
+   {
+      ERROR("Unable to allocate api context");
+      goto exit;
+   }
+
+   ctx->parent= parent;
+   ctx->fdSocket= parent->fdSocket;
+   ctx->fdWake= parent->fdWake;
+   ctx->captureParameters.version= (unsigned)-1;
+   ctx->captureRingEventFd= -1;
+   ctx->dataRingFd= -1;
+
+   pthread_mutex_init( &ctx->mutexSend, 0 );
+   pthread_mutex_init( &ctx->mutexRecv, 0 );
+   pthread_mutex_init( &ctx->mutexDispatch, 0 );
+   pthread_cond_init( &ctx->condReady, 0 );
+   pthread_cond_init( &ctx->condSync, 0 );
+
+   onReceiveThread= pthread_equal( pthread_self(), parent->threadId );
+   if ( !onReceiveThread )
+   {
+      pthread_mutex_lock( &parent->mutexDispatch );
+   }
+   for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+   {
+      if ( !parent->subSessions[i] )
+      {
+         slot= i;
+         break;
+      }
+   }
+   if ( slot >= 0 )
+   {
+      // Ids are not reused right away so that late traffic for a released sub-session is discarded
+      do
+      {
+         if ( ++parent->nextSubSessionId == 0 )
+         {
+            parent->nextSubSessionId= 1;
+         }
+      }
+      while( audsrv_find_sub_session( parent, parent->nextSubSessionId ) );
+      ctx->subSessionId= parent->nextSubSessionId;
+
+      ctx->conn= audsrv_conn_init_sub( parent->conn, ctx->subSessionId, AUDSRV_MAX_MSG );
+      if ( ctx->conn )
+      {
+         parent->subSessions[slot]= ctx;
+      }
+   }
+   if ( !onReceiveThread )
+   {
+      pthread_mutex_unlock( &parent->mutexDispatch );
+   }
+
+   if ( !ctx->conn )
+   {
+      if ( slot < 0 )
+      {
+         ERROR("too many sub-sessions on connection %p", parent);
+      }
+      else
+      {
+         ERROR("Error initilaizing connection" );
+      }
+      pthread_cond_destroy( &ctx->condReady );
+      pthread_cond_destroy( &ctx->condSync );
+      pthread_mutex_destroy( &ctx->mutexDispatch );
+      pthread_mutex_destroy( &ctx->mutexRecv );
+      pthread_mutex_destroy( &ctx->mutexSend );
+      free( ctx );
+      ctx= 0;
+   }
+
+exit:
+
+   TRACE1( "AudioServerConnectSubSession: exit : audsrv %p", ctx );
+
+   return (AudSrv)ctx;
+}
+
 void AudioServerDisconnect( AudSrv audsrv )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
@@ -248,14 +768,39 @@ void AudioServerDisconnect( AudSrv audsrv )
 
    if ( ctx )
    {
+      if ( ctx->parent )
+      {
+         if ( !audsrv_release_sub_session( ctx ) )
+         {
+            goto exit;
+         }
+
+         // The socket and wake fd are borrowed from the owner
+         ctx->fdSocket= -1;
+         ctx->fdWake= -1;
+      }
+
       pthread_mutex_lock( &ctx->mutexRecv );
 
       if ( ctx->inCallback )
       {
          ctx->discPending= true;
+         pthread_mutex_unlock( &ctx->mutexRecv );
          goto exit;
       }
 
+      // Sub-sessions cannot outlive the connection that carries them
+      for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+      {
+         if ( ctx->subSessions[i] )
+         {
+            AudioServerDisconnect( (AudSrv)ctx->subSessions[i] );
+         }
+      }
+
+      // Request the stop first so the receive thread does not treat the shutdown as a server restart
+      ctx->receiveThreadStopRequested= true;
+
       if ( ctx->fdSocket >= 0 )
       {
          TRACE1("AudioServerDisconnect: shutting down socket fd %d for ctx %p", ctx->fdSocket, ctx );
@@ -264,7 +809,7 @@ void AudioServerDisconnect( AudSrv audsrv )
 
       if ( ctx->receiveThreadStarted )
       {
-         ctx->receiveThreadStopRequested= true;
+         eventfd_write( ctx->fdWake, 1 );
          pthread_mutex_unlock( &ctx->mutexRecv );
          TRACE1("AudioServerDisconnect: requested stop, calling join for ctx %p", ctx);
          pthread_join( ctx->threadId, NULL );
@@ -272,11 +817,12 @@ void AudioServerDisconnect( AudSrv audsrv )
          pthread_mutex_lock( &ctx->mutexRecv );
       }
 
-      while( ctx->pendingCallbacks.size() > 0 )
+      audsrv_pending_cancel( ctx, AUDSRV_RESULT_Cancelled, 0 );
+
+      if ( ctx->fdWake >= 0 )
       {
-         AudsrvCBCtx *pCBCtx= ctx->pendingCallbacks.back();
-         free( pCBCtx );
-         ctx->pendingCallbacks.pop_back();
+         close( ctx->fdWake );
+         ctx->fdWake= -1;
       }
 
       if ( ctx->conn )
@@ -295,6 +841,37 @@ void AudioServerDisconnect( AudSrv audsrv )
          free( ctx->sessionNamePrivate );
          ctx->sessionNamePrivate = 0;
       }
+
+      if ( ctx->sessionNameAttached )
+      {
+         free( ctx->sessionNameAttached );
+         ctx->sessionNameAttached= 0;
+      }
+
+      if ( ctx->sessionNameInit )
+      {
+         free( ctx->sessionNameInit );
+         ctx->sessionNameInit= 0;
+      }
+
+      if ( ctx->captureSessionName )
+      {
+         free( ctx->captureSessionName );
+         ctx->captureSessionName= 0;
+      }
+
+      audsrv_capture_ring_unmap( ctx );
+      if ( ctx->captureRingEventFd >= 0 )
+      {
+         close( ctx->captureRingEventFd );
+         ctx->captureRingEventFd= -1;
+      }
+
+      if ( ctx->dataRingFd >= 0 )
+      {
+         close( ctx->dataRingFd );
+         ctx->dataRingFd= -1;
+      }
       
       if ( ctx->serverName )
       {
@@ -303,6 +880,9 @@ void AudioServerDisconnect( AudSrv audsrv )
       }
 
       pthread_mutex_unlock( &ctx->mutexRecv );
+      pthread_cond_destroy( &ctx->condReady );
+      pthread_cond_destroy( &ctx->condSync );
+      pthread_mutex_destroy( &ctx->mutexDispatch );
       pthread_mutex_destroy( &ctx->mutexRecv );
       pthread_mutex_destroy( &ctx->mutexSend );
       
@@ -328,6 +908,20 @@ bool AudioServerInitSession( AudSrv audsrv, int sessionType, bool isPrivate, con
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
+      ctx->sessionInitialized= true;
+      if ( sessionName != ctx->sessionNameInit )
+      {
+         if ( ctx->sessionNameInit )
+         {
+            free( ctx->sessionNameInit );
+            ctx->sessionNameInit= 0;
+         }
+         if ( sessionName )
+         {
+            ctx->sessionNameInit= strdup( sessionName );
+         }
+      }
+
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
@@ -377,6 +971,7 @@ bool AudioServerInitSession( AudSrv audsrv, int sessionType, bool isPrivate, con
       {
          ctx->isPrivate= isPrivate;
          ctx->sessionType= sessionType;
+         ctx->sessionHandle= 0;
 
          if ( ctx->isPrivate == true ) {
              if ( !ctx->sessionNamePrivate || strcmp( ctx->sessionNamePrivate, sessionName ) ) {
@@ -427,27 +1022,111 @@ bool AudioServerGetSessionIsPrivate( AudSrv audsrv, bool *sessionIsPrivate )
    return result;
 }
 
-bool AudioServerSessionAttach( AudSrv audsrv, const char *sessionName )
+bool AudioServerGetSessionHandle( AudSrv audsrv, unsigned *sessionHandle )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
 
-   if ( ctx )
+   if ( ctx && sessionHandle )
    {
-      if ( ctx->sessionType == AUDSRV_SESSION_Observer )
+      pthread_mutex_lock( &ctx->mutexSend );
+      if ( ctx->sessionHandle )
       {
-         if ( !ctx->sessionNameAttached || strcmp( ctx->sessionNameAttached, sessionName ) )
-         {
-            if ( ctx->sessionNameAttached )
-            {         
-               free( ctx->sessionNameAttached );
-               ctx->sessionNameAttached= 0;
-            }
-            ctx->sessionNameAttached= strdup( sessionName );
+         *sessionHandle= ctx->sessionHandle;
+         result= true;
+      }
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+   return result;
+}
+
+bool AudioServerSessionAttach( AudSrv audsrv, const char *sessionName )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen, nameLen;
+
+   if ( ctx )
+   {
+      if ( ctx->sessionType == AUDSRV_SESSION_Observer )
+      {
+         pthread_mutex_lock( &ctx->mutexSend );
+         if ( !ctx->sessionNameAttached || strcmp( ctx->sessionNameAttached, sessionName ) )
+         {
+            if ( ctx->sessionNameAttached )
+            {         
+               free( ctx->sessionNameAttached );
+               ctx->sessionNameAttached= 0;
+            }
+            ctx->sessionHandleAttached= 0;
+            ctx->sessionNameAttached= strdup( sessionName );
          }
          if ( ctx->sessionNameAttached )
          {
             result= true;
+
+            // Ask the server to map the name to a session handle.  Until the answer arrives,
+            // or if the name is ambiguous, requests address the attached session by name.
+            if ( !ctx->sessionHandleAttached && (strlen( sessionName ) <= AUDSRV_MAX_SESSION_NAME_LEN) )
+            {
+               p= ctx->conn->sendbuff;
+               paramLen= 0;
+
+               nameLen= AUDSRV_MSG_STRING_LEN(sessionName);
+               paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
+
+               msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+               if ( msgLen <= AUDSRV_MAX_MSG )
+               {
+                  p += audsrv_conn_put_u32( p, paramLen );
+                  p += audsrv_conn_put_u32( p, AUDSRV_MSG_ResolveSession );
+                  p += audsrv_conn_put_u32( p, AUDSRV_MSG_ResolveSession_Version );
+                  p += audsrv_conn_put_u32( p, nameLen );
+                  p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
+                  p += audsrv_conn_put_string( p, sessionName );
+
+                  audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+               }
+            }
+         }
+         pthread_mutex_unlock( &ctx->mutexSend );
+      }
+      else
+      {
+         ERROR("Cannot perform attach/detach on non-observer session");
+      }
+   }   
+
+   return result;
+}
+
+bool AudioServerSessionAttachByHandle( AudSrv audsrv, unsigned sessionHandle )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+
+   if ( ctx )
+   {
+      if ( ctx->sessionType == AUDSRV_SESSION_Observer )
+      {
+         if ( sessionHandle )
+         {
+            pthread_mutex_lock( &ctx->mutexSend );
+            if ( ctx->sessionNameAttached )
+            {
+               free( ctx->sessionNameAttached );
+               ctx->sessionNameAttached= 0;
+            }
+            ctx->sessionHandleAttached= sessionHandle;
+            pthread_mutex_unlock( &ctx->mutexSend );
+            result= true;
+         }
+         else
+         {
+            ERROR("Cannot attach to invalid session handle");
          }
       }
       else
@@ -468,11 +1147,14 @@ bool AudioServerSessionDetach( AudSrv audsrv )
    {
       if ( ctx->sessionType == AUDSRV_SESSION_Observer )
       {
+         pthread_mutex_lock( &ctx->mutexSend );
          if ( ctx->sessionNameAttached )
          {
             free( ctx->sessionNameAttached );
             ctx->sessionNameAttached= 0;
          }
+         ctx->sessionHandleAttached= 0;
+         pthread_mutex_unlock( &ctx->mutexSend );
          result= true;
       }
       else
@@ -498,6 +1180,12 @@ bool AudioServerSetAudioInfo( AudSrv audsrv, AudSrvAudioInfo *info )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
+      if ( info != &ctx->audioInfo )
+      {
+         ctx->audioInfo= *info;
+         ctx->audioInfoSet= true;
+      }
+
       p= ctx->conn->sendbuff;
       paramLen= 0;
       
@@ -565,6 +1253,56 @@ exit:
    return result;
 }
 
+bool AudioServerSetPcmFormat( AudSrv audsrv, unsigned format )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+
+   TRACE1("AudioServerSetPcmFormat: audsrv %p format %u", audsrv, format );
+
+   if ( format > AUDSRV_PCM_FORMAT_F32LE )
+   {
+      ERROR("unsupported pcm format %u", format);
+      goto exit;
+   }
+
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->pcmFormat= format;
+      ctx->pcmFormatSet= true;
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // format
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_SetPcmFormat );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_SetPcmFormat_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, format );
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+exit:
+   TRACE1("AudioServerSetPcmFormat: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
 bool AudioServerBasetime( AudSrv audsrv, long long basetime )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
@@ -579,6 +1317,9 @@ bool AudioServerBasetime( AudSrv audsrv, long long basetime )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
+      ctx->basetime= basetime;
+      ctx->basetimeSet= true;
+
       p= ctx->conn->sendbuff;
       paramLen= 0;
       
@@ -627,6 +1368,9 @@ bool AudioServerPlay( AudSrv audsrv )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
+      ctx->playing= true;
+      ctx->paused= false;
+
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
@@ -670,6 +1414,9 @@ bool AudioServerStop( AudSrv audsrv )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
+      ctx->playing= false;
+      ctx->paused= false;
+
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
@@ -713,6 +1460,8 @@ bool AudioServerPause( AudSrv audsrv, bool pause )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
+      ctx->paused= pause;
+
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
@@ -749,6 +1498,7 @@ bool AudioServerFlush( AudSrv audsrv )
    unsigned char *p;
    int msgLen, paramLen;
    int sendLen;
+   bool sendGeneration;
    
    TRACE1("AudioServerFlush: audsrv %p", audsrv );
    
@@ -756,9 +1506,18 @@ bool AudioServerFlush( AudSrv audsrv )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
+      // Data sent from here on belongs to the new generation
+      ++ctx->flushGeneration;
+      sendGeneration= audsrv_send_generation( ctx );
+
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
+      if ( sendGeneration )
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // generation
+      }
+
       msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
       
       if ( msgLen > AUDSRV_MAX_MSG )
@@ -770,11 +1529,18 @@ bool AudioServerFlush( AudSrv audsrv )
 
       p += audsrv_conn_put_u32( p, paramLen );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_Flush );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_Flush_Version );
+      p += audsrv_conn_put_u32( p, (sendGeneration ? AUDSRV_MSG_Flush_Version_Generation : AUDSRV_MSG_Flush_Version_Plain) );
+      if ( sendGeneration )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, ctx->flushGeneration );
+      }
 
       sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
       
       result= (sendLen == msgLen);
+      ctx->flushGenerationSent= (result && sendGeneration);
 
       pthread_mutex_unlock( &ctx->mutexSend );
    }   
@@ -785,6 +1551,22 @@ exit:
    return result;
 }
 
+bool AudioServerGetFlushGeneration( AudSrv audsrv, unsigned *generation )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+
+   if ( ctx && generation )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+      *generation= ctx->flushGeneration;
+      result= ctx->flushGenerationSent;
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+   return result;
+}
+
 bool AudioServerAudioSync( AudSrv audsrv, long long nowMicros, long long stc )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
@@ -844,6 +1626,7 @@ bool AudioServerAudioData( AudSrv audsrv, unsigned char *data, unsigned len )
    unsigned char *p;
    int msgLen, paramLen;
    int sendLen;
+   bool sendGeneration;
    
    TRACE3("AudioServerData: audsrv %p data %p len %u", audsrv, data, len );
    
@@ -854,6 +1637,11 @@ bool AudioServerAudioData( AudSrv audsrv, unsigned char *data, unsigned len )
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
+      sendGeneration= audsrv_send_generation( ctx );
+      if ( sendGeneration )
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // generation
+      }
       paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + len); // buffer
 
       // Don't include payload data length since it doesn't occupy space
@@ -869,7 +1657,13 @@ bool AudioServerAudioData( AudSrv audsrv, unsigned char *data, unsigned len )
 
       p += audsrv_conn_put_u32( p, paramLen );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_AudioData );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_AudioData_Version );
+      p += audsrv_conn_put_u32( p, (sendGeneration ? AUDSRV_MSG_AudioData_Version_Generation : AUDSRV_MSG_AudioData_Version_Plain) );
+      if ( sendGeneration )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, ctx->flushGeneration );
+      }
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_BUFFER_LEN(len) );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_Buffer );
 
@@ -885,462 +1679,424 @@ exit:
    return result;
 }
 
-bool AudioServerAudioDataHandle( AudSrv audsrv, unsigned long long dataHandle )
+int AudioServerAudioDataNonBlocking( AudSrv audsrv, unsigned char *data, unsigned len )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   bool result= false;
+   int result= -1;
    unsigned char *p;
    int msgLen, paramLen;
    int sendLen;
-   
-   TRACE3("AudioServerDataHandle: audsrv %p handle %llu", audsrv, dataHandle );
-   
+   bool sendGeneration;
+
+   TRACE3("AudioServerDataNonBlocking: audsrv %p data %p len %u", audsrv, data, len );
+
    if ( ctx )
    {
-      pthread_mutex_lock( &ctx->mutexSend );
+      // A blocking call in progress holds the send lock: report would block rather than wait.
+      // The send below does the same for the lock of a connection shared with sub-sessions.
+      if ( pthread_mutex_trylock( &ctx->mutexSend ) )
+      {
+         result= 0;
+         goto exit;
+      }
+
+      if ( len > AUDSRV_MAX_NONBLOCKING_DATA )
+      {
+         len= AUDSRV_MAX_NONBLOCKING_DATA;
+      }
 
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // dataHandle
-
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
-      
-      if ( msgLen > AUDSRV_MAX_MSG )
+      sendGeneration= audsrv_send_generation( ctx );
+      if ( sendGeneration )
       {
-         ERROR("audio data handle msg too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // generation
       }
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + len); // buffer
+
+      // Don't include payload data length since it doesn't occupy space
+      // in our work buffer
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen - len;
 
       p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_AudioDataHandle );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_AudioDataHandle_Version );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
-      p += audsrv_conn_put_u64( p, dataHandle );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_AudioData );
+      p += audsrv_conn_put_u32( p, (sendGeneration ? AUDSRV_MSG_AudioData_Version_Generation : AUDSRV_MSG_AudioData_Version_Plain) );
+      if ( sendGeneration )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, ctx->flushGeneration );
+      }
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_BUFFER_LEN(len) );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_Buffer );
 
-      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
-      
-      result= (sendLen == msgLen);
+      sendLen= audsrv_conn_send_nonblocking( ctx->conn, ctx->conn->sendbuff, msgLen, data, len );
+      if ( sendLen == (msgLen+(int)len) )
+      {
+         result= len;
+      }
+      else if ( sendLen == 0 )
+      {
+         result= 0;
+      }
 
       pthread_mutex_unlock( &ctx->mutexSend );
-   }   
+   }
 
 exit:
 
    return result;
 }
 
-static bool audioServerMute( AudsrvApiContext *ctx, bool mute, bool global, const char *sessionName )
+bool AudioServerAudioDataV( AudSrv audsrv, const struct iovec *iov, int count )
 {
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
-   unsigned char *p;
-   int msgLen, paramLen, nameLen;
-   int sendLen;
-   
-   TRACE1("audioServerMute: audsrv %p mute %d global %d sessionName (%s)", ctx, mute, global, sessionName );
-   if ( global && sessionName )
-   {
-      ERROR("audioServerMute: sessionName not permitted with global request");
-      sessionName= 0;
-   }
+   unsigned char hdr[AUDSRV_MAX_DATAV_CHUNKS][AUDSRV_DATA_HDR_LEN];
+   struct iovec vec[2*AUDSRV_MAX_DATAV_CHUNKS];
+   bool sendGeneration;
+   int hdrLen;
 
-   nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
-   
-   if ( ctx )
+   TRACE3("AudioServerDataV: audsrv %p iov %p count %d", audsrv, iov, count );
+
+   if ( ctx && iov && (count > 0) )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
-      p= ctx->conn->sendbuff;
-      paramLen= 0;
-
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // global
-      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
+      result= true;
+      sendGeneration= audsrv_send_generation( ctx );
+      hdrLen= (sendGeneration ? AUDSRV_DATA_HDR_LEN : AUDSRV_DATA_HDR_LEN-AUDSRV_DATA_GEN_LEN);
 
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
-      
-      if ( msgLen > AUDSRV_MAX_MSG )
+      // Frame each chunk as its own AudioData message and send the run in one call
+      for( int i= 0; result && (i < count); )
       {
-         ERROR("mute msg too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
-      }
+         int vcount= 0;
+         int totalLen= 0;
+         int sendLen;
 
-      p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, (mute ? AUDSRV_MSG_Mute : AUDSRV_MSG_UnMute) );
-      p += audsrv_conn_put_u32( p, (mute ? AUDSRV_MSG_Mute_Version : AUDSRV_MSG_UnMute_Version) );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
-      p += audsrv_conn_put_u16( p, (global ? 0x0001 : 0x0000) );
-      p += audsrv_conn_put_u32( p, nameLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
-      if ( sessionName )
-      {
-         p += audsrv_conn_put_string( p, sessionName );
-      }
+         for( int n= 0; (n < AUDSRV_MAX_DATAV_CHUNKS) && (i < count); ++i )
+         {
+            unsigned len= iov[i].iov_len;
+            unsigned char *p= hdr[n];
 
-      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
-      
-      result= (sendLen == msgLen);
+            if ( !len )
+            {
+               continue;
+            }
 
-      pthread_mutex_unlock( &ctx->mutexSend );
-   }   
+            p += audsrv_conn_put_u32( p, hdrLen - AUDSRV_MSG_HDR_LEN + len );
+            p += audsrv_conn_put_u32( p, AUDSRV_MSG_AudioData );
+            p += audsrv_conn_put_u32( p, (sendGeneration ? AUDSRV_MSG_AudioData_Version_Generation : AUDSRV_MSG_AudioData_Version_Plain) );
+            if ( sendGeneration )
+            {
+               p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+               p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+               p += audsrv_conn_put_u32( p, ctx->flushGeneration );
+            }
+            p += audsrv_conn_put_u32( p, AUDSRV_MSG_BUFFER_LEN(len) );
+            p += audsrv_conn_put_u32( p, AUDSRV_TYPE_Buffer );
+
+            vec[vcount].iov_base= hdr[n];
+            vec[vcount].iov_len= hdrLen;
+            ++vcount;
+            vec[vcount].iov_base= iov[i].iov_base;
+            vec[vcount].iov_len= len;
+            ++vcount;
+            totalLen += hdrLen + len;
+            ++n;
+         }
 
-exit:
-   TRACE1("audioServerMute: audsrv %p mute %d result %d", ctx, mute, result );
+         if ( vcount )
+         {
+            sendLen= audsrv_conn_sendv( ctx->conn, vec, vcount );
+            result= (sendLen == totalLen);
+         }
+      }
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
 
    return result;
 }
 
-bool AudioServerGlobalMute( AudSrv audsrv, bool mute )
+int AudioServerGetPollFd( AudSrv audsrv )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   bool result= false;
+   int fd= -1;
 
    if ( ctx )
    {
-      result= audioServerMute( ctx, mute, true, 0 );
+      fd= ctx->fdSocket;
    }
 
-   return result;
+   return fd;
 }
 
-bool AudioServerMute( AudSrv audsrv, bool mute )
+bool AudioServerWaitWritable( AudSrv audsrv, int timeoutMs )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
+   long long deadline= 0;
+
+   TRACE3("AudioServerWaitWritable: audsrv %p timeout %d", audsrv, timeoutMs );
 
    if ( ctx )
    {
-      if ((ctx->isPrivate == true) && ctx->sessionNamePrivate) {
-          result= audioServerMute( ctx, mute, false, ctx->sessionNamePrivate );
-      }
-      else {
-          result= audioServerMute( ctx, mute, false, ctx->sessionNameAttached );
+      if ( timeoutMs > 0 )
+      {
+         deadline= getCurrentTimeMillis() + timeoutMs;
       }
-   }
 
-   return result;
-}
+      for( ; ; )
+      {
+         struct pollfd pfd;
+         int flushed;
+         int rc, wait;
 
-static bool audioServerVolume( AudsrvApiContext *ctx, float volume, bool global, const char *sessionName )
-{
-   bool result= false;
-   unsigned char *p;
-   int msgLen, paramLen, nameLen;
-   int sendLen;
-   unsigned level;
-   
-   TRACE1("audioServerVolume: audsrv %p volume %f global %d sessionName (%s)", ctx, volume, global, sessionName );
-   if ( global && sessionName )
-   {
-      ERROR("audioServerVolume: sessionName not permitted with global request");
-      sessionName= 0;
-   }
+         // A blocking send in progress on this session, or on another session sharing the
+         // connection, may be waiting on a peer that is not reading: report not writable
+         if ( pthread_mutex_trylock( &ctx->mutexSend ) )
+         {
+            break;
+         }
+         // Writable means any tail of a previous non-blocking send has gone out
+         flushed= audsrv_conn_flush( ctx->conn, false );
+         pthread_mutex_unlock( &ctx->mutexSend );
+         if ( flushed < 0 )
+         {
+            break;
+         }
 
-   nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
-      
-   if ( ctx )
-   {
-      pthread_mutex_lock( &ctx->mutexSend );
+         wait= timeoutMs;
+         if ( timeoutMs > 0 )
+         {
+            wait= (int)(deadline - getCurrentTimeMillis());
+            if ( wait < 0 ) wait= 0;
+         }
 
-      p= ctx->conn->sendbuff;
-      paramLen= 0;
-      
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // level numerator
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // level denominator
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // global
-      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
-      
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
-      
-      if ( msgLen > AUDSRV_MAX_MSG )
-      {
-         ERROR("audio volume msg too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
-      }
-      
-      if ( volume < 0.0 ) volume= 0.0;
-      if ( volume > 1.0 ) volume= 1.0;
-      
-      level= (unsigned)(LEVEL_DENOMINATOR * volume);
-      TRACE1("AudioServerVolume: audsrv %p level %u / %u", ctx, level, LEVEL_DENOMINATOR );
-      
-      p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_Volume );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_Volume_Version );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
-      p += audsrv_conn_put_u32( p, level );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
-      p += audsrv_conn_put_u32( p, LEVEL_DENOMINATOR );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
-      p += audsrv_conn_put_u16( p, (global ? 0x0001 : 0x0000) );
-      p += audsrv_conn_put_u32( p, nameLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
-      if ( sessionName )
-      {
-         p += audsrv_conn_put_string( p, sessionName );
-      }
+         pfd.fd= ctx->fdSocket;
+         pfd.events= POLLOUT;
+         pfd.revents= 0;
+         do
+         {
+            rc= poll( &pfd, 1, wait );
+         }
+         while ( (rc < 0) && (errno == EINTR) );
 
-      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
-      
-      result= (sendLen == msgLen);
+         if ( (rc <= 0) || (pfd.revents & (POLLERR|POLLHUP|POLLNVAL)) )
+         {
+            break;
+         }
 
-      pthread_mutex_unlock( &ctx->mutexSend );
+         if ( flushed > 0 )
+         {
+            result= true;
+            break;
+         }
+      }
    }
 
-exit:
-   TRACE1("AudioServerVolume: audsrv %p result %d", ctx, result );
-   
    return result;
 }
 
-bool AudioServerGlobalVolume( AudSrv audsrv, float volume )
+bool AudioServerEnableDataRing( AudSrv audsrv, int fd )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
+   int fdDup= -1;
+
+   TRACE1("AudioServerEnableDataRing: audsrv %p fd %d", audsrv, fd );
 
    if ( ctx )
    {
-      result= audioServerVolume( ctx, volume, true, 0 );
-   }
+      if ( fd >= 0 )
+      {
+         fdDup= fcntl( fd, F_DUPFD_CLOEXEC, 0 );
+         if ( fdDup < 0 )
+         {
+            ERROR("unable to duplicate data ring fd %d: errno %d", fd, errno);
+            goto exit;
+         }
+      }
 
-   return result;
-}
+      pthread_mutex_lock( &ctx->mutexSend );
 
-bool AudioServerVolume( AudSrv audsrv, float volume )
-{
-   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   bool result= false;
-   
-   if ( ctx )
-   {
-      result= audioServerVolume( ctx, volume, false, ctx->sessionNameAttached );
+      if ( ctx->dataRingFd >= 0 )
+      {
+         close( ctx->dataRingFd );
+      }
+      ctx->dataRingFd= fdDup;
+
+      result= audsrv_send_enable_data_ring( ctx );
+
+      pthread_mutex_unlock( &ctx->mutexSend );
    }
 
+exit:
+   TRACE1("AudioServerEnableDataRing: audsrv %p result %d", audsrv, result );
+
    return result;
 }
 
-bool AudioServerEnumerateSessions( AudSrv audsrv, AudioServerEnumSessions cb, void *userData )
+// Must be called with mutexSend held
+static bool audsrv_send_enable_data_ring( AudsrvApiContext *ctx )
 {
-   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
    unsigned char *p;
    int msgLen, paramLen;
    int sendLen;
-   AudsrvCBCtx *pCBCtx= 0;
-   unsigned long long token;
-   
-   TRACE1("AudioServerEnumerateSessions: audsrv %p", audsrv );
-
-   if ( ctx )
-   {
-      pCBCtx= (AudsrvCBCtx*)calloc( 1, sizeof(AudsrvCBCtx));
-      if ( !pCBCtx )
-      {
-         ERROR("No memory for session enum callback context");
-         goto exit;
-      }
-
-      pCBCtx->cb.enumsess= cb;
-      pCBCtx->userData= userData;
-
-      if ( sizeof(void*) == 4 )
-      {
-         token= (unsigned)pCBCtx;
-      }
-      else
-      {
-         token= (unsigned long long)pCBCtx;
-      }
-      TRACE1("audio enum sessions: pCBCtx %p token %llx", pCBCtx, token);      
+   bool enable= (ctx->dataRingFd >= 0);
 
-      pthread_mutex_lock( &ctx->mutexSend );
-
-      p= ctx->conn->sendbuff;
-      paramLen= 0;
+   p= ctx->conn->sendbuff;
+   paramLen= 0;
 
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
+   paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // enable
+   paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // sequence
 
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+   msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
 
-      if ( msgLen > AUDSRV_MAX_MSG )
-      {
-         ERROR("audio enum sessions msg too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
-      }
+   p += audsrv_conn_put_u32( p, paramLen );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableDataRing );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableDataRing_Version );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+   p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+   p += audsrv_conn_put_u16( p, (enable ? 1 : 0) );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+   p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+   p += audsrv_conn_put_u64( p, ctx->dataRingSequence );
 
-      p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnumSessions );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnumSessions_Version );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
-      p += audsrv_conn_put_u64( p, token );
-      
+   if ( enable )
+   {
+      sendLen= audsrv_conn_send_fds( ctx->conn, ctx->conn->sendbuff, msgLen, &ctx->dataRingFd, 1 );
+   }
+   else
+   {
       sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
-      
-      result= (sendLen == msgLen);
-
-      if ( result )
-      {
-         ctx->pendingCallbacks.push_back(pCBCtx);
-      }
-      else
-      {
-         free( pCBCtx );
-      }
-
-      pthread_mutex_unlock( &ctx->mutexSend );
    }
 
-exit:
-   TRACE1("AudioServerEnumerateSessions: audsrv %p result %d", audsrv, result );
+   result= (sendLen == msgLen);
 
    return result;
 }
 
-bool AudioServerGetSessionStatus( AudSrv audsrv, AudioServerSessionStatus cb, void *userData )
+bool AudioServerAudioDataRing( AudSrv audsrv, unsigned offset, unsigned len, unsigned long long *sequence )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
    unsigned char *p;
-   int msgLen, paramLen, nameLen;
+   int msgLen, paramLen;
    int sendLen;
-   AudsrvCBCtx *pCBCtx= 0;
-   unsigned long long token;
+   bool sendGeneration;
 
-   TRACE1("AudioServerGetSessionStatus: audsrv %p", audsrv );
+   TRACE3("AudioServerAudioDataRing: audsrv %p offset %u len %u", audsrv, offset, len );
 
-   if ( ctx )
+   if ( ctx && sequence )
    {
-      pCBCtx= (AudsrvCBCtx*)calloc( 1, sizeof(AudsrvCBCtx));
-      if ( !pCBCtx )
-      {
-         ERROR("No memory for getstatus callback context");
-         goto exit;
-      }
-
-      pCBCtx->cb.getstatus= cb;
-      pCBCtx->userData= userData;
-
-      if (ctx->isPrivate == true) {
-         nameLen= (ctx->sessionNamePrivate ? AUDSRV_MSG_STRING_LEN(ctx->sessionNamePrivate) : 0);
-      }
-      else {
-         nameLen= (ctx->sessionNameAttached ? AUDSRV_MSG_STRING_LEN(ctx->sessionNameAttached) : 0);
-      }
+      pthread_mutex_lock( &ctx->mutexSend );
 
-      if ( sizeof(void*) == 4 )
-      {
-         token= (unsigned)pCBCtx;
-      }
-      else
+      if ( ctx->dataRingFd < 0 )
       {
-         token= (unsigned long long)pCBCtx;
+         ERROR("no data ring enabled");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
       }
-      TRACE1("audio getstatus: pCBCtx %p token %llx", pCBCtx, token);      
-
-      pthread_mutex_lock( &ctx->mutexSend );
 
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
-      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
-
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
-
-      if ( msgLen > AUDSRV_MAX_MSG )
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // offset
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // len
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // sequence
+      sendGeneration= audsrv_send_generation( ctx );
+      if ( sendGeneration )
       {
-         ERROR("audio get session status msg too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // generation
       }
 
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
       p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetStatus );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetStatus_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_AudioDataRing );
+      p += audsrv_conn_put_u32( p, (sendGeneration ? AUDSRV_MSG_AudioDataRing_Version_Generation : AUDSRV_MSG_AudioDataRing_Version_Plain) );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, offset );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, len );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
-      p += audsrv_conn_put_u64( p, token );
-      p += audsrv_conn_put_u32( p, nameLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
-      if ( nameLen ) {
-         if (ctx->isPrivate == true) {
-            p += audsrv_conn_put_string( p, ctx->sessionNamePrivate );
-         }
-         else {
-            p += audsrv_conn_put_string( p, ctx->sessionNameAttached );
-         }
+      p += audsrv_conn_put_u64( p, ctx->dataRingSequence+1 );
+      if ( sendGeneration )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, ctx->flushGeneration );
       }
 
       sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
-      
-      result= (sendLen == msgLen);
 
+      result= (sendLen == msgLen);
       if ( result )
       {
-         ctx->pendingCallbacks.push_back(pCBCtx);
-      }
-      else
-      {
-         free( pCBCtx );
+         *sequence= ++ctx->dataRingSequence;
       }
 
       pthread_mutex_unlock( &ctx->mutexSend );
    }
 
 exit:
-   TRACE1("AudioServerGetSessionStatus: audsrv %p result %d", audsrv, result );
 
    return result;
 }
 
-bool AudioServerEnableSessionEvent( AudSrv audsrv, AudioServerSessionEvent cb, void *userData )
+bool AudioServerAudioDataHandle( AudSrv audsrv, unsigned long long dataHandle )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
    unsigned char *p;
    int msgLen, paramLen;
    int sendLen;
+   bool sendGeneration;
    
-   TRACE1("AudioServerEnableSessionEvent: audsrv %p", audsrv );
+   TRACE3("AudioServerDataHandle: audsrv %p handle %llu", audsrv, dataHandle );
    
    if ( ctx )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
-      if ( ctx->sessionType != AUDSRV_SESSION_Observer )
-      {
-         ERROR("session event callbacks may only be added by observer sessions");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
-      }
-
-      ctx->sessionEventCB= cb;
-      ctx->sessionEventUserData= userData;
-
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // dataHandle
+      sendGeneration= audsrv_send_generation( ctx );
+      if ( sendGeneration )
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // generation
+      }
+
       msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
       
       if ( msgLen > AUDSRV_MAX_MSG )
       {
-         ERROR("enableSessionEvent msg too large");
+         ERROR("audio data handle msg too large");
          pthread_mutex_unlock( &ctx->mutexSend );
          goto exit;
       }
 
       p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableSessionEvent );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableSessionEvent_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_AudioDataHandle );
+      p += audsrv_conn_put_u32( p, (sendGeneration ? AUDSRV_MSG_AudioDataHandle_Version_Generation : AUDSRV_MSG_AudioDataHandle_Version_Plain) );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+      p += audsrv_conn_put_u64( p, dataHandle );
+      if ( sendGeneration )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, ctx->flushGeneration );
+      }
 
       sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
       
@@ -1350,135 +2106,81 @@ bool AudioServerEnableSessionEvent( AudSrv audsrv, AudioServerSessionEvent cb, v
    }   
 
 exit:
-   TRACE1("AudioServerEnableSessionEvent: audsrv %p result %d", audsrv, result );
 
    return result;
 }
 
-bool AudioServerDisableSessionEvent( AudSrv audsrv )
+static bool audioServerMute( AudsrvApiContext *ctx, bool mute, bool global, bool attached, const char *sessionName, unsigned sessionHandle )
 {
-   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
    unsigned char *p;
-   int msgLen, paramLen;
+   int msgLen, paramLen, nameLen;
    int sendLen;
    
-   TRACE1("AudioServerDisableSessionEvent: audsrv %p", audsrv );
-   
    if ( ctx )
    {
       pthread_mutex_lock( &ctx->mutexSend );
-      
-      ctx->sessionEventCB= 0;
-      ctx->sessionEventUserData= 0;
 
-      p= ctx->conn->sendbuff;
-      paramLen= 0;
+      if ( attached )
+      {
+         sessionName= ctx->sessionNameAttached;
+         sessionHandle= ctx->sessionHandleAttached;
+      }
 
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
-      
-      if ( msgLen > AUDSRV_MAX_MSG )
+      TRACE1("audioServerMute: audsrv %p mute %d global %d sessionName (%s) sessionHandle %X", ctx, mute, global, sessionName, sessionHandle );
+      if ( global && (sessionName || sessionHandle) )
       {
-         ERROR("disableSessionEvent msg too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
+         ERROR("audioServerMute: session not permitted with global request");
+         sessionName= 0;
+         sessionHandle= 0;
       }
 
-      p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DisableSessionEvent );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DisableSessionEvent_Version );
-
-      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
-      
-      result= (sendLen == msgLen);
-
-      pthread_mutex_unlock( &ctx->mutexSend );
-   }   
-
-exit:
-   TRACE1("AudioServerDisableSessionEvent: audsrv %p result %d", audsrv, result );
-
-   return result;
-}
-
-bool AudioServerEnableEOSDetection( AudSrv audsrv, AudioServerEOS cb, void *userData )
-{
-   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   bool result= false;
-   unsigned char *p;
-   int msgLen, paramLen;
-   int sendLen;
-   
-   TRACE1("AudioServerEnableEOSDetection: audsrv %p", audsrv );
-   
-   if ( ctx )
-   {
-      pthread_mutex_lock( &ctx->mutexSend );
-      
-      ctx->eosCB= cb;
-      ctx->eosUserData= userData;
+      nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
 
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
-      
-      if ( msgLen > AUDSRV_MAX_MSG )
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // global
+      if ( sessionHandle )
       {
-         ERROR("enableEOS msg too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // sessionHandle
       }
-
-      p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableEOS );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableEOS_Version );
-
-      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
-      
-      result= (sendLen == msgLen);
-
-      pthread_mutex_unlock( &ctx->mutexSend );
-   }   
-
-exit:
-   TRACE1("AudioServerEnableEOSDetection: audsrv %p result %d", audsrv, result );
-
-   return result;
-}
-
-bool AudioServerDisableEOSDetection( AudSrv audsrv )
-{
-   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   bool result= false;
-   unsigned char *p;
-   int msgLen, paramLen;
-   int sendLen;
-   
-   TRACE1("AudioServerDisableEOSDetection: audsrv %p", audsrv );
-   
-   if ( ctx )
-   {
-      pthread_mutex_lock( &ctx->mutexSend );
-      
-      ctx->eosCB= 0;
-      ctx->eosUserData= 0;
-
-      p= ctx->conn->sendbuff;
-      paramLen= 0;
+      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
 
       msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
       
       if ( msgLen > AUDSRV_MAX_MSG )
       {
-         ERROR("disableEOS msg too large");
+         ERROR("mute msg too large");
          pthread_mutex_unlock( &ctx->mutexSend );
          goto exit;
       }
 
       p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DisableEOS );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DisableEOS_Version );
+      p += audsrv_conn_put_u32( p, (mute ? AUDSRV_MSG_Mute : AUDSRV_MSG_UnMute) );
+      if ( mute )
+      {
+         p += audsrv_conn_put_u32( p, (sessionHandle ? AUDSRV_MSG_Mute_Version_Handle : AUDSRV_MSG_Mute_Version_Name) );
+      }
+      else
+      {
+         p += audsrv_conn_put_u32( p, (sessionHandle ? AUDSRV_MSG_UnMute_Version_Handle : AUDSRV_MSG_UnMute_Version_Name) );
+      }
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, (global ? 0x0001 : 0x0000) );
+      if ( sessionHandle )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, sessionHandle );
+      }
+      p += audsrv_conn_put_u32( p, nameLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
+      if ( sessionName )
+      {
+         p += audsrv_conn_put_string( p, sessionName );
+      }
 
       sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
       
@@ -1488,129 +2190,118 @@ bool AudioServerDisableEOSDetection( AudSrv audsrv )
    }   
 
 exit:
-   TRACE1("AudioServerDisableEOSDetection: audsrv %p result %d", audsrv, result );
+   TRACE1("audioServerMute: audsrv %p mute %d result %d", ctx, mute, result );
 
    return result;
 }
 
-void AudioServerSetFirstAudioCallback( AudSrv audsrv, AudioServerFirstAudio cb, void *userData )
+bool AudioServerGlobalMute( AudSrv audsrv, bool mute )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   
-   if ( ctx )
-   {
-      pthread_mutex_lock( &ctx->mutexSend );
-
-      ctx->firstAudioCB= cb;
-      ctx->firstAudioUserData= userData;
-
-      pthread_mutex_unlock( &ctx->mutexSend );
-   }
-}
+   bool result= false;
 
-void AudioServerSetPTSErrorCallback( AudSrv audsrv, AudioServerPTSError cb, void *userData )
-{
-   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   
    if ( ctx )
    {
-      pthread_mutex_lock( &ctx->mutexSend );
-
-      ctx->ptsErrorCB= cb;
-      ctx->ptsErrorUserData= userData;
-
-      pthread_mutex_unlock( &ctx->mutexSend );
+      result= audioServerMute( ctx, mute, true, false, 0, 0 );
    }
+
+   return result;
 }
 
-void AudioServerSetUnderflowCallback( AudSrv audsrv, AudioServerUnderflow cb, void *userData )
+bool AudioServerMute( AudSrv audsrv, bool mute )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   
+   bool result= false;
+
    if ( ctx )
    {
-      pthread_mutex_lock( &ctx->mutexSend );
-
-      ctx->underflowCB= cb;
-      ctx->underflowUserData= userData;
+      ctx->muted= mute;
+      ctx->muteSet= true;
 
-      pthread_mutex_unlock( &ctx->mutexSend );
+      if ((ctx->isPrivate == true) && ctx->sessionNamePrivate) {
+          result= audioServerMute( ctx, mute, false, false, ctx->sessionNamePrivate, ctx->sessionHandle );
+      }
+      else {
+          result= audioServerMute( ctx, mute, false, true, 0, 0 );
+      }
    }
+
+   return result;
 }
 
-bool AudioServerStartCapture( AudSrv audsrv, const char *sessionName, AudioServerCapture cb, AudSrvCaptureParameters *params, void *userData )
+static bool audioServerVolume( AudsrvApiContext *ctx, float volume, bool global, bool attached, const char *sessionName, unsigned sessionHandle )
 {
-   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
-   AudSrvCaptureParameters captureParams;
    bool result= false;
    unsigned char *p;
    int msgLen, paramLen, nameLen;
    int sendLen;
-   
-   TRACE1("AudioServerStartCapture: audsrv %p", audsrv );
-
-   memset(&captureParams, 0, sizeof(AudSrvCaptureParameters));
-
-   if ( params )
-      memcpy(&captureParams, params, sizeof(AudSrvCaptureParameters));
+   unsigned level;
    
    if ( ctx )
    {
       pthread_mutex_lock( &ctx->mutexSend );
 
-      ctx->captureCB= cb;
-      ctx->captureUserData= userData;
-
-      p= ctx->conn->sendbuff;
-      paramLen= 0;
+      if ( attached )
+      {
+         sessionName= ctx->sessionNameAttached;
+         sessionHandle= ctx->sessionHandleAttached;
+      }
 
-      nameLen= (sessionName ? strlen(sessionName) : 0);
-      if ( nameLen > AUDSRV_MAX_SESSION_NAME_LEN )
+      TRACE1("audioServerVolume: audsrv %p volume %f global %d sessionName (%s) sessionHandle %X", ctx, volume, global, sessionName, sessionHandle );
+      if ( global && (sessionName || sessionHandle) )
       {
-         ERROR("audio session name len too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
+         ERROR("audioServerVolume: session not permitted with global request");
+         sessionName= 0;
+         sessionHandle= 0;
       }
-      nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
 
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN);   // numChannels
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN);   // bitsPerSample
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN);   // threshold
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN);   // sampleRate
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN);   // outputDelay
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN);   // fifoSize
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + nameLen);              // sessionName
+      nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
 
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+      
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // level numerator
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // level denominator
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // global
+      if ( sessionHandle )
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // sessionHandle
+      }
+      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
+      
       msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
       
       if ( msgLen > AUDSRV_MAX_MSG )
       {
-         ERROR("startCapture msg too large");
+         ERROR("audio volume msg too large");
          pthread_mutex_unlock( &ctx->mutexSend );
          goto exit;
       }
-
+      
+      if ( volume < 0.0 ) volume= 0.0;
+      if ( volume > 1.0 ) volume= 1.0;
+      
+      level= (unsigned)(LEVEL_DENOMINATOR * volume);
+      TRACE1("AudioServerVolume: audsrv %p level %u / %u", ctx, level, LEVEL_DENOMINATOR );
+      
       p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_StartCapture );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_StartCapture_Version );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
-      p += audsrv_conn_put_u16( p, captureParams.numChannels );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
-      p += audsrv_conn_put_u16( p, captureParams.bitsPerSample );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
-      p += audsrv_conn_put_u16( p, captureParams.threshold );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_Volume );
+      p += audsrv_conn_put_u32( p, (sessionHandle ? AUDSRV_MSG_Volume_Version_Handle : AUDSRV_MSG_Volume_Version_Name) );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
-      p += audsrv_conn_put_u32( p, captureParams.sampleRate );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, level );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
-      p += audsrv_conn_put_u32( p, captureParams.outputDelay );
+      p += audsrv_conn_put_u32( p, LEVEL_DENOMINATOR );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
-      p += audsrv_conn_put_u32( p, captureParams.fifoSize );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, (global ? 0x0001 : 0x0000) );
+      if ( sessionHandle )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, sessionHandle );
+      }
       p += audsrv_conn_put_u32( p, nameLen );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
       if ( sessionName )
@@ -1626,540 +2317,3134 @@ bool AudioServerStartCapture( AudSrv audsrv, const char *sessionName, AudioServe
    }
 
 exit:
+   TRACE1("AudioServerVolume: audsrv %p result %d", ctx, result );
+   
+   return result;
+}
+
+bool AudioServerGlobalVolume( AudSrv audsrv, float volume )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
 
-   TRACE1("AudioServerStartCapture: audsrv %p result %d", audsrv, result );
+   if ( ctx )
+   {
+      result= audioServerVolume( ctx, volume, true, false, 0, 0 );
+   }
 
    return result;
 }
 
-bool AudioServerStopCapture( AudSrv audsrv, AudioServerCaptureDone cb, void *userData )
+bool AudioServerVolume( AudSrv audsrv, float volume )
 {
    AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
-   unsigned char *p;
-   int msgLen, paramLen;
-   int sendLen;
-   
-   TRACE1("AudioServerStopCapture: audsrv %p", audsrv );
    
    if ( ctx )
    {
-      pthread_mutex_lock( &ctx->mutexSend );
+      ctx->volume= volume;
+      ctx->volumeSet= true;
 
-      ctx->captureDoneCB= cb;
-      ctx->captureDoneUserData= userData;
+      result= audioServerVolume( ctx, volume, false, true, 0, 0 );
+   }
 
-      p= ctx->conn->sendbuff;
-      paramLen= 0;
+   return result;
+}
 
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
-      
-      if ( msgLen > AUDSRV_MAX_MSG )
-      {
-         ERROR("stopCapture msg too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
+bool AudioServerSessionControl( AudSrv audsrv, int count, AudSrvSessionControl *controls )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   unsigned char ops[AUDSRV_MAX_SESSION_CONTROLS*(4*(AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U32_LEN)+AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MAX_SESSION_NAME_LEN+4)];
+   unsigned char *op;
+   int msgLen, paramLen, opsLen, nameLen;
+   int sendLen;
+   unsigned level;
+   float volume;
+   const char *sessionName;
+   char nameAttached[AUDSRV_MAX_SESSION_NAME_LEN+1];
+
+   TRACE1("AudioServerSessionControl: audsrv %p count %d", audsrv, count );
+
+   if ( ctx && controls )
+   {
+      if ( (count <= 0) || (count > AUDSRV_MAX_SESSION_CONTROLS) )
+      {
+         ERROR("session control count %d out of range (1-%d)", count, AUDSRV_MAX_SESSION_CONTROLS );
+         goto exit;
+      }
+
+      nameAttached[0]= '\0';
+      pthread_mutex_lock( &ctx->mutexSend );
+      if ( ctx->sessionNameAttached )
+      {
+         strncpy( nameAttached, ctx->sessionNameAttached, AUDSRV_MAX_SESSION_NAME_LEN );
+         nameAttached[AUDSRV_MAX_SESSION_NAME_LEN]= '\0';
+      }
+      pthread_mutex_unlock( &ctx->mutexSend );
+
+      // Operations are formatted into a separate buffer and sent as the payload
+      // since the full list may not fit in our work buffer
+      op= ops;
+      for( int i= 0; i < count; ++i )
+      {
+         if ( controls[i].flags & AUDSRV_SESSIONCONTROL_Global )
+         {
+            sessionName= 0;
+         }
+         else
+         {
+            sessionName= (controls[i].sessionName ? controls[i].sessionName : (nameAttached[0] ? nameAttached : 0));
+         }
+         nameLen= (sessionName ? strlen(sessionName) : 0);
+         if ( nameLen > AUDSRV_MAX_SESSION_NAME_LEN )
+         {
+            ERROR("session control %d: session name len too large", i);
+            goto exit;
+         }
+         nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
+
+         volume= controls[i].volume;
+         if ( volume < 0.0 ) volume= 0.0;
+         if ( volume > 1.0 ) volume= 1.0;
+         level= (unsigned)(LEVEL_DENOMINATOR * volume);
+
+         op += audsrv_conn_put_u32( op, AUDSRV_MSG_U16_LEN );
+         op += audsrv_conn_put_u32( op, AUDSRV_TYPE_U16 );
+         op += audsrv_conn_put_u16( op, controls[i].flags );
+         op += audsrv_conn_put_u32( op, AUDSRV_MSG_U16_LEN );
+         op += audsrv_conn_put_u32( op, AUDSRV_TYPE_U16 );
+         op += audsrv_conn_put_u16( op, (controls[i].mute ? 0x0001 : 0x0000) );
+         op += audsrv_conn_put_u32( op, AUDSRV_MSG_U32_LEN );
+         op += audsrv_conn_put_u32( op, AUDSRV_TYPE_U32 );
+         op += audsrv_conn_put_u32( op, level );
+         op += audsrv_conn_put_u32( op, AUDSRV_MSG_U32_LEN );
+         op += audsrv_conn_put_u32( op, AUDSRV_TYPE_U32 );
+         op += audsrv_conn_put_u32( op, LEVEL_DENOMINATOR );
+         op += audsrv_conn_put_u32( op, nameLen );
+         op += audsrv_conn_put_u32( op, AUDSRV_TYPE_String );
+         if ( sessionName )
+         {
+            op += audsrv_conn_put_string( op, sessionName );
+         }
+      }
+      opsLen= op-ops;
+
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // count
+      paramLen += opsLen; // parameter set comprising operations
+
+      // Don't include operations length since it doesn't occupy space
+      // in our work buffer
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen - opsLen;
+
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("session control msg too large");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
       }
 
       p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_StopCapture );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_StopCapture_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_SessionControl );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_SessionControl_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, count );
 
-      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
-      
-      result= (sendLen == msgLen);
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, ops, opsLen );
+
+      result= (sendLen == msgLen+opsLen);
 
       pthread_mutex_unlock( &ctx->mutexSend );
    }
 
 exit:
-
-   TRACE1("AudioServerStopCapture: audsrv %p result %d", audsrv, result );
+   TRACE1("AudioServerSessionControl: audsrv %p result %d", audsrv, result );
 
    return result;
 }
 
-bool AudioServerGetCaptureSessionStatus( AudSrv audsrv, const char *sessionName, AudioServerSessionStatus cb, void *userData )
+// Send an enumerate sessions request, waiting for the reply when sync is set.  The reply
+// goes to handleCB when given, otherwise to cb.
+static bool audsrv_enumerate_sessions( AudsrvApiContext *ctx, AudioServerEnumSessions cb, AudioServerEnumSessionHandles handleCB,
+                                       void *userData, AudsrvSyncWait *sync, int timeout )
 {
-   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
    bool result= false;
    unsigned char *p;
-   int msgLen, paramLen, nameLen;
+   int msgLen, paramLen;
    int sendLen;
    AudsrvCBCtx *pCBCtx= 0;
    unsigned long long token;
-
-   TRACE1("AudioServerGetCaptureSessionStatus: audsrv %p", audsrv );
-
+   
    if ( ctx )
    {
-      pCBCtx= (AudsrvCBCtx*)calloc( 1, sizeof(AudsrvCBCtx));
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      pCBCtx= audsrv_pending_alloc( ctx, AUDSRV_CBTYPE_EnumSessions, timeout, &token );
       if ( !pCBCtx )
       {
-         ERROR("No memory for getstatus callback context");
+         pthread_mutex_unlock( &ctx->mutexSend );
          goto exit;
       }
 
-      pCBCtx->cb.getstatus= cb;
-      pCBCtx->userData= userData;
-
-      if ( sizeof(void*) == 4 )
+      if ( handleCB )
       {
-         token= (unsigned)pCBCtx;
+         pCBCtx->cb.enumhandles= handleCB;
+         pCBCtx->withHandles= true;
       }
       else
       {
-         token= (unsigned long long)pCBCtx;
+         pCBCtx->cb.enumsess= cb;
       }
-      TRACE1("audio getstatus: pCBCtx %p token %llx", pCBCtx, token);      
+      pCBCtx->userData= userData;
+      pCBCtx->sync= sync;
 
-      pthread_mutex_lock( &ctx->mutexSend );
+      TRACE1("audio enum sessions: token %llx", token);
 
       p= ctx->conn->sendbuff;
       paramLen= 0;
 
-      nameLen= (sessionName ? strlen(sessionName) : 0);
-      if ( nameLen > AUDSRV_MAX_SESSION_NAME_LEN )
-      {
-         ERROR("audio session name len too large");
-         pthread_mutex_unlock( &ctx->mutexSend );
-         goto exit;
-      }
-      nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
-
       paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
-      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
 
       msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
 
       if ( msgLen > AUDSRV_MAX_MSG )
       {
-         ERROR("audio get session status msg too large");
+         ERROR("audio enum sessions msg too large");
+         audsrv_pending_free( ctx, pCBCtx );
          pthread_mutex_unlock( &ctx->mutexSend );
          goto exit;
       }
 
       p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetStatus );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetStatus_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnumSessions );
+      p += audsrv_conn_put_u32( p, (audsrv_server_has_handles( ctx ) ? AUDSRV_MSG_EnumSessions_Version_Handle : AUDSRV_MSG_EnumSessions_Version_Name) );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
       p += audsrv_conn_put_u64( p, token );
-      p += audsrv_conn_put_u32( p, nameLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
-      if ( sessionName )
-      {
-         p += audsrv_conn_put_string( p, sessionName );
-      }
-
+      
       sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
       
       result= (sendLen == msgLen);
 
-      if ( result )
+      if ( !result )
       {
-         ctx->pendingCallbacks.push_back(pCBCtx);
+         audsrv_pending_free( ctx, pCBCtx );
       }
-      else
+      else if ( sync )
       {
-         free( pCBCtx );
+         audsrv_sync_wait( ctx, sync, AUDSRV_CBTYPE_EnumSessions, token, timeout );
       }
 
       pthread_mutex_unlock( &ctx->mutexSend );
    }
 
 exit:
-   TRACE1("AudioServerGetCaptureSessionStatus: audsrv %p result %d", audsrv, result );
 
    return result;
 }
 
-static bool audsrv_connect_socket( AudsrvApiContext *ctx )
+bool AudioServerEnumerateSessions( AudSrv audsrv, AudioServerEnumSessions cb, void *userData )
 {
-   bool result= false;
-   const char *workDir;
-   int pathSize, maxPathSize;
-   socklen_t addrSize;
-   int rc;
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result;
 
-   workDir= getenv("XDG_RUNTIME_DIR");
-   if ( !workDir )
-   {
-      ERROR("XDG_RUNTIME_DIR is not set");
-      goto exit;
-   }
-   
-   ctx->addr.sun_family= AF_LOCAL;
-   maxPathSize= (int)sizeof(ctx->addr.sun_path);
-   pathSize= snprintf(ctx->addr.sun_path, 
-                      maxPathSize,
-			             "%s/%s", 
-			             workDir, 
-			             ctx->serverName) + 1;
-   if ( pathSize < 0 )
-   {
-      ERROR("error formulating socket name");
-      goto exit;
-   }
-   
-   if ( pathSize > maxPathSize )
-   {
-      ERROR("full socket name length (%d) exceeds allowed length of %d bytes", pathSize, maxPathSize );
-      goto exit;
-   }
-   
-   TRACE1("full socket name (%s)", ctx->addr.sun_path );
+   TRACE1("AudioServerEnumerateSessions: audsrv %p", audsrv );
 
-   ctx->fdSocket= socket( PF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0 );
-   if ( ctx->fdSocket < 0 )
-   {
-      ERROR("unable to open socket: errno %d", errno );
-      goto exit;
-   }
-   
-   addrSize= offsetof(struct sockaddr_un, sun_path) + pathSize;
-   
-   rc= connect(ctx->fdSocket, (struct sockaddr *)&ctx->addr, addrSize );
-   if ( rc < 0 )
-   {
-      ERROR("connect failed for socket: errno %d", errno );
-      goto exit;
-   }
+   result= audsrv_enumerate_sessions( ctx, cb, 0, userData, 0, AUDSRV_PENDING_CALLBACK_TIMEOUT );
 
-   result= true;
+   TRACE1("AudioServerEnumerateSessions: audsrv %p result %d", audsrv, result );
 
-exit:
+   return result;
+}
 
-   if ( !result )
-   {
-      ctx->addr.sun_path[0]= '\0';
-      
-      if ( ctx->fdSocket >= 0 )
-      {
-         close( ctx->fdSocket );
-         ctx->fdSocket= -1;
-      }
-   }
+bool AudioServerEnumerateSessionHandles( AudSrv audsrv, AudioServerEnumSessionHandles cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result;
+
+   TRACE1("AudioServerEnumerateSessionHandles: audsrv %p", audsrv );
+
+   result= audsrv_enumerate_sessions( ctx, 0, cb, userData, 0, AUDSRV_PENDING_CALLBACK_TIMEOUT );
+
+   TRACE1("AudioServerEnumerateSessionHandles: audsrv %p result %d", audsrv, result );
 
    return result;
 }
 
-static void* audsrv_receive_thread( void *arg )
+int AudioServerEnumerateSessionsSync( AudSrv audsrv, AudSrvSessionHandleInfo *sessionInfo, int *count, int timeoutMs )
 {
-   AudsrvApiContext *ctx= (AudsrvApiContext*)arg;
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   AudsrvSyncWait wait;
 
-   TRACE1( "audsrv_receive_thread: enter" );
+   TRACE1("AudioServerEnumerateSessionsSync: audsrv %p", audsrv );
 
-   ctx->receiveThreadStarted= true;
-   
-   pthread_mutex_lock( &ctx->mutexRecv );
-   ctx->receiveThreadReady= true;
-   pthread_mutex_unlock( &ctx->mutexRecv );
-   
-   while ( !ctx->receiveThreadStopRequested )
+   memset( &wait, 0, sizeof(wait) );
+   wait.result= AUDSRV_RESULT_Error;
+
+   if ( ctx && count )
    {
-      int consumed;
-      int len= audsrv_conn_recv( ctx->conn );
-      if ( !ctx->receiveThreadStopRequested && (len > 0) )
+      if ( ctx->inCaptureData && pthread_equal( pthread_self(), ctx->threadId ) )
       {
-         if ( ctx->conn->count >= AUDSRV_MSG_HDR_LEN )
-         {
-            do
-            {
-               consumed= audsrv_process_message( ctx );
-            }
-            while( consumed > 0 );
-         }
+         ERROR("synchronous enumerate not permitted from capture data callback");
+         goto exit;
       }
+
+      wait.maxCount= (sessionInfo ? *count : 0);
+      wait.sessionInfo= sessionInfo;
+
+      audsrv_enumerate_sessions( ctx, 0, 0, 0, &wait, timeoutMs );
+
+      *count= wait.count;
    }
 
-   ctx->receiveThreadStarted= true;
-   TRACE1( "audsrv_receive_thread: exit" );
-   return NULL;
+exit:
+   TRACE1("AudioServerEnumerateSessionsSync: audsrv %p result %d", audsrv, wait.result );
+
+   return wait.result;
 }
 
-static int audsrv_process_message( AudsrvApiContext *ctx )
+// Send a get session status request, waiting for the reply when sync is set
+static bool audsrv_get_session_status( AudsrvApiContext *ctx, AudioServerSessionStatus cb, void *userData, AudsrvSyncWait *sync, int timeout )
 {
-   int consumed= 0;
-   int avail= ctx->conn->count;
-   unsigned msglen, msgid, version;
-   
-   if ( avail < AUDSRV_MSG_HDR_LEN )
-   {
-      goto exit;
-   }
-   
-   msglen= audsrv_conn_peek_u32( ctx->conn );
-   TRACE2("audsrv_process_message: peeked msglen %d", msglen);
-   if ( msglen+AUDSRV_MSG_HDR_LEN > ctx->conn->count )
-   {
-      goto exit;
-   }
-   
-   audsrv_conn_skip( ctx->conn, 4 );
-   msgid= audsrv_conn_get_u32( ctx->conn );
-   version= audsrv_conn_get_u32( ctx->conn );
-   TRACE2("audsrv_process_message: msglen %d msgid %d version %d", msglen, msgid, version);
-   
-   consumed += AUDSRV_MSG_HDR_LEN;
-      
-   switch( msgid )
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen, nameLen;
+   int sendLen;
+   AudsrvCBCtx *pCBCtx= 0;
+   unsigned long long token;
+   unsigned sessionHandle;
+
+   if ( ctx )
    {
-      case AUDSRV_MSG_Init:
-      case AUDSRV_MSG_AudioInfo:
-      case AUDSRV_MSG_Play:
-      case AUDSRV_MSG_Stop:
-      case AUDSRV_MSG_Pause:
-      case AUDSRV_MSG_UnPause:
-      case AUDSRV_MSG_Flush:
-      case AUDSRV_MSG_AudioSync:
-      case AUDSRV_MSG_AudioData:
-      case AUDSRV_MSG_Mute:
-      case AUDSRV_MSG_UnMute:
-      case AUDSRV_MSG_Volume:
-      case AUDSRV_MSG_EnableEOS:
-      case AUDSRV_MSG_DisableEOS:
-      case AUDSRV_MSG_StartCapture:
-      case AUDSRV_MSG_StopCapture:
-      case AUDSRV_MSG_EnumSessions:
-      case AUDSRV_MSG_GetStatus:
-      case AUDSRV_MSG_EnableSessionEvent:
-      case AUDSRV_MSG_DisableSessionEvent:
-         ERROR("ignoring msg %d inappropriate for client to receive", msgid);
-         audsrv_conn_skip( ctx->conn, msglen );
-         consumed += msglen;
-         break;
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      if (ctx->isPrivate == true) {
+         nameLen= (ctx->sessionNamePrivate ? AUDSRV_MSG_STRING_LEN(ctx->sessionNamePrivate) : 0);
+         sessionHandle= ctx->sessionHandle;
+      }
+      else {
+         nameLen= (ctx->sessionNameAttached ? AUDSRV_MSG_STRING_LEN(ctx->sessionNameAttached) : 0);
+         sessionHandle= ctx->sessionHandleAttached;
+      }
+
+      pCBCtx= audsrv_pending_alloc( ctx, AUDSRV_CBTYPE_GetStatus, timeout, &token );
+      if ( !pCBCtx )
+      {
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      pCBCtx->cb.getstatus= cb;
+      pCBCtx->userData= userData;
+      pCBCtx->sync= sync;
+
+      TRACE1("audio getstatus: token %llx", token);
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
+      if ( sessionHandle )
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // sessionHandle
+      }
+      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("audio get session status msg too large");
+         audsrv_pending_free( ctx, pCBCtx );
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetStatus );
+      p += audsrv_conn_put_u32( p, (sessionHandle ? AUDSRV_MSG_GetStatus_Version_Handle : AUDSRV_MSG_GetStatus_Version_Name) );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+      p += audsrv_conn_put_u64( p, token );
+      if ( sessionHandle )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, sessionHandle );
+      }
+      p += audsrv_conn_put_u32( p, nameLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
+      if ( nameLen ) {
+         if (ctx->isPrivate == true) {
+            p += audsrv_conn_put_string( p, ctx->sessionNamePrivate );
+         }
+         else {
+            p += audsrv_conn_put_string( p, ctx->sessionNameAttached );
+         }
+      }
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+      
+      result= (sendLen == msgLen);
+
+      if ( !result )
+      {
+         audsrv_pending_free( ctx, pCBCtx );
+      }
+      else if ( sync )
+      {
+         audsrv_sync_wait( ctx, sync, AUDSRV_CBTYPE_GetStatus, token, timeout );
+      }
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+exit:
+
+   return result;
+}
+
+bool AudioServerGetSessionStatus( AudSrv audsrv, AudioServerSessionStatus cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result;
+
+   TRACE1("AudioServerGetSessionStatus: audsrv %p", audsrv );
+
+   result= audsrv_get_session_status( ctx, cb, userData, 0, AUDSRV_PENDING_CALLBACK_TIMEOUT );
+
+   TRACE1("AudioServerGetSessionStatus: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+int AudioServerGetSessionStatusSync( AudSrv audsrv, AudSrvSessionStatus *sessionStatus, int timeoutMs )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   AudsrvSyncWait wait;
+
+   TRACE1("AudioServerGetSessionStatusSync: audsrv %p", audsrv );
+
+   memset( &wait, 0, sizeof(wait) );
+   wait.result= AUDSRV_RESULT_Error;
+
+   if ( ctx && sessionStatus )
+   {
+      if ( ctx->inCaptureData && pthread_equal( pthread_self(), ctx->threadId ) )
+      {
+         ERROR("synchronous get status not permitted from capture data callback");
+         goto exit;
+      }
+
+      memset( sessionStatus, 0, sizeof(AudSrvSessionStatus) );
+      wait.sessionStatus= sessionStatus;
+
+      audsrv_get_session_status( ctx, 0, 0, &wait, timeoutMs );
+   }
+
+exit:
+   TRACE1("AudioServerGetSessionStatusSync: audsrv %p result %d", audsrv, wait.result );
+
+   return wait.result;
+}
+
+bool AudioServerGetLatency( AudSrv audsrv, AudioServerLatency cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned long long token;
+
+   TRACE1("AudioServerGetLatency: audsrv %p", audsrv );
+
+   if ( ctx && cb )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      result= audsrv_send_getlatency( ctx, cb, userData, 0, AUDSRV_PENDING_CALLBACK_TIMEOUT, &token );
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+   TRACE1("AudioServerGetLatency: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+int AudioServerGetLatencySync( AudSrv audsrv, AudSrvLatency *latency, int timeoutMs )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   AudsrvSyncWait wait;
+   unsigned long long token;
+
+   TRACE1("AudioServerGetLatencySync: audsrv %p", audsrv );
+
+   memset( &wait, 0, sizeof(wait) );
+   wait.result= AUDSRV_RESULT_Error;
+
+   if ( ctx && latency )
+   {
+      if ( ctx->inCaptureData && pthread_equal( pthread_self(), ctx->threadId ) )
+      {
+         ERROR("synchronous get latency not permitted from capture data callback");
+         goto exit;
+      }
+
+      memset( latency, 0, sizeof(AudSrvLatency) );
+      wait.latency= latency;
+
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      if ( audsrv_send_getlatency( ctx, 0, 0, &wait, timeoutMs, &token ) )
+      {
+         audsrv_sync_wait( ctx, &wait, AUDSRV_CBTYPE_GetLatency, token, timeoutMs );
+      }
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+exit:
+   TRACE1("AudioServerGetLatencySync: audsrv %p result %d", audsrv, wait.result );
+
+   return wait.result;
+}
+
+// Must be called with mutexSend held
+static bool audsrv_send_getlatency( AudsrvApiContext *ctx, AudioServerLatency cb, void *userData, AudsrvSyncWait *sync, int timeout, unsigned long long *token )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   AudsrvCBCtx *pCBCtx= 0;
+
+   pCBCtx= audsrv_pending_alloc( ctx, AUDSRV_CBTYPE_GetLatency, timeout, token );
+   if ( !pCBCtx )
+   {
+      goto exit;
+   }
+
+   pCBCtx->cb.getlatency= cb;
+   pCBCtx->userData= userData;
+   pCBCtx->sync= sync;
+
+   TRACE1("audio getlatency: token %llx", *token);
+
+   p= ctx->conn->sendbuff;
+   paramLen= 0;
+
+   paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
+
+   msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+   p += audsrv_conn_put_u32( p, paramLen );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetLatency );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetLatency_Version );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+   p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+   p += audsrv_conn_put_u64( p, *token );
+
+   sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+
+   result= (sendLen == msgLen);
+
+   if ( !result )
+   {
+      audsrv_pending_free( ctx, pCBCtx );
+   }
+
+exit:
+
+   return result;
+}
+
+bool AudioServerEnableSessionEvent( AudSrv audsrv, AudioServerSessionEvent cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result;
+   
+   TRACE1("AudioServerEnableSessionEvent: audsrv %p", audsrv );
+   
+   result= audsrv_enable_session_event( ctx, cb, 0, userData );
+
+   TRACE1("AudioServerEnableSessionEvent: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+bool AudioServerEnableSessionHandleEvent( AudSrv audsrv, AudioServerSessionHandleEvent cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result;
+
+   TRACE1("AudioServerEnableSessionHandleEvent: audsrv %p", audsrv );
+
+   result= audsrv_enable_session_event( ctx, 0, cb, userData );
+
+   TRACE1("AudioServerEnableSessionHandleEvent: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+// Register the session event callback, cb or handleCB, and ask the server for events
+static bool audsrv_enable_session_event( AudsrvApiContext *ctx, AudioServerSessionEvent cb, AudioServerSessionHandleEvent handleCB, void *userData )
+{
+   bool result= false;
+
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      if ( ctx->sessionType != AUDSRV_SESSION_Observer )
+      {
+         ERROR("session event callbacks may only be added by observer sessions");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      ctx->sessionEventCB= cb;
+      ctx->sessionHandleEventCB= handleCB;
+      ctx->sessionEventUserData= userData;
+
+      result= audsrv_send_enable_session_event( ctx );
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }   
+
+exit:
+
+   return result;
+}
+
+// Must be called with mutexSend held
+static bool audsrv_send_enable_session_event( AudsrvApiContext *ctx )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   unsigned version;
+
+   // Events only carry session handles from servers known to send them
+   version= (audsrv_server_has_handles( ctx ) ? AUDSRV_MSG_EnableSessionEvent_Version_Handle : AUDSRV_MSG_EnableSessionEvent_Version_Name);
+
+   p= ctx->conn->sendbuff;
+   paramLen= 0;
+
+   msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+   p += audsrv_conn_put_u32( p, paramLen );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableSessionEvent );
+   p += audsrv_conn_put_u32( p, version );
+
+   sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+
+   result= (sendLen == msgLen);
+   if ( result )
+   {
+      ctx->sessionEventVersion= version;
+   }
+
+   return result;
+}
+
+// Must be called with mutexSend held
+static bool audsrv_server_has_handles( AudsrvApiContext *ctx )
+{
+   // A server that supports sub-sessions also supports session handles
+   return (ctx->serverHandles || ctx->parent);
+}
+
+// Must be called with mutexSend held
+static bool audsrv_send_generation( AudsrvApiContext *ctx )
+{
+   // Servers that send session handles also accept flush generations
+   return audsrv_server_has_handles( ctx );
+}
+
+bool AudioServerDisableSessionEvent( AudSrv audsrv )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   
+   TRACE1("AudioServerDisableSessionEvent: audsrv %p", audsrv );
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+      
+      ctx->sessionEventCB= 0;
+      ctx->sessionHandleEventCB= 0;
+      ctx->sessionEventUserData= 0;
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+      
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("disableSessionEvent msg too large");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DisableSessionEvent );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DisableSessionEvent_Version );
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+      
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }   
+
+exit:
+   TRACE1("AudioServerDisableSessionEvent: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+bool AudioServerEnableEOSDetection( AudSrv audsrv, AudioServerEOS cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   
+   TRACE1("AudioServerEnableEOSDetection: audsrv %p", audsrv );
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+      
+      ctx->eosCB= cb;
+      ctx->eosUserData= userData;
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+      
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("enableEOS msg too large");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableEOS );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableEOS_Version );
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+      
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }   
+
+exit:
+   TRACE1("AudioServerEnableEOSDetection: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+bool AudioServerDisableEOSDetection( AudSrv audsrv )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   
+   TRACE1("AudioServerDisableEOSDetection: audsrv %p", audsrv );
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+      
+      ctx->eosCB= 0;
+      ctx->eosUserData= 0;
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+      
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("disableEOS msg too large");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DisableEOS );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DisableEOS_Version );
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+      
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }   
+
+exit:
+   TRACE1("AudioServerDisableEOSDetection: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+void AudioServerSetFirstAudioCallback( AudSrv audsrv, AudioServerFirstAudio cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->firstAudioCB= cb;
+      ctx->firstAudioUserData= userData;
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+}
+
+void AudioServerSetPTSErrorCallback( AudSrv audsrv, AudioServerPTSError cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->ptsErrorCB= cb;
+      ctx->ptsErrorUserData= userData;
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+}
+
+void AudioServerSetDiscontinuityCallback( AudSrv audsrv, AudioServerDiscontinuity cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->discontinuityCB= cb;
+      ctx->discontinuityUserData= userData;
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+}
+
+void AudioServerSetUnderflowCallback( AudSrv audsrv, AudioServerUnderflow cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->underflowCB= cb;
+      ctx->underflowUserData= userData;
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+}
+
+void AudioServerSetFlushAckCallback( AudSrv audsrv, AudioServerFlushAck cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->flushAckCB= cb;
+      ctx->flushAckUserData= userData;
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+}
+
+bool AudioServerSetHandleReleaseCallback( AudSrv audsrv, AudioServerHandleRelease cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+
+   TRACE1("AudioServerSetHandleReleaseCallback: audsrv %p cb %p", audsrv, cb );
+
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->handleReleaseCB= cb;
+      ctx->handleReleaseUserData= (cb ? userData : 0);
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // enable
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableHandleRelease );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableHandleRelease_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, (cb ? 1 : 0) );
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+   TRACE1("AudioServerSetHandleReleaseCallback: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+bool AudioServerSetDataRequestCallback( AudSrv audsrv, AudioServerDataRequest cb, unsigned watermark, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+
+   TRACE1("AudioServerSetDataRequestCallback: audsrv %p watermark %u", audsrv, watermark );
+
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      if ( !cb )
+      {
+         watermark= 0;
+      }
+
+      ctx->dataRequestCB= (watermark ? cb : 0);
+      ctx->dataRequestUserData= (watermark ? userData : 0);
+      ctx->dataRequestWatermark= watermark;
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // watermark
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("enableDataRequest msg too large");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableDataRequest );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableDataRequest_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, watermark );
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+exit:
+   TRACE1("AudioServerSetDataRequestCallback: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+bool AudioServerStartCapture( AudSrv audsrv, const char *sessionName, AudioServerCapture cb, AudSrvCaptureParameters *params, void *userData )
+{
+   return audioServerStartCapture( (AudsrvApiContext*)audsrv, sessionName, 0, cb, params, userData );
+}
+
+bool AudioServerStartCaptureByHandle( AudSrv audsrv, unsigned sessionHandle, AudioServerCapture cb, AudSrvCaptureParameters *params, void *userData )
+{
+   bool result= false;
+
+   if ( sessionHandle )
+   {
+      result= audioServerStartCapture( (AudsrvApiContext*)audsrv, 0, sessionHandle, cb, params, userData );
+   }
+   else
+   {
+      ERROR("Cannot capture from invalid session handle");
+   }
+
+   return result;
+}
+
+static bool audioServerStartCapture( AudsrvApiContext *ctx, const char *sessionName, unsigned sessionHandle, AudioServerCapture cb, AudSrvCaptureParameters *params, void *userData )
+{
+   AudSrvCaptureParameters captureParams;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen, nameLen;
+   int sendLen;
+   
+   TRACE1("AudioServerStartCapture: audsrv %p sessionHandle %X", ctx, sessionHandle );
+
+   memset(&captureParams, 0, sizeof(AudSrvCaptureParameters));
+
+   if ( params )
+      memcpy(&captureParams, params, sizeof(AudSrvCaptureParameters));
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->captureCB= cb;
+      ctx->captureUserData= userData;
+      ctx->captureRequest= captureParams;
+      ctx->captureStarted= true;
+      ctx->captureSessionHandle= sessionHandle;
+      if ( sessionName != ctx->captureSessionName )
+      {
+         if ( ctx->captureSessionName )
+         {
+            free( ctx->captureSessionName );
+            ctx->captureSessionName= 0;
+         }
+         if ( sessionName )
+         {
+            ctx->captureSessionName= strdup( sessionName );
+         }
+      }
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      nameLen= (sessionName ? strlen(sessionName) : 0);
+      if ( nameLen > AUDSRV_MAX_SESSION_NAME_LEN )
+      {
+         ERROR("audio session name len too large");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+      nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN);   // numChannels
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN);   // bitsPerSample
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN);   // threshold
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN);   // sampleRate
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN);   // outputDelay
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN);   // fifoSize
+      if ( sessionHandle )
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN);   // sessionHandle
+      }
+      else
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + nameLen);              // sessionName
+      }
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+      
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("startCapture msg too large");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_StartCapture );
+      p += audsrv_conn_put_u32( p, (sessionHandle ? AUDSRV_MSG_StartCapture_Version_Handle : AUDSRV_MSG_StartCapture_Version_Name) );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, captureParams.numChannels );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, captureParams.bitsPerSample );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, captureParams.threshold );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, captureParams.sampleRate );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, captureParams.outputDelay );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, captureParams.fifoSize );
+      if ( sessionHandle )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, sessionHandle );
+      }
+      else
+      {
+         p += audsrv_conn_put_u32( p, nameLen );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
+         if ( sessionName )
+         {
+            p += audsrv_conn_put_string( p, sessionName );
+         }
+      }
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+      
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+exit:
+
+   TRACE1("AudioServerStartCapture: audsrv %p result %d", ctx, result );
+
+   return result;
+}
+
+bool AudioServerStopCapture( AudSrv audsrv, AudioServerCaptureDone cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   
+   TRACE1("AudioServerStopCapture: audsrv %p", audsrv );
+   
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->captureDoneCB= cb;
+      ctx->captureDoneUserData= userData;
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+      
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("stopCapture msg too large");
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_StopCapture );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_StopCapture_Version );
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+      
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+exit:
+
+   TRACE1("AudioServerStopCapture: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+int AudioServerEnableCaptureRing( AudSrv audsrv, unsigned ringSize, int timeoutMs )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   AudsrvSyncWait wait;
+   unsigned long long token;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   AudsrvCBCtx *pCBCtx;
+
+   TRACE1("AudioServerEnableCaptureRing: audsrv %p ringSize %u", audsrv, ringSize );
+
+   memset( &wait, 0, sizeof(wait) );
+   wait.result= AUDSRV_RESULT_Error;
+
+   if ( ctx )
+   {
+      if ( ctx->inCaptureData && pthread_equal( pthread_self(), ctx->threadId ) )
+      {
+         ERROR("enabling capture ring not permitted from capture data callback");
+         goto exit;
+      }
+
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->captureRingSize= ringSize;
+
+      pCBCtx= audsrv_pending_alloc( ctx, AUDSRV_CBTYPE_CaptureRing, timeoutMs, &token );
+      if ( !pCBCtx )
+      {
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+      pCBCtx->sync= &wait;
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // ringSize
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableCaptureRing );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnableCaptureRing_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+      p += audsrv_conn_put_u64( p, token );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, ringSize );
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+
+      if ( sendLen == msgLen )
+      {
+         audsrv_sync_wait( ctx, &wait, AUDSRV_CBTYPE_CaptureRing, token, timeoutMs );
+      }
+      else
+      {
+         audsrv_pending_free( ctx, pCBCtx );
+      }
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+exit:
+   TRACE1("AudioServerEnableCaptureRing: audsrv %p result %d", audsrv, wait.result );
+
+   return wait.result;
+}
+
+int AudioServerGetCaptureFd( AudSrv audsrv )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   int fd= -1;
+
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+      if ( ctx->captureRing )
+      {
+         fd= ctx->captureRingEventFd;
+      }
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+   return fd;
+}
+
+int AudioServerCaptureRead( AudSrv audsrv, unsigned char *data, int len, AudSrvCaptureParameters *params )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   int result= -1;
+
+   if ( ctx && data && (len >= 0) )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+      if ( ctx->captureRing )
+      {
+         AudsrvCaptureRing *ring= ctx->captureRing;
+         unsigned char *base= AUDSRV_CAPTURE_RING_DATA(ring);
+         unsigned size= ring->size;
+         unsigned long long readPos, writePos, limit, paramsPos;
+         unsigned paramsVersion, lastVersion;
+         unsigned avail, offset, copylen;
+         eventfd_t value;
+
+         // Consume the notification before sampling writePos so no write goes unsignalled
+         eventfd_read( ctx->captureRingEventFd, &value );
+
+         readPos= ring->readPos;
+         writePos= ring->writePos;
+         __sync_synchronize();
+         paramsPos= ring->paramsPos;
+         paramsVersion= ring->paramsVersion;
+
+         if ( (writePos < readPos) || (writePos-readPos > size) )
+         {
+            ERROR("bad capture ring positions: read %llu write %llu size %u", readPos, writePos, size);
+            writePos= readPos;
+         }
+
+         while( (ctx->captureParamsPendingCount > 0) && (ctx->captureParamsPending[0].position <= readPos) )
+         {
+            ctx->captureRingParams= ctx->captureParamsPending[0].params;
+            --ctx->captureParamsPendingCount;
+            memmove( &ctx->captureParamsPending[0], &ctx->captureParamsPending[1],
+                     ctx->captureParamsPendingCount*sizeof(AudsrvCaptureParamsChange) );
+         }
+
+         // A read stops at the next parameter change, and before any data whose
+         // parameters have not yet arrived on the connection
+         limit= writePos;
+         if ( (ctx->captureParamsPendingCount > 0) && (ctx->captureParamsPending[0].position < limit) )
+         {
+            limit= ctx->captureParamsPending[0].position;
+         }
+         lastVersion= ((ctx->captureParamsPendingCount > 0)
+                       ? ctx->captureParamsPending[ctx->captureParamsPendingCount-1].params.version
+                       : ctx->captureRingParams.version);
+         if ( (paramsVersion != lastVersion) && (paramsPos < limit) )
+         {
+            limit= ((paramsPos > readPos) ? paramsPos : readPos);
+         }
+
+         avail= (unsigned)(limit-readPos);
+         if ( avail > (unsigned)len )
+         {
+            avail= len;
+         }
+
+         offset= (unsigned)(readPos % size);
+         copylen= size-offset;
+         if ( copylen > avail )
+         {
+            copylen= avail;
+         }
+         memcpy( data, base+offset, copylen );
+         if ( copylen < avail )
+         {
+            memcpy( data+copylen, base, avail-copylen );
+         }
+
+         // Release the space only once the data has been copied out
+         __sync_synchronize();
+         ring->readPos= readPos+avail;
+
+         // The notification was consumed above: raise it again if data the next read can
+         // return is left behind, whether cut short by len or stopped at a parameter change
+         if ( (readPos+avail < limit) ||
+              ((ctx->captureParamsPendingCount > 0) &&
+               (ctx->captureParamsPending[0].position == readPos+avail) &&
+               (writePos > readPos+avail)) )
+         {
+            eventfd_write( ctx->captureRingEventFd, 1 );
+         }
+
+         if ( params )
+         {
+            *params= ctx->captureRingParams;
+         }
+         result= avail;
+      }
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+   TRACE3("AudioServerCaptureRead: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+void AudioServerSetCaptureOverrunCallback( AudSrv audsrv, AudioServerCaptureOverrun cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      ctx->captureOverrunCB= cb;
+      ctx->captureOverrunUserData= userData;
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+}
+
+// Must be called with mutexSend held
+static void audsrv_capture_ring_unmap( AudsrvApiContext *ctx )
+{
+   if ( ctx->captureRing )
+   {
+      munmap( ctx->captureRing, ctx->captureRingMapSize );
+      ctx->captureRing= 0;
+      ctx->captureRingMapSize= 0;
+   }
+   ctx->captureParamsPendingCount= 0;
+   ctx->captureRingParams.version= (unsigned)-1;
+}
+
+bool AudioServerGetCaptureSessionStatus( AudSrv audsrv, const char *sessionName, AudioServerSessionStatus cb, void *userData )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)audsrv;
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen, nameLen;
+   int sendLen;
+   AudsrvCBCtx *pCBCtx= 0;
+   unsigned long long token;
+
+   TRACE1("AudioServerGetCaptureSessionStatus: audsrv %p", audsrv );
+
+   if ( ctx )
+   {
+      pthread_mutex_lock( &ctx->mutexSend );
+
+      pCBCtx= audsrv_pending_alloc( ctx, AUDSRV_CBTYPE_GetStatus, AUDSRV_PENDING_CALLBACK_TIMEOUT, &token );
+      if ( !pCBCtx )
+      {
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      pCBCtx->cb.getstatus= cb;
+      pCBCtx->userData= userData;
+
+      TRACE1("audio getstatus: token %llx", token);
+
+      p= ctx->conn->sendbuff;
+      paramLen= 0;
+
+      nameLen= (sessionName ? strlen(sessionName) : 0);
+      if ( nameLen > AUDSRV_MAX_SESSION_NAME_LEN )
+      {
+         ERROR("audio session name len too large");
+         audsrv_pending_free( ctx, pCBCtx );
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+      nameLen= (sessionName ? AUDSRV_MSG_STRING_LEN(sessionName) : 0);
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
+      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("audio get session status msg too large");
+         audsrv_pending_free( ctx, pCBCtx );
+         pthread_mutex_unlock( &ctx->mutexSend );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetStatus );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetStatus_Version_Name );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+      p += audsrv_conn_put_u64( p, token );
+      p += audsrv_conn_put_u32( p, nameLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
+      if ( sessionName )
+      {
+         p += audsrv_conn_put_string( p, sessionName );
+      }
+
+      sendLen= audsrv_conn_send( ctx->conn, ctx->conn->sendbuff, msgLen, NULL, 0 );
+      
+      result= (sendLen == msgLen);
+
+      if ( !result )
+      {
+         audsrv_pending_free( ctx, pCBCtx );
+      }
+
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+
+exit:
+   TRACE1("AudioServerGetCaptureSessionStatus: audsrv %p result %d", audsrv, result );
+
+   return result;
+}
+
+static bool audsrv_connect_socket( AudsrvApiContext *ctx )
+{
+   bool result= false;
+   const char *workDir;
+   int pathSize, maxPathSize;
+   socklen_t addrSize;
+   int rc;
+
+   workDir= getenv("XDG_RUNTIME_DIR");
+   if ( !workDir )
+   {
+      ERROR("XDG_RUNTIME_DIR is not set");
+      goto exit;
+   }
+   
+   ctx->addr.sun_family= AF_LOCAL;
+   maxPathSize= (int)sizeof(ctx->addr.sun_path);
+   pathSize= snprintf(ctx->addr.sun_path, 
+                      maxPathSize,
+			             "%s/%s", 
+			             workDir, 
+			             ctx->serverName) + 1;
+   if ( pathSize < 0 )
+   {
+      ERROR("error formulating socket name");
+      goto exit;
+   }
+   
+   if ( pathSize > maxPathSize )
+   {
+      ERROR("full socket name length (%d) exceeds allowed length of %d bytes", pathSize, maxPathSize );
+      goto exit;
+   }
+   
+   TRACE1("full socket name (%s)", ctx->addr.sun_path );
+
+   ctx->fdSocket= socket( PF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+   if ( ctx->fdSocket < 0 )
+   {
+      ERROR("unable to open socket: errno %d", errno );
+      goto exit;
+   }
+   
+   addrSize= offsetof(struct sockaddr_un, sun_path) + pathSize;
+   ctx->addrSize= addrSize;
+   
+   rc= connect(ctx->fdSocket, (struct sockaddr *)&ctx->addr, addrSize );
+   if ( rc < 0 )
+   {
+      ERROR("connect failed for socket: errno %d", errno );
+      goto exit;
+   }
+
+   result= true;
+
+exit:
+
+   if ( !result )
+   {
+      ctx->addr.sun_path[0]= '\0';
+      
+      if ( ctx->fdSocket >= 0 )
+      {
+         close( ctx->fdSocket );
+         ctx->fdSocket= -1;
+      }
+   }
+
+   return result;
+}
+
+static void* audsrv_receive_thread( void *arg )
+{
+   AudsrvApiContext *ctx= (AudsrvApiContext*)arg;
+
+   TRACE1( "audsrv_receive_thread: enter" );
+
+   ctx->receiveThreadStarted= true;
+   
+   pthread_mutex_lock( &ctx->mutexRecv );
+   ctx->receiveThreadReady= true;
+   pthread_cond_signal( &ctx->condReady );
+   pthread_mutex_unlock( &ctx->mutexRecv );
+   
+   while ( !ctx->receiveThreadStopRequested )
+   {
+      int consumed;
+      int len, rc, timeout;
+      struct pollfd pfd[2];
+
+      pthread_mutex_lock( &ctx->mutexDispatch );
+      timeout= audsrv_pending_expire( ctx );
+      pthread_mutex_unlock( &ctx->mutexDispatch );
+
+      // Wait for data, for a new request to time, or for the next request to expire
+      pfd[0].fd= ctx->fdSocket;
+      pfd[0].events= POLLIN;
+      pfd[0].revents= 0;
+      pfd[1].fd= ctx->fdWake;
+      pfd[1].events= POLLIN;
+      pfd[1].revents= 0;
+      rc= poll( pfd, 2, timeout );
+      if ( pfd[1].revents & POLLIN )
+      {
+         eventfd_t value;
+         eventfd_read( ctx->fdWake, &value );
+      }
+      if ( (rc <= 0) || !pfd[0].revents )
+      {
+         continue;
+      }
+
+      len= audsrv_conn_recv( ctx->conn );
+      if ( !ctx->receiveThreadStopRequested && (len > 0) )
+      {
+         if ( ctx->conn->count >= AUDSRV_MSG_HDR_LEN )
+         {
+            pthread_mutex_lock( &ctx->mutexDispatch );
+            do
+            {
+               consumed= audsrv_process_message( ctx );
+            }
+            while( consumed > 0 );
+            pthread_mutex_unlock( &ctx->mutexDispatch );
+         }
+      }
+      else if ( !ctx->receiveThreadStopRequested && ctx->conn->peerDisconnected )
+      {
+         pthread_mutex_lock( &ctx->mutexDispatch );
+         audsrv_sessions_lost( ctx );
+         pthread_mutex_unlock( &ctx->mutexDispatch );
+
+         if ( audsrv_reconnect( ctx ) )
+         {
+            pthread_mutex_lock( &ctx->mutexDispatch );
+            audsrv_sessions_restored( ctx );
+            pthread_mutex_unlock( &ctx->mutexDispatch );
+         }
+      }
+   }
+
+   ctx->receiveThreadStarted= true;
+   TRACE1( "audsrv_receive_thread: exit" );
+   return NULL;
+}
+
+// The server has gone away: retry the connection with backoff until it succeeds or the
+// client disconnects.  The new socket is moved onto the original descriptor so the fd
+// from AudioServerGetPollFd stays valid.
+static bool audsrv_reconnect( AudsrvApiContext *ctx )
+{
+   bool connected= false;
+   int delay= AUDSRV_RECONNECT_MIN_DELAY;
+   int attempts= 0;
+   long long start= getCurrentTimeMillis();
+
+   WARNING("lost connection to server (%s): reconnecting", ctx->addr.sun_path);
+
+   while( !ctx->receiveThreadStopRequested )
+   {
+      struct pollfd pfd;
+      int fd;
+
+      ++attempts;
+      fd= socket( PF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+      if ( fd >= 0 )
+      {
+         if ( connect( fd, (struct sockaddr *)&ctx->addr, ctx->addrSize ) == 0 )
+         {
+            pthread_mutex_lock( &ctx->mutexRecv );
+            if ( !ctx->receiveThreadStopRequested )
+            {
+               pthread_mutex_lock( &ctx->mutexSend );
+               if ( dup3( fd, ctx->fdSocket, O_CLOEXEC ) >= 0 )
+               {
+                  audsrv_conn_reset( ctx->conn );
+                  connected= true;
+               }
+               else
+               {
+                  ERROR("unable to replace socket: errno %d", errno);
+               }
+               pthread_mutex_unlock( &ctx->mutexSend );
+            }
+            pthread_mutex_unlock( &ctx->mutexRecv );
+         }
+         close( fd );
+      }
+
+      if ( connected )
+      {
+         break;
+      }
+
+      pfd.fd= ctx->fdWake;
+      pfd.events= POLLIN;
+      pfd.revents= 0;
+      if ( poll( &pfd, 1, delay ) > 0 )
+      {
+         eventfd_t value;
+         eventfd_read( ctx->fdWake, &value );
+      }
+      delay= ((2*delay < AUDSRV_RECONNECT_MAX_DELAY) ? 2*delay : AUDSRV_RECONNECT_MAX_DELAY);
+   }
+
+   if ( connected )
+   {
+      INFO("reconnected to server (%s) after %lld ms, %d attempts", ctx->addr.sun_path, getCurrentTimeMillis()-start, attempts);
+   }
+
+   return connected;
+}
+
+// Restore the state of this client's session on a newly started server
+static void audsrv_replay_session( AudsrvApiContext *ctx )
+{
+   AudSrv audsrv= (AudSrv)ctx;
+   AudioServerCaptureDone captureDoneCB= 0;
+   void *captureDoneUserData= 0;
+
+   pthread_mutex_lock( &ctx->mutexSend );
+   // Handles issued by the previous server instance are meaningless now, and the new
+   // instance may be an older server without them
+   ctx->sessionHandle= 0;
+   ctx->serverHandles= false;
+   if ( ctx->sessionHandleAttached && !ctx->sessionNameAttached )
+   {
+      WARNING("dropping attachment to session handle %X across server restart", ctx->sessionHandleAttached);
+   }
+   ctx->sessionHandleAttached= 0;
+   if ( ctx->captureDoneCB )
+   {
+      // The server stopped capture when it went away
+      captureDoneCB= ctx->captureDoneCB;
+      captureDoneUserData= ctx->captureDoneUserData;
+      ctx->captureCB= 0;
+      ctx->captureDoneCB= 0;
+      ctx->captureStarted= false;
+   }
+   pthread_mutex_unlock( &ctx->mutexSend );
+
+   if ( captureDoneCB )
+   {
+      ctx->inCallback= true;
+      captureDoneCB( captureDoneUserData );
+      ctx->inCallback= false;
+   }
+
+   if ( ctx->sessionInitialized )
+   {
+      AudioServerInitSession( audsrv, ctx->sessionType, ctx->isPrivate, ctx->sessionNameInit );
+   }
+   if ( ctx->sessionNameAttached )
+   {
+      AudioServerSessionAttach( audsrv, ctx->sessionNameAttached );
+   }
+   if ( ctx->audioInfoSet )
+   {
+      AudioServerSetAudioInfo( audsrv, &ctx->audioInfo );
+   }
+   if ( ctx->pcmFormatSet )
+   {
+      AudioServerSetPcmFormat( audsrv, ctx->pcmFormat );
+   }
+   if ( ctx->basetimeSet )
+   {
+      AudioServerBasetime( audsrv, ctx->basetime );
+   }
+   if ( ctx->volumeSet )
+   {
+      AudioServerVolume( audsrv, ctx->volume );
+   }
+   if ( ctx->muteSet )
+   {
+      AudioServerMute( audsrv, ctx->muted );
+   }
+   if ( ctx->eosCB )
+   {
+      AudioServerEnableEOSDetection( audsrv, ctx->eosCB, ctx->eosUserData );
+   }
+   if ( ctx->sessionEventCB || ctx->sessionHandleEventCB )
+   {
+      audsrv_enable_session_event( ctx, ctx->sessionEventCB, ctx->sessionHandleEventCB, ctx->sessionEventUserData );
+   }
+   if ( ctx->dataRequestCB )
+   {
+      AudioServerSetDataRequestCallback( audsrv, ctx->dataRequestCB, ctx->dataRequestWatermark, ctx->dataRequestUserData );
+   }
+   if ( ctx->handleReleaseCB )
+   {
+      AudioServerSetHandleReleaseCallback( audsrv, ctx->handleReleaseCB, ctx->handleReleaseUserData );
+   }
+   if ( ctx->dataRingFd >= 0 )
+   {
+      // Commits sent to the old server are lost: sharing the ring again with the last
+      // sequence issued releases every range they held
+      pthread_mutex_lock( &ctx->mutexSend );
+      audsrv_send_enable_data_ring( ctx );
+      pthread_mutex_unlock( &ctx->mutexSend );
+   }
+   if ( ctx->captureRingSize )
+   {
+      AudioServerEnableCaptureRing( audsrv, ctx->captureRingSize, AUDSRV_PENDING_CALLBACK_TIMEOUT );
+   }
+   if ( ctx->captureStarted )
+   {
+      if ( ctx->captureSessionHandle && !ctx->captureSessionName )
+      {
+         WARNING("cannot restart capture of session handle %X across server restart", ctx->captureSessionHandle);
+      }
+      else
+      {
+         audioServerStartCapture( ctx, ctx->captureSessionName, 0, ctx->captureCB, &ctx->captureRequest, ctx->captureUserData );
+      }
+   }
+   if ( ctx->playing )
+   {
+      bool paused= ctx->paused;
+
+      AudioServerPlay( audsrv );
+      if ( paused )
+      {
+         AudioServerPause( audsrv, true );
+      }
+   }
+}
+
+static void audsrv_notify_discontinuity( AudsrvApiContext *ctx, bool connected )
+{
+   AudioServerDiscontinuity discontinuityCB;
+   void *discontinuityUserData;
+
+   pthread_mutex_lock( &ctx->mutexSend );
+   discontinuityCB= ctx->discontinuityCB;
+   discontinuityUserData= ctx->discontinuityUserData;
+   pthread_mutex_unlock( &ctx->mutexSend );
+
+   if ( discontinuityCB )
+   {
+      ctx->inCallback= true;
+      discontinuityCB( discontinuityUserData, connected );
+      ctx->inCallback= false;
+   }
+}
+
+// The server has gone away: fail the outstanding requests of every session carried on the
+// connection.  Must be called on the receive thread with mutexDispatch held.
+static void audsrv_sessions_lost( AudsrvApiContext *ctx )
+{
+   ctx->recvSessionId= 0;
+
+   for( int i= -1; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+   {
+      AudsrvApiContext *session= ((i < 0) ? ctx : ctx->subSessions[i]);
+
+      if ( session )
+      {
+         audsrv_pending_cancel( session, AUDSRV_RESULT_Cancelled, 0 );
+         audsrv_notify_discontinuity( session, false );
+         audsrv_complete_disconnect( session );
+      }
+   }
+}
+
+// The connection has been re-established: restore every session carried on it.  Must be
+// called on the receive thread with mutexDispatch held.
+static void audsrv_sessions_restored( AudsrvApiContext *ctx )
+{
+   for( int i= -1; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+   {
+      AudsrvApiContext *session= ((i < 0) ? ctx : ctx->subSessions[i]);
+
+      if ( session )
+      {
+         audsrv_replay_session( session );
+         audsrv_notify_discontinuity( session, true );
+         audsrv_complete_disconnect( session );
+      }
+   }
+}
+
+// Time out expired requests of every session carried on the connection and return the
+// milliseconds until the next request expires, or -1 if none are pending.  Must be called
+// on the receive thread with mutexDispatch held.
+static int audsrv_pending_expire( AudsrvApiContext *ctx )
+{
+   long long now= getCurrentTimeMillis();
+   int timeout= -1;
+
+   for( int i= -1; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+   {
+      AudsrvApiContext *session= ((i < 0) ? ctx : ctx->subSessions[i]);
+
+      if ( session )
+      {
+         audsrv_pending_cancel( session, AUDSRV_RESULT_Timeout, now );
+         audsrv_complete_disconnect( session );
+      }
+
+      // A callback may have closed the sub-session
+      session= ((i < 0) ? ctx : ctx->subSessions[i]);
+      if ( session )
+      {
+         int sessionTimeout;
+
+         pthread_mutex_lock( &session->mutexSend );
+         sessionTimeout= audsrv_pending_timeout( session );
+         pthread_mutex_unlock( &session->mutexSend );
+
+         if ( (sessionTimeout >= 0) && ((timeout < 0) || (sessionTimeout < timeout)) )
+         {
+            timeout= sessionTimeout;
+         }
+      }
+   }
+
+   return timeout;
+}
+
+// Must be called on the receive thread or with mutexDispatch held
+static AudsrvApiContext* audsrv_find_sub_session( AudsrvApiContext *ctx, unsigned sessionId )
+{
+   AudsrvApiContext *session= 0;
+
+   for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+   {
+      if ( ctx->subSessions[i] && (ctx->subSessions[i]->subSessionId == sessionId) )
+      {
+         session= ctx->subSessions[i];
+         break;
+      }
+   }
+
+   return session;
+}
+
+// Remove a sub-session from its connection and have the server close it.  Returns false if
+// the sub-session is in a callback, in which case it is released once the callback returns.
+static bool audsrv_release_sub_session( AudsrvApiContext *ctx )
+{
+   AudsrvApiContext *parent= ctx->parent;
+   bool onReceiveThread= pthread_equal( pthread_self(), parent->threadId );
+   bool released= false;
+
+   if ( !onReceiveThread )
+   {
+      pthread_mutex_lock( &parent->mutexDispatch );
+   }
+   if ( ctx->inCallback )
+   {
+      ctx->discPending= true;
+   }
+   else
+   {
+      for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+      {
+         if ( parent->subSessions[i] == ctx )
+         {
+            parent->subSessions[i]= 0;
+            break;
+         }
+      }
+      released= true;
+   }
+   if ( !onReceiveThread )
+   {
+      pthread_mutex_unlock( &parent->mutexDispatch );
+   }
+
+   if ( released )
+   {
+      unsigned char *p;
+      int msgLen, paramLen;
+      int sendLen;
+
+      pthread_mutex_lock( &parent->mutexSend );
+
+      p= parent->conn->sendbuff;
+      paramLen= AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN;
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_ReleaseSession );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_ReleaseSession_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, ctx->subSessionId );
+
+      sendLen= audsrv_conn_send( parent->conn, parent->conn->sendbuff, msgLen, NULL, 0 );
+      if ( sendLen != msgLen )
+      {
+         TRACE1("unable to send release for sub-session %u", ctx->subSessionId);
+      }
+
+      pthread_mutex_unlock( &parent->mutexSend );
+   }
+
+   return released;
+}
+
+// Close a sub-session that was disconnected from within one of its callbacks
+static void audsrv_complete_disconnect( AudsrvApiContext *ctx )
+{
+   if ( ctx->parent && ctx->discPending && !ctx->inlineDispatch )
+   {
+      ctx->discPending= false;
+      AudioServerDisconnect( (AudSrv)ctx );
+   }
+}
+
+static int audsrv_process_message( AudsrvApiContext *ctx )
+{
+   int consumed= 0;
+   int avail= ctx->conn->count;
+   unsigned msglen, msgid, version;
+   AudsrvApiContext *session;
+   
+   if ( avail < AUDSRV_MSG_HDR_LEN )
+   {
+      goto exit;
+   }
+   
+   msglen= audsrv_conn_peek_u32( ctx->conn );
+   TRACE2("audsrv_process_message: peeked msglen %d", msglen);
+   if ( msglen+AUDSRV_MSG_HDR_LEN > ctx->conn->count )
+   {
+      goto exit;
+   }
+   
+   audsrv_conn_skip( ctx->conn, 4 );
+   msgid= audsrv_conn_get_u32( ctx->conn );
+   version= audsrv_conn_get_u32( ctx->conn );
+   TRACE2("audsrv_process_message: msglen %d msgid %d version %d", msglen, msgid, version);
+   
+   consumed += AUDSRV_MSG_HDR_LEN;
+
+   // Session messages apply to the sub-session last selected by the server
+   session= ctx;
+   if ( ctx->recvSessionId && (msgid != AUDSRV_MSG_SelectSession) )
+   {
+      session= audsrv_find_sub_session( ctx, ctx->recvSessionId );
+      if ( !session )
+      {
+         TRACE1("ignoring msg %d for released sub-session %u", msgid, ctx->recvSessionId);
+         audsrv_conn_skip( ctx->conn, msglen );
+         consumed += msglen;
+         goto exit;
+      }
+   }
+      
+   switch( msgid )
+   {
+      case AUDSRV_MSG_Init:
+      case AUDSRV_MSG_AudioInfo:
+      case AUDSRV_MSG_Play:
+      case AUDSRV_MSG_Stop:
+      case AUDSRV_MSG_Pause:
+      case AUDSRV_MSG_UnPause:
+      case AUDSRV_MSG_Flush:
+      case AUDSRV_MSG_AudioSync:
+      case AUDSRV_MSG_AudioData:
+      case AUDSRV_MSG_Mute:
+      case AUDSRV_MSG_UnMute:
+      case AUDSRV_MSG_Volume:
+      case AUDSRV_MSG_EnableEOS:
+      case AUDSRV_MSG_DisableEOS:
+      case AUDSRV_MSG_StartCapture:
+      case AUDSRV_MSG_StopCapture:
+      case AUDSRV_MSG_EnumSessions:
+      case AUDSRV_MSG_GetStatus:
+      case AUDSRV_MSG_EnableSessionEvent:
+      case AUDSRV_MSG_DisableSessionEvent:
+      case AUDSRV_MSG_SessionControl:
+      case AUDSRV_MSG_ResolveSession:
+      case AUDSRV_MSG_EnableDataRequest:
+      case AUDSRV_MSG_ReleaseSession:
+      case AUDSRV_MSG_EnableCaptureRing:
+      case AUDSRV_MSG_GetLatency:
+      case AUDSRV_MSG_EnableHandleRelease:
+      case AUDSRV_MSG_EnableDataRing:
+      case AUDSRV_MSG_AudioDataRing:
+      case AUDSRV_MSG_SetPcmFormat:
+         ERROR("ignoring msg %d inappropriate for client to receive", msgid);
+         audsrv_conn_skip( ctx->conn, msglen );
+         consumed += msglen;
+         break;
 
       case AUDSRV_MSG_SessionEvent:
-         consumed += audsrv_process_session_event( ctx, msglen, version );
+         consumed += audsrv_process_session_event( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EOSDetected:
+         consumed += audsrv_process_eosdetected( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_FirstAudio:
+         consumed += audsrv_process_firstaudio( session, msglen, version );
+         break; 
+        
+      case AUDSRV_MSG_PtsError:
+         consumed += audsrv_process_ptserror( session, msglen, version );
+         break; 
+        
+      case AUDSRV_MSG_Underflow:
+         consumed += audsrv_process_underflow( session, msglen, version );
+         break; 
+        
+      case AUDSRV_MSG_CaptureParameters:
+         consumed += audsrv_process_capture_parameters( session, msglen, version );
+         break; 
+        
+      case AUDSRV_MSG_CaptureData:
+         consumed += audsrv_process_capture_data( session, msglen, version );
+         break; 
+        
+      case AUDSRV_MSG_CaptureDone:
+         consumed += audsrv_process_capture_done( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EnumSessionsResults:
+         consumed += audsrv_process_enum_sessions_results( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_GetStatusResults:
+         consumed += audsrv_process_getstatus_results( session, msglen, version );
+         break;        
+
+      case AUDSRV_MSG_GetLatencyResults:
+         consumed += audsrv_process_getlatency_results( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_SessionHandle:
+         consumed += audsrv_process_session_handle( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_DataRequest:
+         consumed += audsrv_process_data_request( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_HandleRelease:
+         consumed += audsrv_process_handle_release( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_FlushAck:
+         consumed += audsrv_process_flush_ack( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_SelectSession:
+         consumed += audsrv_process_select_session( ctx, msglen, version );
+         break;
+
+      case AUDSRV_MSG_CaptureRing:
+         consumed += audsrv_process_capture_ring( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_CaptureOverrun:
+         consumed += audsrv_process_capture_overrun( session, msglen, version );
+         break;
+
+      default:
+         INFO("ignoring unknown command %d len %d", msgid, msglen );
+         audsrv_conn_skip( ctx->conn, msglen );
+         consumed += msglen;
          break;
+   }
+
+   if ( session != ctx )
+   {
+      audsrv_complete_disconnect( session );
+   }
+
+   if ( ctx->discPending && !ctx->inlineDispatch )
+   {
+      ctx->discPending= false;
+      AudioServerDisconnect( (AudSrv)ctx );
+   }   
+
+exit:
+
+   return consumed;
+}
+
+static int audsrv_process_session_event( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: session event version %d", version);
+   
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_SessionEvent_Version )
+      {
+         unsigned len, type;
+         int event;
+         AudSrvSessionHandleInfo info;
+
+         memset( &info, 0, sizeof(info) );
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U16 )
+         {
+            ERROR("expecting type %d (U16) not type %d for session event arg 1 (event)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }
+         
+         event= audsrv_conn_get_u32( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for session event (pid)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         info.info.pid= audsrv_conn_get_u32( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U16 )
+         {
+            ERROR("expecting type %d (U16) not type %d for session event (sessionType)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }
+         
+         info.info.sessionType= audsrv_conn_get_u16( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_String )
+         {
+            ERROR("expecting type %d (string) not type %d for session event (sessionName)", AUDSRV_TYPE_String, type );
+            goto exit;
+         }
+         if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+         {
+            ERROR("sessionName too long (%d) for session event", len );
+            goto exit;
+         }
+         
+         if ( len )
+         {
+            audsrv_conn_get_string( ctx->conn, info.info.sessionName );
+         }
+
+         if ( version >= AUDSRV_MSG_SessionEvent_Version_Handle )
+         {
+            len= audsrv_conn_get_u32( ctx->conn );
+            type= audsrv_conn_get_u32( ctx->conn );
+
+            if ( type != AUDSRV_TYPE_U32 )
+            {
+               ERROR("expecting type %d (U32) not type %d for session event (sessionHandle)", AUDSRV_TYPE_U32, type );
+               goto exit;
+            }
+
+            info.sessionHandle= audsrv_conn_get_u32( ctx->conn );
+         }
+
+         pthread_mutex_lock( &ctx->mutexSend );
+         if ( (event == AUDSRV_SESSIONEVENT_Removed) &&
+              info.sessionHandle &&
+              (info.sessionHandle == ctx->sessionHandleAttached) &&
+              ctx->sessionNameAttached )
+         {
+            // Attached by name: fall back to the name so a replacement session is picked up
+            ctx->sessionHandleAttached= 0;
+         }
+         if ( ctx->sessionHandleEventCB )
+         {
+            ctx->inCallback= true;
+            ctx->sessionHandleEventCB( ctx->sessionEventUserData, event, &info );
+            ctx->inCallback= false;
+         }
+         else if ( ctx->sessionEventCB )
+         {
+            ctx->inCallback= true;
+            ctx->sessionEventCB( ctx->sessionEventUserData, event, &info.info );
+            ctx->inCallback= false;
+         }
+         pthread_mutex_unlock( &ctx->mutexSend );
+      }
+   }
+
+exit:
+
+   return msglen;
+}
+
+static int audsrv_process_eosdetected( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: eosdetected version %d", version);
+   
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_EOSDetected_Version )
+      {
+         pthread_mutex_lock( &ctx->mutexSend );
+         if ( ctx->eosCB )
+         {
+            ctx->inCallback= true;
+            ctx->eosCB( ctx->eosUserData );
+            ctx->inCallback= false;
+         }
+         pthread_mutex_unlock( &ctx->mutexSend );
+      }
+   }
+   
+   return msglen;
+}
+
+static int audsrv_process_firstaudio( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: firstaudio version %d", version);
+   
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_FirstAudio_Version )
+      {
+         if ( ctx->firstAudioCB )
+         {
+            ctx->inCallback= true;
+            ctx->firstAudioCB( ctx->firstAudioUserData );
+            ctx->inCallback= false;
+         }
+      }
+   }
+   
+   return msglen;
+}
+
+static int audsrv_process_ptserror( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: ptserror version %d", version);
+   
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_PtsError_Version )
+      {
+         unsigned len, type;
+         unsigned count;
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for ptserror arg 1 (count)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         count= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( ctx->ptsErrorCB )
+         {
+            ctx->inCallback= true;
+            ctx->ptsErrorCB( ctx->ptsErrorUserData, count );
+            ctx->inCallback= false;
+         }
+      }
+   }
+
+exit:
+
+   return msglen;
+}
+
+static int audsrv_process_underflow( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: underflow version %d", version);
+   
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_Underflow_Version )
+      {
+         unsigned len, type;
+         unsigned count, bufferedBytes, queuedFrames;
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for underflow arg 1 (count)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         count= audsrv_conn_get_u32( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for underflow arg 2 (bufferedBytes)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         bufferedBytes= audsrv_conn_get_u32( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for underflow arg 3 (queuedFrames)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         queuedFrames= audsrv_conn_get_u32( ctx->conn );
+
+         if ( ctx->underflowCB )
+         {
+            ctx->inCallback= true;
+            ctx->underflowCB( ctx->ptsErrorUserData, count, bufferedBytes, queuedFrames );
+            ctx->inCallback= false;
+         }
+      }
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_capture_parameters( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: capture parameters version %d", version);
+   
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_CaptureParameters_Version )
+      {
+         unsigned len, type;
+         unsigned msgVersion= version;
+         unsigned version, sampleRate, outputDelay;
+         unsigned short numChannels, bitsPerSample;
 
-      case AUDSRV_MSG_EOSDetected:
-         consumed += audsrv_process_eosdetected( ctx, msglen, version );
-         break;
 
-      case AUDSRV_MSG_FirstAudio:
-         consumed += audsrv_process_firstaudio( ctx, msglen, version );
-         break; 
-        
-      case AUDSRV_MSG_PtsError:
-         consumed += audsrv_process_ptserror( ctx, msglen, version );
-         break; 
-        
-      case AUDSRV_MSG_Underflow:
-         consumed += audsrv_process_underflow( ctx, msglen, version );
-         break; 
-        
-      case AUDSRV_MSG_CaptureParameters:
-         consumed += audsrv_process_capture_parameters( ctx, msglen, version );
-         break; 
-        
-      case AUDSRV_MSG_CaptureData:
-         consumed += audsrv_process_capture_data( ctx, msglen, version );
-         break; 
-        
-      case AUDSRV_MSG_CaptureDone:
-         consumed += audsrv_process_capture_done( ctx, msglen, version );
-         break;
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for captureParameters arg 1 (version)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         version= audsrv_conn_get_u32( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U16 )
+         {
+            ERROR("expecting type %d (U16) not type %d for captureParameters arg 2 (numChannels)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }
+         
+         numChannels= audsrv_conn_get_u16( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U16 )
+         {
+            ERROR("expecting type %d (U16) not type %d for captureParameters arg 3 (bitsPerSample)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }
+         
+         bitsPerSample= audsrv_conn_get_u16( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for captureParameters arg 4 (sampleRate)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         sampleRate= audsrv_conn_get_u32( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for captureParameters arg 5 (outputDelay)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         outputDelay= audsrv_conn_get_u32( ctx->conn );
+
+
+         if ( msgVersion >= AUDSRV_MSG_CaptureParameters_Version_Ring )
+         {
+            unsigned long long position;
+
+            len= audsrv_conn_get_u32( ctx->conn );
+            type= audsrv_conn_get_u32( ctx->conn );
+
+            if ( type != AUDSRV_TYPE_U64 )
+            {
+               ERROR("expecting type %d (U64) not type %d for captureParameters arg 6 (position)", AUDSRV_TYPE_U64, type );
+               goto exit;
+            }
+
+            position= audsrv_conn_get_u64( ctx->conn );
+
+            // Ring delivery: hand the change to the reader at the ring position it applies from
+            pthread_mutex_lock( &ctx->mutexSend );
+            if ( ctx->captureRing )
+            {
+               AudsrvCaptureParamsChange *change;
+
+               if ( ctx->captureParamsPendingCount == AUDSRV_MAX_CAPTURE_PARAMS_PENDING )
+               {
+                  WARNING("capture parameter changes not yet reached by the reader: dropping oldest");
+                  ctx->captureRingParams= ctx->captureParamsPending[0].params;
+                  --ctx->captureParamsPendingCount;
+                  memmove( &ctx->captureParamsPending[0], &ctx->captureParamsPending[1],
+                           ctx->captureParamsPendingCount*sizeof(AudsrvCaptureParamsChange) );
+               }
+               change= &ctx->captureParamsPending[ctx->captureParamsPendingCount++];
+               change->position= position;
+               change->params= ctx->captureRequest;
+               change->params.version= version;
+               change->params.numChannels= numChannels;
+               change->params.bitsPerSample= bitsPerSample;
+               change->params.sampleRate= sampleRate;
+               change->params.outputDelay= outputDelay;
+
+               // The reader may be holding back data until it knows these parameters
+               eventfd_write( ctx->captureRingEventFd, 1 );
+            }
+            ctx->captureParameters.version= version;
+            ctx->captureParameters.numChannels= numChannels;
+            ctx->captureParameters.bitsPerSample= bitsPerSample;
+            ctx->captureParameters.sampleRate= sampleRate;
+            ctx->captureParameters.outputDelay= outputDelay;
+            pthread_mutex_unlock( &ctx->mutexSend );
+         }
+         else if ( version != ctx->captureParameters.version )
+         {
+            ctx->captureParameters.version= version;
+            ctx->captureParameters.numChannels= numChannels;
+            ctx->captureParameters.bitsPerSample= bitsPerSample;
+            ctx->captureParameters.sampleRate= sampleRate;
+            ctx->captureParameters.outputDelay= outputDelay;
+            
+            if ( ctx->captureCB )
+            {
+               ctx->inCallback= true;
+               ctx->captureCB( ctx->captureUserData, &ctx->captureParameters, NULL, 0 );
+               ctx->inCallback= false;
+            }
+         }
+      }
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_capture_data( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: capture data version %d", version);
+   
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_CaptureData_Version )
+      {
+         unsigned len, type;
+         unsigned datalen;
+         unsigned char *data;
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_Buffer )
+         {
+            ERROR("expecting type %d (buffer) not type %d for captureData arg 1 (data)", AUDSRV_TYPE_Buffer, type );
+            goto exit;
+         }
+         
+         // Capture data is passed in place from the receive buffer
+         ctx->inCaptureData= true;
+
+         audsrv_conn_get_buffer( ctx->conn, len, &data, &datalen );
+         if ( data && datalen )
+         {
+            if ( ctx->captureCB )
+            {
+               ctx->captureCB( ctx->captureUserData, &ctx->captureParameters, data, datalen );               
+            }
+            len -= datalen;
+         }
+
+         if ( len )
+         {
+            audsrv_conn_get_buffer( ctx->conn, len, &data, &datalen );
+            if ( data && datalen )
+            {
+               if ( ctx->captureCB )
+               {
+                  ctx->inCallback= true;
+                  ctx->captureCB( ctx->captureUserData, &ctx->captureParameters, data, datalen );               
+                  ctx->inCallback= false;
+               }
+            }
+         }
+
+         ctx->inCaptureData= false;
+      }
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_capture_done( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: capture done version %d", version);
+   
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_CaptureDone_Version )
+      {
+         AudioServerCaptureDone captureDoneCB;
+         void *captureDoneUserData;
+
+         pthread_mutex_lock( &ctx->mutexSend );
+         captureDoneCB= ctx->captureDoneCB;
+         captureDoneUserData= ctx->captureDoneUserData;
+         ctx->captureCB= 0;
+         ctx->captureDoneCB= 0;
+         ctx->captureStarted= false;
+         pthread_mutex_unlock( &ctx->mutexSend );
+
+         if ( captureDoneCB )
+         {
+            ctx->inCallback= true;
+            captureDoneCB( captureDoneUserData );
+            ctx->inCallback= false;
+         }
+      }
+   }
+   
+   return msglen;
+}
+
+static int audsrv_process_capture_ring( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: capture ring version %d", version);
+
+   if ( ctx )
+   {
+      if ( version <= AUDSRV_MSG_CaptureRing_Version )
+      {
+         unsigned len, type;
+         unsigned long long token;
+         unsigned result, ringSize;
+         AudsrvCBCtx *pCBCtx;
+         AudsrvCaptureRing *ring= 0;
+         unsigned mapSize= 0;
+         int fdMem= -1, fdEvent= -1;
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+
+         if ( type != AUDSRV_TYPE_U64 )
+         {
+            ERROR("expecting type %d (U64) not type %d for captureRing arg 1 (token)", AUDSRV_TYPE_U64, type );
+            goto exit;
+         }
+
+         token= audsrv_conn_get_u64( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+
+         if ( type != AUDSRV_TYPE_U16 )
+         {
+            ERROR("expecting type %d (U16) not type %d for captureRing arg 2 (result)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }
+
+         result= audsrv_conn_get_u16( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for captureRing arg 3 (ringSize)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+
+         ringSize= audsrv_conn_get_u32( ctx->conn );
+
+         TRACE1("capture ring: token %llx result %u ringSize %u", token, result, ringSize );
+
+         if ( (result == 0) && ringSize )
+         {
+            fdMem= audsrv_conn_get_fd( ctx->conn );
+            fdEvent= audsrv_conn_get_fd( ctx->conn );
+            if ( (fdMem >= 0) && (fdEvent >= 0) && (ringSize <= AUDSRV_CAPTURE_RING_MAX_SIZE) )
+            {
+               void *map;
+
+               mapSize= sizeof(AudsrvCaptureRing)+ringSize;
+               map= mmap( NULL, mapSize, PROT_READ|PROT_WRITE, MAP_SHARED, fdMem, 0 );
+               if ( map != MAP_FAILED )
+               {
+                  ring= (AudsrvCaptureRing*)map;
+                  if ( (ring->magic != AUDSRV_CAPTURE_RING_MAGIC) || (ring->size != ringSize) )
+                  {
+                     ERROR("bad capture ring: magic %X size %u", ring->magic, ring->size);
+                     munmap( map, mapSize );
+                     ring= 0;
+                  }
+               }
+               else
+               {
+                  ERROR("unable to map capture ring: errno %d", errno);
+               }
+            }
+            else
+            {
+               ERROR("capture ring: missing descriptors (%d, %d) or bad size %u", fdMem, fdEvent, ringSize);
+            }
+            if ( fdMem >= 0 )
+            {
+               close( fdMem );
+            }
+            if ( !ring )
+            {
+               result= 1;
+            }
+         }
 
-      case AUDSRV_MSG_EnumSessionsResults:
-         consumed += audsrv_process_enum_sessions_results( ctx, msglen, version );
-         break;
+         pthread_mutex_lock( &ctx->mutexSend );
 
-      case AUDSRV_MSG_GetStatusResults:
-         consumed += audsrv_process_getstatus_results( ctx, msglen, version );
-         break;        
+         audsrv_capture_ring_unmap( ctx );
+         if ( ring )
+         {
+            ctx->captureRing= ring;
+            ctx->captureRingMapSize= mapSize;
+            if ( ctx->captureRingEventFd >= 0 )
+            {
+               // Keep the descriptor the application polls stable across reconnection, first
+               // waking any poll already waiting on the eventfd being replaced
+               eventfd_write( ctx->captureRingEventFd, 1 );
+               if ( dup3( fdEvent, ctx->captureRingEventFd, O_CLOEXEC ) < 0 )
+               {
+                  ERROR("unable to replace capture ring eventfd: errno %d", errno);
+               }
+               close( fdEvent );
+            }
+            else
+            {
+               ctx->captureRingEventFd= fdEvent;
+            }
+            fdEvent= -1;
+         }
+         else if ( ctx->captureRingEventFd >= 0 )
+         {
+            close( ctx->captureRingEventFd );
+            ctx->captureRingEventFd= -1;
+         }
 
-      default:
-         INFO("ignoring unknown command %d len %d", msgid, msglen );
-         audsrv_conn_skip( ctx->conn, msglen );
-         consumed += msglen;
-         break;
-   }
+         pCBCtx= audsrv_pending_find( ctx, AUDSRV_CBTYPE_CaptureRing, token );
+         if ( pCBCtx )
+         {
+            if ( pCBCtx->sync )
+            {
+               pCBCtx->sync->result= ((result == 0) ? 0 : AUDSRV_RESULT_Error);
+               pCBCtx->sync->done= true;
+               pthread_cond_broadcast( &ctx->condSync );
+            }
+            audsrv_pending_free( ctx, pCBCtx );
+         }
+         else
+         {
+            ERROR("capture ring: no match for token %llx", token);
+         }
 
-   if ( ctx->discPending )
-   {
-      ctx->discPending= false;
-      AudioServerDisconnect( (AudSrv)ctx );
-   }   
+         pthread_mutex_unlock( &ctx->mutexSend );
+
+         if ( fdEvent >= 0 )
+         {
+            close( fdEvent );
+         }
+      }
+   }
 
 exit:
 
-   return consumed;
+   return msglen;
 }
 
-static int audsrv_process_session_event( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+static int audsrv_process_capture_overrun( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: session event version %d", version);
-   
+   TRACE1("msg: capture overrun version %d", version);
+
    if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_SessionEvent_Version )
+   {
+      if ( version <= AUDSRV_MSG_CaptureOverrun_Version )
       {
          unsigned len, type;
-         int event;
-         AudSrvSessionInfo info;
+         unsigned long long position;
+         unsigned droppedBytes;
+         AudioServerCaptureOverrun captureOverrunCB;
+         void *captureOverrunUserData;
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U16 )
+
+         if ( type != AUDSRV_TYPE_U64 )
          {
-            ERROR("expecting type %d (U16) not type %d for session event arg 1 (event)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U64) not type %d for captureOverrun arg 1 (position)", AUDSRV_TYPE_U64, type );
             goto exit;
          }
-         
-         event= audsrv_conn_get_u32( ctx->conn );
+
+         position= audsrv_conn_get_u64( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
+
          if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U32) not type %d for session event (pid)", AUDSRV_TYPE_U32, type );
+            ERROR("expecting type %d (U32) not type %d for captureOverrun arg 2 (droppedBytes)", AUDSRV_TYPE_U32, type );
             goto exit;
          }
-         
-         info.pid= audsrv_conn_get_u32( ctx->conn );
+
+         droppedBytes= audsrv_conn_get_u32( ctx->conn );
+
+         WARNING("capture ring overrun: %u bytes dropped at position %llu", droppedBytes, position);
+
+         pthread_mutex_lock( &ctx->mutexSend );
+         captureOverrunCB= ctx->captureOverrunCB;
+         captureOverrunUserData= ctx->captureOverrunUserData;
+         pthread_mutex_unlock( &ctx->mutexSend );
+
+         if ( captureOverrunCB )
+         {
+            ctx->inCallback= true;
+            captureOverrunCB( captureOverrunUserData, position, droppedBytes );
+            ctx->inCallback= false;
+         }
+      }
+   }
+
+exit:
+
+   return msglen;
+}
+
+static int audsrv_process_enum_sessions_results( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: emum sessions results version %d", version);
+
+   if ( ctx )
+   {   
+      if ( version <= AUDSRV_MSG_EnumSessionsResults_Version )
+      {
+         unsigned len, type;
+         unsigned long long token;
+         unsigned result, sessionCount;
+         AudsrvCBCtx *pCBCtx= 0;   
+         AudsrvCBCtx entry;
+         AudSrvSessionHandleInfo *pInfo= 0;
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
          
-         if ( type != AUDSRV_TYPE_U16 )
+         if ( type != AUDSRV_TYPE_U64 )
          {
-            ERROR("expecting type %d (U16) not type %d for session event (sessionType)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U64) not type %d for enumSessionsResults arg 1 (token)", AUDSRV_TYPE_U64, type );
             goto exit;
          }
          
-         info.sessionType= audsrv_conn_get_u16( ctx->conn );
+         token= audsrv_conn_get_u64( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
          
-         if ( type != AUDSRV_TYPE_String )
+         if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("expecting type %d (string) not type %d for session event (sessionName)", AUDSRV_TYPE_String, type );
+            ERROR("expecting type %d (U16) not type %d for enumSessionsResults arg 2 (result)", AUDSRV_TYPE_U16, type );
             goto exit;
          }
-         if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+         
+         result= audsrv_conn_get_u16( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("sessionName too long (%d) for session event", len );
+            ERROR("expecting type %d (U16) not type %d for enumSessionsResults arg 3 (sessionCount)", AUDSRV_TYPE_U16, type );
             goto exit;
          }
          
-         if ( len )
-         {
-            audsrv_conn_get_string( ctx->conn, info.sessionName );
-         }
+         sessionCount= audsrv_conn_get_u16( ctx->conn );
+
+         TRACE1("enum sessions results: token %llx result %u sessionCount %u", token, result, sessionCount );
 
          pthread_mutex_lock( &ctx->mutexSend );
-         if ( ctx->sessionEventCB )
+
+         pCBCtx= audsrv_pending_find( ctx, AUDSRV_CBTYPE_EnumSessions, token );
+
+         if ( pCBCtx )
          {
-            ctx->inCallback= true;
-            ctx->sessionEventCB( ctx->sessionEventUserData, event, &info );
-            ctx->inCallback= false;
-         }
-         pthread_mutex_unlock( &ctx->mutexSend );
-      }
-   }
+            AudSrvSessionHandleInfo scratch;
+            int capacity= sessionCount;
 
-exit:
+            if ( (result == 0) && (sessionCount > 0) )
+            {
+               if ( pCBCtx->sync )
+               {
+                  // Parse straight into the caller's array, skipping entries beyond its capacity
+                  pInfo= pCBCtx->sync->sessionInfo;
+                  capacity= pCBCtx->sync->maxCount;
+               }
+               else
+               {
+                  pInfo= (AudSrvSessionHandleInfo*)calloc( sessionCount, sizeof(AudSrvSessionHandleInfo) );
+               }
+               if ( pInfo || !capacity )
+               {
+                  bool error= false;
+                  for( int i= 0; i < sessionCount; ++i )
+                  {
+                     AudSrvSessionHandleInfo *pSession= &scratch;
 
-   return msglen;
-}
+                     if ( i < capacity )
+                     {
+                        pSession= &pInfo[i];
+                     }
+                     memset( pSession, 0, sizeof(AudSrvSessionHandleInfo) );
 
-static int audsrv_process_eosdetected( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: eosdetected version %d", version);
-   
-   if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_EOSDetected_Version )
-      {
-         pthread_mutex_lock( &ctx->mutexSend );
-         if ( ctx->eosCB )
+                     len= audsrv_conn_get_u32( ctx->conn );
+                     type= audsrv_conn_get_u32( ctx->conn );
+                     
+                     if ( type != AUDSRV_TYPE_U32 )
+                     {
+                        ERROR("expecting type %d (U32) not type %d for enumSessionsResults session %d pid", AUDSRV_TYPE_U32, type, i );
+                        error= true;
+                        break;
+                     }
+                     
+                     pSession->info.pid= audsrv_conn_get_u32( ctx->conn );
+
+
+                     len= audsrv_conn_get_u32( ctx->conn );
+                     type= audsrv_conn_get_u32( ctx->conn );
+                     
+                     if ( type != AUDSRV_TYPE_U16 )
+                     {
+                        ERROR("expecting type %d (U16) not type %d for enumSessionsResults session %d sessionType", AUDSRV_TYPE_U16, type, i );
+                        error= true;
+                        break;
+                     }
+                     
+                     pSession->info.sessionType= audsrv_conn_get_u16( ctx->conn );
+
+
+                     len= audsrv_conn_get_u32( ctx->conn );
+                     type= audsrv_conn_get_u32( ctx->conn );
+                     
+                     if ( type != AUDSRV_TYPE_String )
+                     {
+                        ERROR("expecting type %d (string) not type %d for enumSessionsResults session %d sessionName)", AUDSRV_TYPE_String, type, i );
+                        error= true;
+                        break;
+                     }
+                     if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+                     {
+                        ERROR("sessionName too long (%d) for enumSessionsResults session %d", len, i );
+                        error= true;
+                        break;
+                     }
+                     
+                     if ( len )
+                     {
+                        audsrv_conn_get_string( ctx->conn, pSession->info.sessionName );
+                     }
+
+                     if ( version >= AUDSRV_MSG_EnumSessionsResults_Version_Handle )
+                     {
+                        len= audsrv_conn_get_u32( ctx->conn );
+                        type= audsrv_conn_get_u32( ctx->conn );
+
+                        if ( type != AUDSRV_TYPE_U32 )
+                        {
+                           ERROR("expecting type %d (U32) not type %d for enumSessionsResults session %d sessionHandle", AUDSRV_TYPE_U32, type, i );
+                           error= true;
+                           break;
+                        }
+
+                        pSession->sessionHandle= audsrv_conn_get_u32( ctx->conn );
+                     }
+                  }
+                  if ( error )
+                  {
+                     result= 1;
+                     if ( !pCBCtx->sync )
+                     {
+                        free( pInfo );
+                     }
+                     pInfo= 0;
+                  }
+               }
+               else
+               {
+                  ERROR("No memory for enumn sessions results info");
+                  result= 1;
+               }
+            }
+
+            entry= *pCBCtx;
+            audsrv_pending_free( ctx, pCBCtx );
+
+            if ( entry.sync )
+            {
+               entry.sync->result= result;
+               entry.sync->count= ((result == 0) ? sessionCount : 0);
+               entry.sync->done= true;
+               pthread_cond_broadcast( &ctx->condSync );
+            }
+         }
+         else
          {
-            ctx->inCallback= true;
-            ctx->eosCB( ctx->eosUserData );
-            ctx->inCallback= false;
+            ERROR("enum session results: no match for token %llx", token);
          }
+
          pthread_mutex_unlock( &ctx->mutexSend );
-      }
-   }
-   
-   return msglen;
-}
 
-static int audsrv_process_firstaudio( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: firstaudio version %d", version);
-   
-   if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_FirstAudio_Version )
-      {
-         if ( ctx->firstAudioCB )
-         {
-            ctx->inCallback= true;
-            ctx->firstAudioCB( ctx->firstAudioUserData );
-            ctx->inCallback= false;
+         if ( pCBCtx && !entry.sync )
+         {
+            if ( entry.withHandles )
+            {
+               ctx->inCallback= true;
+               entry.cb.enumhandles( entry.userData, result, sessionCount, pInfo );
+               ctx->inCallback= false;
+            }
+            else
+            {
+               AudSrvSessionInfo *pSessionInfo= 0;
+
+               if ( pInfo )
+               {
+                  pSessionInfo= (AudSrvSessionInfo*)calloc( sessionCount, sizeof(AudSrvSessionInfo) );
+                  if ( pSessionInfo )
+                  {
+                     for( int i= 0; i < sessionCount; ++i )
+                     {
+                        pSessionInfo[i]= pInfo[i].info;
+                     }
+                  }
+                  else
+                  {
+                     ERROR("No memory for enumn sessions results info");
+                     result= 1;
+                  }
+               }
+
+               ctx->inCallback= true;
+               entry.cb.enumsess( entry.userData, result, sessionCount, pSessionInfo );
+               ctx->inCallback= false;
+
+               if ( pSessionInfo )
+               {
+                  free( pSessionInfo );
+               }
+            }
+            
+            if ( pInfo )
+            {
+               free( pInfo );
+            }
          }
       }
    }
+
+exit:
    
    return msglen;
 }
 
-static int audsrv_process_ptserror( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+static int audsrv_process_getstatus_results( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: ptserror version %d", version);
-   
+   TRACE1("msg: getstatus results version %d", version);
+
    if ( ctx )
    {   
-      if ( version <= AUDSRV_MSG_PtsError_Version )
+      if ( version <= AUDSRV_MSG_GetStatusResults_Version )
       {
          unsigned len, type;
-         unsigned count;
+         unsigned long long token;
+         unsigned result;
+         unsigned numerator, denominator;
+         AudsrvCBCtx *pCBCtx= 0;   
+         AudsrvCBCtx entry;
+         AudSrvSessionStatus status, *pStatus;
+
+         pStatus= &status;
+         memset( &status, 0, sizeof(status) );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
          
-         if ( type != AUDSRV_TYPE_U32 )
+         if ( type != AUDSRV_TYPE_U64 )
          {
-            ERROR("expecting type %d (U32) not type %d for ptserror arg 1 (count)", AUDSRV_TYPE_U32, type );
+            ERROR("expecting type %d (U64) not type %d for getStatusResults arg 1 (token)", AUDSRV_TYPE_U64, type );
             goto exit;
-         }
-         
-         count= audsrv_conn_get_u32( ctx->conn );
+         }         
+         token= audsrv_conn_get_u64( ctx->conn );
+
+
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
          
-         if ( ctx->ptsErrorCB )
+         if ( type != AUDSRV_TYPE_U16 )
          {
-            ctx->inCallback= true;
-            ctx->ptsErrorCB( ctx->ptsErrorUserData, count );
-            ctx->inCallback= false;
-         }
-      }
-   }
-
-exit:
+            ERROR("expecting type %d (U16) not type %d for getStatusResults arg 2 (result)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }         
+         result= audsrv_conn_get_u16( ctx->conn );
 
-   return msglen;
-}
 
-static int audsrv_process_underflow( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: underflow version %d", version);
-   
-   if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_Underflow_Version )
-      {
-         unsigned len, type;
-         unsigned count, bufferedBytes, queuedFrames;
+         len= audsrv_conn_get_u32( ctx->conn );
+         type= audsrv_conn_get_u32( ctx->conn );
+         
+         if ( type != AUDSRV_TYPE_U16 )
+         {
+            ERROR("expecting type %d (U16) not type %d for getStatusResults arg 3 (global muted)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }
+         status.globalMuted= audsrv_conn_get_u16( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
@@ -2167,11 +5452,10 @@ static int audsrv_process_underflow( AudsrvApiContext *ctx, unsigned msglen, uns
          
          if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U32) not type %d for underflow arg 1 (count)", AUDSRV_TYPE_U32, type );
+            ERROR("expecting type %d (U32) not type %d for getStatusResults arg 4 (global volume num)", AUDSRV_TYPE_U32, type );
             goto exit;
          }
-         
-         count= audsrv_conn_get_u32( ctx->conn );
+         numerator= audsrv_conn_get_u32( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
@@ -2179,28 +5463,179 @@ static int audsrv_process_underflow( AudsrvApiContext *ctx, unsigned msglen, uns
          
          if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U32) not type %d for underflow arg 2 (bufferedBytes)", AUDSRV_TYPE_U32, type );
+            ERROR("expecting type %d (U32) not type %d for getStatusResults arg 5 (global volume denom)", AUDSRV_TYPE_U32, type );
             goto exit;
          }
-         
-         bufferedBytes= audsrv_conn_get_u32( ctx->conn );
+         denominator= audsrv_conn_get_u32( ctx->conn );
+         if ( denominator == 0 )
+         {
+            ERROR("zero global volume denominator for getStatusResults");
+            goto exit;
+         }
+         status.globalVolume= ((float)numerator)/((float)denominator);
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
          
-         if ( type != AUDSRV_TYPE_U32 )
+         if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("expecting type %d (U32) not type %d for underflow arg 3 (queuedFrames)", AUDSRV_TYPE_U32, type );
+            ERROR("expecting type %d (U16) not type %d for getStatusResults arg 6 (ready)", AUDSRV_TYPE_U16, type );
             goto exit;
-         }
+         }         
+         status.ready= audsrv_conn_get_u16( ctx->conn );
          
-         queuedFrames= audsrv_conn_get_u32( ctx->conn );
 
-         if ( ctx->underflowCB )
+
+         TRACE1("getstatus results: token %llx result %u", token, result );
+
+         pthread_mutex_lock( &ctx->mutexSend );
+
+         pCBCtx= audsrv_pending_find( ctx, AUDSRV_CBTYPE_GetStatus, token );
+
+         if ( pCBCtx )
+         {
+            bool error= false;
+
+            if ( result == 0 )
+            {
+               len= audsrv_conn_get_u32( ctx->conn );
+               type= audsrv_conn_get_u32( ctx->conn );
+               
+               if ( type != AUDSRV_TYPE_U16 )
+               {
+                  ERROR("expecting type %d (U16) not type %d for getStatusResults playing", AUDSRV_TYPE_U16, type );
+                  error= true;
+               }
+               else
+               {
+                  status.playing= audsrv_conn_get_u16( ctx->conn );
+               }
+
+               if ( !error )
+               {
+                  len= audsrv_conn_get_u32( ctx->conn );
+                  type= audsrv_conn_get_u32( ctx->conn );
+                  
+                  if ( type != AUDSRV_TYPE_U16 )
+                  {
+                     ERROR("expecting type %d (U16) not type %d for getStatusResults paused", AUDSRV_TYPE_U16, type );
+                     error= true;
+                  }
+                  else
+                  {
+                     status.paused= audsrv_conn_get_u16( ctx->conn );
+                  }
+               }
+
+               if ( !error )
+               {
+                  len= audsrv_conn_get_u32( ctx->conn );
+                  type= audsrv_conn_get_u32( ctx->conn );
+
+                  if ( type != AUDSRV_TYPE_U16 )
+                  {
+                     ERROR("expecting type %d (U16) not type %d for getStatusResults muted", AUDSRV_TYPE_U16, type );
+                     error= true;
+                  }
+                  else
+                  {
+                     status.muted= audsrv_conn_get_u16( ctx->conn );
+                  }
+               }
+
+               if ( !error )
+               {
+                  len= audsrv_conn_get_u32( ctx->conn );
+                  type= audsrv_conn_get_u32( ctx->conn );
+                  
+                  if ( type != AUDSRV_TYPE_U32 )
+                  {
+                     ERROR("expecting type %d (U32) not type %d for getStatusResults volume num", AUDSRV_TYPE_U32, type );
+                     error= true;
+                  }
+                  else
+                  {
+                     numerator= audsrv_conn_get_u32( ctx->conn );
+                  }
+               }
+
+               if ( !error )
+               {
+                  len= audsrv_conn_get_u32( ctx->conn );
+                  type= audsrv_conn_get_u32( ctx->conn );
+                  
+                  if ( type != AUDSRV_TYPE_U32 )
+                  {
+                     ERROR("expecting type %d (U32) not type %d for getStatusResults volume denom", AUDSRV_TYPE_U32, type );
+                     error= true;
+                  }
+                  else
+                  {
+                     denominator= audsrv_conn_get_u32( ctx->conn );
+                     if ( denominator == 0 )
+                     {
+                        ERROR("zero volume denominator for getStatusResults");
+                        error= true;
+                     }
+                  }
+               }
+
+               status.volume= ((float)numerator)/((float)denominator);
+
+               if ( !error )
+               {
+                  len= audsrv_conn_get_u32( ctx->conn );
+                  type= audsrv_conn_get_u32( ctx->conn );
+                  
+                  if ( type != AUDSRV_TYPE_String )
+                  {
+                     ERROR("expecting type %d (string) not type %d for getStatusResults sessionName)", AUDSRV_TYPE_String, type );
+                     error= true;
+                  }
+                  else if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+                  {
+                     ERROR("sessionName too long (%d) for getStatusResults", len );
+                     error= true;
+                  }                  
+                  else if ( len )
+                  {
+                     audsrv_conn_get_string( ctx->conn, status.sessionName );
+                  }
+               }
+            }
+
+            if ( error )
+            {
+               result= 0;
+               pStatus= 0;
+            }
+
+            entry= *pCBCtx;
+            audsrv_pending_free( ctx, pCBCtx );
+
+            if ( entry.sync )
+            {
+               if ( pStatus )
+               {
+                  *entry.sync->sessionStatus= status;
+               }
+               entry.sync->result= (pStatus ? result : 1);
+               entry.sync->done= true;
+               pthread_cond_broadcast( &ctx->condSync );
+            }
+         }
+         else
+         {
+            ERROR("enum session results: no match for token %llx", token);
+         }
+
+         pthread_mutex_unlock( &ctx->mutexSend );
+
+         if ( pCBCtx && !entry.sync )
          {
             ctx->inCallback= true;
-            ctx->underflowCB( ctx->ptsErrorUserData, count, bufferedBytes, queuedFrames );
+            entry.cb.getstatus( entry.userData, result, pStatus );
             ctx->inCallback= false;
          }
       }
@@ -2211,605 +5646,377 @@ exit:
    return msglen;
 }
 
-static int audsrv_process_capture_parameters( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+static int audsrv_process_getlatency_results( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: capture parameters version %d", version);
-   
+   TRACE1("msg: getlatency results version %d", version);
+
    if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_CaptureParameters_Version )
+   {
+      if ( version <= AUDSRV_MSG_GetLatencyResults_Version )
       {
          unsigned len, type;
-         unsigned version, sampleRate, outputDelay;
-         unsigned short numChannels, bitsPerSample;
-
+         unsigned long long token;
+         unsigned result;
+         unsigned values[6];
+         AudsrvCBCtx *pCBCtx= 0;
+         AudsrvCBCtx entry;
+         AudSrvLatency latency, *pLatency;
+         static const char *names[6]= { "serverBytes", "serverFrames", "socBytes", "socFrames", "sampleRate", "outputDelay" };
 
-         len= audsrv_conn_get_u32( ctx->conn );
-         type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U32 )
-         {
-            ERROR("expecting type %d (U32) not type %d for captureParameters arg 1 (version)", AUDSRV_TYPE_U32, type );
-            goto exit;
-         }
-         
-         version= audsrv_conn_get_u32( ctx->conn );
+         memset( &latency, 0, sizeof(latency) );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U16 )
+
+         if ( type != AUDSRV_TYPE_U64 )
          {
-            ERROR("expecting type %d (U16) not type %d for captureParameters arg 2 (numChannels)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U64) not type %d for getLatencyResults arg 1 (token)", AUDSRV_TYPE_U64, type );
             goto exit;
          }
-         
-         numChannels= audsrv_conn_get_u16( ctx->conn );
+         token= audsrv_conn_get_u64( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
+
          if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("expecting type %d (U16) not type %d for captureParameters arg 3 (bitsPerSample)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U16) not type %d for getLatencyResults arg 2 (result)", AUDSRV_TYPE_U16, type );
             goto exit;
          }
-         
-         bitsPerSample= audsrv_conn_get_u16( ctx->conn );
+         result= audsrv_conn_get_u16( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U32 )
-         {
-            ERROR("expecting type %d (U32) not type %d for captureParameters arg 4 (sampleRate)", AUDSRV_TYPE_U32, type );
-            goto exit;
-         }
-         
-         sampleRate= audsrv_conn_get_u32( ctx->conn );
 
-
-         len= audsrv_conn_get_u32( ctx->conn );
-         type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U32 )
+         if ( type != AUDSRV_TYPE_U64 )
          {
-            ERROR("expecting type %d (U32) not type %d for captureParameters arg 5 (outputDelay)", AUDSRV_TYPE_U32, type );
+            ERROR("expecting type %d (U64) not type %d for getLatencyResults arg 3 (timestamp)", AUDSRV_TYPE_U64, type );
             goto exit;
          }
-         
-         outputDelay= audsrv_conn_get_u32( ctx->conn );
+         latency.timestamp= (long long)audsrv_conn_get_u64( ctx->conn );
 
 
-         if ( version != ctx->captureParameters.version )
+         for( int i= 0; i < 6; ++i )
          {
-            ctx->captureParameters.version= version;
-            ctx->captureParameters.numChannels= numChannels;
-            ctx->captureParameters.bitsPerSample= bitsPerSample;
-            ctx->captureParameters.sampleRate= sampleRate;
-            ctx->captureParameters.outputDelay= outputDelay;
-            
-            if ( ctx->captureCB )
+            len= audsrv_conn_get_u32( ctx->conn );
+            type= audsrv_conn_get_u32( ctx->conn );
+
+            if ( type != AUDSRV_TYPE_U32 )
             {
-               ctx->inCallback= true;
-               ctx->captureCB( ctx->captureUserData, &ctx->captureParameters, NULL, 0 );
-               ctx->inCallback= false;
+               ERROR("expecting type %d (U32) not type %d for getLatencyResults arg %d (%s)", AUDSRV_TYPE_U32, type, i+4, names[i] );
+               goto exit;
             }
+            values[i]= audsrv_conn_get_u32( ctx->conn );
          }
-      }
-   }
+         latency.serverBytes= values[0];
+         latency.serverFrames= values[1];
+         latency.socBytes= values[2];
+         latency.socFrames= values[3];
+         latency.sampleRate= values[4];
+         latency.outputDelay= values[5];
+         latency.clientBytes= audsrv_conn_send_pending( ctx->conn );
+         pLatency= (result == 0 ? &latency : 0);
 
-exit:
-   
-   return msglen;
-}
+         TRACE1("getlatency results: token %llx result %u", token, result );
 
-static int audsrv_process_capture_data( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: capture data version %d", version);
-   
-   if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_CaptureData_Version )
-      {
-         unsigned len, type;
-         unsigned datalen;
-         unsigned char *data;
+         pthread_mutex_lock( &ctx->mutexSend );
 
-         len= audsrv_conn_get_u32( ctx->conn );
-         type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_Buffer )
-         {
-            ERROR("expecting type %d (buffer) not type %d for captureData arg 1 (data)", AUDSRV_TYPE_Buffer, type );
-            goto exit;
-         }
-         
-         audsrv_conn_get_buffer( ctx->conn, len, &data, &datalen );
-         if ( data && datalen )
-         {
-            if ( ctx->captureCB )
-            {
-               ctx->captureCB( ctx->captureUserData, &ctx->captureParameters, data, datalen );               
-            }
-            len -= datalen;
-         }
+         pCBCtx= audsrv_pending_find( ctx, AUDSRV_CBTYPE_GetLatency, token );
 
-         if ( len )
+         if ( pCBCtx )
          {
-            audsrv_conn_get_buffer( ctx->conn, len, &data, &datalen );
-            if ( data && datalen )
+            entry= *pCBCtx;
+            audsrv_pending_free( ctx, pCBCtx );
+
+            if ( entry.sync )
             {
-               if ( ctx->captureCB )
+               if ( pLatency )
                {
-                  ctx->inCallback= true;
-                  ctx->captureCB( ctx->captureUserData, &ctx->captureParameters, data, datalen );               
-                  ctx->inCallback= false;
+                  *entry.sync->latency= latency;
                }
+               entry.sync->result= result;
+               entry.sync->done= true;
+               pthread_cond_broadcast( &ctx->condSync );
             }
          }
-      }
-   }
+         else
+         {
+            ERROR("getlatency results: no match for token %llx", token);
+         }
 
-exit:
-   
-   return msglen;
-}
+         pthread_mutex_unlock( &ctx->mutexSend );
 
-static int audsrv_process_capture_done( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: capture done version %d", version);
-   
-   if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_CaptureDone_Version )
-      {
-         pthread_mutex_lock( &ctx->mutexSend );
-         if ( ctx->captureDoneCB )
+         if ( pCBCtx && !entry.sync )
          {
             ctx->inCallback= true;
-            ctx->captureDoneCB( ctx->captureDoneUserData );
+            entry.cb.getlatency( entry.userData, result, pLatency );
             ctx->inCallback= false;
          }
-         ctx->captureCB= 0;
-         ctx->captureDoneCB= 0;
-         pthread_mutex_unlock( &ctx->mutexSend );
       }
    }
-   
+
+exit:
+
    return msglen;
 }
 
-static int audsrv_process_enum_sessions_results( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+static int audsrv_process_session_handle( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: emum sessions results version %d", version);
+   TRACE1("msg: session handle version %d", version);
 
    if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_EnumSessionsResults_Version )
+   {
+      if ( version <= AUDSRV_MSG_SessionHandle_Version )
       {
          unsigned len, type;
-         unsigned long long token, tokenMatch;
-         unsigned result, sessionCount;
-         AudsrvCBCtx *pCBCtx= 0;   
-
+         unsigned reason, sessionHandle;
+         char sessionName[AUDSRV_MAX_SESSION_NAME_LEN+1];
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
+
+         if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("expecting type %d (U64) not type %d for enumSessionsResults arg 1 (token)", AUDSRV_TYPE_U64, type );
+            ERROR("expecting type %d (U16) not type %d for session handle arg 1 (reason)", AUDSRV_TYPE_U16, type );
             goto exit;
          }
-         
-         token= audsrv_conn_get_u64( ctx->conn );
+
+         reason= audsrv_conn_get_u16( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U16 )
+
+         if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U16) not type %d for enumSessionsResults arg 2 (result)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U32) not type %d for session handle arg 2 (sessionHandle)", AUDSRV_TYPE_U32, type );
             goto exit;
          }
-         
-         result= audsrv_conn_get_u16( ctx->conn );
+
+         sessionHandle= audsrv_conn_get_u32( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U16 )
+
+         if ( type != AUDSRV_TYPE_String )
          {
-            ERROR("expecting type %d (U16) not type %d for enumSessionsResults arg 3 (sessionCount)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (string) not type %d for session handle arg 3 (sessionName)", AUDSRV_TYPE_String, type );
             goto exit;
          }
-         
-         sessionCount= audsrv_conn_get_u16( ctx->conn );
-
-         TRACE1("enum sessions results: token %llx result %u sessionCount %u", token, result, sessionCount );
-
-         pthread_mutex_lock( &ctx->mutexSend );
-
-         for( std::vector<AudsrvCBCtx*>::iterator it= ctx->pendingCallbacks.begin();
-              it != ctx->pendingCallbacks.end();
-              ++it )
+         if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
          {
-            AudsrvCBCtx *pCBCtxIter= (*it);
-
-            if ( sizeof(void*) == 4 )
-            {
-               tokenMatch= (unsigned)pCBCtxIter;
-            }
-            else
-            {
-               tokenMatch= (unsigned long long)pCBCtxIter;
-            }
-
-            if ( token == tokenMatch )
-            {
-               pCBCtx= pCBCtxIter;
-               ctx->pendingCallbacks.erase( it );
-               break;
-            }
+            ERROR("sessionName too long (%d) for session handle", len );
+            goto exit;
          }
 
-         if ( pCBCtx )
+         sessionName[0]= '\0';
+         if ( len )
          {
-            AudSrvSessionInfo *pInfo= 0;
-
-            if ( (result == 0) && (sessionCount > 0) )
-            {
-               pInfo= (AudSrvSessionInfo*)calloc( sessionCount, sizeof(AudSrvSessionInfo) );
-               if ( pInfo )
-               {
-                  bool error= false;
-                  for( int i= 0; i < sessionCount; ++i )
-                  {
-                     len= audsrv_conn_get_u32( ctx->conn );
-                     type= audsrv_conn_get_u32( ctx->conn );
-                     
-                     if ( type != AUDSRV_TYPE_U32 )
-                     {
-                        ERROR("expecting type %d (U32) not type %d for enumSessionsResults session %d pid", AUDSRV_TYPE_U32, type, i );
-                        error= true;
-                        break;
-                     }
-                     
-                     pInfo[i].pid= audsrv_conn_get_u32( ctx->conn );
-
-
-                     len= audsrv_conn_get_u32( ctx->conn );
-                     type= audsrv_conn_get_u32( ctx->conn );
-                     
-                     if ( type != AUDSRV_TYPE_U16 )
-                     {
-                        ERROR("expecting type %d (U16) not type %d for enumSessionsResults session %d sessionType", AUDSRV_TYPE_U16, type, i );
-                        error= true;
-                        break;
-                     }
-                     
-                     pInfo[i].sessionType= audsrv_conn_get_u16( ctx->conn );
-
+            audsrv_conn_get_string( ctx->conn, sessionName );
+         }
 
-                     len= audsrv_conn_get_u32( ctx->conn );
-                     type= audsrv_conn_get_u32( ctx->conn );
-                     
-                     if ( type != AUDSRV_TYPE_String )
-                     {
-                        ERROR("expecting type %d (string) not type %d for enumSessionsResults session %d sessionName)", AUDSRV_TYPE_String, type, i );
-                        error= true;
-                        break;
-                     }
-                     if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
-                     {
-                        ERROR("sessionName too long (%d) for enumSessionsResults session %d", len, i );
-                        error= true;
-                        break;
-                     }
-                     
-                     if ( len )
-                     {
-                        audsrv_conn_get_string( ctx->conn, pInfo[i].sessionName );
-                     }
-                  }
-                  if ( error )
-                  {
-                     result= 1;
-                     free( pInfo );
-                     pInfo= 0;
-                  }
-               }
-               else
-               {
-                  ERROR("No memory for enumn sessions results info");
-                  result= 1;
-               }
-            }
+         TRACE1("session handle: reason %u handle %X sessionName (%s)", reason, sessionHandle, sessionName );
 
-            ctx->inCallback= true;
-            pCBCtx->cb.enumsess( pCBCtx->userData, result, sessionCount, pInfo );
-            ctx->inCallback= false;
-            
-            if ( pInfo )
-            {
-               free( pInfo );
-            }
-            free( pCBCtx );
+         pthread_mutex_lock( &ctx->mutexSend );
+         ctx->serverHandles= true;
+         if ( (ctx->sessionEventCB || ctx->sessionHandleEventCB) && (ctx->sessionEventVersion < AUDSRV_MSG_EnableSessionEvent_Version_Handle) )
+         {
+            // Events were enabled before we knew the server had handles
+            audsrv_send_enable_session_event( ctx );
          }
-         else
+         switch( reason )
          {
-            ERROR("enum session results: no match for token %llx", token);
+            case AUDSRV_SESSIONHANDLE_Init:
+               ctx->sessionHandle= sessionHandle;
+               break;
+            case AUDSRV_SESSIONHANDLE_Resolve:
+               // Ignore answers for a name we are no longer attached to
+               if ( ctx->sessionNameAttached && !strcmp( ctx->sessionNameAttached, sessionName ) )
+               {
+                  ctx->sessionHandleAttached= sessionHandle;
+               }
+               break;
+            default:
+               INFO("ignoring session handle with unknown reason %u", reason);
+               break;
          }
-
          pthread_mutex_unlock( &ctx->mutexSend );
       }
    }
 
 exit:
-   
+
    return msglen;
 }
 
-static int audsrv_process_getstatus_results( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+static int audsrv_process_data_request( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: getstatus results version %d", version);
+   TRACE2("msg: data request version %d", version);
 
    if ( ctx )
-   {   
-      if ( version <= AUDSRV_MSG_GetStatusResults_Version )
+   {
+      if ( version <= AUDSRV_MSG_DataRequest_Version )
       {
          unsigned len, type;
-         unsigned long long token, tokenMatch;
-         unsigned result;
-         unsigned numerator, denominator;
-         AudsrvCBCtx *pCBCtx= 0;   
-         AudSrvSessionStatus status, *pStatus;
-
-         pStatus= &status;
-         memset( &status, 0, sizeof(status) );
-
+         unsigned credit, bufferedBytes;
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
-         {
-            ERROR("expecting type %d (U64) not type %d for getStatusResults arg 1 (token)", AUDSRV_TYPE_U64, type );
-            goto exit;
-         }         
-         token= audsrv_conn_get_u64( ctx->conn );
 
-
-         len= audsrv_conn_get_u32( ctx->conn );
-         type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U16 )
+         if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U16) not type %d for getStatusResults arg 2 (result)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U32) not type %d for data request arg 1 (credit)", AUDSRV_TYPE_U32, type );
             goto exit;
-         }         
-         result= audsrv_conn_get_u16( ctx->conn );
+         }
+
+         credit= audsrv_conn_get_u32( ctx->conn );
 
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U16 )
+
+         if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U16) not type %d for getStatusResults arg 3 (global muted)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U32) not type %d for data request arg 2 (bufferedBytes)", AUDSRV_TYPE_U32, type );
             goto exit;
          }
-         status.globalMuted= audsrv_conn_get_u16( ctx->conn );
 
+         bufferedBytes= audsrv_conn_get_u32( ctx->conn );
 
-         len= audsrv_conn_get_u32( ctx->conn );
-         type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U32 )
+         if ( ctx->dataRequestCB )
          {
-            ERROR("expecting type %d (U32) not type %d for getStatusResults arg 4 (global volume num)", AUDSRV_TYPE_U32, type );
-            goto exit;
+            ctx->inCallback= true;
+            ctx->dataRequestCB( ctx->dataRequestUserData, credit, bufferedBytes );
+            ctx->inCallback= false;
          }
-         numerator= audsrv_conn_get_u32( ctx->conn );
+      }
+   }
+
+exit:
+
+   return msglen;
+}
+
+static int audsrv_process_flush_ack( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE2("msg: flush ack version %d", version);
 
+   if ( ctx )
+   {
+      if ( version <= AUDSRV_MSG_FlushAck_Version )
+      {
+         unsigned len, type;
+         unsigned generation;
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
+
          if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U32) not type %d for getStatusResults arg 5 (global volume denom)", AUDSRV_TYPE_U32, type );
+            ERROR("expecting type %d (U32) not type %d for flush ack arg 1 (generation)", AUDSRV_TYPE_U32, type );
             goto exit;
          }
-         denominator= audsrv_conn_get_u32( ctx->conn );
-         if ( denominator == 0 )
+
+         generation= audsrv_conn_get_u32( ctx->conn );
+
+         if ( ctx->flushAckCB )
          {
-            ERROR("zero global volume denominator for getStatusResults");
-            goto exit;
+            ctx->inCallback= true;
+            ctx->flushAckCB( ctx->flushAckUserData, generation );
+            ctx->inCallback= false;
          }
-         status.globalVolume= ((float)numerator)/((float)denominator);
+      }
+   }
+
+exit:
 
+   return msglen;
+}
+
+static int audsrv_process_handle_release( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE2("msg: handle release version %d", version);
+
+   if ( ctx )
+   {
+      if ( version <= AUDSRV_MSG_HandleRelease_Version )
+      {
+         unsigned len, type;
+         unsigned count;
+         unsigned long long dataHandles[AUDSRV_MAX_RELEASED_HANDLES];
 
          len= audsrv_conn_get_u32( ctx->conn );
          type= audsrv_conn_get_u32( ctx->conn );
-         
-         if ( type != AUDSRV_TYPE_U16 )
+
+         if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U16) not type %d for getStatusResults arg 6 (ready)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U32) not type %d for handle release arg 1 (count)", AUDSRV_TYPE_U32, type );
             goto exit;
-         }         
-         status.ready= audsrv_conn_get_u16( ctx->conn );
-         
-
-
-         TRACE1("getstatus results: token %llx result %u", token, result );
+         }
 
-         pthread_mutex_lock( &ctx->mutexSend );
+         count= audsrv_conn_get_u32( ctx->conn );
+         if ( count > AUDSRV_MAX_RELEASED_HANDLES )
+         {
+            ERROR("handle release count too large (%u)", count );
+            goto exit;
+         }
 
-         for( std::vector<AudsrvCBCtx*>::iterator it= ctx->pendingCallbacks.begin();
-              it != ctx->pendingCallbacks.end();
-              ++it )
+         for( unsigned i= 0; i < count; ++i )
          {
-            AudsrvCBCtx *pCBCtxIter= (*it);
+            len= audsrv_conn_get_u32( ctx->conn );
+            type= audsrv_conn_get_u32( ctx->conn );
 
-            if ( sizeof(void*) == 4 )
-            {
-               tokenMatch= (unsigned)pCBCtxIter;
-            }
-            else
+            if ( type != AUDSRV_TYPE_U64 )
             {
-               tokenMatch= (unsigned long long)pCBCtxIter;
+               ERROR("expecting type %d (U64) not type %d for handle release dataHandle %u", AUDSRV_TYPE_U64, type, i );
+               goto exit;
             }
 
-            if ( token == tokenMatch )
-            {
-               pCBCtx= pCBCtxIter;
-               ctx->pendingCallbacks.erase( it );
-               break;
-            }
+            dataHandles[i]= audsrv_conn_get_u64( ctx->conn );
          }
 
-         if ( pCBCtx )
+         if ( ctx->handleReleaseCB && count )
          {
-            bool error= false;
-
-            if ( result == 0 )
-            {
-               len= audsrv_conn_get_u32( ctx->conn );
-               type= audsrv_conn_get_u32( ctx->conn );
-               
-               if ( type != AUDSRV_TYPE_U16 )
-               {
-                  ERROR("expecting type %d (U16) not type %d for getStatusResults playing", AUDSRV_TYPE_U16, type );
-                  error= true;
-               }
-               else
-               {
-                  status.playing= audsrv_conn_get_u16( ctx->conn );
-               }
-
-               if ( !error )
-               {
-                  len= audsrv_conn_get_u32( ctx->conn );
-                  type= audsrv_conn_get_u32( ctx->conn );
-                  
-                  if ( type != AUDSRV_TYPE_U16 )
-                  {
-                     ERROR("expecting type %d (U16) not type %d for getStatusResults paused", AUDSRV_TYPE_U16, type );
-                     error= true;
-                  }
-                  else
-                  {
-                     status.paused= audsrv_conn_get_u16( ctx->conn );
-                  }
-               }
-
-               if ( !error )
-               {
-                  len= audsrv_conn_get_u32( ctx->conn );
-                  type= audsrv_conn_get_u32( ctx->conn );
+            ctx->inCallback= true;
+            ctx->handleReleaseCB( ctx->handleReleaseUserData, count, dataHandles );
+            ctx->inCallback= false;
+         }
+      }
+   }
 
-                  if ( type != AUDSRV_TYPE_U16 )
-                  {
-                     ERROR("expecting type %d (U16) not type %d for getStatusResults muted", AUDSRV_TYPE_U16, type );
-                     error= true;
-                  }
-                  else
-                  {
-                     status.muted= audsrv_conn_get_u16( ctx->conn );
-                  }
-               }
+exit:
 
-               if ( !error )
-               {
-                  len= audsrv_conn_get_u32( ctx->conn );
-                  type= audsrv_conn_get_u32( ctx->conn );
-                  
-                  if ( type != AUDSRV_TYPE_U32 )
-                  {
-                     ERROR("expecting type %d (U32) not type %d for getStatusResults volume num", AUDSRV_TYPE_U32, type );
-                     error= true;
-                  }
-                  else
-                  {
-                     numerator= audsrv_conn_get_u32( ctx->conn );
-                  }
-               }
+   return msglen;
+}
 
-               if ( !error )
-               {
-                  len= audsrv_conn_get_u32( ctx->conn );
-                  type= audsrv_conn_get_u32( ctx->conn );
-                  
-                  if ( type != AUDSRV_TYPE_U32 )
-                  {
-                     ERROR("expecting type %d (U32) not type %d for getStatusResults volume denom", AUDSRV_TYPE_U32, type );
-                     error= true;
-                  }
-                  else
-                  {
-                     denominator= audsrv_conn_get_u32( ctx->conn );
-                     if ( denominator == 0 )
-                     {
-                        ERROR("zero volume denominator for getStatusResults");
-                        error= true;
-                     }
-                  }
-               }
+static int audsrv_process_select_session( AudsrvApiContext *ctx, unsigned msglen, unsigned version )
+{
+   TRACE2("msg: select session version %d", version);
 
-               status.volume= ((float)numerator)/((float)denominator);
+   if ( version <= AUDSRV_MSG_SelectSession_Version )
+   {
+      unsigned len, type;
 
-               if ( !error )
-               {
-                  len= audsrv_conn_get_u32( ctx->conn );
-                  type= audsrv_conn_get_u32( ctx->conn );
-                  
-                  if ( type != AUDSRV_TYPE_String )
-                  {
-                     ERROR("expecting type %d (string) not type %d for getStatusResults sessionName)", AUDSRV_TYPE_String, type );
-                     error= true;
-                  }
-                  else if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
-                  {
-                     ERROR("sessionName too long (%d) for getStatusResults", len );
-                     error= true;
-                  }                  
-                  else if ( len )
-                  {
-                     audsrv_conn_get_string( ctx->conn, status.sessionName );
-                  }
-               }
-            }
+      len= audsrv_conn_get_u32( ctx->conn );
+      type= audsrv_conn_get_u32( ctx->conn );
 
-            if ( error )
-            {
-               result= 0;
-               pStatus= 0;
-            }
+      if ( type != AUDSRV_TYPE_U32 )
+      {
+         ERROR("expecting type %d (U32) not type %d for select session arg 1 (sessionId)", AUDSRV_TYPE_U32, type );
+         goto exit;
+      }
 
-            ctx->inCallback= true;
-            pCBCtx->cb.getstatus( pCBCtx->userData, result, pStatus );
-            ctx->inCallback= false;
-            
-            free( pCBCtx );
-         }
-         else
-         {
-            ERROR("enum session results: no match for token %llx", token);
-         }
+      ctx->recvSessionId= audsrv_conn_get_u32( ctx->conn );
 
-         pthread_mutex_unlock( &ctx->mutexSend );
-      }
+      TRACE2("msg: select session sessionId %u", ctx->recvSessionId);
    }
 
 exit:
-   
+
    return msglen;
 }
 
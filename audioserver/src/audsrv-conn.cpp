@@ -41,6 +41,7 @@
 //#define AUDSRV_DUMP_TRAFFIC
 
 static void dumpBuffer( unsigned char *p, int len );
+static void audsrv_conn_close_fds( AudsrvConn *conn );
 
 AudsrvConn* audsrv_conn_init( int fd, unsigned sendBufferSize, unsigned recvBufferSize )
 {
@@ -50,6 +51,7 @@ AudsrvConn* audsrv_conn_init( int fd, unsigned sendBufferSize, unsigned recvBuff
    conn= (AudsrvConn*)calloc( 1, sizeof(AudsrvConn) );
    if ( conn )
    {
+      pthread_mutex_init( &conn->sendMutex, 0 );
       conn->fdSocket= fd;
       
       conn->sendbuff= (unsigned char*)malloc( sendBufferSize );
@@ -86,6 +88,42 @@ exit:
    return conn;
 } 
 
+// A sub-session connection carries the messages of one sub-session over the parent's socket.
+// It has its own send buffer for composing messages but reads from the parent's receive buffer,
+// and its sends are serialized with those of the parent and prefixed with a select session
+// message whenever the socket last carried a different session.
+AudsrvConn* audsrv_conn_init_sub( AudsrvConn *parent, unsigned sessionId, unsigned sendBufferSize )
+{
+   AudsrvConn *conn= 0;
+
+   conn= (AudsrvConn*)calloc( 1, sizeof(AudsrvConn) );
+   if ( conn )
+   {
+      pthread_mutex_init( &conn->sendMutex, 0 );
+      conn->parent= parent;
+      conn->sessionId= sessionId;
+      conn->fdSocket= parent->fdSocket;
+
+      conn->sendbuff= (unsigned char*)malloc( sendBufferSize );
+      if ( !conn->sendbuff )
+      {
+         ERROR("unable to allocate AudsrvConn send buffer, size %d bytes", sendBufferSize );
+         audsrv_conn_term( conn );
+         conn= 0;
+      }
+      else
+      {
+         conn->sendCapacity= sendBufferSize;
+      }
+   }
+   else
+   {
+      ERROR("unable allocate new AudsrvConn");
+   }
+
+   return conn;
+}
+
 void audsrv_conn_term( AudsrvConn *conn )
 {
    if ( conn )
@@ -100,10 +138,36 @@ void audsrv_conn_term( AudsrvConn *conn )
          free( conn->recvbuff );
          conn->recvbuff= 0;
       }
+      if ( conn->pendbuff )
+      {
+         free( conn->pendbuff );
+         conn->pendbuff= 0;
+      }
+      audsrv_conn_close_fds( conn );
+      pthread_mutex_destroy( &conn->sendMutex );
       free( conn );
    }
 }
 
+// Discard buffered traffic after the underlying socket has been replaced
+void audsrv_conn_reset( AudsrvConn *conn )
+{
+   if ( conn )
+   {
+      conn->head= 0;
+      conn->tail= 0;
+      conn->count= 0;
+      conn->recvTotal= 0;
+      conn->peerDisconnected= false;
+      audsrv_conn_close_fds( conn );
+      pthread_mutex_lock( &conn->sendMutex );
+      conn->pendOffset= 0;
+      conn->pendCount= 0;
+      conn->sendSessionId= 0;
+      pthread_mutex_unlock( &conn->sendMutex );
+   }
+}
+
 int audsrv_conn_put_u16( unsigned char *p, unsigned short n )
 {
    p[0]= (n>>8);
@@ -147,27 +211,339 @@ int audsrv_conn_put_string( unsigned char *p, const char *s )
    return ( (len+3)&~3 );
 }
 
+static int audsrv_conn_put_select( unsigned char *p, unsigned sessionId )
+{
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U32_LEN );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_SelectSession );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_SelectSession_Version );
+   p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+   p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+   p += audsrv_conn_put_u32( p, sessionId );
+
+   return AUDSRV_SELECT_SESSION_LEN;
+}
+
+// Must be called with base->sendMutex held
+static int audsrv_conn_sendv_locked( AudsrvConn *base, struct iovec *iov, int count )
+{
+   int sentLen= 0;
+   int len;
+
+   while( count > 0 )
+   {
+      struct msghdr msg;
+
+      msg.msg_name= NULL;
+      msg.msg_namelen= 0;
+      msg.msg_iov= iov;
+      msg.msg_iovlen= count;
+      msg.msg_control= NULL;
+      msg.msg_controllen= 0;
+      msg.msg_flags= 0;
+
+      do
+      {
+         len= sendmsg( base->fdSocket, &msg, MSG_NOSIGNAL );
+      }
+      while ( (len < 0) && (errno == EINTR));
+
+      if ( len < 0 )
+      {
+         return -1;
+      }
+      sentLen += len;
+
+      // A blocking send may still be cut short: resume after what went out
+      while( (count > 0) && (len >= (int)iov->iov_len) )
+      {
+         len -= iov->iov_len;
+         ++iov;
+         --count;
+      }
+      if ( count > 0 )
+      {
+         iov->iov_base= (unsigned char*)iov->iov_base + len;
+         iov->iov_len -= len;
+      }
+   }
+
+   return sentLen;
+}
+
+// Must be called with base->sendMutex held
+static bool audsrv_conn_flush_locked( AudsrvConn *base, bool block )
+{
+   while( base->pendCount > 0 )
+   {
+      int len;
+
+      do
+      {
+         len= send( base->fdSocket, base->pendbuff+base->pendOffset, base->pendCount, (block ? 0 : MSG_DONTWAIT)|MSG_NOSIGNAL );
+      }
+      while ( (len < 0) && (errno == EINTR));
+
+      if ( len <= 0 )
+      {
+         break;
+      }
+
+      base->pendOffset += len;
+      base->pendCount -= len;
+   }
+
+   return (base->pendCount == 0);
+}
+
 int audsrv_conn_send( AudsrvConn *conn, unsigned char *data1, int len1, unsigned char *data2, int len2 )
 {
+   AudsrvConn *base= (conn->parent ? conn->parent : conn);
+   unsigned char select[AUDSRV_SELECT_SESSION_LEN];
    int sentLen= 0;
    
+   pthread_mutex_lock( &base->sendMutex );
+
+   // The tail of a message left by a non-blocking send must go out first
+   if ( base->pendCount && !audsrv_conn_flush_locked( base, true ) )
+   {
+      pthread_mutex_unlock( &base->sendMutex );
+      return -1;
+   }
+
    if ( data1 && len1 )
    {
-      struct msghdr msg;
-      struct iovec iov[2];
-      int vcount= 1;
+      struct iovec iov[3];
+      int vcount= 0;
+      int selectLen= 0;
+      int total;
 
       dumpBuffer( data1, len1 );
          
-      iov[0].iov_base= data1;
-      iov[0].iov_len= len1;
+      if ( base->sendSessionId != conn->sessionId )
+      {
+         selectLen= audsrv_conn_put_select( select, conn->sessionId );
+         iov[vcount].iov_base= select;
+         iov[vcount].iov_len= selectLen;
+         ++vcount;
+      }
+      iov[vcount].iov_base= data1;
+      iov[vcount].iov_len= len1;
+      ++vcount;
+      total= selectLen+len1;
       if ( data2 && len2 )
       {
-         vcount= 2;
-         iov[1].iov_base= data2;
-         iov[1].iov_len= len2;
+         iov[vcount].iov_base= data2;
+         iov[vcount].iov_len= len2;
+         ++vcount;
+         total += len2;
       }
-      
+
+      sentLen= audsrv_conn_sendv_locked( base, iov, vcount );
+      if ( sentLen == total )
+      {
+         base->sendSessionId= conn->sessionId;
+         sentLen -= selectLen;
+      }
+      else
+      {
+         sentLen= -1;
+      }
+   }
+   
+   pthread_mutex_unlock( &base->sendMutex );
+
+   return sentLen;
+}
+
+// Send a run of complete messages described by iov in a single call where possible.
+// Returns the number of bytes sent or -1 on error.
+int audsrv_conn_sendv( AudsrvConn *conn, struct iovec *iov, int count )
+{
+   AudsrvConn *base= (conn->parent ? conn->parent : conn);
+   int sentLen= -1;
+
+   pthread_mutex_lock( &base->sendMutex );
+
+   if ( base->pendCount && !audsrv_conn_flush_locked( base, true ) )
+   {
+      goto exit;
+   }
+
+   if ( base->sendSessionId != conn->sessionId )
+   {
+      unsigned char select[AUDSRV_SELECT_SESSION_LEN];
+      struct iovec iovSelect;
+
+      iovSelect.iov_base= select;
+      iovSelect.iov_len= audsrv_conn_put_select( select, conn->sessionId );
+      if ( audsrv_conn_sendv_locked( base, &iovSelect, 1 ) != AUDSRV_SELECT_SESSION_LEN )
+      {
+         goto exit;
+      }
+      base->sendSessionId= conn->sessionId;
+   }
+
+   sentLen= audsrv_conn_sendv_locked( base, iov, count );
+
+exit:
+   pthread_mutex_unlock( &base->sendMutex );
+
+   return sentLen;
+}
+
+// Send a single message with file descriptors attached as SCM_RIGHTS ancillary data.
+// The descriptors travel with the first byte of the message.  Returns the number of
+// message bytes sent or -1 on error.
+int audsrv_conn_send_fds( AudsrvConn *conn, unsigned char *data, int len, int *fds, int fdCount )
+{
+   AudsrvConn *base= (conn->parent ? conn->parent : conn);
+   unsigned char select[AUDSRV_SELECT_SESSION_LEN];
+   union
+   {
+      struct cmsghdr align;
+      char buf[CMSG_SPACE(sizeof(int)*AUDSRV_CONN_MAX_FDS)];
+   } control;
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   struct iovec iov[2];
+   int vcount= 0;
+   int selectLen= 0;
+   int sentLen= -1;
+   int rc;
+
+   if ( (fdCount <= 0) || (fdCount > AUDSRV_CONN_MAX_FDS) )
+   {
+      ERROR("bad fd count %d", fdCount);
+      return -1;
+   }
+
+   pthread_mutex_lock( &base->sendMutex );
+
+   if ( base->pendCount && !audsrv_conn_flush_locked( base, true ) )
+   {
+      goto exit;
+   }
+
+   dumpBuffer( data, len );
+
+   if ( base->sendSessionId != conn->sessionId )
+   {
+      selectLen= audsrv_conn_put_select( select, conn->sessionId );
+      iov[vcount].iov_base= select;
+      iov[vcount].iov_len= selectLen;
+      ++vcount;
+   }
+   iov[vcount].iov_base= data;
+   iov[vcount].iov_len= len;
+   ++vcount;
+
+   memset( &control, 0, sizeof(control) );
+   msg.msg_name= NULL;
+   msg.msg_namelen= 0;
+   msg.msg_iov= iov;
+   msg.msg_iovlen= vcount;
+   msg.msg_control= control.buf;
+   msg.msg_controllen= CMSG_SPACE(sizeof(int)*fdCount);
+   msg.msg_flags= 0;
+
+   cmsg= CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level= SOL_SOCKET;
+   cmsg->cmsg_type= SCM_RIGHTS;
+   cmsg->cmsg_len= CMSG_LEN(sizeof(int)*fdCount);
+   memcpy( CMSG_DATA(cmsg), fds, sizeof(int)*fdCount );
+
+   do
+   {
+      rc= sendmsg( base->fdSocket, &msg, MSG_NOSIGNAL );
+   }
+   while ( (rc < 0) && (errno == EINTR));
+
+   if ( rc > 0 )
+   {
+      // The descriptors are attached: finish any remainder as ordinary data
+      if ( rc < selectLen+len )
+      {
+         int more;
+
+         while( (vcount > 0) && (rc >= (int)iov[0].iov_len) )
+         {
+            rc -= iov[0].iov_len;
+            iov[0]= iov[1];
+            --vcount;
+         }
+         iov[0].iov_base= (unsigned char*)iov[0].iov_base + rc;
+         iov[0].iov_len -= rc;
+         more= audsrv_conn_sendv_locked( base, iov, vcount );
+         if ( more < 0 )
+         {
+            goto exit;
+         }
+      }
+      base->sendSessionId= conn->sessionId;
+      sentLen= len;
+   }
+
+exit:
+   pthread_mutex_unlock( &base->sendMutex );
+
+   return sentLen;
+}
+
+// Send a message without blocking.  Returns -1 on error, 0 if the socket cannot accept any
+// of the message or another thread is sending on the connection (would block), or len1+len2
+// once the whole message is committed: any part the socket did not take is kept in the
+// connection and sent ahead of later messages.
+int audsrv_conn_send_nonblocking( AudsrvConn *conn, unsigned char *data1, int len1, unsigned char *data2, int len2 )
+{
+   AudsrvConn *base= (conn->parent ? conn->parent : conn);
+   unsigned char select[AUDSRV_SELECT_SESSION_LEN];
+   int sentLen= 0;
+
+   // A blocking send may hold the lock while the peer is not reading
+   if ( pthread_mutex_trylock( &base->sendMutex ) != 0 )
+   {
+      return 0;
+   }
+
+   if ( !audsrv_conn_flush_locked( base, false ) )
+   {
+      sentLen= ((base->pendCount > 0) ? 0 : -1);
+      goto exit;
+   }
+
+   if ( data1 && len1 )
+   {
+      struct msghdr msg;
+      struct iovec iov[3];
+      int vcount= 0;
+      int selectLen= 0;
+      int total, remaining, skip;
+      unsigned char *pend;
+
+      dumpBuffer( data1, len1 );
+
+      if ( base->sendSessionId != conn->sessionId )
+      {
+         selectLen= audsrv_conn_put_select( select, conn->sessionId );
+         iov[vcount].iov_base= select;
+         iov[vcount].iov_len= selectLen;
+         ++vcount;
+      }
+      iov[vcount].iov_base= data1;
+      iov[vcount].iov_len= len1;
+      ++vcount;
+      if ( data2 && len2 )
+      {
+         iov[vcount].iov_base= data2;
+         iov[vcount].iov_len= len2;
+         ++vcount;
+      }
+      else
+      {
+         len2= 0;
+      }
+      total= selectLen+len1+len2;
+
       msg.msg_name= NULL;
       msg.msg_namelen= 0;
       msg.msg_iov= iov;
@@ -178,19 +554,101 @@ int audsrv_conn_send( AudsrvConn *conn, unsigned char *data1, int len1, unsigned
 
       do
       {
-         sentLen= sendmsg( conn->fdSocket, &msg, 0 );
+         sentLen= sendmsg( base->fdSocket, &msg, MSG_DONTWAIT|MSG_NOSIGNAL );
+      }
+      while ( (sentLen < 0) && (errno == EINTR));
+
+      if ( sentLen < 0 )
+      {
+         sentLen= (((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1);
+         goto exit;
+      }
+
+      remaining= total-sentLen;
+      if ( remaining > 0 )
+      {
+         if ( remaining > (int)base->pendCapacity )
+         {
+            unsigned char *pendbuff= (unsigned char*)realloc( base->pendbuff, remaining );
+            if ( !pendbuff )
+            {
+               // Part of a message is on the wire: the stream can't be recovered
+               ERROR("unable to allocate AudsrvConn pending buffer, size %d bytes", remaining );
+               sentLen= -1;
+               goto exit;
+            }
+            base->pendbuff= pendbuff;
+            base->pendCapacity= remaining;
+         }
+         pend= base->pendbuff;
+         skip= sentLen;
+         for( int i= 0; i < vcount; ++i )
+         {
+            int len= (int)iov[i].iov_len;
+            if ( skip >= len )
+            {
+               skip -= len;
+               continue;
+            }
+            memcpy( pend, (unsigned char*)iov[i].iov_base+skip, len-skip );
+            pend += (len-skip);
+            skip= 0;
+         }
+         base->pendOffset= 0;
+         base->pendCount= remaining;
       }
-      while ( (sentLen < 0) && (errno == EINTR));   
+      base->sendSessionId= conn->sessionId;
+      sentLen= len1+len2;
    }
-   
+
+exit:
+   pthread_mutex_unlock( &base->sendMutex );
+
    return sentLen;
 }
 
+// Send any message tail left by audsrv_conn_send_nonblocking.  Returns 1 when nothing
+// remains pending, 0 while some does, or -1 without block when another thread is sending
+// on the connection.
+int audsrv_conn_flush( AudsrvConn *conn, bool block )
+{
+   AudsrvConn *base= (conn->parent ? conn->parent : conn);
+   int result;
+
+   if ( block )
+   {
+      pthread_mutex_lock( &base->sendMutex );
+   }
+   else if ( pthread_mutex_trylock( &base->sendMutex ) != 0 )
+   {
+      return -1;
+   }
+   result= (audsrv_conn_flush_locked( base, block ) ? 1 : 0);
+   pthread_mutex_unlock( &base->sendMutex );
+
+   return result;
+}
+
+// Bytes committed by non-blocking sends but not yet accepted by the socket
+int audsrv_conn_send_pending( AudsrvConn *conn )
+{
+   AudsrvConn *base= (conn->parent ? conn->parent : conn);
+   int pending;
+
+   pthread_mutex_lock( &base->sendMutex );
+   pending= base->pendCount;
+   pthread_mutex_unlock( &base->sendMutex );
+
+   return pending;
+}
+
 void audsrv_conn_get_buffer( AudsrvConn *conn, int maxlen, unsigned char **data, unsigned *datalen )
 {
    unsigned char *start;
    unsigned avail= 0;
    
+   if ( conn->parent ) conn= conn->parent;
+
    if ( conn->count )
    {
       if ( conn->head < conn->tail )
@@ -224,10 +682,13 @@ void audsrv_conn_get_buffer( AudsrvConn *conn, int maxlen, unsigned char **data,
 void audsrv_conn_get_string( AudsrvConn *conn, char *s )
 {
    unsigned char c;
-   int head= conn->head;
+   int head;
    int len= 0;
    int paddedLen, padCount;
    
+   if ( conn->parent ) conn= conn->parent;
+   head= conn->head;
+   
    do
    {
       c= conn->recvbuff[head];
@@ -248,7 +709,10 @@ void audsrv_conn_get_string( AudsrvConn *conn, char *s )
 unsigned audsrv_conn_get_u16( AudsrvConn *conn )
 {
    unsigned n;
-   int head= conn->head;
+   int head;
+   
+   if ( conn->parent ) conn= conn->parent;
+   head= conn->head;
    
    n= conn->recvbuff[head];
    head= ((head+1)%conn->recvCapacity);
@@ -264,7 +728,10 @@ unsigned audsrv_conn_get_u16( AudsrvConn *conn )
 unsigned audsrv_conn_get_u32( AudsrvConn *conn )
 {
    unsigned n;
-   int head= conn->head;
+   int head;
+   
+   if ( conn->parent ) conn= conn->parent;
+   head= conn->head;
    
    n= conn->recvbuff[head];
    head= ((head+1)%conn->recvCapacity);
@@ -284,7 +751,10 @@ unsigned audsrv_conn_get_u32( AudsrvConn *conn )
 unsigned audsrv_conn_peek_u32( AudsrvConn *conn )
 {
    unsigned n;
-   int head= conn->head;
+   int head;
+   
+   if ( conn->parent ) conn= conn->parent;
+   head= conn->head;
    
    n= conn->recvbuff[head];
    head= ((head+1)%conn->recvCapacity);
@@ -297,10 +767,63 @@ unsigned audsrv_conn_peek_u32( AudsrvConn *conn )
    return n;
 }
 
+// Peek at a value offset bytes past the next unconsumed byte
+unsigned audsrv_conn_peek_u32_at( AudsrvConn *conn, int offset )
+{
+   unsigned n;
+   int head;
+
+   if ( conn->parent ) conn= conn->parent;
+   head= ((conn->head+offset)%conn->recvCapacity);
+
+   n= conn->recvbuff[head];
+   head= ((head+1)%conn->recvCapacity);
+   n= ((n << 8) | conn->recvbuff[head]);
+   head= ((head+1)%conn->recvCapacity);
+   n= ((n << 8) | conn->recvbuff[head]);
+   head= ((head+1)%conn->recvCapacity);
+   n= ((n << 8) | conn->recvbuff[head]);
+
+   return n;
+}
+
+// Copy up to len received bytes starting offset bytes past the next unconsumed byte
+int audsrv_conn_peek_at( AudsrvConn *conn, int offset, unsigned char *data, int len )
+{
+   int head, copylen;
+
+   if ( conn->parent ) conn= conn->parent;
+   if ( offset >= conn->count )
+   {
+      return 0;
+   }
+   if ( len > conn->count-offset )
+   {
+      len= conn->count-offset;
+   }
+   head= ((conn->head+offset)%conn->recvCapacity);
+
+   copylen= conn->recvCapacity-head;
+   if ( copylen > len )
+   {
+      copylen= len;
+   }
+   memcpy( data, &conn->recvbuff[head], copylen );
+   if ( copylen < len )
+   {
+      memcpy( data+copylen, conn->recvbuff, len-copylen );
+   }
+
+   return len;
+}
+
 unsigned long long audsrv_conn_get_u64( AudsrvConn *conn )
 {
    unsigned long long n;
-   int head= conn->head;
+   int head;
+   
+   if ( conn->parent ) conn= conn->parent;
+   head= conn->head;
    
    n= conn->recvbuff[head];
    head= ((head+1)%conn->recvCapacity);
@@ -327,14 +850,28 @@ unsigned long long audsrv_conn_get_u64( AudsrvConn *conn )
 
 void audsrv_conn_skip( AudsrvConn *conn, int n )
 {
+   if ( conn->parent ) conn= conn->parent;
    conn->head= ((conn->head+n)%conn->recvCapacity);
    conn->count -= n;
 }
 
-int audsrv_conn_recv( AudsrvConn *conn )
+// Bytes received but not yet consumed
+int audsrv_conn_recv_count( AudsrvConn *conn )
+{
+   if ( conn->parent ) conn= conn->parent;
+
+   return conn->count;
+}
+
+static int audsrv_conn_recv_flags( AudsrvConn *conn, int flags )
 {
    struct msghdr msg;
    struct iovec iov[2];
+   union
+   {
+      struct cmsghdr align;
+      char buf[CMSG_SPACE(sizeof(int)*AUDSRV_CONN_MAX_FDS)];
+   } control;
    int vcount;
    int len= -1;
    
@@ -362,21 +899,50 @@ int audsrv_conn_recv( AudsrvConn *conn )
       msg.msg_namelen= 0;
       msg.msg_iov= iov;
       msg.msg_iovlen= vcount;
-      msg.msg_control= NULL;
-      msg.msg_controllen= 0;
+      msg.msg_control= control.buf;
+      msg.msg_controllen= sizeof(control.buf);
       msg.msg_flags= 0;
 
       do
       {
-         len= recvmsg( conn->fdSocket, &msg, 0 );
+         len= recvmsg( conn->fdSocket, &msg, MSG_CMSG_CLOEXEC|flags );
       }
       while ( (len < 0) && (errno == EINTR));
       
       if ( len > 0 )
       {
+         struct cmsghdr *cmsg;
+
+         for( cmsg= CMSG_FIRSTHDR(&msg); cmsg; cmsg= CMSG_NXTHDR(&msg, cmsg) )
+         {
+            if ( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) )
+            {
+               int *fds= (int*)CMSG_DATA(cmsg);
+               int fdCount= (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+
+               for( int i= 0; i < fdCount; ++i )
+               {
+                  if ( conn->fdCount < AUDSRV_CONN_MAX_FDS )
+                  {
+                     conn->fds[conn->fdCount++]= fds[i];
+                  }
+                  else
+                  {
+                     ERROR("too many received fds: closing fd %d", fds[i]);
+                     close( fds[i] );
+                  }
+               }
+            }
+         }
+
          conn->count += len;
+         conn->recvTotal += len;
          conn->tail= ((conn->tail + len) % conn->recvCapacity);
       }
+      else if ( (len < 0) && (flags & MSG_DONTWAIT) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+      {
+         len= 0;
+      }
       else
       {
          conn->peerDisconnected= true;
@@ -386,6 +952,43 @@ int audsrv_conn_recv( AudsrvConn *conn )
    return len;
 }
 
+int audsrv_conn_recv( AudsrvConn *conn )
+{
+   return audsrv_conn_recv_flags( conn, 0 );
+}
+
+// Take in whatever is already queued on the socket without waiting for more
+int audsrv_conn_recv_nonblocking( AudsrvConn *conn )
+{
+   return audsrv_conn_recv_flags( conn, MSG_DONTWAIT );
+}
+
+// Claim the oldest descriptor received and not yet claimed, or -1 if there is none
+int audsrv_conn_get_fd( AudsrvConn *conn )
+{
+   int fd= -1;
+
+   if ( conn->parent ) conn= conn->parent;
+
+   if ( conn->fdCount > 0 )
+   {
+      fd= conn->fds[0];
+      --conn->fdCount;
+      memmove( &conn->fds[0], &conn->fds[1], conn->fdCount*sizeof(int) );
+   }
+
+   return fd;
+}
+
+static void audsrv_conn_close_fds( AudsrvConn *conn )
+{
+   for( int i= 0; i < conn->fdCount; ++i )
+   {
+      close( conn->fds[i] );
+   }
+   conn->fdCount= 0;
+}
+
 static void dumpBuffer( unsigned char *p, int len )
 {
    #ifdef AUDSRV_DUMP_TRAFFIC
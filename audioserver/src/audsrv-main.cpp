@@ -31,15 +31,24 @@
 #include <string.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/un.h>
 
 #include "audsrv-logger.h"
 #include "audsrv-protocol.h"
 #include "audsrv-conn.h"
+#include "audsrv-state.h"
+#include "audsrv-pcm.h"
 
 #include "audioserver-soc.h"
 
@@ -56,26 +65,74 @@
 
 #define LEVEL_DENOMINATOR (1000000)
 
+#define AUDSRV_LISTEN_FDS_START (3)
+#define AUDSRV_LISTEN_BACKLOG (64)
+
+#define AUDSRV_DATA_REQUEST_INTERVAL (5)
+
+#define AUDSRV_FLUSH_SCAN_INTERVAL (10000)
+
+#define AUDSRV_MAX_SESSIONS (256)
+#define AUDSRV_SESSION_HANDLE_SLOT(h) ((h)&0xFFFF)
+
 typedef struct _AudsrvContext AudsrvContext;
 
 typedef struct _AudsrvClient
 {
    AudsrvContext *ctx;
    int fdSocket;
+   int fdWake; // wakes the client thread to send what other threads queued for it
    struct ucred ucred;
    AudsrvConn *conn;
    pthread_t threadId;
    pthread_mutex_t mutex;
    bool clientStarted;
-   bool clientReady;
    bool clientAbort;
    bool stopRequested;
    AudSrvCaptureParameters captureParams;
    AudSrvSocClient soc;
    unsigned sessionType;
+   unsigned sessionHandle;
+   unsigned sessionEventVersion;
+   unsigned dataRequestWatermark;
+   unsigned dataRequestCredit;
    char sessionName[AUDSRV_MAX_SESSION_NAME_LEN+1];
+   struct _AudsrvClient *parent;
+   unsigned subSessionId;
+   unsigned recvSessionId;
+   struct _AudsrvClient *subSessions[AUDSRV_MAX_SUBSESSIONS];
+   AudsrvCaptureRing *captureRing;
+   unsigned captureRingMapSize;
+   int captureRingFd;
+   int captureRingEventFd;
+   unsigned long long captureOverrunPosition;
+   unsigned captureOverrunBytes;
+   bool handleReleaseEnabled;
+   int releasedHandleCount;
+   int releasedHandleCapacity;
+   unsigned long long *releasedHandles;
+   AudSrvDataRing *dataRing;
+   unsigned dataRingMapSize;
+   unsigned dataRingSize;
+   unsigned pcmFormat;
+   AudsrvPcm *pcm;
+   unsigned flushGeneration;
+   // Look-ahead for flushes queued behind data, kept on the connection owner as stream positions
+   unsigned long long recvMsgEnd;
+   unsigned long long scanPos;
+   unsigned scanSessionId;
+   long long scanSocketTime;
 } AudsrvClient;
 
+typedef struct _AudsrvSessionControl
+{
+   unsigned flags;
+   bool mute;
+   float volume;
+   char *sessionName;
+   char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
+} AudsrvSessionControl;
+
 typedef struct _AudsrvContext
 {
    char *serverName;
@@ -83,21 +140,57 @@ typedef struct _AudsrvContext
    char lockName[sizeof(addr.sun_path)+FILE_LOCK_SUFFIX_LEN];
    int fdLock;
    int fdSocket;
+   bool socketActivated;
    
    AudSrvSoc soc;
+   AudsrvState *state;
+   unsigned globalPendingFlags;
+   float globalPendingVolume;
+   bool globalPendingMute;
    
    pthread_mutex_t mutex;
    std::vector<AudsrvClient*> clients;
    std::vector<AudsrvClient*> clientsSessionEvent;
 
+   AudsrvClient *sessions[AUDSRV_MAX_SESSIONS];
+   unsigned short sessionGeneration[AUDSRV_MAX_SESSIONS];
+   int sessionNext;
+
+   pthread_t dataRequestThreadId;
+   pthread_cond_t dataRequestCond;
+   bool dataRequestThreadStarted;
+   bool dataRequestStopRequested;
+   int dataRequestClientCount;
+   int handleReleaseClientCount;
+
 } AudsrvContext;
 
 static AudsrvContext* audsrv_create_server_context( const char *name );
 static void audsrv_destroy_server_context( AudsrvContext* ctx );
 static bool audsrv_create_server_socket( AudsrvContext *ctx );
+static bool audsrv_get_activated_socket( AudsrvContext *ctx );
+static bool audsrv_open_soc( AudsrvContext *ctx );
+static void audsrv_set_global_mute( AudsrvContext *ctx, bool mute );
+static void audsrv_set_global_volume( AudsrvContext *ctx, float volume );
+static void audsrv_get_global_status( AudsrvContext *ctx, AudSrvSessionStatus *status );
 static AudsrvClient* audsrv_create_client( AudsrvContext *ctx, int fd );
 static void audsrv_destroy_client( AudsrvContext *ctx, AudsrvClient *client );
 static void* audsrv_client_thread( void *arg );
+static AudsrvClient* audsrv_create_sub_session( AudsrvClient *client, unsigned sessionId );
+static void audsrv_release_sub_session( AudsrvClient *client, AudsrvClient *sub );
+static AudsrvClient* audsrv_find_sub_session( AudsrvClient *client, unsigned sessionId );
+static void audsrv_restore_state( AudsrvContext *ctx, AudsrvClient *client );
+static void audsrv_register_session( AudsrvContext *ctx, AudsrvClient *client );
+static void audsrv_unregister_session( AudsrvContext *ctx, AudsrvClient *client );
+static AudsrvClient* audsrv_lookup_session( AudsrvContext *ctx, unsigned sessionHandle );
+static AudsrvClient* audsrv_find_session( AudsrvContext *ctx, unsigned sessionHandle );
+static unsigned audsrv_resolve_session_name( AudsrvContext *ctx, const char *name, int *matchCount );
+static unsigned audsrv_check_session_handle( AudsrvClient *client, unsigned sessionHandle, const char *sessionName );
+static void* audsrv_data_request_thread( void *arg );
+static void audsrv_check_data_request( AudsrvClient *client );
+static void audsrv_flush_released_handles( AudsrvClient *client );
+static void audsrv_wake_client( AudsrvClient *client );
+static bool audsrv_client_wait( AudsrvClient *client );
 static int audsrv_process_message( AudsrvClient *client );
 static int audsrv_process_init( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_audioinfo( AudsrvClient *client, unsigned msglen, unsigned version );
@@ -110,22 +203,44 @@ static int audsrv_process_flush( AudsrvClient *client, unsigned msglen, unsigned
 static int audsrv_process_audiosync( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_audiodata( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_audiodatahandle( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_audiodataring( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_enable_data_ring( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_mute( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_unmute( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_volume( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_session_control( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_enable_session_event( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_disable_session_event( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_enableeos( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_disableeos( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_startcapture( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_stopcapture( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_enable_capture_ring( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_enumsessions( AudsrvClient *client, unsigned msglen, unsigned version );
 static int audsrv_process_getstatus( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_getlatency( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_resolve_session( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_enable_data_request( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_select_session( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_release_session( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_enable_handle_release( AudsrvClient *client, unsigned msglen, unsigned version );
+static int audsrv_process_set_pcm_format( AudsrvClient *client, unsigned msglen, unsigned version );
+static void audsrv_play_data( AudsrvClient *client, unsigned char *data, unsigned datalen );
+static void audsrv_scan_flush( AudsrvClient *client );
+static void audsrv_scan_flush_buffered( AudsrvClient *client );
+static bool audsrv_data_is_stale( AudsrvClient *session, unsigned generation );
 static void audsrv_eos_callback( void *userData );
 static void audsrv_first_audio_callback( void *userData );
 static void audsrv_pts_error_callback( void *userData, unsigned count );
 static void audsrv_underflow_callback( void *userData, unsigned count, unsigned bufferedBytes, unsigned queuedFrames );
+static void audsrv_handle_release_callback( void *userData, unsigned long long dataHandle );
 static void audsrv_capture_callback( void *userData, AudSrvCaptureParameters *params, unsigned char *data, int datalen );
+static bool audsrv_create_capture_ring( AudsrvClient *client, unsigned ringSize );
+static void audsrv_destroy_capture_ring( AudsrvClient *client );
+static void audsrv_capture_ring_write( AudsrvClient *client, unsigned char *data, int datalen );
+static void audsrv_capture_overrun_flush( AudsrvClient *client );
+static bool audsrv_map_data_ring( AudsrvClient *client, int fd );
+static void audsrv_unmap_data_ring( AudsrvClient *client );
 static void audsrv_distribute_session_event( AudsrvContext *ctx, int event, AudsrvClient *clientSubject );
 static void audsrv_send_session_event( AudsrvClient *client, int event, AudsrvClient *clientSubject );
 static bool audsrv_send_eos_detected( AudsrvClient *client );
@@ -135,8 +250,15 @@ static bool audsrv_send_underflow( AudsrvClient *client, unsigned count, unsigne
 static bool audsrv_send_capture_params( AudsrvClient *client );
 static bool audsrv_send_capture_data( AudsrvClient *client, unsigned char *data, int datalen );
 static bool audsrv_send_capture_done( AudsrvClient *client );
-static bool audsrv_send_enum_session_results( AudsrvClient *client, unsigned long long token, int sessionCount, unsigned char *data, int datalen );
+static bool audsrv_send_capture_ring( AudsrvClient *client, unsigned long long token, int ringResult );
+static bool audsrv_send_capture_overrun( AudsrvClient *client, unsigned long long position, unsigned droppedBytes );
+static bool audsrv_send_enum_session_results( AudsrvClient *client, unsigned version, unsigned long long token, int sessionCount, unsigned char *data, int datalen );
 static bool audsrv_send_getstatus_results( AudsrvClient *client, unsigned long long token, AudSrvSessionStatus *status );
+static bool audsrv_send_getlatency_results( AudsrvClient *client, unsigned long long token, int latencyResult, AudSrvLatency *latency );
+static bool audsrv_send_session_handle( AudsrvClient *client, unsigned reason, unsigned sessionHandle, const char *sessionName );
+static bool audsrv_send_data_request( AudsrvClient *client, unsigned credit, unsigned bufferedBytes );
+static bool audsrv_send_handle_release( AudsrvClient *client, int count, unsigned long long *dataHandles );
+static bool audsrv_send_flush_ack( AudsrvClient *client, unsigned generation );
 
 static bool g_running= false;
 
@@ -169,6 +291,7 @@ static AudsrvContext* audsrv_create_server_context( const char *name )
       ctx->fdSocket= -1;
       ctx->serverName= strdup( name );
       pthread_mutex_init( &ctx->mutex, 0 );
+      pthread_cond_init( &ctx->dataRequestCond, 0 );
       ctx->clients= std::vector<AudsrvClient*>();
       ctx->clientsSessionEvent= std::vector<AudsrvClient*>();
       if ( !ctx->serverName )
@@ -176,13 +299,10 @@ static AudsrvContext* audsrv_create_server_context( const char *name )
          ERROR("audsrv_create_server_context: unable to duplicate server name");
          goto error;
       }
-      
-      ctx->soc= AudioServerSocOpen();
-      if ( !ctx->soc )
-      {
-         ERROR("audsrv_create_server_context: unable to open audioserver-soc");
-         goto error;
-      }
+
+      // The soc is opened on the first non-observer session (see audsrv_open_soc)
+      // so the server can accept connections as early as possible during boot
+      ctx->state= audsrv_state_open( ctx->serverName );
       
       return ctx;
    }   
@@ -199,12 +319,26 @@ static void audsrv_destroy_server_context( AudsrvContext* ctx )
    if ( ctx )
    {
       pthread_mutex_lock( &ctx->mutex );
+
+      if ( ctx->dataRequestThreadStarted )
+      {
+         ctx->dataRequestStopRequested= true;
+         pthread_cond_signal( &ctx->dataRequestCond );
+         pthread_mutex_unlock( &ctx->mutex );
+         pthread_join( ctx->dataRequestThreadId, NULL );
+         pthread_mutex_lock( &ctx->mutex );
+         ctx->dataRequestThreadStarted= false;
+      }
       
       while( ctx->clients.size() > 0 )
       {
          AudsrvClient *client= ctx->clients.back();
-         audsrv_destroy_client( ctx, client );
          ctx->clients.pop_back();
+         if ( !client->parent )
+         {
+            // Sub-sessions are destroyed along with the client that carries them
+            audsrv_destroy_client( ctx, client );
+         }
       }
       
       while( ctx->clientsSessionEvent.size() > 0 )
@@ -248,8 +382,15 @@ static void audsrv_destroy_server_context( AudsrvContext* ctx )
          ctx->soc= 0;
       }
 
+      if ( ctx->state )
+      {
+         audsrv_state_close( ctx->state );
+         ctx->state= 0;
+      }
+
       pthread_mutex_unlock( &ctx->mutex );
 
+      pthread_cond_destroy( &ctx->dataRequestCond );
       pthread_mutex_destroy( &ctx->mutex );
       
       free( ctx );
@@ -263,6 +404,11 @@ static bool audsrv_create_server_socket( AudsrvContext *ctx )
    int pathSize, maxPathSize;
    socklen_t addrSize;
    int rc;
+
+   if ( audsrv_get_activated_socket( ctx ) )
+   {
+      return true;
+   }
    
    workDir= getenv("XDG_RUNTIME_DIR");
    if ( !workDir )
@@ -330,7 +476,7 @@ static bool audsrv_create_server_socket( AudsrvContext *ctx )
       goto exit;
    }
    
-   rc= listen(ctx->fdSocket, 1);
+   rc= listen(ctx->fdSocket, AUDSRV_LISTEN_BACKLOG);
    if ( rc < 0 )
    {
       ERROR("listen failed for socket: errno %d", errno );
@@ -371,6 +517,61 @@ exit:
    return result;
 }
 
+// Use a listening socket passed by systemd socket activation (LISTEN_PID/LISTEN_FDS).
+// The socket file is owned by systemd so it is neither locked nor unlinked here.
+static bool audsrv_get_activated_socket( AudsrvContext *ctx )
+{
+   bool result= false;
+   const char *env;
+   int listenFds, fd, flags;
+   struct stat st;
+
+   env= getenv("LISTEN_PID");
+   if ( !env || (atoi(env) != (int)getpid()) )
+   {
+      goto exit;
+   }
+
+   env= getenv("LISTEN_FDS");
+   listenFds= (env ? atoi(env) : 0);
+
+   unsetenv("LISTEN_PID");
+   unsetenv("LISTEN_FDS");
+   unsetenv("LISTEN_FDNAMES");
+
+   if ( listenFds < 1 )
+   {
+      goto exit;
+   }
+   if ( listenFds > 1 )
+   {
+      WARNING("received %d activated sockets: using only the first", listenFds);
+   }
+
+   fd= AUDSRV_LISTEN_FDS_START;
+   if ( (fstat( fd, &st ) < 0) || !S_ISSOCK(st.st_mode) )
+   {
+      ERROR("activated fd %d is not a socket", fd);
+      goto exit;
+   }
+
+   flags= fcntl( fd, F_GETFD );
+   if ( flags >= 0 )
+   {
+      fcntl( fd, F_SETFD, flags|FD_CLOEXEC );
+   }
+
+   ctx->fdSocket= fd;
+   ctx->socketActivated= true;
+   INFO("using activated socket fd %d", fd);
+
+   result= true;
+
+exit:
+
+   return result;
+}
+
 static void showUsage()
 {
    printf("usage:\n");
@@ -469,9 +670,6 @@ int main( int argc, const char **argv )
                   if ( client )
                   {
                      INFO("created client %p for fd %d", client, fd);
-                     pthread_mutex_lock( &ctx->mutex );
-                     ctx->clients.push_back( client );
-                     pthread_mutex_unlock( &ctx->mutex );
                   }
                   else
                   {
@@ -511,6 +709,15 @@ static AudsrvClient* audsrv_create_client( AudsrvContext *ctx, int fd )
       client->ctx= ctx;
       client->fdSocket= fd;
       client->captureParams.version= (unsigned)-1;
+      client->captureRingFd= -1;
+      client->captureRingEventFd= -1;
+
+      client->fdWake= eventfd( 0, EFD_CLOEXEC|EFD_NONBLOCK );
+      if ( client->fdWake < 0 )
+      {
+         ERROR("unable to create client wake eventfd: errno %d", errno );
+         goto exit;
+      }
       
       optlen= sizeof(struct ucred);
       rc= getsockopt( client->fdSocket, SOL_SOCKET, SO_PEERCRED, 
@@ -528,48 +735,24 @@ static AudsrvClient* audsrv_create_client( AudsrvContext *ctx, int fd )
          }
          else
          {
+            // The accept loop does not wait for the client thread.  The client is
+            // added to the list before the thread can run so that a thread
+            // exiting early always finds itself there and cleans up.
+            pthread_mutex_lock( &ctx->mutex );
+            client->clientStarted= true;
             rc= pthread_create( &client->threadId, NULL, audsrv_client_thread, client );
             if ( !rc )
             {
-               bool ready, abort;
-               
+               ctx->clients.push_back( client );
+               error= false;
                INFO("client %p pid %d connected", client, client->ucred.pid);
-               
-               for( int i= 0; i < 500; ++i )
-               {
-                  pthread_mutex_lock( &client->mutex );
-                  ready= client->clientReady;
-                  abort= client->clientAbort;
-                  pthread_mutex_unlock( &client->mutex );
-
-                  if ( ready )
-                  {
-                     TRACE1("client %p ready", client);
-                     break;
-                  }
-                  
-                  if ( abort )
-                  {
-                     TRACE1("client %p aborting", client);
-                     break;
-                  }
-
-                  usleep( 10000 );
-               }
-               
-               if ( ready )
-               {
-                  error= false;
-               }
-               else
-               {
-                  ERROR("client thread failed to become ready");
-               }         
             }
             else
             {
+               client->clientStarted= false;
                ERROR("error creating thread for client %p fd %d", client, fd );
             }
+            pthread_mutex_unlock( &ctx->mutex );
          }
       }      
    }
@@ -577,7 +760,8 @@ static AudsrvClient* audsrv_create_client( AudsrvContext *ctx, int fd )
    {
       ERROR("unable to allocate new client");
    }
-   
+
+exit:
    if ( error )
    {
       pthread_mutex_lock( &ctx->mutex );
@@ -608,13 +792,67 @@ static void audsrv_destroy_client( AudsrvContext *ctx, AudsrvClient *client )
          TRACE1("audsrv_destroy_client: join complete for client %p", client);
          pthread_mutex_lock( &ctx->mutex );
       }
+
+      for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+      {
+         AudsrvClient *sub= client->subSessions[i];
+         if ( sub )
+         {
+            for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+                 it != ctx->clients.end();
+                 ++it )
+            {
+               if ( sub == (*it) )
+               {
+                  ctx->clients.erase( it );
+                  break;
+               }
+            }
+            for( std::vector<AudsrvClient*>::iterator it= ctx->clientsSessionEvent.begin();
+                 it != ctx->clientsSessionEvent.end();
+                 ++it )
+            {
+               if ( sub == (*it) )
+               {
+                  ctx->clientsSessionEvent.erase( it );
+                  break;
+               }
+            }
+            client->subSessions[i]= 0;
+            audsrv_destroy_client( ctx, sub );
+         }
+      }
       
+      audsrv_unregister_session( ctx, client );
+
+      if ( client->dataRequestWatermark )
+      {
+         client->dataRequestWatermark= 0;
+         --ctx->dataRequestClientCount;
+      }
+
+      if ( client->handleReleaseEnabled )
+      {
+         client->handleReleaseEnabled= false;
+         --ctx->handleReleaseClientCount;
+      }
+
       if ( client->soc )
       {
          AudioServerSocCloseClient( client->soc );
          client->soc= 0;
       }
 
+      audsrv_destroy_capture_ring( client );
+
+      audsrv_unmap_data_ring( client );
+
+      if ( client->pcm )
+      {
+         audsrv_pcm_destroy( client->pcm );
+         client->pcm= 0;
+      }
+
       if ( client->conn )
       {
          audsrv_conn_term( client->conn );
@@ -627,6 +865,18 @@ static void audsrv_destroy_client( AudsrvContext *ctx, AudsrvClient *client )
          close( client->fdSocket );
          client->fdSocket= -1;
       }
+
+      if ( client->fdWake >= 0 )
+      {
+         close( client->fdWake );
+         client->fdWake= -1;
+      }
+
+      if ( client->releasedHandles )
+      {
+         free( client->releasedHandles );
+         client->releasedHandles= 0;
+      }
       
       pthread_mutex_destroy( &client->mutex );
       
@@ -634,21 +884,60 @@ static void audsrv_destroy_client( AudsrvContext *ctx, AudsrvClient *client )
    }
 }
 
+// Wait until the client socket is readable.  Returns false when woken instead to send
+// released data handles, which is done here so that only the client thread writes them.
+static bool audsrv_client_wait( AudsrvClient *client )
+{
+   struct pollfd pfd[2];
+   int rc;
+
+   pfd[0].fd= client->fdSocket;
+   pfd[0].events= POLLIN;
+   pfd[0].revents= 0;
+   pfd[1].fd= client->fdWake;
+   pfd[1].events= POLLIN;
+   pfd[1].revents= 0;
+
+   rc= poll( pfd, 2, -1 );
+   if ( rc < 0 )
+   {
+      // Let the receive report errors other than a signal
+      return (errno != EINTR);
+   }
+
+   if ( pfd[1].revents & POLLIN )
+   {
+      eventfd_t count;
+
+      eventfd_read( client->fdWake, &count );
+
+      audsrv_flush_released_handles( client );
+      for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+      {
+         if ( client->subSessions[i] )
+         {
+            audsrv_flush_released_handles( client->subSessions[i] );
+         }
+      }
+   }
+
+   return (pfd[0].revents != 0);
+}
+
 static void* audsrv_client_thread( void *arg )
 {
    AudsrvClient *client= (AudsrvClient*)arg;
    
    TRACE1( "audsrv_client_thread: enter: client %p fd %d pid %d", client, client->fdSocket, client->ucred.pid );
    
-   client->clientStarted= true;
-
-   pthread_mutex_lock( &client->mutex );
-   client->clientReady= true;
-   pthread_mutex_unlock( &client->mutex );
-   
    while( !client->stopRequested && !client->clientAbort )
    {
       int consumed;
+
+      if ( !audsrv_client_wait( client ) )
+      {
+         continue;
+      }
       
       int len= audsrv_conn_recv( client->conn );
 
@@ -673,15 +962,17 @@ static void* audsrv_client_thread( void *arg )
       }
    }
    
+   pthread_mutex_lock( &client->mutex );
    if ( client->soc )
-   {   
-      AudioServerSocCloseClient( client->soc );      
+   {
+      AudioServerSocCloseClient( client->soc );
       client->soc= 0;
    }
    else if ( client->sessionType != AUDSRV_SESSION_Observer )
    {
       ERROR("audsrv_client_thread: enter: client %p fd %d pid %d: unable to open soc client, aborting", client, client->fdSocket, client->ucred.pid );
    }
+   pthread_mutex_unlock( &client->mutex );
 
 exit:
    TRACE1( "audsrv_client_thread: exit: client %p fd %d", client, client->fdSocket );
@@ -692,16 +983,26 @@ exit:
       pthread_mutex_lock( &ctx->mutex );
       for( std::vector<AudsrvClient*>::iterator it= ctx->clientsSessionEvent.begin();
            it != ctx->clientsSessionEvent.end();
-           ++it )
+           )
       {
-         if ( client == (*it) )
+         if ( (client == (*it)) || (client == (*it)->parent) )
          {
-            ctx->clientsSessionEvent.erase( it );
-            break;
+            it= ctx->clientsSessionEvent.erase( it );
+         }
+         else
+         {
+            ++it;
          }
       }
       pthread_mutex_unlock( &ctx->mutex );
 
+      for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+      {
+         if ( client->subSessions[i] )
+         {
+            audsrv_distribute_session_event( client->ctx, AUDSRV_SESSIONEVENT_Removed, client->subSessions[i] );
+         }
+      }
       audsrv_distribute_session_event( client->ctx, AUDSRV_SESSIONEVENT_Removed, client );
 
       pthread_mutex_lock( &ctx->mutex );
@@ -711,9 +1012,13 @@ exit:
       {
          if ( client == (*it) )
          {
+            // No one will join this thread once it is off the list
             ctx->clients.erase( it );
+            pthread_detach( client->threadId );
+            client->clientStarted= false;
             audsrv_destroy_client( ctx, client );
-            break;
+            pthread_mutex_unlock( &ctx->mutex );
+            return NULL;
          }
       }
       pthread_mutex_unlock( &ctx->mutex );
@@ -724,157 +1029,1759 @@ exit:
    return NULL;
 }
 
-static int audsrv_process_message( AudsrvClient *client )
+// Create a sub-session carried on the connection of client.  Sub-sessions have no socket or
+// thread of their own: their messages are read and dispatched by the owning client's thread.
+static AudsrvClient* audsrv_create_sub_session( AudsrvClient *client, unsigned sessionId )
 {
-   int consumed= 0;
-   int avail= client->conn->count;
-   unsigned msglen, msgid, version;
-   
-   if ( avail < AUDSRV_MSG_HDR_LEN )
+   AudsrvContext *ctx= client->ctx;
+   AudsrvClient *sub= 0;
+   int slot= -1;
+
+   for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+   {
+      if ( !client->subSessions[i] )
+      {
+         slot= i;
+         break;
+      }
+   }
+   if ( slot < 0 )
    {
+      ERROR("client %p pid %d: too many sub-sessions", client, client->ucred.pid);
       goto exit;
    }
-   
-   msglen= audsrv_conn_peek_u32( client->conn );
-   TRACE2("audsrv_process_message: peeked msglen %d", msglen);
-   if ( msglen+AUDSRV_MSG_HDR_LEN > client->conn->count )
+
+   sub= (AudsrvClient*)calloc( 1, sizeof(AudsrvClient) );
+   if ( !sub )
    {
+      ERROR("unable to allocate sub-session");
       goto exit;
    }
-   
-   audsrv_conn_skip( client->conn, 4 );
-   msgid= audsrv_conn_get_u32( client->conn );
-   version= audsrv_conn_get_u32( client->conn );
-   TRACE2("audsrv_process_message: msglen %d msgid %d version %d", msglen, msgid, version);
-   
-   consumed += AUDSRV_MSG_HDR_LEN;
-      
-   switch( msgid )
+
+   pthread_mutex_init( &sub->mutex, 0 );
+   sub->ctx= ctx;
+   sub->fdSocket= -1;
+   sub->fdWake= -1;
+   sub->ucred= client->ucred;
+   sub->captureParams.version= (unsigned)-1;
+   sub->captureRingFd= -1;
+   sub->captureRingEventFd= -1;
+   sub->parent= client;
+   sub->subSessionId= sessionId;
+
+   sub->conn= audsrv_conn_init_sub( client->conn, sessionId, AUDSRV_MAX_MSG );
+   if ( !sub->conn )
    {
-      case AUDSRV_MSG_Init:
-         consumed += audsrv_process_init( client, msglen, version );
-         break;
-         
-      case AUDSRV_MSG_AudioInfo:
-         consumed += audsrv_process_audioinfo( client, msglen, version );
-         break;
+      ERROR("unable to initialize sub-session connection");
+      pthread_mutex_destroy( &sub->mutex );
+      free( sub );
+      sub= 0;
+      goto exit;
+   }
 
-      case AUDSRV_MSG_Play:
-         consumed += audsrv_process_play( client, msglen, version );
-         break;
+   pthread_mutex_lock( &ctx->mutex );
+   client->subSessions[slot]= sub;
+   ctx->clients.push_back( sub );
+   pthread_mutex_unlock( &ctx->mutex );
 
-      case AUDSRV_MSG_Basetime:
-         consumed += audsrv_process_basetime( client, msglen, version );
-         break;
+   INFO("client %p pid %d: created sub-session %p id %u", client, client->ucred.pid, sub, sessionId);
 
-      case AUDSRV_MSG_Stop:
-         consumed += audsrv_process_stop( client, msglen, version );
-         break;
+exit:
 
-      case AUDSRV_MSG_Pause:
-         consumed += audsrv_process_pause( client, msglen, version );
-         break;
+   return sub;
+}
 
-      case AUDSRV_MSG_UnPause:
-         consumed += audsrv_process_unpause( client, msglen, version );
-         break;
+// Close a sub-session at the request of the client carrying it
+static void audsrv_release_sub_session( AudsrvClient *client, AudsrvClient *sub )
+{
+   AudsrvContext *ctx= client->ctx;
 
-      case AUDSRV_MSG_Flush:
-         consumed += audsrv_process_flush( client, msglen, version );
-         break;
-         
-      case AUDSRV_MSG_AudioSync:
-         consumed += audsrv_process_audiosync( client, msglen, version );
-         break;
-         
-      case AUDSRV_MSG_AudioData:
-         consumed += audsrv_process_audiodata( client, msglen, version );
-         break;
-         
-      case AUDSRV_MSG_AudioDataHandle:
-         consumed += audsrv_process_audiodatahandle( client, msglen, version );
-         break;
- 
-      case AUDSRV_MSG_Mute:
-         consumed += audsrv_process_mute( client, msglen, version );
-         break;
- 
-      case AUDSRV_MSG_UnMute:
-         consumed += audsrv_process_unmute( client, msglen, version );
-         break;
-        
-      case AUDSRV_MSG_Volume:
-         consumed += audsrv_process_volume( client, msglen, version );
-         break;
+   INFO("client %p pid %d: releasing sub-session %p id %u", client, client->ucred.pid, sub, sub->subSessionId);
 
-      case AUDSRV_MSG_EnableSessionEvent:
-         consumed += audsrv_process_enable_session_event( client, msglen, version );
+   pthread_mutex_lock( &ctx->mutex );
+   for( std::vector<AudsrvClient*>::iterator it= ctx->clientsSessionEvent.begin();
+        it != ctx->clientsSessionEvent.end();
+        ++it )
+   {
+      if ( sub == (*it) )
+      {
+         ctx->clientsSessionEvent.erase( it );
          break;
+      }
+   }
+   pthread_mutex_unlock( &ctx->mutex );
 
-      case AUDSRV_MSG_DisableSessionEvent:
-         consumed += audsrv_process_disable_session_event( client, msglen, version );
-         break;
+   audsrv_distribute_session_event( ctx, AUDSRV_SESSIONEVENT_Removed, sub );
 
-      case AUDSRV_MSG_EnableEOS:
-         consumed += audsrv_process_enableeos( client, msglen, version );
-         break;
-        
-      case AUDSRV_MSG_DisableEOS:
-         consumed += audsrv_process_disableeos( client, msglen, version );
-         break;
-        
-      case AUDSRV_MSG_StartCapture:
-         consumed += audsrv_process_startcapture( client, msglen, version );
+   pthread_mutex_lock( &ctx->mutex );
+   for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+        it != ctx->clients.end();
+        ++it )
+   {
+      if ( sub == (*it) )
+      {
+         ctx->clients.erase( it );
          break;
-        
-      case AUDSRV_MSG_StopCapture:
-         consumed += audsrv_process_stopcapture( client, msglen, version );
+      }
+   }
+   for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+   {
+      if ( client->subSessions[i] == sub )
+      {
+         client->subSessions[i]= 0;
          break;
+      }
+   }
+   audsrv_destroy_client( ctx, sub );
+   pthread_mutex_unlock( &ctx->mutex );
+}
 
-      case AUDSRV_MSG_EnumSessions:
-         consumed += audsrv_process_enumsessions( client, msglen, version );
+static AudsrvClient* audsrv_find_sub_session( AudsrvClient *client, unsigned sessionId )
+{
+   AudsrvClient *sub= 0;
+
+   for( int i= 0; i < AUDSRV_MAX_SUBSESSIONS; ++i )
+   {
+      if ( client->subSessions[i] && (client->subSessions[i]->subSessionId == sessionId) )
+      {
+         sub= client->subSessions[i];
+         break;
+      }
+   }
+
+   return sub;
+}
+
+// Apply persisted volume and mute to the global mix (client NULL) or to a
+// newly initialized session with a matching name
+static void audsrv_restore_state( AudsrvContext *ctx, AudsrvClient *client )
+{
+   unsigned flags;
+   float volume;
+   bool muted;
+
+   if ( client )
+   {
+      if ( !client->soc || !client->sessionName[0] )
+      {
+         return;
+      }
+
+      flags= audsrv_state_get( ctx->state, client->sessionName, &volume, &muted );
+      if ( flags & AUDSRV_STATE_Volume )
+      {
+         INFO("restoring volume %f for session (%s)", volume, client->sessionName);
+         if ( !AudioServerSocVolume( client->soc, volume ) )
+         {
+            ERROR("AudioServerSocVolume failed");
+         }
+      }
+      if ( flags & AUDSRV_STATE_Mute )
+      {
+         INFO("restoring mute %d for session (%s)", muted, client->sessionName);
+         if ( !AudioServerSocMute( client->soc, muted ) )
+         {
+            ERROR("AudioServerSocMute %d failed", muted);
+         }
+      }
+   }
+   else
+   {
+      flags= audsrv_state_get( ctx->state, 0, &volume, &muted );
+      if ( flags & AUDSRV_STATE_Volume )
+      {
+         INFO("restoring global volume %f", volume);
+         if ( !AudioServerSocGlobalVolume( ctx->soc, volume ) )
+         {
+            ERROR("AudioServerSocGlobalVolume failed");
+         }
+      }
+      if ( flags & AUDSRV_STATE_Mute )
+      {
+         INFO("restoring global mute %d", muted);
+         if ( !AudioServerSocGlobalMute( ctx->soc, muted ) )
+         {
+            ERROR("AudioServerSocGlobalMute %d failed", muted);
+         }
+      }
+   }
+}
+
+// Open the soc on first use.  Global volume and mute received while it was closed
+// are applied after the persisted state since they are more recent.
+// Must be called with ctx->mutex held.
+static bool audsrv_open_soc( AudsrvContext *ctx )
+{
+   if ( !ctx->soc )
+   {
+      long long t1= getCurrentTimeMicro();
+
+      ctx->soc= AudioServerSocOpen();
+      if ( !ctx->soc )
+      {
+         ERROR("unable to open audioserver-soc");
+         return false;
+      }
+      INFO("opened audioserver-soc in %lld us", getCurrentTimeMicro()-t1);
+
+      audsrv_restore_state( ctx, 0 );
+
+      if ( ctx->globalPendingFlags & AUDSRV_STATE_Volume )
+      {
+         if ( !AudioServerSocGlobalVolume( ctx->soc, ctx->globalPendingVolume ) )
+         {
+            ERROR("AudioServerSocGlobalVolume failed");
+         }
+      }
+      if ( ctx->globalPendingFlags & AUDSRV_STATE_Mute )
+      {
+         if ( !AudioServerSocGlobalMute( ctx->soc, ctx->globalPendingMute ) )
+         {
+            ERROR("AudioServerSocGlobalMute %d failed", ctx->globalPendingMute);
+         }
+      }
+      ctx->globalPendingFlags= 0;
+   }
+
+   return true;
+}
+
+// Must be called with ctx->mutex held
+static void audsrv_set_global_mute( AudsrvContext *ctx, bool mute )
+{
+   if ( ctx->soc )
+   {
+      if ( !AudioServerSocGlobalMute( ctx->soc, mute ) )
+      {
+         ERROR("AudioServerSocGlobalMute %d failed", mute);
+      }
+   }
+   else
+   {
+      TRACE1("soc not open: deferring global mute %d", mute);
+      ctx->globalPendingMute= mute;
+      ctx->globalPendingFlags |= AUDSRV_STATE_Mute;
+   }
+   audsrv_state_set_mute( ctx->state, 0, mute );
+}
+
+// Must be called with ctx->mutex held
+static void audsrv_set_global_volume( AudsrvContext *ctx, float volume )
+{
+   if ( ctx->soc )
+   {
+      if ( !AudioServerSocGlobalVolume( ctx->soc, volume ) )
+      {
+         ERROR("AudioServerSocGlobalVolume failed");
+      }
+   }
+   else
+   {
+      TRACE1("soc not open: deferring global volume %f", volume);
+      ctx->globalPendingVolume= volume;
+      ctx->globalPendingFlags |= AUDSRV_STATE_Volume;
+   }
+   audsrv_state_set_volume( ctx->state, 0, volume );
+}
+
+// Must be called with ctx->mutex held
+static void audsrv_get_global_status( AudsrvContext *ctx, AudSrvSessionStatus *status )
+{
+   if ( ctx->soc )
+   {
+      if ( !AudioServerSocGetStatus( ctx->soc, 0, status ) )
+      {
+         ERROR("msg: getstatus: failed to get global status");
+      }
+   }
+   else
+   {
+      // Report what will be applied when the soc is opened
+      status->globalVolume= 1.0;
+      status->globalMuted= false;
+      audsrv_state_get( ctx->state, 0, &status->globalVolume, &status->globalMuted );
+      if ( ctx->globalPendingFlags & AUDSRV_STATE_Volume )
+      {
+         status->globalVolume= ctx->globalPendingVolume;
+      }
+      if ( ctx->globalPendingFlags & AUDSRV_STATE_Mute )
+      {
+         status->globalMuted= ctx->globalPendingMute;
+      }
+   }
+}
+
+// Session handles are (generation<<16)|slot so a handle resolves by direct
+// indexing and a stale handle never matches a later session in the same slot.
+// Must be called with ctx->mutex held.
+static void audsrv_register_session( AudsrvContext *ctx, AudsrvClient *client )
+{
+   if ( client->sessionHandle )
+   {
+      return;
+   }
+
+   for( int i= 0; i < AUDSRV_MAX_SESSIONS; ++i )
+   {
+      int slot= (ctx->sessionNext+i) % AUDSRV_MAX_SESSIONS;
+      if ( !ctx->sessions[slot] )
+      {
+         if ( ++ctx->sessionGeneration[slot] == 0 )
+         {
+            ctx->sessionGeneration[slot]= 1;
+         }
+         ctx->sessions[slot]= client;
+         ctx->sessionNext= (slot+1) % AUDSRV_MAX_SESSIONS;
+         client->sessionHandle= (((unsigned)ctx->sessionGeneration[slot])<<16)|slot;
+         TRACE1("client %p session handle %X", client, client->sessionHandle);
+         return;
+      }
+   }
+
+   ERROR("no free session slot for client %p: session may only be addressed by name", client);
+}
+
+// Must be called with ctx->mutex held.
+static void audsrv_unregister_session( AudsrvContext *ctx, AudsrvClient *client )
+{
+   if ( client->sessionHandle )
+   {
+      int slot= AUDSRV_SESSION_HANDLE_SLOT(client->sessionHandle);
+      if ( ctx->sessions[slot] == client )
+      {
+         ctx->sessions[slot]= 0;
+      }
+      client->sessionHandle= 0;
+   }
+}
+
+// Must be called with ctx->mutex held.
+static AudsrvClient* audsrv_lookup_session( AudsrvContext *ctx, unsigned sessionHandle )
+{
+   AudsrvClient *client= 0;
+   int slot= AUDSRV_SESSION_HANDLE_SLOT(sessionHandle);
+
+   if ( sessionHandle && (slot < AUDSRV_MAX_SESSIONS) )
+   {
+      client= ctx->sessions[slot];
+      if ( client && (client->sessionHandle != sessionHandle) )
+      {
+         client= 0;
+      }
+   }
+
+   return client;
+}
+
+static AudsrvClient* audsrv_find_session( AudsrvContext *ctx, unsigned sessionHandle )
+{
+   AudsrvClient *client= audsrv_lookup_session( ctx, sessionHandle );
+
+   if ( !client )
+   {
+      ERROR("no session for handle %X", sessionHandle);
+   }
+
+   return client;
+}
+
+// Returns the handle of the only non-observer session with the given name, or 0
+static unsigned audsrv_resolve_session_name( AudsrvContext *ctx, const char *name, int *matchCount )
+{
+   unsigned sessionHandle= 0;
+
+   *matchCount= 0;
+
+   pthread_mutex_lock( &ctx->mutex );
+   for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+        it != ctx->clients.end();
+        ++it )
+   {
+      AudsrvClient *clientIter= (*it);
+
+      pthread_mutex_lock( &clientIter->mutex );
+      if ( (clientIter->sessionType != AUDSRV_SESSION_Observer) && !strcmp( name, clientIter->sessionName ) )
+      {
+         ++(*matchCount);
+         sessionHandle= clientIter->sessionHandle;
+      }
+      pthread_mutex_unlock( &clientIter->mutex );
+   }
+   pthread_mutex_unlock( &ctx->mutex );
+
+   return (*matchCount == 1) ? sessionHandle : 0;
+}
+
+// A client caches the handle it resolved for an attached session name.  Once that session
+// has gone the request falls back to the name, and the client is sent the handle of the
+// session now using the name so it stops sending the stale one.
+static unsigned audsrv_check_session_handle( AudsrvClient *client, unsigned sessionHandle, const char *sessionName )
+{
+   AudsrvContext *ctx= client->ctx;
+   bool found;
+   int matchCount;
+
+   if ( sessionHandle && sessionName )
+   {
+      pthread_mutex_lock( &ctx->mutex );
+      found= (audsrv_lookup_session( ctx, sessionHandle ) != 0);
+      pthread_mutex_unlock( &ctx->mutex );
+
+      if ( !found )
+      {
+         TRACE1("stale session handle %X: using sessionName (%s)", sessionHandle, sessionName);
+         sessionHandle= 0;
+
+         audsrv_send_session_handle( client, AUDSRV_SESSIONHANDLE_Resolve,
+                                     audsrv_resolve_session_name( ctx, sessionName, &matchCount ),
+                                     sessionName );
+      }
+   }
+
+   return sessionHandle;
+}
+
+// Pull mode: while any session has a data request watermark set, poll the queued
+// level of each such session and grant credit when it falls below the watermark.
+static void* audsrv_data_request_thread( void *arg )
+{
+   AudsrvContext *ctx= (AudsrvContext*)arg;
+
+   TRACE1("audsrv_data_request_thread: enter");
+
+   // Besides granting data request credit, each period has the client threads
+   // deliver the data handles the SoC released since the previous one
+   pthread_mutex_lock( &ctx->mutex );
+   while( !ctx->dataRequestStopRequested )
+   {
+      if ( (ctx->dataRequestClientCount > 0) || (ctx->handleReleaseClientCount > 0) )
+      {
+         struct timespec deadline;
+
+         clock_gettime( CLOCK_REALTIME, &deadline );
+         deadline.tv_nsec += AUDSRV_DATA_REQUEST_INTERVAL*1000000;
+         if ( deadline.tv_nsec >= 1000000000 )
+         {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+         }
+         pthread_cond_timedwait( &ctx->dataRequestCond, &ctx->mutex, &deadline );
+      }
+      else
+      {
+         pthread_cond_wait( &ctx->dataRequestCond, &ctx->mutex );
+      }
+
+      if ( ctx->dataRequestStopRequested )
+      {
+         break;
+      }
+
+      for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+           it != ctx->clients.end();
+           ++it )
+      {
+         if ( (*it)->dataRequestWatermark )
+         {
+            // Complete any request a previous period left partly sent
+            audsrv_conn_flush( (*it)->conn, false );
+         }
+         audsrv_check_data_request( (*it) );
+         audsrv_wake_client( (*it) );
+      }
+   }
+   pthread_mutex_unlock( &ctx->mutex );
+
+   TRACE1("audsrv_data_request_thread: exit");
+
+   return NULL;
+}
+
+// Must be called with ctx->mutex held
+static void audsrv_check_data_request( AudsrvClient *client )
+{
+   unsigned bufferedBytes= 0;
+   unsigned credit= 0;
+
+   pthread_mutex_lock( &client->mutex );
+   if ( client->dataRequestWatermark && client->soc )
+   {
+      if ( AudioServerSocGetBufferLevel( client->soc, &bufferedBytes ) )
+      {
+         unsigned target;
+
+         // Credit is granted in the client's sample format
+         bufferedBytes= audsrv_pcm_input_bytes( client->pcmFormat, bufferedBytes );
+         target= 2*client->dataRequestWatermark;
+
+         if ( (bufferedBytes < client->dataRequestWatermark) &&
+              (bufferedBytes + client->dataRequestCredit < target) )
+         {
+            credit= target - bufferedBytes - client->dataRequestCredit;
+            client->dataRequestCredit += credit;
+         }
+      }
+   }
+   pthread_mutex_unlock( &client->mutex );
+
+   if ( credit )
+   {
+      if ( !audsrv_send_data_request( client, credit, bufferedBytes ) )
+      {
+         // Not granted: the next period offers it again
+         pthread_mutex_lock( &client->mutex );
+         client->dataRequestCredit= (credit < client->dataRequestCredit) ? client->dataRequestCredit-credit : 0;
+         pthread_mutex_unlock( &client->mutex );
+      }
+   }
+}
+
+// Must be called with ctx->mutex held
+static void audsrv_wake_client( AudsrvClient *client )
+{
+   bool wake;
+
+   pthread_mutex_lock( &client->mutex );
+   wake= (client->releasedHandleCount > 0);
+   pthread_mutex_unlock( &client->mutex );
+
+   if ( wake )
+   {
+      // Sub-sessions are served by their parent's thread
+      eventfd_write( (client->parent ? client->parent : client)->fdWake, 1 );
+   }
+}
+
+// Must be called from the client thread without client->mutex held
+static void audsrv_flush_released_handles( AudsrvClient *client )
+{
+   int count;
+   unsigned long long *dataHandles;
+
+   pthread_mutex_lock( &client->mutex );
+   count= client->releasedHandleCount;
+   dataHandles= client->releasedHandles;
+   client->releasedHandleCount= 0;
+   client->releasedHandleCapacity= 0;
+   client->releasedHandles= 0;
+   pthread_mutex_unlock( &client->mutex );
+
+   for( int i= 0; i < count; i += AUDSRV_MAX_RELEASED_HANDLES )
+   {
+      int batch= count-i;
+      if ( batch > AUDSRV_MAX_RELEASED_HANDLES )
+      {
+         batch= AUDSRV_MAX_RELEASED_HANDLES;
+      }
+      audsrv_send_handle_release( client, batch, dataHandles+i );
+   }
+
+   if ( dataHandles )
+   {
+      free( dataHandles );
+   }
+}
+
+static int audsrv_process_message( AudsrvClient *client )
+{
+   int consumed= 0;
+   int avail= client->conn->count;
+   unsigned msglen, msgid, version;
+   AudsrvClient *session;
+   
+   if ( avail < AUDSRV_MSG_HDR_LEN )
+   {
+      goto exit;
+   }
+   
+   msglen= audsrv_conn_peek_u32( client->conn );
+   TRACE2("audsrv_process_message: peeked msglen %d", msglen);
+   if ( msglen+AUDSRV_MSG_HDR_LEN > client->conn->count )
+   {
+      goto exit;
+   }
+   
+   audsrv_conn_skip( client->conn, 4 );
+   msgid= audsrv_conn_get_u32( client->conn );
+   version= audsrv_conn_get_u32( client->conn );
+   TRACE2("audsrv_process_message: msglen %d msgid %d version %d", msglen, msgid, version);
+   
+   consumed += AUDSRV_MSG_HDR_LEN;
+
+   client->recvMsgEnd= client->conn->recvTotal - client->conn->count + msglen;
+
+   // Session messages apply to the sub-session last selected on this connection
+   session= client;
+   if ( client->recvSessionId && (msgid != AUDSRV_MSG_SelectSession) && (msgid != AUDSRV_MSG_ReleaseSession) )
+   {
+      session= audsrv_find_sub_session( client, client->recvSessionId );
+      if ( !session )
+      {
+         TRACE1("ignoring msg %d for unknown sub-session %u", msgid, client->recvSessionId);
+         audsrv_conn_skip( client->conn, msglen );
+         consumed += msglen;
+         goto exit;
+      }
+   }
+      
+   switch( msgid )
+   {
+      case AUDSRV_MSG_Init:
+         consumed += audsrv_process_init( session, msglen, version );
+         break;
+         
+      case AUDSRV_MSG_AudioInfo:
+         consumed += audsrv_process_audioinfo( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_Play:
+         consumed += audsrv_process_play( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_Basetime:
+         consumed += audsrv_process_basetime( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_Stop:
+         consumed += audsrv_process_stop( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_Pause:
+         consumed += audsrv_process_pause( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_UnPause:
+         consumed += audsrv_process_unpause( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_Flush:
+         consumed += audsrv_process_flush( session, msglen, version );
+         break;
+         
+      case AUDSRV_MSG_AudioSync:
+         consumed += audsrv_process_audiosync( session, msglen, version );
+         break;
+         
+      case AUDSRV_MSG_AudioData:
+         consumed += audsrv_process_audiodata( session, msglen, version );
+         break;
+         
+      case AUDSRV_MSG_AudioDataHandle:
+         consumed += audsrv_process_audiodatahandle( session, msglen, version );
+         break;
+ 
+      case AUDSRV_MSG_Mute:
+         consumed += audsrv_process_mute( session, msglen, version );
+         break;
+ 
+      case AUDSRV_MSG_UnMute:
+         consumed += audsrv_process_unmute( session, msglen, version );
+         break;
+        
+      case AUDSRV_MSG_Volume:
+         consumed += audsrv_process_volume( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_SessionControl:
+         consumed += audsrv_process_session_control( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EnableSessionEvent:
+         consumed += audsrv_process_enable_session_event( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_DisableSessionEvent:
+         consumed += audsrv_process_disable_session_event( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EnableEOS:
+         consumed += audsrv_process_enableeos( session, msglen, version );
+         break;
+        
+      case AUDSRV_MSG_DisableEOS:
+         consumed += audsrv_process_disableeos( session, msglen, version );
+         break;
+        
+      case AUDSRV_MSG_StartCapture:
+         consumed += audsrv_process_startcapture( session, msglen, version );
+         break;
+        
+      case AUDSRV_MSG_StopCapture:
+         consumed += audsrv_process_stopcapture( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EnumSessions:
+         consumed += audsrv_process_enumsessions( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_GetStatus:
+         consumed += audsrv_process_getstatus( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_GetLatency:
+         consumed += audsrv_process_getlatency( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_ResolveSession:
+         consumed += audsrv_process_resolve_session( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EnableDataRequest:
+         consumed += audsrv_process_enable_data_request( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_SelectSession:
+         consumed += audsrv_process_select_session( client, msglen, version );
+         break;
+
+      case AUDSRV_MSG_ReleaseSession:
+         consumed += audsrv_process_release_session( client, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EnableCaptureRing:
+         consumed += audsrv_process_enable_capture_ring( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EnableHandleRelease:
+         consumed += audsrv_process_enable_handle_release( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EnableDataRing:
+         consumed += audsrv_process_enable_data_ring( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_AudioDataRing:
+         consumed += audsrv_process_audiodataring( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_SetPcmFormat:
+         consumed += audsrv_process_set_pcm_format( session, msglen, version );
+         break;
+
+      case AUDSRV_MSG_EOSDetected:
+      case AUDSRV_MSG_FirstAudio:
+      case AUDSRV_MSG_PtsError:
+      case AUDSRV_MSG_Underflow:
+      case AUDSRV_MSG_CaptureParameters:
+      case AUDSRV_MSG_CaptureData:
+      case AUDSRV_MSG_CaptureDone:
+      case AUDSRV_MSG_EnumSessionsResults:
+      case AUDSRV_MSG_GetStatusResults:
+      case AUDSRV_MSG_SessionEvent:
+      case AUDSRV_MSG_SessionHandle:
+      case AUDSRV_MSG_DataRequest:
+      case AUDSRV_MSG_CaptureRing:
+      case AUDSRV_MSG_CaptureOverrun:
+      case AUDSRV_MSG_GetLatencyResults:
+      case AUDSRV_MSG_HandleRelease:
+      case AUDSRV_MSG_FlushAck:
+         ERROR("ignoring msg %d inappropriate for server to receive", msgid);
+         audsrv_conn_skip( client->conn, msglen );
+         consumed += msglen;
+         break;
+        
+      default:
+         INFO("ignoring unknown command %d len %d", msgid, msglen );
+         audsrv_conn_skip( client->conn, msglen );
+         consumed += msglen;
+         break;
+   }
+   
+exit:
+
+   return consumed;
+}
+
+static int audsrv_process_init( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: init version %d", version);
+   
+   if ( version <= AUDSRV_MSG_Init_Version )
+   {
+      unsigned len, type, value;
+      unsigned sessionType;
+      bool isPrivate;
+      char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
+      char *sessionName= 0;
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( type != AUDSRV_TYPE_U16 )
+      {
+         ERROR("expecting type %d (U16) not type %d for init arg 1 (sessionType)", AUDSRV_TYPE_U16, type );
+         goto exit;
+      }
+
+      value= audsrv_conn_get_u16( client->conn );
+      switch( value )
+      {
+         case AUDSRV_SESSION_Primary:
+         case AUDSRV_SESSION_Secondary:
+         case AUDSRV_SESSION_Effect:
+         case AUDSRV_SESSION_Capture:
+            sessionType= (AUDSRV_SESSIONTYPE)value;
+            break;
+         default:
+            WARNING("unknown sesson type: using secondary");
+            sessionType= AUDSRV_SESSION_Secondary;
+            break;
+      }
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( type != AUDSRV_TYPE_U16 )
+      {
+         ERROR("expecting type %d (U16) not type %d for init arg 2 (isPrivate)", AUDSRV_TYPE_U16, type );
+         goto exit;
+      }
+
+      value= audsrv_conn_get_u16( client->conn );
+      isPrivate= (value ? true : false);
+
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( type != AUDSRV_TYPE_String )
+      {
+         ERROR("expecting type %d (string) not type %d for init arg 3 (sessionName)", AUDSRV_TYPE_String, type );
+         goto exit;
+      }
+      if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+      {
+         ERROR("sessionName too long (%d) for init", len );
+         goto exit;
+      }
+      
+      if ( len )
+      {
+         audsrv_conn_get_string( client->conn, name );
+         sessionName= name;
+      }
+      INFO("sessionType %d sessionName (%s) isPrivate %d", sessionType, sessionName, isPrivate);
+
+      pthread_mutex_lock( &client->ctx->mutex );
+      if ( !audsrv_open_soc( client->ctx ) )
+      {
+         pthread_mutex_unlock( &client->ctx->mutex );
+         goto exit;
+      }
+      pthread_mutex_unlock( &client->ctx->mutex );
+      
+      client->soc= AudioServerSocOpenClient( client->ctx->soc, sessionType, isPrivate, sessionName );
+      if ( !client->soc )
+      {
+         ERROR("AudioServerSocOpenClient failed: sessionType %u", sessionType);
+         goto exit;
+      }
+
+      client->sessionType= sessionType;
+      if ( sessionName )
+      {
+         int len= strlen(sessionName);
+         strncpy( client->sessionName, sessionName, len );
+         client->sessionName[len]= 0;
+      }
+
+      pthread_mutex_lock( &client->ctx->mutex );
+      audsrv_register_session( client->ctx, client );
+      pthread_mutex_unlock( &client->ctx->mutex );
+
+      audsrv_restore_state( client->ctx, client );
+
+      if ( client->sessionHandle )
+      {
+         audsrv_send_session_handle( client, AUDSRV_SESSIONHANDLE_Init, client->sessionHandle, client->sessionName );
+      }
+
+      audsrv_distribute_session_event( client->ctx, AUDSRV_SESSIONEVENT_Added, client );
+
+      AudioServerSocSetFirstAudioFrameCallback( client->soc, audsrv_first_audio_callback, client );
+
+      AudioServerSocSetPTSErrorCallback( client->soc, audsrv_pts_error_callback, client );
+
+      AudioServerSocSetUnderflowCallback( client->soc, audsrv_underflow_callback, client );
+
+      AudioServerSocSetHandleReleaseCallback( client->soc, audsrv_handle_release_callback, client );
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_audioinfo( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: audioinfo version %d", version);
+
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_AudioInfo_Version )
+      {
+         AudSrvAudioInfo audioInfo;
+         unsigned len, type;
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_String )
+         {
+            ERROR("expecting type %d (string) not type %d for audioinfo arg 1 (mimeType)", AUDSRV_TYPE_String, type );
+            goto exit;
+         }
+         if ( len > AUDSRV_MAX_MIME_LEN )
+         {
+            ERROR("mimetype too long (%d) for audioinfo", len );
+            goto exit;
+         }
+         
+         audsrv_conn_get_string( client->conn, audioInfo.mimeType );
+         
+         
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U16 )
+         {
+            ERROR("expecting type %d (U16) not type %d for audioinfo arg 2 (codec)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }
+         
+         audioInfo.codec= audsrv_conn_get_u16( client->conn );
+         
+         
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U16 )
+         {
+            ERROR("expecting type %d (U16) not type %d for audioinfo arg 3 (pid)", AUDSRV_TYPE_U16, type );
+            goto exit;
+         }
+         
+         audioInfo.pid= audsrv_conn_get_u16( client->conn );
+         
+         
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for audioinfo arg 4 (ptsOffset)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+         
+         audioInfo.ptsOffset= audsrv_conn_get_u32( client->conn );
+         
+         
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U64 )
+         {
+            ERROR("expecting type %d (U64) not type %d for audioinfo arg 5 (dataId)", AUDSRV_TYPE_U64, type );
+            goto exit;
+         }
+         
+         audioInfo.dataId= audsrv_conn_get_u64( client->conn );
+
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U64 )
+         {
+            ERROR("expecting type %d (U64) not type %d for audioinfo arg 6 (timingId)", AUDSRV_TYPE_U64, type );
+            goto exit;
+         }
+         
+         audioInfo.timingId= audsrv_conn_get_u64( client->conn );
+
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U64 )
+         {
+            ERROR("expecting type %d (U64) not type %d for audioinfo arg 7 (privateId)", AUDSRV_TYPE_U64, type );
+            goto exit;
+         }
+         
+         audioInfo.privateId= audsrv_conn_get_u64( client->conn );
+
+         
+         TRACE1("audioInfo: codec %d pid 0x%X ptsOffset:%u mimeType(%s) timingId %llX dataId %llX privateId %llX", 
+                 audioInfo.codec, audioInfo.pid, audioInfo.ptsOffset, audioInfo.mimeType, audioInfo.timingId, audioInfo.dataId, audioInfo.privateId );
+         
+         if ( !AudioServerSocSetAudioInfo( client->soc, &audioInfo ) )
+         {
+            ERROR("AudioServerSocSetAudioInfo failed");
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: audioInfo: no soc");
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_basetime( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: basetime version %d", version);
+
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_Basetime_Version )
+      {
+         unsigned len, type;
+         unsigned long long basetime;
+         
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U64 )
+         {
+            ERROR("expecting type %d (U64) not type %d for basetime arg 1 (basetime)", AUDSRV_TYPE_U64, type );
+            goto exit;
+         }
+         
+         basetime= audsrv_conn_get_u64( client->conn );
+         
+         TRACE1("msg: basetime basetime %lld", basetime );
+
+         if ( !AudioServerSocBasetime( client->soc, basetime ) )
+         {
+            ERROR("AudioServerSocBasetime failed");
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: basetime: no soc");
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_play( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: play version %d", version);
+   
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_Play_Version )
+      {
+         if ( !AudioServerSocPlay( client->soc ) )
+         {
+            ERROR("AudioServerSocPlay failed");
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: play: no soc");
+   }
+   
+   return msglen;
+}
+
+static int audsrv_process_stop( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: stop version %d", version);
+   
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_Stop_Version )
+      {
+         if ( !AudioServerSocStop( client->soc ) )
+         {
+            ERROR("AudioServerSocStop failed");
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: stop: no soc");
+   }
+   
+   return msglen;
+}
+
+static int audsrv_process_pause( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: pause version %d", version);
+   
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_Pause_Version )
+      {
+         if ( !AudioServerSocPause( client->soc, true ) )
+         {
+            ERROR("AudioServerSocPause TRUE failed");
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: pause: no soc");
+   }
+   
+   return msglen;
+}
+
+static int audsrv_process_unpause( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: unpause version %d", version);
+   
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_UnPause_Version )
+      {
+         if ( !AudioServerSocPause( client->soc, false ) )
+         {
+            ERROR("AudioServerSocPause FALSE failed");
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: unpause: no soc");
+   }
+   
+   return msglen;
+}
+
+static int audsrv_process_flush( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: flush version %d", version);
+   
+   if ( version <= AUDSRV_MSG_Flush_Version )
+   {
+      unsigned len, type;
+      unsigned generation= 0;
+
+      if ( version >= AUDSRV_MSG_Flush_Version_Generation )
+      {
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for flush arg 1 (generation)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+
+         generation= audsrv_conn_get_u32( client->conn );
+
+         // Usually already known from the look-ahead
+         client->flushGeneration= generation;
+      }
+
+      if ( client->soc )
+      {   
+         if ( !AudioServerSocFlush( client->soc ) )
+         {
+            ERROR("AudioServerSocFlush failed");
+         }
+
+         // A partial sample held for conversion belongs to the discarded data
+         audsrv_pcm_reset( client->pcm );
+
+         // Credit granted before the flush no longer reflects the queued level
+         pthread_mutex_lock( &client->mutex );
+         client->dataRequestCredit= 0;
+         pthread_mutex_unlock( &client->mutex );
+
+         // Return handles discarded by the flush without waiting for the next period
+         audsrv_flush_released_handles( client );
+      }
+      else
+      {
+         ERROR("msg: flush: no soc");
+      }
+
+      if ( version >= AUDSRV_MSG_Flush_Version_Generation )
+      {
+         audsrv_send_flush_ack( client, generation );
+      }
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_audiosync( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: audiosync version %d", version);
+
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_AudioSync_Version )
+      {
+         unsigned len, type;
+         long long thenMicros, nowMicros, diff, diff45KHz;
+         unsigned long long stc;
+         unsigned adjustedStc;
+         
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U64 )
+         {
+            ERROR("expecting type %d (U64) not type %d for audiosync arg 1 (nowMicros)", AUDSRV_TYPE_U64, type );
+            goto exit;
+         }
+         
+         thenMicros= (long long)audsrv_conn_get_u64( client->conn );
+
+         
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U64 )
+         {
+            ERROR("expecting type %d (U64) not type %d for audiosync arg 2 (stc)", AUDSRV_TYPE_U64, type );
+            goto exit;
+         }
+         
+         stc= audsrv_conn_get_u64( client->conn );
+         
+         nowMicros= getCurrentTimeMicro();
+         diff= nowMicros-thenMicros;
+         
+         diff45KHz= ((diff * 45000) / 1000000);
+         
+         adjustedStc= stc + diff45KHz;
+
+         TRACE1("msg: audiosync stc %lld then %lld now %lld diff %lld diff45 %lld stcadj %u", 
+                stc, thenMicros, nowMicros, diff, diff45KHz, adjustedStc);
+         
+         if ( !AudioServerSocAudioSync( client->soc, adjustedStc ) )
+         {
+            ERROR("AudioServerSocAudioSync failed");
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: audiosync: no soc");
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_audiodata( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE3("msg: audiodata version %d", version);
+   
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_AudioData_Version )
+      {
+         unsigned len, type, datalen;
+         unsigned char *data;
+         unsigned generation;
+         
+         if ( version >= AUDSRV_MSG_AudioData_Version_Generation )
+         {
+            len= audsrv_conn_get_u32( client->conn );
+            type= audsrv_conn_get_u32( client->conn );
+
+            if ( type != AUDSRV_TYPE_U32 )
+            {
+               ERROR("expecting type %d (U32) not type %d for audiodata arg 1 (generation)", AUDSRV_TYPE_U32, type );
+               goto exit;
+            }
+
+            generation= audsrv_conn_get_u32( client->conn );
+         }
+         else
+         {
+            generation= client->flushGeneration;
+         }
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_Buffer )
+         {
+            ERROR("expecting type %d (buffer) not type %d for audiodata arg %d (data)", AUDSRV_TYPE_Buffer, type, (version >= AUDSRV_MSG_AudioData_Version_Generation ? 2 : 1) );
+            goto exit;
+         }
+
+         // Checked before any pointer into the receive buffer is taken: the look-ahead may
+         // receive more data
+         if ( audsrv_data_is_stale( client, generation ) )
+         {
+            TRACE2("msg: audiodata: dropping %u bytes of generation %u", len, generation);
+            audsrv_conn_skip( client->conn, len );
+            goto exit;
+         }
+         
+         if ( client->dataRequestWatermark )
+         {
+            pthread_mutex_lock( &client->mutex );
+            client->dataRequestCredit= (len < client->dataRequestCredit) ? client->dataRequestCredit-len : 0;
+            pthread_mutex_unlock( &client->mutex );
+         }
+
+         audsrv_conn_get_buffer( client->conn, len, &data, &datalen );
+         if ( data && datalen )
+         {
+            audsrv_play_data( client, data, datalen );
+            len -= datalen;
+         }
+
+         if ( len )
+         {
+            audsrv_conn_get_buffer( client->conn, len, &data, &datalen );
+            if ( data && datalen )
+            {
+               audsrv_play_data( client, data, datalen );
+            }
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: audiodata: no soc");
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static void audsrv_play_data( AudsrvClient *client, unsigned char *data, unsigned datalen )
+{
+   if ( client->pcm )
+   {
+      datalen= audsrv_pcm_convert( client->pcm, data, datalen, &data );
+   }
+
+   if ( datalen && !AudioServerSocAudioData( client->soc, data, datalen ) )
+   {
+      ERROR("AudioServerSocData failed");
+   }
+}
+
+// Look ahead through messages already received, and any waiting on the socket, for flushes
+// not yet reached so the data they discard is dropped rather than played.  The scan resumes
+// where it last stopped and tracks session selection as it goes.
+static void audsrv_scan_flush( AudsrvClient *client )
+{
+   AudsrvConn *conn= client->conn;
+   long long now;
+
+   if ( client->scanPos < client->recvMsgEnd )
+   {
+      client->scanPos= client->recvMsgEnd;
+      client->scanSessionId= client->recvSessionId;
+   }
+
+   audsrv_scan_flush_buffered( client );
+
+   // Looking into the socket costs a system call, so do it at most once per interval rather
+   // than for every data message
+   now= getCurrentTimeMicro();
+   if ( now-client->scanSocketTime >= AUDSRV_FLUSH_SCAN_INTERVAL )
+   {
+      client->scanSocketTime= now;
+      if ( audsrv_conn_recv_nonblocking( conn ) > 0 )
+      {
+         audsrv_scan_flush_buffered( client );
+      }
+   }
+}
+
+static void audsrv_scan_flush_buffered( AudsrvClient *client )
+{
+   AudsrvConn *conn= client->conn;
+   AudsrvClient *session;
+   unsigned long long headPos;
+   unsigned msglen, msgid, version;
+   int offset;
+
+   headPos= conn->recvTotal - conn->count;
+   while( client->scanPos + AUDSRV_MSG_HDR_LEN <= conn->recvTotal )
+   {
+      offset= (int)(client->scanPos - headPos);
+      msglen= audsrv_conn_peek_u32_at( conn, offset );
+      if ( client->scanPos + AUDSRV_MSG_HDR_LEN + msglen > conn->recvTotal )
+      {
          break;
+      }
+      msgid= audsrv_conn_peek_u32_at( conn, offset+4 );
+      version= audsrv_conn_peek_u32_at( conn, offset+8 );
+
+      if ( msglen >= AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN )
+      {
+         if ( msgid == AUDSRV_MSG_SelectSession )
+         {
+            client->scanSessionId= audsrv_conn_peek_u32_at( conn, offset+AUDSRV_MSG_HDR_LEN+AUDSRV_MSG_TYPE_HDR_LEN );
+         }
+         else if ( (msgid == AUDSRV_MSG_Flush) && (version >= AUDSRV_MSG_Flush_Version_Generation) )
+         {
+            session= (client->scanSessionId ? audsrv_find_sub_session( client, client->scanSessionId ) : client);
+            if ( session )
+            {
+               session->flushGeneration= audsrv_conn_peek_u32_at( conn, offset+AUDSRV_MSG_HDR_LEN+AUDSRV_MSG_TYPE_HDR_LEN );
+               TRACE2("audsrv_scan_flush: session %p flush generation %u ahead", session, session->flushGeneration);
+            }
+         }
+      }
+
+      client->scanPos += AUDSRV_MSG_HDR_LEN + msglen;
+   }
+}
+
+// Data is stale when it was sent before a flush the server has seen, whether processed or
+// only found by the look-ahead
+static bool audsrv_data_is_stale( AudsrvClient *session, unsigned generation )
+{
+   audsrv_scan_flush( session->parent ? session->parent : session );
+
+   return ((int)(generation - session->flushGeneration) < 0);
+}
+
+static int audsrv_process_audiodatahandle( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE3("msg: audiodatahandle version %d", version);
+   
+   if ( client->soc )
+   {   
+      if ( version <= AUDSRV_MSG_AudioDataHandle_Version )
+      {
+         unsigned len, type;
+         unsigned long long dataHandle;
+         unsigned generation;
+         
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+         
+         if ( type != AUDSRV_TYPE_U64 )
+         {
+            ERROR("expecting type %d (U64) not type %d for audiodatahandle arg 1 (dataHandle)", AUDSRV_TYPE_U64, type );
+            goto exit;
+         }
+
+         dataHandle= audsrv_conn_get_u64( client->conn );
+
+         if ( version >= AUDSRV_MSG_AudioDataHandle_Version_Generation )
+         {
+            len= audsrv_conn_get_u32( client->conn );
+            type= audsrv_conn_get_u32( client->conn );
+
+            if ( type != AUDSRV_TYPE_U32 )
+            {
+               ERROR("expecting type %d (U32) not type %d for audiodatahandle arg 2 (generation)", AUDSRV_TYPE_U32, type );
+               goto exit;
+            }
+
+            generation= audsrv_conn_get_u32( client->conn );
+
+            if ( audsrv_data_is_stale( client, generation ) )
+            {
+               // Returned as if the SoC had flushed it
+               TRACE2("msg: audiodatahandle: dropping handle %llx of generation %u", dataHandle, generation);
+               audsrv_handle_release_callback( client, dataHandle );
+               goto exit;
+            }
+         }
+
+         if ( !AudioServerSocAudioDataHandle( client->soc, dataHandle ) )
+         {
+            ERROR("AudioServerSocDataHandle failed" );
+         }
+      }
+   }
+   else
+   {
+      ERROR("msg: audiodata: no soc");
+   }
+
+exit:
+   
+   return msglen;
+}
+
+static int audsrv_process_audiodataring( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE3("msg: audiodataring version %d", version);
+
+   if ( version <= AUDSRV_MSG_AudioDataRing_Version )
+   {
+      unsigned len, type;
+      unsigned offset, datalen;
+      unsigned long long sequence;
+      unsigned generation;
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+
+      if ( type != AUDSRV_TYPE_U32 )
+      {
+         ERROR("expecting type %d (U32) not type %d for audiodataring arg 1 (offset)", AUDSRV_TYPE_U32, type );
+         goto exit;
+      }
+
+      offset= audsrv_conn_get_u32( client->conn );
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+
+      if ( type != AUDSRV_TYPE_U32 )
+      {
+         ERROR("expecting type %d (U32) not type %d for audiodataring arg 2 (len)", AUDSRV_TYPE_U32, type );
+         goto exit;
+      }
+
+      datalen= audsrv_conn_get_u32( client->conn );
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+
+      if ( type != AUDSRV_TYPE_U64 )
+      {
+         ERROR("expecting type %d (U64) not type %d for audiodataring arg 3 (sequence)", AUDSRV_TYPE_U64, type );
+         goto exit;
+      }
+
+      sequence= audsrv_conn_get_u64( client->conn );
+
+      generation= client->flushGeneration;
+      if ( version >= AUDSRV_MSG_AudioDataRing_Version_Generation )
+      {
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for audiodataring arg 4 (generation)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+
+         generation= audsrv_conn_get_u32( client->conn );
+      }
+
+      if ( !client->dataRing )
+      {
+         ERROR("msg: audiodataring: no data ring");
+         goto exit;
+      }
+
+      // Bounds are checked against the size captured at map time, not the shared header
+      if ( (datalen > client->dataRingSize) || (offset > client->dataRingSize-datalen) )
+      {
+         ERROR("msg: audiodataring: range %u+%u outside ring of %u bytes", offset, datalen, client->dataRingSize);
+      }
+      else if ( audsrv_data_is_stale( client, generation ) )
+      {
+         TRACE2("msg: audiodataring: dropping %u bytes of generation %u", datalen, generation);
+      }
+      else if ( client->soc )
+      {
+         if ( client->dataRequestWatermark )
+         {
+            pthread_mutex_lock( &client->mutex );
+            client->dataRequestCredit= (datalen < client->dataRequestCredit) ? client->dataRequestCredit-datalen : 0;
+            pthread_mutex_unlock( &client->mutex );
+         }
+
+         if ( datalen )
+         {
+            // Conversion writes to the converter's buffer, never back into the shared ring
+            audsrv_play_data( client, AUDSRV_DATA_RING_DATA(client->dataRing)+offset, datalen );
+         }
+      }
+      else
+      {
+         ERROR("msg: audiodataring: no soc");
+      }
+
+      // The range is released even when it could not be played so the client never stalls on it
+      __sync_synchronize();
+      client->dataRing->consumed= sequence;
+   }
+
+exit:
+
+   return msglen;
+}
+
+static int audsrv_process_mute( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: mute version %d", version);
+
+   if ( version <= AUDSRV_MSG_Mute_Version )
+   {
+      unsigned len, type;
+      unsigned global;
+      unsigned sessionHandle= 0;
+      char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
+      char *sessionName= 0;
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( type != AUDSRV_TYPE_U16 )
+      {
+         ERROR("expecting type %d (U16) not type %d for audio mute arg 1 (global)", AUDSRV_TYPE_U16, type );
+         goto exit;
+      }
+
+      global= audsrv_conn_get_u16( client->conn );
+
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( version >= AUDSRV_MSG_Mute_Version_Handle )
+      {
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for audio mute arg 2 (sessionHandle)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+
+         sessionHandle= audsrv_conn_get_u32( client->conn );
+
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+      }
+
+      if ( type != AUDSRV_TYPE_String )
+      {
+         ERROR("expecting type %d (string) not type %d for audio mute arg 2 (sessionName)", AUDSRV_TYPE_String, type );
+         goto exit;
+      }
+      if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+      {
+         ERROR("sessionName too long (%d) for audio mute", len );
+         goto exit;
+      }
+      
+      if ( len )
+      {
+         audsrv_conn_get_string( client->conn, name );
+         sessionName= name;
+      }
+
+      sessionHandle= audsrv_check_session_handle( client, sessionHandle, sessionName );
+
+      if ( global )
+      {            
+         AudsrvContext *ctx= client->ctx;
+         pthread_mutex_lock( &ctx->mutex );
+         audsrv_set_global_mute( ctx, true );
+         pthread_mutex_unlock( &ctx->mutex );
+      }
+      else
+      {
+         if ( sessionHandle )
+         {
+            TRACE1("msg: mute sessionHandle %X", sessionHandle);
+
+            AudsrvContext *ctx= client->ctx;
+
+            pthread_mutex_lock( &ctx->mutex );
+            AudsrvClient *clientTarget= audsrv_find_session( ctx, sessionHandle );
+            if ( clientTarget )
+            {
+               pthread_mutex_lock( &clientTarget->mutex );
+               if ( clientTarget->soc )
+               {
+                  if ( !AudioServerSocMute( clientTarget->soc, true ) )
+                  {
+                     ERROR("AudioServerSocMute TRUE failed");
+                  }
+                  audsrv_state_set_mute( client->ctx->state, clientTarget->sessionName, true );
+               }
+               else
+               {
+                  ERROR("msg: mute: no soc");
+               }
+               pthread_mutex_unlock( &clientTarget->mutex );
+            }
+            pthread_mutex_unlock( &ctx->mutex );
+         }
+         else if ( sessionName )
+         {
+            TRACE1("msg: mute sessionName (%s)", sessionName);
 
-      case AUDSRV_MSG_GetStatus:
-         consumed += audsrv_process_getstatus( client, msglen, version );
-         break;
+            AudsrvContext *ctx= client->ctx;
 
-      case AUDSRV_MSG_EOSDetected:
-      case AUDSRV_MSG_FirstAudio:
-      case AUDSRV_MSG_PtsError:
-      case AUDSRV_MSG_Underflow:
-      case AUDSRV_MSG_CaptureParameters:
-      case AUDSRV_MSG_CaptureData:
-      case AUDSRV_MSG_CaptureDone:
-      case AUDSRV_MSG_EnumSessionsResults:
-      case AUDSRV_MSG_GetStatusResults:
-      case AUDSRV_MSG_SessionEvent:
-         ERROR("ignoring msg %d inappropriate for server to receive", msgid);
-         audsrv_conn_skip( client->conn, msglen );
-         consumed += msglen;
-         break;
-        
-      default:
-         INFO("ignoring unknown command %d len %d", msgid, msglen );
-         audsrv_conn_skip( client->conn, msglen );
-         consumed += msglen;
-         break;
+            pthread_mutex_lock( &ctx->mutex );
+            for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+                 it != ctx->clients.end();
+                 ++it )
+            {
+               AudsrvClient *clientIter= (*it);
+
+               pthread_mutex_lock( &clientIter->mutex );
+               if ( !strcmp( sessionName, clientIter->sessionName ) )
+               {
+                  if ( clientIter->soc )
+                  {   
+                     if ( !AudioServerSocMute( clientIter->soc, true ) )
+                     {
+                        ERROR("AudioServerSocMute TRUE failed");
+                     }
+                     audsrv_state_set_mute( client->ctx->state, clientIter->sessionName, true );
+                  }
+                  else
+                  {
+                     ERROR("msg: mute: no soc");
+                  }
+               }
+               pthread_mutex_unlock( &clientIter->mutex );
+            }
+            pthread_mutex_unlock( &ctx->mutex );
+         }
+         else
+         {
+            if ( client->soc )
+            {   
+               if ( !AudioServerSocMute( client->soc, true ) )
+               {
+                  ERROR("AudioServerSocMute TRUE failed");
+               }
+               audsrv_state_set_mute( client->ctx->state, client->sessionName, true );
+            }
+            else
+            {
+               ERROR("msg: mute: no soc");
+            }
+         }
+      }
    }
-   
-exit:
 
-   return consumed;
+exit:   
+
+   return msglen;
 }
 
-static int audsrv_process_init( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_unmute( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: init version %d", version);
-   
-   if ( version <= AUDSRV_MSG_Init_Version )
+   TRACE1("msg: unmute version %d", version);
+
+   if ( version <= AUDSRV_MSG_UnMute_Version )
    {
-      unsigned len, type, value;
-      unsigned sessionType;
-      bool isPrivate;
+      unsigned len, type;
+      unsigned global;
+      unsigned sessionHandle= 0;
       char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
       char *sessionName= 0;
 
@@ -883,23 +2790,187 @@ static int audsrv_process_init( AudsrvClient *client, unsigned msglen, unsigned
       
       if ( type != AUDSRV_TYPE_U16 )
       {
-         ERROR("expecting type %d (U16) not type %d for init arg 1 (sessionType)", AUDSRV_TYPE_U16, type );
+         ERROR("expecting type %d (U16) not type %d for audio unmute arg 1 (global)", AUDSRV_TYPE_U16, type );
          goto exit;
       }
 
-      value= audsrv_conn_get_u16( client->conn );
-      switch( value )
+      global= audsrv_conn_get_u16( client->conn );
+
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( version >= AUDSRV_MSG_UnMute_Version_Handle )
       {
-         case AUDSRV_SESSION_Primary:
-         case AUDSRV_SESSION_Secondary:
-         case AUDSRV_SESSION_Effect:
-         case AUDSRV_SESSION_Capture:
-            sessionType= (AUDSRV_SESSIONTYPE)value;
-            break;
-         default:
-            WARNING("unknown sesson type: using secondary");
-            sessionType= AUDSRV_SESSION_Secondary;
-            break;
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for audio unmute arg 2 (sessionHandle)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+
+         sessionHandle= audsrv_conn_get_u32( client->conn );
+
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+      }
+
+      if ( type != AUDSRV_TYPE_String )
+      {
+         ERROR("expecting type %d (string) not type %d for audio unmute arg 2 (sessionName)", AUDSRV_TYPE_String, type );
+         goto exit;
+      }
+      if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+      {
+         ERROR("sessionName too long (%d) for audio unmute", len );
+         goto exit;
+      }
+      
+      if ( len )
+      {
+         audsrv_conn_get_string( client->conn, name );
+         sessionName= name;
+      }
+
+      sessionHandle= audsrv_check_session_handle( client, sessionHandle, sessionName );
+
+      if ( global )
+      {            
+         AudsrvContext *ctx= client->ctx;
+         pthread_mutex_lock( &ctx->mutex );
+         audsrv_set_global_mute( ctx, false );
+         pthread_mutex_unlock( &ctx->mutex );
+      }
+      else
+      {
+         if ( sessionHandle )
+         {
+            TRACE1("msg: unmute sessionHandle %X", sessionHandle);
+
+            AudsrvContext *ctx= client->ctx;
+
+            pthread_mutex_lock( &ctx->mutex );
+            AudsrvClient *clientTarget= audsrv_find_session( ctx, sessionHandle );
+            if ( clientTarget )
+            {
+               pthread_mutex_lock( &clientTarget->mutex );
+               if ( clientTarget->soc )
+               {
+                  if ( !AudioServerSocMute( clientTarget->soc, false ) )
+                  {
+                     ERROR("AudioServerSocMute FALSE failed");
+                  }
+                  audsrv_state_set_mute( client->ctx->state, clientTarget->sessionName, false );
+               }
+               else
+               {
+                  ERROR("msg: unmute: no soc");
+               }
+               pthread_mutex_unlock( &clientTarget->mutex );
+            }
+            pthread_mutex_unlock( &ctx->mutex );
+         }
+         else if ( sessionName )
+         {
+            TRACE1("msg: unmute sessionName (%s)", sessionName);
+
+            AudsrvContext *ctx= client->ctx;
+
+            pthread_mutex_lock( &ctx->mutex );
+            for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+                 it != ctx->clients.end();
+                 ++it )
+            {
+               AudsrvClient *clientIter= (*it);
+
+               pthread_mutex_lock( &clientIter->mutex );
+               if ( !strcmp( sessionName, clientIter->sessionName ) )
+               {
+                  if ( clientIter->soc )
+                  {   
+                     if ( !AudioServerSocMute( clientIter->soc, false ) )
+                     {
+                        ERROR("AudioServerSocMute FALSE failed");
+                     }
+                     audsrv_state_set_mute( client->ctx->state, clientIter->sessionName, false );
+                  }
+                  else
+                  {
+                     ERROR("msg: unmute: no soc");
+                  }
+               }
+               pthread_mutex_unlock( &clientIter->mutex );
+            }
+            pthread_mutex_unlock( &ctx->mutex );
+         }
+         else
+         {
+            if ( client->soc )
+            {   
+               if ( !AudioServerSocMute( client->soc, false ) )
+               {
+                  ERROR("AudioServerSocMute FALSE failed");
+               }
+               audsrv_state_set_mute( client->ctx->state, client->sessionName, false );
+            }
+            else
+            {
+               ERROR("msg: unmute: no soc");
+            }
+         }
+      }
+   }
+
+exit:   
+
+   return msglen;
+}
+
+static int audsrv_process_volume( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: volume version %d", version);
+
+   if ( version <= AUDSRV_MSG_Volume_Version )
+   {
+      unsigned len, type;
+      unsigned numerator, denominator;
+      float volume= 1.0;
+      unsigned global;
+      unsigned sessionHandle= 0;
+      char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
+      char *sessionName= 0;
+      
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( type != AUDSRV_TYPE_U32 )
+      {
+         ERROR("expecting type %d (U32) not type %d for volume arg 1 (numerator)", AUDSRV_TYPE_U32, type );
+         goto exit;
+      }
+      
+      numerator= audsrv_conn_get_u32( client->conn );
+
+      
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( type != AUDSRV_TYPE_U32 )
+      {
+         ERROR("expecting type %d (U32) not type %d for volume arg 2 (denominator)", AUDSRV_TYPE_U32, type );
+         goto exit;
+      }
+      
+      denominator= audsrv_conn_get_u32( client->conn );
+      
+      if ( denominator == 0 )
+      {
+         ERROR("volume denominator is 0 - setting volume to 1.0");            
+      }
+      else
+      {
+         volume= (float)numerator/(float)denominator;
+         TRACE1("msg: volume (%u/%u) = %f", numerator, denominator, volume );
       }
 
       len= audsrv_conn_get_u32( client->conn );
@@ -907,25 +2978,39 @@ static int audsrv_process_init( AudsrvClient *client, unsigned msglen, unsigned
       
       if ( type != AUDSRV_TYPE_U16 )
       {
-         ERROR("expecting type %d (U16) not type %d for init arg 2 (isPrivate)", AUDSRV_TYPE_U16, type );
+         ERROR("expecting type %d (U16) not type %d for audio volume arg 3 (global)", AUDSRV_TYPE_U16, type );
          goto exit;
       }
 
-      value= audsrv_conn_get_u16( client->conn );
-      isPrivate= (value ? true : false);
+      global= audsrv_conn_get_u16( client->conn );
 
 
       len= audsrv_conn_get_u32( client->conn );
       type= audsrv_conn_get_u32( client->conn );
       
+      if ( version >= AUDSRV_MSG_Volume_Version_Handle )
+      {
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for audio volume arg 4 (sessionHandle)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+
+         sessionHandle= audsrv_conn_get_u32( client->conn );
+
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+      }
+
       if ( type != AUDSRV_TYPE_String )
       {
-         ERROR("expecting type %d (string) not type %d for init arg 3 (sessionName)", AUDSRV_TYPE_String, type );
+         ERROR("expecting type %d (string) not type %d for audio volume arg 4 (sessionName)", AUDSRV_TYPE_String, type );
          goto exit;
       }
       if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
       {
-         ERROR("sessionName too long (%d) for init", len );
+         ERROR("sessionName too long (%d) for audio volume", len );
          goto exit;
       }
       
@@ -934,30 +3019,94 @@ static int audsrv_process_init( AudsrvClient *client, unsigned msglen, unsigned
          audsrv_conn_get_string( client->conn, name );
          sessionName= name;
       }
-      INFO("sessionType %d sessionName (%s) isPrivate %d", sessionType, sessionName, isPrivate);
-      
-      client->soc= AudioServerSocOpenClient( client->ctx->soc, sessionType, isPrivate, sessionName );
-      if ( !client->soc )
-      {
-         ERROR("AudioServerSocOpenClient failed: sessionType %u", sessionType);
-         goto exit;
-      }
 
-      client->sessionType= sessionType;
-      if ( sessionName )
+      sessionHandle= audsrv_check_session_handle( client, sessionHandle, sessionName );
+
+      if ( global )
       {
-         int len= strlen(sessionName);
-         strncpy( client->sessionName, sessionName, len );
-         client->sessionName[len]= 0;
+         AudsrvContext *ctx= client->ctx;
+         pthread_mutex_lock( &ctx->mutex );
+         audsrv_set_global_volume( ctx, volume );
+         pthread_mutex_unlock( &ctx->mutex );
       }
+      else
+      {
+         if ( sessionHandle )
+         {
+            TRACE1("msg: volume sessionHandle %X", sessionHandle);
 
-      audsrv_distribute_session_event( client->ctx, AUDSRV_SESSIONEVENT_Added, client );
+            AudsrvContext *ctx= client->ctx;
 
-      AudioServerSocSetFirstAudioFrameCallback( client->soc, audsrv_first_audio_callback, client );
+            pthread_mutex_lock( &ctx->mutex );
+            AudsrvClient *clientTarget= audsrv_find_session( ctx, sessionHandle );
+            if ( clientTarget )
+            {
+               pthread_mutex_lock( &clientTarget->mutex );
+               if ( clientTarget->soc )
+               {
+                  if ( !AudioServerSocVolume( clientTarget->soc, volume ) )
+                  {
+                     ERROR("AudioServerSocVolume failed");
+                  }
+                  audsrv_state_set_volume( client->ctx->state, clientTarget->sessionName, volume );
+               }
+               else
+               {
+                  ERROR("msg: volume: no soc");
+               }
+               pthread_mutex_unlock( &clientTarget->mutex );
+            }
+            pthread_mutex_unlock( &ctx->mutex );
+         }
+         else if ( sessionName )
+         {
+            TRACE1("msg: volume sessionName (%s)", sessionName);
 
-      AudioServerSocSetPTSErrorCallback( client->soc, audsrv_pts_error_callback, client );
+            AudsrvContext *ctx= client->ctx;
 
-      AudioServerSocSetUnderflowCallback( client->soc, audsrv_underflow_callback, client );
+            pthread_mutex_lock( &ctx->mutex );
+            for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+                 it != ctx->clients.end();
+                 ++it )
+            {
+               AudsrvClient *clientIter= (*it);
+
+               pthread_mutex_lock( &clientIter->mutex );
+               if ( !strcmp( sessionName, clientIter->sessionName ) )
+               {
+                  if ( clientIter->soc )
+                  {   
+                     if ( !AudioServerSocVolume( clientIter->soc, volume ) )
+                     {
+                        ERROR("AudioServerSocVolume failed");
+                     }
+                     audsrv_state_set_volume( client->ctx->state, clientIter->sessionName, volume );
+                  }
+                  else
+                  {
+                     ERROR("msg: volume: no soc");
+                  }
+               }
+               pthread_mutex_unlock( &clientIter->mutex );
+            }
+            pthread_mutex_unlock( &ctx->mutex );
+         }
+         else
+         {
+            if ( client->soc )
+            {   
+               if ( !AudioServerSocVolume( client->soc, volume ) )
+               {
+                  ERROR("AudioServerSocVolume failed");
+               }
+               audsrv_state_set_volume( client->ctx->state, client->sessionName, volume );
+            }
+            else
+            {
+               ERROR("msg: volume: no soc");
+            }
+         }
+      }
    }
 
 exit:
@@ -965,569 +3114,702 @@ exit:
    return msglen;
 }
 
-static int audsrv_process_audioinfo( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_session_control( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: audioinfo version %d", version);
+   TRACE1("msg: sessioncontrol version %d", version);
 
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_AudioInfo_Version )
+   int startCount= audsrv_conn_recv_count( client->conn );
+
+   if ( version <= AUDSRV_MSG_SessionControl_Version )
+   {
+      unsigned len, type;
+      unsigned count, numerator, denominator;
+      AudsrvSessionControl controls[AUDSRV_MAX_SESSION_CONTROLS];
+      AudsrvContext *ctx= client->ctx;
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+
+      if ( type != AUDSRV_TYPE_U32 )
       {
-         AudSrvAudioInfo audioInfo;
-         unsigned len, type;
+         ERROR("expecting type %d (U32) not type %d for session control arg 1 (count)", AUDSRV_TYPE_U32, type );
+         goto exit;
+      }
+
+      count= audsrv_conn_get_u32( client->conn );
+      if ( count > AUDSRV_MAX_SESSION_CONTROLS )
+      {
+         ERROR("too many operations (%u) for session control", count );
+         goto exit;
+      }
+
+      // Parse the complete list before applying anything so a malformed
+      // message leaves the mix untouched
+      for( unsigned i= 0; i < count; ++i )
+      {
+         AudsrvSessionControl *control= &controls[i];
 
          len= audsrv_conn_get_u32( client->conn );
          type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_String )
-         {
-            ERROR("expecting type %d (string) not type %d for audioinfo arg 1 (mimeType)", AUDSRV_TYPE_String, type );
-            goto exit;
-         }
-         if ( len > AUDSRV_MAX_MIME_LEN )
-         {
-            ERROR("mimetype too long (%d) for audioinfo", len );
-            goto exit;
-         }
-         
-         audsrv_conn_get_string( client->conn, audioInfo.mimeType );
-         
-         
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
-         
+
          if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("expecting type %d (U16) not type %d for audioinfo arg 2 (codec)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U16) not type %d for session control %u (flags)", AUDSRV_TYPE_U16, type, i );
             goto exit;
          }
-         
-         audioInfo.codec= audsrv_conn_get_u16( client->conn );
-         
-         
+
+         control->flags= audsrv_conn_get_u16( client->conn );
+
+
          len= audsrv_conn_get_u32( client->conn );
          type= audsrv_conn_get_u32( client->conn );
-         
+
          if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("expecting type %d (U16) not type %d for audioinfo arg 3 (pid)", AUDSRV_TYPE_U16, type );
+            ERROR("expecting type %d (U16) not type %d for session control %u (mute)", AUDSRV_TYPE_U16, type, i );
             goto exit;
          }
-         
-         audioInfo.pid= audsrv_conn_get_u16( client->conn );
-         
-         
+
+         control->mute= (audsrv_conn_get_u16( client->conn ) ? true : false);
+
+
          len= audsrv_conn_get_u32( client->conn );
          type= audsrv_conn_get_u32( client->conn );
-         
+
          if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U32) not type %d for audioinfo arg 4 (ptsOffset)", AUDSRV_TYPE_U32, type );
+            ERROR("expecting type %d (U32) not type %d for session control %u (numerator)", AUDSRV_TYPE_U32, type, i );
             goto exit;
          }
-         
-         audioInfo.ptsOffset= audsrv_conn_get_u32( client->conn );
-         
-         
+
+         numerator= audsrv_conn_get_u32( client->conn );
+
+
          len= audsrv_conn_get_u32( client->conn );
          type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
+
+         if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (U64) not type %d for audioinfo arg 5 (dataId)", AUDSRV_TYPE_U64, type );
+            ERROR("expecting type %d (U32) not type %d for session control %u (denominator)", AUDSRV_TYPE_U32, type, i );
             goto exit;
          }
-         
-         audioInfo.dataId= audsrv_conn_get_u64( client->conn );
 
+         denominator= audsrv_conn_get_u32( client->conn );
 
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
+         control->volume= 1.0;
+         if ( denominator == 0 )
          {
-            ERROR("expecting type %d (U64) not type %d for audioinfo arg 6 (timingId)", AUDSRV_TYPE_U64, type );
-            goto exit;
+            if ( control->flags & AUDSRV_SESSIONCONTROL_Volume )
+            {
+               ERROR("session control %u: volume denominator is 0 - setting volume to 1.0", i);
+            }
+         }
+         else
+         {
+            control->volume= (float)numerator/(float)denominator;
          }
-         
-         audioInfo.timingId= audsrv_conn_get_u64( client->conn );
 
 
          len= audsrv_conn_get_u32( client->conn );
          type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
+
+         if ( type != AUDSRV_TYPE_String )
          {
-            ERROR("expecting type %d (U64) not type %d for audioinfo arg 7 (privateId)", AUDSRV_TYPE_U64, type );
+            ERROR("expecting type %d (string) not type %d for session control %u (sessionName)", AUDSRV_TYPE_String, type, i );
             goto exit;
          }
-         
-         audioInfo.privateId= audsrv_conn_get_u64( client->conn );
-
-         
-         TRACE1("audioInfo: codec %d pid 0x%X ptsOffset:%u mimeType(%s) timingId %llX dataId %llX privateId %llX", 
-                 audioInfo.codec, audioInfo.pid, audioInfo.ptsOffset, audioInfo.mimeType, audioInfo.timingId, audioInfo.dataId, audioInfo.privateId );
-         
-         if ( !AudioServerSocSetAudioInfo( client->soc, &audioInfo ) )
+         if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
          {
-            ERROR("AudioServerSocSetAudioInfo failed");
+            ERROR("sessionName too long (%d) for session control %u", len, i );
+            goto exit;
          }
-      }
-   }
-   else
-   {
-      ERROR("msg: audioInfo: no soc");
-   }
-
-exit:
-   
-   return msglen;
-}
-
-static int audsrv_process_basetime( AudsrvClient *client, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: basetime version %d", version);
 
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_Basetime_Version )
-      {
-         unsigned len, type;
-         unsigned long long basetime;
-         
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
+         control->sessionName= 0;
+         if ( len )
          {
-            ERROR("expecting type %d (U64) not type %d for basetime arg 1 (basetime)", AUDSRV_TYPE_U64, type );
-            goto exit;
+            audsrv_conn_get_string( client->conn, control->name );
+            control->sessionName= control->name;
          }
-         
-         basetime= audsrv_conn_get_u64( client->conn );
-         
-         TRACE1("msg: basetime basetime %lld", basetime );
 
-         if ( !AudioServerSocBasetime( client->soc, basetime ) )
+         TRACE1("msg: sessioncontrol %u: flags 0x%X mute %d volume %f sessionName (%s)",
+                i, control->flags, control->mute, control->volume, control->sessionName );
+      }
+
+      pthread_mutex_lock( &ctx->mutex );
+
+      for( unsigned i= 0; i < count; ++i )
+      {
+         AudsrvSessionControl *control= &controls[i];
+
+         if ( control->flags & AUDSRV_SESSIONCONTROL_Global )
          {
-            ERROR("AudioServerSocBasetime failed");
+            if ( control->flags & AUDSRV_SESSIONCONTROL_Volume )
+            {
+               audsrv_set_global_volume( ctx, control->volume );
+            }
+            if ( control->flags & AUDSRV_SESSIONCONTROL_Mute )
+            {
+               audsrv_set_global_mute( ctx, control->mute );
+            }
          }
       }
-   }
-   else
-   {
-      ERROR("msg: basetime: no soc");
-   }
-
-exit:
-   
-   return msglen;
-}
 
-static int audsrv_process_play( AudsrvClient *client, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: play version %d", version);
-   
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_Play_Version )
+      for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+           it != ctx->clients.end();
+           ++it )
       {
-         if ( !AudioServerSocPlay( client->soc ) )
+         AudsrvClient *clientIter= (*it);
+
+         pthread_mutex_lock( &clientIter->mutex );
+         for( unsigned i= 0; i < count; ++i )
          {
-            ERROR("AudioServerSocPlay failed");
+            AudsrvSessionControl *control= &controls[i];
+
+            if ( control->flags & AUDSRV_SESSIONCONTROL_Global )
+            {
+               continue;
+            }
+
+            if ( control->sessionName ? strcmp( control->sessionName, clientIter->sessionName ) : (clientIter != client) )
+            {
+               continue;
+            }
+
+            if ( clientIter->soc )
+            {
+               if ( control->flags & AUDSRV_SESSIONCONTROL_Volume )
+               {
+                  if ( !AudioServerSocVolume( clientIter->soc, control->volume ) )
+                  {
+                     ERROR("AudioServerSocVolume failed");
+                  }
+                  audsrv_state_set_volume( client->ctx->state, clientIter->sessionName, control->volume );
+               }
+               if ( control->flags & AUDSRV_SESSIONCONTROL_Mute )
+               {
+                  if ( !AudioServerSocMute( clientIter->soc, control->mute ) )
+                  {
+                     ERROR("AudioServerSocMute %d failed", control->mute);
+                  }
+                  audsrv_state_set_mute( client->ctx->state, clientIter->sessionName, control->mute );
+               }
+            }
+            else
+            {
+               ERROR("msg: sessioncontrol: no soc");
+            }
          }
+         pthread_mutex_unlock( &clientIter->mutex );
       }
+
+      pthread_mutex_unlock( &ctx->mutex );
    }
-   else
+
+exit:
+
+   // Discard anything left unparsed in a malformed message
+   if ( startCount-audsrv_conn_recv_count( client->conn ) < (int)msglen )
    {
-      ERROR("msg: play: no soc");
+      audsrv_conn_skip( client->conn, msglen-(startCount-audsrv_conn_recv_count( client->conn )) );
    }
-   
+
    return msglen;
 }
 
-static int audsrv_process_stop( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_enable_session_event( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: stop version %d", version);
-   
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_Stop_Version )
+   TRACE1("msg: enableSessionEvent version %d", version);
+
+   if ( version <= AUDSRV_MSG_EnableSessionEvent_Version )
+   {
+      if ( client )
       {
-         if ( !AudioServerSocStop( client->soc ) )
+         AudsrvContext *ctx= client->ctx;
+
+         if ( ctx )
          {
-            ERROR("AudioServerSocStop failed");
+            pthread_mutex_lock( &ctx->mutex );
+
+            // A client enables again to upgrade the version once it knows we support handles
+            bool found= false;
+            for( std::vector<AudsrvClient*>::iterator it= ctx->clientsSessionEvent.begin();
+                 it != ctx->clientsSessionEvent.end();
+                 ++it )
+            {
+               if ( client == (*it) )
+               {
+                  found= true;
+                  break;
+               }
+            }
+            if ( !found )
+            {
+               ctx->clientsSessionEvent.push_back( client );
+            }
+            client->sessionEventVersion= version;
+
+            pthread_mutex_unlock( &ctx->mutex );
          }
       }
    }
-   else
-   {
-      ERROR("msg: stop: no soc");
-   }
-   
+
    return msglen;
 }
 
-static int audsrv_process_pause( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_disable_session_event( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: pause version %d", version);
-   
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_Pause_Version )
+   TRACE1("msg: disableSessionEvent version %d", version);
+
+   if ( version <= AUDSRV_MSG_DisableSessionEvent_Version )
+   {
+      if ( client )
       {
-         if ( !AudioServerSocPause( client->soc, true ) )
+         AudsrvContext *ctx= client->ctx;
+
+         if ( ctx )
          {
-            ERROR("AudioServerSocPause TRUE failed");
+            pthread_mutex_lock( &ctx->mutex );
+
+            for( std::vector<AudsrvClient*>::iterator it= ctx->clientsSessionEvent.begin();
+                 it != ctx->clientsSessionEvent.end();
+                 ++it )
+            {
+               if ( client == (*it) )
+               {
+                  ctx->clientsSessionEvent.erase( it );
+                  break;
+               }
+            }
+
+            pthread_mutex_unlock( &ctx->mutex );
          }
       }
    }
-   else
-   {
-      ERROR("msg: pause: no soc");
-   }
-   
+
    return msglen;
 }
 
-static int audsrv_process_unpause( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_enableeos( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: unpause version %d", version);
-   
+   TRACE1("msg: enableeos version %d", version);
+
    if ( client->soc )
    {   
-      if ( version <= AUDSRV_MSG_UnPause_Version )
+      if ( version <= AUDSRV_MSG_EnableEOS_Version )
       {
-         if ( !AudioServerSocPause( client->soc, false ) )
-         {
-            ERROR("AudioServerSocPause FALSE failed");
-         }
+         AudioServerSocEnableEOSDetection( client->soc, audsrv_eos_callback, client );
       }
    }
    else
    {
-      ERROR("msg: unpause: no soc");
+      ERROR("msg: enableeos: no soc");
    }
-   
+
    return msglen;
 }
 
-static int audsrv_process_flush( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_disableeos( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: flush version %d", version);
-   
+   TRACE1("msg: disableeos version %d", version);
+
    if ( client->soc )
    {   
-      if ( version <= AUDSRV_MSG_Flush_Version )
+      if ( version <= AUDSRV_MSG_DisableEOS_Version )
       {
-         if ( !AudioServerSocFlush( client->soc ) )
-         {
-            ERROR("AudioServerSocFlush failed");
-         }
+         AudioServerSocDisableEOSDetection( client->soc );
       }
    }
    else
    {
-      ERROR("msg: flush: no soc");
+      ERROR("msg: disableeos: no soc");
    }
-   
+
    return msglen;
 }
 
-static int audsrv_process_audiosync( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_startcapture( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: audiosync version %d", version);
+   TRACE1("msg: startcapture version %d", version);
 
    if ( client->soc )
    {   
-      if ( version <= AUDSRV_MSG_AudioSync_Version )
+      if ( version <= AUDSRV_MSG_StartCapture_Version )
       {
-         unsigned len, type;
-         long long thenMicros, nowMicros, diff, diff45KHz;
-         unsigned long long stc;
-         unsigned adjustedStc;
-         
+         unsigned len, type, value;
+         char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
+         char *sessionName= 0;
+         AudSrvCaptureParameters captureParams;
+
          len= audsrv_conn_get_u32( client->conn );
          type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
+
+         if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("expecting type %d (U64) not type %d for audiosync arg 1 (nowMicros)", AUDSRV_TYPE_U64, type );
+            ERROR("expecting type %d (U16) not type %d for audio start capture arg 1 (numChannels)", AUDSRV_TYPE_U16, type );
             goto exit;
          }
-         
-         thenMicros= (long long)audsrv_conn_get_u64( client->conn );
 
-         
+         captureParams.numChannels = audsrv_conn_get_u16( client->conn );
+
          len= audsrv_conn_get_u32( client->conn );
          type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
+
+         if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("expecting type %d (U64) not type %d for audiosync arg 2 (stc)", AUDSRV_TYPE_U64, type );
+            ERROR("expecting type %d (U16) not type %d for audio start capture arg 3 (bitsPerSample)", AUDSRV_TYPE_U16, type );
             goto exit;
          }
-         
-         stc= audsrv_conn_get_u64( client->conn );
-         
-         nowMicros= getCurrentTimeMicro();
-         diff= nowMicros-thenMicros;
-         
-         diff45KHz= ((diff * 45000) / 1000000);
-         
-         adjustedStc= stc + diff45KHz;
 
-         TRACE1("msg: audiosync stc %lld then %lld now %lld diff %lld diff45 %lld stcadj %u", 
-                stc, thenMicros, nowMicros, diff, diff45KHz, adjustedStc);
-         
-         if ( !AudioServerSocAudioSync( client->soc, adjustedStc ) )
+         captureParams.bitsPerSample = audsrv_conn_get_u16( client->conn );
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+
+         if ( type != AUDSRV_TYPE_U16 )
          {
-            ERROR("AudioServerSocAudioSync failed");
+            ERROR("expecting type %d (U16) not type %d for audio start capture arg 3 (threshold)", AUDSRV_TYPE_U16, type );
+            goto exit;
          }
-      }
-   }
-   else
-   {
-      ERROR("msg: audiosync: no soc");
-   }
 
-exit:
-   
-   return msglen;
-}
+         captureParams.threshold = audsrv_conn_get_u16( client->conn );
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for audio start capture arg 1 (sampleRate)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+
+         captureParams.sampleRate = audsrv_conn_get_u32( client->conn );
 
-static int audsrv_process_audiodata( AudsrvClient *client, unsigned msglen, unsigned version )
-{
-   TRACE3("msg: audiodata version %d", version);
-   
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_AudioData_Version )
-      {
-         unsigned len, type, datalen;
-         unsigned char *data;
-         
          len= audsrv_conn_get_u32( client->conn );
          type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_Buffer )
+
+         if ( type != AUDSRV_TYPE_U32 )
          {
-            ERROR("expecting type %d (buffer) not type %d for audiodata arg 1 (data)", AUDSRV_TYPE_Buffer, type );
+            ERROR("expecting type %d (U32) not type %d for audio start capture arg 1 (outputDelay)", AUDSRV_TYPE_U32, type );
             goto exit;
          }
          
-         audsrv_conn_get_buffer( client->conn, len, &data, &datalen );
-         if ( data && datalen )
+         captureParams.outputDelay = audsrv_conn_get_u32( client->conn );
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+
+         if ( type != AUDSRV_TYPE_U32 )
          {
-            if ( !AudioServerSocAudioData( client->soc, data, datalen ) )
-            {
-               ERROR("AudioServerSocData failed");
-            }
-            len -= datalen;
+            ERROR("expecting type %d (U32) not type %d for audio start capture arg 1 (fifoSize)", AUDSRV_TYPE_U32, type );
+            goto exit;
          }
 
-         if ( len )
+         captureParams.fifoSize = audsrv_conn_get_u32( client->conn );
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+
+         if ( version >= AUDSRV_MSG_StartCapture_Version_Handle )
          {
-            audsrv_conn_get_buffer( client->conn, len, &data, &datalen );
-            if ( data && datalen )
+            unsigned sessionHandle;
+
+            if ( type != AUDSRV_TYPE_U32 )
+            {
+               ERROR("expecting type %d (U32) not type %d for audio start capture arg 7 (sessionHandle)", AUDSRV_TYPE_U32, type );
+               goto exit;
+            }
+
+            sessionHandle= audsrv_conn_get_u32( client->conn );
+            if ( sessionHandle )
             {
-               if ( !AudioServerSocAudioData( client->soc, data, datalen ) )
+               AudsrvContext *ctx= client->ctx;
+
+               pthread_mutex_lock( &ctx->mutex );
+               AudsrvClient *clientTarget= audsrv_find_session( ctx, sessionHandle );
+               if ( clientTarget )
+               {
+                  pthread_mutex_lock( &clientTarget->mutex );
+                  strcpy( name, clientTarget->sessionName );
+                  sessionName= name;
+                  pthread_mutex_unlock( &clientTarget->mutex );
+               }
+               pthread_mutex_unlock( &ctx->mutex );
+
+               if ( !sessionName )
                {
-                  ERROR("AudioServerSocData failed");
+                  goto exit;
                }
             }
          }
+         else
+         {
+            if ( type != AUDSRV_TYPE_String )
+            {
+               ERROR("expecting type %d (string) not type %d for init arg 1 (sessionName)", AUDSRV_TYPE_String, type );
+               goto exit;
+            }
+            if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+            {
+               ERROR("sessionName too long (%d) for init", len );
+               goto exit;
+            }
+            
+            if ( len )
+            {
+               audsrv_conn_get_string( client->conn, name );
+               sessionName= name;
+            }
+         }
+         INFO("capture sessionName (%s)", sessionName);
+
+         AudioServerSocSetCaptureCallback( client->soc, sessionName, audsrv_capture_callback, &captureParams, client );
       }
    }
    else
    {
-      ERROR("msg: audiodata: no soc");
+      ERROR("msg: startcapture: no soc");
    }
 
 exit:
-   
+
    return msglen;
 }
 
-static int audsrv_process_audiodatahandle( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_stopcapture( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE3("msg: audiodatahandle version %d", version);
-   
+   TRACE1("msg: stopcapture version %d", version);
+
    if ( client->soc )
    {   
-      if ( version <= AUDSRV_MSG_AudioDataHandle_Version )
+      if ( version <= AUDSRV_MSG_StartCapture_Version )
       {
-         unsigned len, type;
-         unsigned long long dataHandle;
-         
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
-         
-         if ( type != AUDSRV_TYPE_U64 )
-         {
-            ERROR("expecting type %d (U64) not type %d for audiodatahandle arg 1 (dataHandle)", AUDSRV_TYPE_U64, type );
-            goto exit;
-         }
-
-         dataHandle= audsrv_conn_get_u64( client->conn );
+         AudioServerSocSetCaptureCallback( client->soc, NULL, NULL, NULL, 0 );
 
-         if ( !AudioServerSocAudioDataHandle( client->soc, dataHandle ) )
-         {
-            ERROR("AudioServerSocDataHandle failed" );
-         }
+         audsrv_capture_overrun_flush( client );
+         
+         audsrv_send_capture_done( client );
       }
    }
    else
    {
-      ERROR("msg: audiodata: no soc");
+      ERROR("msg: stopcapture: no soc");
    }
 
-exit:
-   
    return msglen;
 }
 
-static int audsrv_process_mute( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_enable_capture_ring( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: mute version %d", version);
+   TRACE1("msg: enablecapturering version %d", version);
 
-   if ( version <= AUDSRV_MSG_Mute_Version )
+   if ( version <= AUDSRV_MSG_EnableCaptureRing_Version )
    {
       unsigned len, type;
-      unsigned global;
-      char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
-      char *sessionName= 0;
+      unsigned long long token;
+      unsigned ringSize;
+      int ringResult= 0;
 
       len= audsrv_conn_get_u32( client->conn );
       type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_U16 )
+
+      if ( type != AUDSRV_TYPE_U64 )
       {
-         ERROR("expecting type %d (U16) not type %d for audio mute arg 1 (global)", AUDSRV_TYPE_U16, type );
+         ERROR("expecting type %d (U64) not type %d for enablecapturering arg 1 (token)", AUDSRV_TYPE_U64, type );
          goto exit;
       }
 
-      global= audsrv_conn_get_u16( client->conn );
-
+      token= audsrv_conn_get_u64( client->conn );
 
       len= audsrv_conn_get_u32( client->conn );
       type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_String )
+
+      if ( type != AUDSRV_TYPE_U32 )
       {
-         ERROR("expecting type %d (string) not type %d for audio mute arg 2 (sessionName)", AUDSRV_TYPE_String, type );
+         ERROR("expecting type %d (U32) not type %d for enablecapturering arg 2 (ringSize)", AUDSRV_TYPE_U32, type );
          goto exit;
       }
-      if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+
+      ringSize= audsrv_conn_get_u32( client->conn );
+
+      TRACE1("msg: enablecapturering token %llx ringSize %u", token, ringSize);
+
+      audsrv_capture_overrun_flush( client );
+      audsrv_destroy_capture_ring( client );
+
+      if ( ringSize && !audsrv_create_capture_ring( client, ringSize ) )
       {
-         ERROR("sessionName too long (%d) for audio mute", len );
-         goto exit;
+         ringResult= 1;
       }
+
+      audsrv_send_capture_ring( client, token, ringResult );
+   }
+
+exit:
+
+   return msglen;
+}
+
+static int audsrv_process_enumsessions( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: enumsessions version %d", version);
+
+   if ( version <= AUDSRV_MSG_EnumSessions_Version )
+   {
+      unsigned long long token;
+      int sessionCount= 0;
+      int infoSize= 0;
+      int namelen;
+      const char *name;
+      unsigned char *enumInfo= 0;
+      unsigned len, type;
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
       
-      if ( len )
+      if ( type != AUDSRV_TYPE_U64 )
       {
-         audsrv_conn_get_string( client->conn, name );
-         sessionName= name;
+         ERROR("expecting type %d (U64) not type %d for enum sessions arg 1 (token)", AUDSRV_TYPE_U64, type );
+         goto exit;
       }
+      
+      token= audsrv_conn_get_u64( client->conn );
 
-      if ( global )
-      {            
-         AudsrvContext *ctx= client->ctx;
-         if ( !AudioServerSocGlobalMute( ctx->soc, true ) )
+
+      AudsrvContext *ctx= client->ctx;
+      pthread_mutex_lock( &ctx->mutex );
+      sessionCount= 0;
+      for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+           it != ctx->clients.end();
+           ++it )
+      {
+         AudsrvClient *clientIter= (*it);
+
+         pthread_mutex_lock( &clientIter->mutex );
+         if ( clientIter->sessionType != AUDSRV_SESSION_Observer )
          {
-            ERROR("AudioServerSocMute TRUE failed");
+            ++sessionCount;
+            infoSize += (AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U32_LEN); //client pid
+            infoSize += (AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U16_LEN); //client session type
+            namelen= strlen(clientIter->sessionName);
+            name= namelen ? clientIter->sessionName : "no-name";
+            infoSize += AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_STRING_LEN(name);
+            if ( version >= AUDSRV_MSG_EnumSessions_Version_Handle )
+            {
+               infoSize += (AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U32_LEN); //client session handle
+            }
          }
+         pthread_mutex_unlock( &clientIter->mutex );
       }
-      else
+
+      enumInfo= (unsigned char *)malloc( infoSize );
+      if ( enumInfo )
       {
-         if ( sessionName )
+         unsigned char *p= enumInfo;
+         for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+              it != ctx->clients.end();
+              ++it )
          {
-            TRACE1("msg: mute sessionName (%s)", sessionName);
-
-            AudsrvContext *ctx= client->ctx;
+            AudsrvClient *clientIter= (*it);
 
-            pthread_mutex_lock( &ctx->mutex );
-            for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
-                 it != ctx->clients.end();
-                 ++it )
+            pthread_mutex_lock( &clientIter->mutex );
+            if ( clientIter->sessionType != AUDSRV_SESSION_Observer )
             {
-               AudsrvClient *clientIter= (*it);
-
-               pthread_mutex_lock( &clientIter->mutex );
-               if ( !strcmp( sessionName, clientIter->sessionName ) )
-               {
-                  if ( clientIter->soc )
-                  {   
-                     if ( !AudioServerSocMute( clientIter->soc, true ) )
-                     {
-                        ERROR("AudioServerSocMute TRUE failed");
-                     }
-                  }
-                  else
-                  {
-                     ERROR("msg: mute: no soc");
-                  }
-               }
-               pthread_mutex_unlock( &clientIter->mutex );
-            }
-            pthread_mutex_unlock( &ctx->mutex );
-         }
-         else
-         {
-            if ( client->soc )
-            {   
-               if ( !AudioServerSocMute( client->soc, true ) )
+               TRACE1("client pid %d type %d name(%s)", clientIter->ucred.pid, clientIter->sessionType, name );
+               p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+               p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+               p += audsrv_conn_put_u32( p, clientIter->ucred.pid );
+               p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+               p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+               p += audsrv_conn_put_u16( p, clientIter->sessionType );
+               namelen= strlen(clientIter->sessionName);
+               name= namelen ? clientIter->sessionName : "no-name";
+               p += audsrv_conn_put_u32( p, AUDSRV_MSG_STRING_LEN(name) );
+               p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
+               p += audsrv_conn_put_string( p, name );
+               if ( version >= AUDSRV_MSG_EnumSessions_Version_Handle )
                {
-                  ERROR("AudioServerSocMute TRUE failed");
+                  p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+                  p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+                  p += audsrv_conn_put_u32( p, clientIter->sessionHandle );
                }
             }
-            else
-            {
-               ERROR("msg: mute: no soc");
-            }
+            pthread_mutex_unlock( &clientIter->mutex );
          }
       }
-   }
+      else
+      {
+         ERROR("No memory for enum session response");
+      }
 
-exit:   
+      audsrv_send_enum_session_results( client, version, token, sessionCount, enumInfo, infoSize );
+
+      if ( enumInfo )
+      {
+         free( enumInfo );
+      }
+
+      pthread_mutex_unlock( &ctx->mutex );
+   }
 
+exit:
    return msglen;
 }
 
-static int audsrv_process_unmute( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_getstatus( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: unmute version %d", version);
+   TRACE1("msg: getstatus version %d", version);
 
-   if ( version <= AUDSRV_MSG_UnMute_Version )
+   if ( version <= AUDSRV_MSG_GetStatus_Version )
    {
+      unsigned long long token;
       unsigned len, type;
-      unsigned global;
+      unsigned sessionHandle= 0;
       char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
       char *sessionName= 0;
+      bool haveStatus= false;
+      AudSrvSessionStatus status, *pStatus= 0;
+      AudsrvContext *ctx= client->ctx;
+
+      pStatus= &status;
+      memset( &status, 0, sizeof(status) );
 
       len= audsrv_conn_get_u32( client->conn );
       type= audsrv_conn_get_u32( client->conn );
       
-      if ( type != AUDSRV_TYPE_U16 )
+      if ( type != AUDSRV_TYPE_U64 )
       {
-         ERROR("expecting type %d (U16) not type %d for audio unmute arg 1 (global)", AUDSRV_TYPE_U16, type );
+         ERROR("expecting type %d (U64) not type %d for getstatus arg 1 (token)", AUDSRV_TYPE_U64, type );
          goto exit;
       }
-
-      global= audsrv_conn_get_u16( client->conn );
-
+      
+      token= audsrv_conn_get_u64( client->conn );
 
       len= audsrv_conn_get_u32( client->conn );
       type= audsrv_conn_get_u32( client->conn );
       
+      if ( version >= AUDSRV_MSG_GetStatus_Version_Handle )
+      {
+         if ( type != AUDSRV_TYPE_U32 )
+         {
+            ERROR("expecting type %d (U32) not type %d for getstatus arg 2 (sessionHandle)", AUDSRV_TYPE_U32, type );
+            goto exit;
+         }
+
+         sessionHandle= audsrv_conn_get_u32( client->conn );
+
+
+         len= audsrv_conn_get_u32( client->conn );
+         type= audsrv_conn_get_u32( client->conn );
+      }
+
       if ( type != AUDSRV_TYPE_String )
       {
-         ERROR("expecting type %d (string) not type %d for audio unmute arg 2 (sessionName)", AUDSRV_TYPE_String, type );
+         ERROR("expecting type %d (string) not type %d for getstatus arg 2 (sessionName)", AUDSRV_TYPE_String, type );
          goto exit;
       }
       if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
       {
-         ERROR("sessionName too long (%d) for audio unmute", len );
+         ERROR("sessionName too long (%d) for audio getstatus", len );
          goto exit;
       }
       
@@ -1537,63 +3819,97 @@ static int audsrv_process_unmute( AudsrvClient *client, unsigned msglen, unsigne
          sessionName= name;
       }
 
-      if ( global )
-      {            
-         AudsrvContext *ctx= client->ctx;
-         if ( !AudioServerSocGlobalMute( ctx->soc, false ) )
+      sessionHandle= audsrv_check_session_handle( client, sessionHandle, sessionName );
+
+      if ( sessionHandle )
+      {
+         TRACE1("msg: getstatus sessionHandle %X", sessionHandle);
+
+         pthread_mutex_lock( &ctx->mutex );
+         AudsrvClient *clientTarget= audsrv_find_session( ctx, sessionHandle );
+         if ( clientTarget )
          {
-            ERROR("AudioServerSocGlobalMute FALSE failed");
+            pthread_mutex_lock( &clientTarget->mutex );
+            if ( clientTarget->soc )
+            {
+               if ( AudioServerSocGetStatus( ctx->soc, clientTarget->soc, &status ) )
+               {
+                  status.ready= true;
+               }
+               haveStatus= true;
+               strcpy( name, clientTarget->sessionName );
+               sessionName= name;
+            }
+            else
+            {
+               ERROR("msg: getstatus: no soc");
+            }
+            pthread_mutex_unlock( &clientTarget->mutex );
          }
+         pthread_mutex_unlock( &ctx->mutex );
       }
-      else
+      else if ( sessionName )
       {
-         if ( sessionName )
-         {
-            TRACE1("msg: unmute sessionName (%s)", sessionName);
+         TRACE1("msg: getstatus sessionName (%s)", sessionName);
 
-            AudsrvContext *ctx= client->ctx;
+         pthread_mutex_lock( &ctx->mutex );
+         for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
+              it != ctx->clients.end();
+              ++it )
+         {
+            AudsrvClient *clientIter= (*it);
 
-            pthread_mutex_lock( &ctx->mutex );
-            for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
-                 it != ctx->clients.end();
-                 ++it )
+            pthread_mutex_lock( &clientIter->mutex );
+            if ( !strcmp( sessionName, clientIter->sessionName ) )
             {
-               AudsrvClient *clientIter= (*it);
-
-               pthread_mutex_lock( &clientIter->mutex );
-               if ( !strcmp( sessionName, clientIter->sessionName ) )
+               if ( clientIter->soc )
                {
-                  if ( clientIter->soc )
-                  {   
-                     if ( !AudioServerSocMute( clientIter->soc, false ) )
-                     {
-                        ERROR("AudioServerSocMute FALSE failed");
-                     }
-                  }
-                  else
+                  if ( AudioServerSocGetStatus( ctx->soc, clientIter->soc, &status ) )
                   {
-                     ERROR("msg: unmute: no soc");
+                     status.ready= true;
                   }
+                  haveStatus= true;
                }
-               pthread_mutex_unlock( &clientIter->mutex );
-            }
-            pthread_mutex_unlock( &ctx->mutex );
-         }
-         else
-         {
-            if ( client->soc )
-            {   
-               if ( !AudioServerSocMute( client->soc, false ) )
+               else
                {
-                  ERROR("AudioServerSocMute FALSE failed");
+                  ERROR("msg: getstatus: no soc");
                }
             }
-            else
+            pthread_mutex_unlock( &clientIter->mutex );
+         }
+         pthread_mutex_unlock( &ctx->mutex );
+      }
+      else
+      {
+         if ( client->soc )
+         {   
+            if ( AudioServerSocGetStatus( ctx->soc, client->soc, &status ) )
             {
-               ERROR("msg: unmute: no soc");
+               status.ready= true;
             }
+            haveStatus= true;
+         }
+         else
+         {
+            pthread_mutex_lock( &ctx->mutex );
+            audsrv_get_global_status( ctx, &status );
+            pthread_mutex_unlock( &ctx->mutex );
+         }
+      }
+
+      if ( haveStatus )
+      {
+         if ( sessionName )
+         {
+            strcpy( status.sessionName, sessionName );
+         }
+         else
+         {
+            strcpy( status.sessionName, client->sessionName );
          }
       }
+
+      audsrv_send_getstatus_results( client, token, pStatus );
    }
 
 exit:   
@@ -1601,346 +3917,324 @@ exit:
    return msglen;
 }
 
-static int audsrv_process_volume( AudsrvClient *client, unsigned msglen, unsigned version )
+static unsigned audsrv_read_u32( unsigned char *p )
 {
-   TRACE1("msg: volume version %d", version);
+   return ((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
 
-   if ( version <= AUDSRV_MSG_Volume_Version )
+// Audio data for a session received behind the message being processed, whether already
+// buffered or still waiting on the socket.  Sub-sessions share their owner's connection, so
+// the messages are followed through session selection and only AudioData and AudioDataRing
+// payload addressed to this session is counted.  AudioDataHandle handles are opaque so their
+// size is unknown here.  Must be called from the client thread.
+static unsigned audsrv_queued_audio_bytes( AudsrvClient *client )
+{
+   AudsrvClient *owner= (client->parent ? client->parent : client);
+   AudsrvConn *conn= owner->conn;
+   unsigned sessionId= (client->parent ? client->subSessionId : 0);
+   unsigned selectedId= sessionId;
+   unsigned total= 0;
+   unsigned char *data;
+   int buffered, inSocket= 0, len, pos;
+
+   buffered= ((conn->recvTotal > owner->recvMsgEnd) ? (int)(conn->recvTotal - owner->recvMsgEnd) : 0);
+   if ( ioctl( owner->fdSocket, FIONREAD, &inSocket ) < 0 )
    {
-      unsigned len, type;
-      unsigned numerator, denominator;
-      float volume= 1.0;
-      unsigned global;
-      char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
-      char *sessionName= 0;
-      
-      len= audsrv_conn_get_u32( client->conn );
-      type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_U32 )
-      {
-         ERROR("expecting type %d (U32) not type %d for volume arg 1 (numerator)", AUDSRV_TYPE_U32, type );
-         goto exit;
-      }
-      
-      numerator= audsrv_conn_get_u32( client->conn );
+      inSocket= 0;
+   }
 
-      
-      len= audsrv_conn_get_u32( client->conn );
-      type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_U32 )
-      {
-         ERROR("expecting type %d (U32) not type %d for volume arg 2 (denominator)", AUDSRV_TYPE_U32, type );
-         goto exit;
-      }
-      
-      denominator= audsrv_conn_get_u32( client->conn );
-      
-      if ( denominator == 0 )
-      {
-         ERROR("volume denominator is 0 - setting volume to 1.0");            
-      }
-      else
-      {
-         volume= (float)numerator/(float)denominator;
-         TRACE1("msg: volume (%u/%u) = %f", numerator, denominator, volume );
-      }
+   data= (unsigned char*)malloc( buffered+inSocket+1 );
+   if ( !data )
+   {
+      ERROR("unable to allocate %d bytes to count queued audio", buffered+inSocket);
+      goto exit;
+   }
 
-      len= audsrv_conn_get_u32( client->conn );
-      type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_U16 )
+   len= audsrv_conn_peek_at( conn, conn->count-buffered, data, buffered );
+   if ( inSocket > 0 )
+   {
+      int peekLen= recv( owner->fdSocket, data+len, inSocket, MSG_PEEK|MSG_DONTWAIT );
+      if ( peekLen > 0 )
       {
-         ERROR("expecting type %d (U16) not type %d for audio volume arg 3 (global)", AUDSRV_TYPE_U16, type );
-         goto exit;
+         len += peekLen;
       }
+   }
 
-      global= audsrv_conn_get_u16( client->conn );
-
+   pos= 0;
+   while( pos + AUDSRV_MSG_HDR_LEN <= len )
+   {
+      unsigned msglen= audsrv_read_u32( data+pos );
+      unsigned msgid= audsrv_read_u32( data+pos+4 );
+      unsigned version= audsrv_read_u32( data+pos+8 );
+      int paramPos= pos+AUDSRV_MSG_HDR_LEN;
 
-      len= audsrv_conn_get_u32( client->conn );
-      type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_String )
-      {
-         ERROR("expecting type %d (string) not type %d for audio volume arg 4 (sessionName)", AUDSRV_TYPE_String, type );
-         goto exit;
-      }
-      if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+      if ( msgid == AUDSRV_MSG_SelectSession )
       {
-         ERROR("sessionName too long (%d) for audio volume", len );
-         goto exit;
+         if ( paramPos + AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN > len )
+         {
+            break;
+         }
+         selectedId= audsrv_read_u32( data+paramPos+AUDSRV_MSG_TYPE_HDR_LEN );
       }
-      
-      if ( len )
+      else if ( (msgid == AUDSRV_MSG_AudioData) && (selectedId == sessionId) )
       {
-         audsrv_conn_get_string( client->conn, name );
-         sessionName= name;
-      }
+         int dataPos= paramPos + AUDSRV_MSG_TYPE_HDR_LEN;
+         int dataEnd= paramPos + (int)msglen;
 
-      if ( global )
-      {
-         AudsrvContext *ctx= client->ctx;
-         AudioServerSocGlobalVolume( ctx->soc, volume );
+         if ( version >= AUDSRV_MSG_AudioData_Version_Generation )
+         {
+            dataPos += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN);
+         }
+         // Only what has arrived so far
+         if ( dataEnd > len )
+         {
+            dataEnd= len;
+         }
+         if ( dataEnd > dataPos )
+         {
+            total += (dataEnd-dataPos);
+         }
       }
-      else
+      else if ( (msgid == AUDSRV_MSG_AudioDataRing) && (selectedId == sessionId) )
       {
-         if ( sessionName )
-         {
-            TRACE1("msg: volume sessionName (%s)", sessionName);
-
-            AudsrvContext *ctx= client->ctx;
-
-            pthread_mutex_lock( &ctx->mutex );
-            for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
-                 it != ctx->clients.end();
-                 ++it )
-            {
-               AudsrvClient *clientIter= (*it);
+         // The len param follows the offset param; its data is already in the ring
+         int lenPos= paramPos + 2*AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN;
 
-               pthread_mutex_lock( &clientIter->mutex );
-               if ( !strcmp( sessionName, clientIter->sessionName ) )
-               {
-                  if ( clientIter->soc )
-                  {   
-                     if ( !AudioServerSocVolume( clientIter->soc, volume ) )
-                     {
-                        ERROR("AudioServerSocVolume failed");
-                     }
-                  }
-                  else
-                  {
-                     ERROR("msg: volume: no soc");
-                  }
-               }
-               pthread_mutex_unlock( &clientIter->mutex );
-            }
-            pthread_mutex_unlock( &ctx->mutex );
-         }
-         else
+         if ( lenPos + AUDSRV_MSG_U32_LEN > len )
          {
-            if ( client->soc )
-            {   
-               if ( !AudioServerSocVolume( client->soc, volume ) )
-               {
-                  ERROR("AudioServerSocVolume failed");
-               }
-            }
-            else
-            {
-               ERROR("msg: volume: no soc");
-            }
+            break;
          }
+         total += audsrv_read_u32( data+lenPos );
+      }
+
+      if ( msglen >= (unsigned)(len-paramPos) )
+      {
+         break;
       }
+      pos= paramPos + msglen;
    }
 
+   free( data );
+
 exit:
-   
-   return msglen;
+   return total;
 }
 
-static int audsrv_process_enable_session_event( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_getlatency( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: enableSessionEvent version %d", version);
+   TRACE1("msg: getlatency version %d", version);
 
-   if ( version <= AUDSRV_MSG_EnableSessionEvent_Version )
+   if ( version <= AUDSRV_MSG_GetLatency_Version )
    {
-      if ( client )
-      {
-         AudsrvContext *ctx= client->ctx;
+      unsigned long long token;
+      unsigned len, type;
+      AudSrvLatency latency;
+      int latencyResult= 1;
 
-         if ( ctx )
-         {
-            pthread_mutex_lock( &ctx->mutex );
+      memset( &latency, 0, sizeof(latency) );
 
-            ctx->clientsSessionEvent.push_back( client );
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
 
-            pthread_mutex_unlock( &ctx->mutex );
-         }
+      if ( type != AUDSRV_TYPE_U64 )
+      {
+         ERROR("expecting type %d (U64) not type %d for getlatency arg 1 (token)", AUDSRV_TYPE_U64, type );
+         goto exit;
       }
-   }
 
-   return msglen;
-}
-
-static int audsrv_process_disable_session_event( AudsrvClient *client, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: disableSessionEvent version %d", version);
+      token= audsrv_conn_get_u64( client->conn );
 
-   if ( version <= AUDSRV_MSG_DisableSessionEvent_Version )
-   {
-      if ( client )
+      pthread_mutex_lock( &client->mutex );
+      if ( client->soc )
       {
-         AudsrvContext *ctx= client->ctx;
-
-         if ( ctx )
+         if ( AudioServerSocGetLatency( client->soc, &latency ) )
          {
-            pthread_mutex_lock( &ctx->mutex );
-
-            for( std::vector<AudsrvClient*>::iterator it= ctx->clientsSessionEvent.begin();
-                 it != ctx->clientsSessionEvent.end();
-                 ++it )
-            {
-               if ( client == (*it) )
-               {
-                  ctx->clientsSessionEvent.erase( it );
-                  break;
-               }
-            }
-
-            pthread_mutex_unlock( &ctx->mutex );
+            latency.socBytes= audsrv_pcm_input_bytes( client->pcmFormat, latency.socBytes );
+            latencyResult= 0;
          }
       }
-   }
+      else
+      {
+         ERROR("msg: getlatency: no soc");
+      }
+      pthread_mutex_unlock( &client->mutex );
 
-   return msglen;
-}
+      if ( !latency.timestamp )
+      {
+         struct timespec tm;
 
-static int audsrv_process_enableeos( AudsrvClient *client, unsigned msglen, unsigned version )
-{
-   TRACE1("msg: enableeos version %d", version);
+         clock_gettime( CLOCK_MONOTONIC, &tm );
+         latency.timestamp= tm.tv_sec*1000000LL + tm.tv_nsec/1000LL;
+      }
 
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_EnableEOS_Version )
+      latency.serverBytes= audsrv_queued_audio_bytes( client );
+      if ( latency.socBytes && latency.socFrames )
       {
-         AudioServerSocEnableEOSDetection( client->soc, audsrv_eos_callback, client );
+         latency.serverFrames= (unsigned)(((unsigned long long)latency.serverBytes*latency.socFrames)/latency.socBytes);
       }
+
+      TRACE1("msg: getlatency: result %d serverBytes %u socBytes %u socFrames %u rate %u outputDelay %u",
+             latencyResult, latency.serverBytes, latency.socBytes, latency.socFrames, latency.sampleRate, latency.outputDelay );
+
+      audsrv_send_getlatency_results( client, token, latencyResult, &latency );
    }
-   else
-   {
-      ERROR("msg: enableeos: no soc");
-   }
+
+exit:
 
    return msglen;
 }
 
-static int audsrv_process_disableeos( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_resolve_session( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: disableeos version %d", version);
+   TRACE1("msg: resolvesession version %d", version);
 
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_DisableEOS_Version )
+   if ( version <= AUDSRV_MSG_ResolveSession_Version )
+   {
+      unsigned len, type;
+      unsigned sessionHandle= 0;
+      int matchCount= 0;
+      char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
+      AudsrvContext *ctx= client->ctx;
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+      
+      if ( type != AUDSRV_TYPE_String )
       {
-         AudioServerSocDisableEOSDetection( client->soc );
+         ERROR("expecting type %d (string) not type %d for resolvesession arg 1 (sessionName)", AUDSRV_TYPE_String, type );
+         goto exit;
       }
+      if ( (len == 0) || (len > AUDSRV_MAX_SESSION_NAME_LEN) )
+      {
+         ERROR("bad sessionName length (%d) for resolvesession", len );
+         goto exit;
+      }
+      
+      audsrv_conn_get_string( client->conn, name );
+
+      // Only resolve names that identify a single session: name based
+      // requests act on every session with the name
+      sessionHandle= audsrv_resolve_session_name( ctx, name, &matchCount );
+      TRACE1("msg: resolvesession (%s) matches %d handle %X", name, matchCount, sessionHandle);
+
+      audsrv_send_session_handle( client, AUDSRV_SESSIONHANDLE_Resolve, sessionHandle, name );
    }
-   else
-   {
-      ERROR("msg: disableeos: no soc");
-   }
+
+exit:
 
    return msglen;
 }
 
-static int audsrv_process_startcapture( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_enable_data_ring( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: startcapture version %d", version);
+   TRACE1("msg: enabledataring version %d", version);
 
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_StartCapture_Version )
+   if ( version <= AUDSRV_MSG_EnableDataRing_Version )
+   {
+      unsigned len, type;
+      bool enable;
+      unsigned long long sequence;
+      int fd;
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+
+      if ( type != AUDSRV_TYPE_U16 )
       {
-         unsigned len, type, value;
-         char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
-         char *sessionName= 0;
-         AudSrvCaptureParameters captureParams;
+         ERROR("expecting type %d (U16) not type %d for enabledataring arg 1 (enable)", AUDSRV_TYPE_U16, type );
+         goto exit;
+      }
 
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
+      enable= audsrv_conn_get_u16( client->conn );
 
-         if ( type != AUDSRV_TYPE_U16 )
-         {
-            ERROR("expecting type %d (U16) not type %d for audio start capture arg 1 (numChannels)", AUDSRV_TYPE_U16, type );
-            goto exit;
-         }
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
 
-         captureParams.numChannels = audsrv_conn_get_u16( client->conn );
+      if ( type != AUDSRV_TYPE_U64 )
+      {
+         ERROR("expecting type %d (U64) not type %d for enabledataring arg 2 (sequence)", AUDSRV_TYPE_U64, type );
+         goto exit;
+      }
 
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
+      sequence= audsrv_conn_get_u64( client->conn );
 
-         if ( type != AUDSRV_TYPE_U16 )
+      TRACE1("msg: enabledataring enable %d sequence %llu", enable, sequence);
+
+      audsrv_unmap_data_ring( client );
+
+      if ( enable )
+      {
+         fd= audsrv_conn_get_fd( client->conn );
+         if ( fd < 0 )
          {
-            ERROR("expecting type %d (U16) not type %d for audio start capture arg 3 (bitsPerSample)", AUDSRV_TYPE_U16, type );
+            ERROR("msg: enabledataring: no descriptor");
             goto exit;
          }
 
-         captureParams.bitsPerSample = audsrv_conn_get_u16( client->conn );
-
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
-
-         if ( type != AUDSRV_TYPE_U16 )
+         if ( audsrv_map_data_ring( client, fd ) )
          {
-            ERROR("expecting type %d (U16) not type %d for audio start capture arg 3 (threshold)", AUDSRV_TYPE_U16, type );
-            goto exit;
+            client->dataRing->consumed= sequence;
          }
 
-         captureParams.threshold = audsrv_conn_get_u16( client->conn );
+         close( fd );
+      }
+   }
 
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
+exit:
 
-         if ( type != AUDSRV_TYPE_U32 )
-         {
-            ERROR("expecting type %d (U32) not type %d for audio start capture arg 1 (sampleRate)", AUDSRV_TYPE_U32, type );
-            goto exit;
-         }
+   return msglen;
+}
 
-         captureParams.sampleRate = audsrv_conn_get_u32( client->conn );
+static int audsrv_process_enable_handle_release( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: enablehandlerelease version %d", version);
 
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
+   if ( version <= AUDSRV_MSG_EnableHandleRelease_Version )
+   {
+      unsigned len, type;
+      bool enable;
+      AudsrvContext *ctx= client->ctx;
 
-         if ( type != AUDSRV_TYPE_U32 )
-         {
-            ERROR("expecting type %d (U32) not type %d for audio start capture arg 1 (outputDelay)", AUDSRV_TYPE_U32, type );
-            goto exit;
-         }
-         
-         captureParams.outputDelay = audsrv_conn_get_u32( client->conn );
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
 
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
+      if ( type != AUDSRV_TYPE_U16 )
+      {
+         ERROR("expecting type %d (U16) not type %d for enablehandlerelease arg 1 (enable)", AUDSRV_TYPE_U16, type );
+         goto exit;
+      }
 
-         if ( type != AUDSRV_TYPE_U32 )
-         {
-            ERROR("expecting type %d (U32) not type %d for audio start capture arg 1 (fifoSize)", AUDSRV_TYPE_U32, type );
-            goto exit;
-         }
+      enable= audsrv_conn_get_u16( client->conn );
 
-         captureParams.fifoSize = audsrv_conn_get_u32( client->conn );
+      TRACE1("msg: enablehandlerelease enable %d", enable);
 
-         len= audsrv_conn_get_u32( client->conn );
-         type= audsrv_conn_get_u32( client->conn );
+      pthread_mutex_lock( &ctx->mutex );
+      pthread_mutex_lock( &client->mutex );
+      if ( enable && !client->handleReleaseEnabled )
+      {
+         ++ctx->handleReleaseClientCount;
+      }
+      else if ( !enable && client->handleReleaseEnabled )
+      {
+         --ctx->handleReleaseClientCount;
+      }
+      client->handleReleaseEnabled= enable;
+      client->releasedHandleCount= 0;
+      pthread_mutex_unlock( &client->mutex );
 
-         if ( type != AUDSRV_TYPE_String )
-         {
-            ERROR("expecting type %d (string) not type %d for init arg 1 (sessionName)", AUDSRV_TYPE_String, type );
-            goto exit;
-         }
-         if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+      if ( enable && !ctx->dataRequestThreadStarted )
+      {
+         if ( !pthread_create( &ctx->dataRequestThreadId, NULL, audsrv_data_request_thread, ctx ) )
          {
-            ERROR("sessionName too long (%d) for init", len );
-            goto exit;
+            ctx->dataRequestThreadStarted= true;
          }
-         
-         if ( len )
+         else
          {
-            audsrv_conn_get_string( client->conn, name );
-            sessionName= name;
+            ERROR("unable to create data request thread");
          }
-         INFO("capture sessionName (%s)", sessionName);
-
-         AudioServerSocSetCaptureCallback( client->soc, sessionName, audsrv_capture_callback, &captureParams, client );
       }
-   }
-   else
-   {
-      ERROR("msg: startcapture: no soc");
+      pthread_cond_signal( &ctx->dataRequestCond );
+      pthread_mutex_unlock( &ctx->mutex );
    }
 
 exit:
@@ -1948,312 +4242,559 @@ exit:
    return msglen;
 }
 
-static int audsrv_process_stopcapture( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_set_pcm_format( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: stopcapture version %d", version);
+   TRACE1("msg: setpcmformat version %d", version);
 
-   if ( client->soc )
-   {   
-      if ( version <= AUDSRV_MSG_StartCapture_Version )
+   if ( version <= AUDSRV_MSG_SetPcmFormat_Version )
+   {
+      unsigned len, type;
+      unsigned format;
+
+      len= audsrv_conn_get_u32( client->conn );
+      type= audsrv_conn_get_u32( client->conn );
+
+      if ( type != AUDSRV_TYPE_U32 )
       {
-         AudioServerSocSetCaptureCallback( client->soc, NULL, NULL, NULL, 0 );
-         
-         audsrv_send_capture_done( client );
+         ERROR("expecting type %d (U32) not type %d for setpcmformat arg 1 (format)", AUDSRV_TYPE_U32, type );
+         goto exit;
+      }
+
+      format= audsrv_conn_get_u32( client->conn );
+
+      TRACE1("msg: setpcmformat format %u", format);
+
+      if ( format > AUDSRV_PCM_FORMAT_F32LE )
+      {
+         ERROR("msg: setpcmformat: unsupported format %u", format);
+         goto exit;
+      }
+
+      if ( format != audsrv_pcm_get_format( client->pcm ) )
+      {
+         if ( client->pcm )
+         {
+            audsrv_pcm_destroy( client->pcm );
+            client->pcm= 0;
+         }
+         if ( format != AUDSRV_PCM_FORMAT_S16LE )
+         {
+            client->pcm= audsrv_pcm_create( format );
+         }
+         pthread_mutex_lock( &client->mutex );
+         client->pcmFormat= (client->pcm ? format : AUDSRV_PCM_FORMAT_S16LE);
+         pthread_mutex_unlock( &client->mutex );
+         INFO("client %p pcm format %u", client, format);
       }
    }
-   else
-   {
-      ERROR("msg: stopcapture: no soc");
-   }
+
+exit:
 
    return msglen;
 }
 
-static int audsrv_process_enumsessions( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_enable_data_request( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: enumsessions version %d", version);
+   TRACE1("msg: enabledatarequest version %d", version);
 
-   if ( version <= AUDSRV_MSG_EnumSessions_Version )
+   if ( version <= AUDSRV_MSG_EnableDataRequest_Version )
    {
-      unsigned long long token;
-      int sessionCount= 0;
-      int infoSize= 0;
-      int namelen;
-      const char *name;
-      unsigned char *enumInfo= 0;
       unsigned len, type;
+      unsigned watermark;
+      AudsrvContext *ctx= client->ctx;
 
       len= audsrv_conn_get_u32( client->conn );
       type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_U64 )
+
+      if ( type != AUDSRV_TYPE_U32 )
       {
-         ERROR("expecting type %d (U64) not type %d for enum sessions arg 1 (token)", AUDSRV_TYPE_U64, type );
+         ERROR("expecting type %d (U32) not type %d for enabledatarequest arg 1 (watermark)", AUDSRV_TYPE_U32, type );
          goto exit;
       }
-      
-      token= audsrv_conn_get_u64( client->conn );
-
 
-      AudsrvContext *ctx= client->ctx;
-      pthread_mutex_lock( &ctx->mutex );
-      sessionCount= 0;
-      for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
-           it != ctx->clients.end();
-           ++it )
-      {
-         AudsrvClient *clientIter= (*it);
+      watermark= audsrv_conn_get_u32( client->conn );
 
-         pthread_mutex_lock( &clientIter->mutex );
-         if ( clientIter->sessionType != AUDSRV_SESSION_Observer )
-         {
-            ++sessionCount;
-            infoSize += (AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U32_LEN); //client pid
-            infoSize += (AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U16_LEN); //client session type
-            namelen= strlen(clientIter->sessionName);
-            name= namelen ? clientIter->sessionName : "no-name";
-            infoSize += AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_STRING_LEN(name);
-         }
-         pthread_mutex_unlock( &clientIter->mutex );
-      }
+      TRACE1("msg: enabledatarequest watermark %u", watermark);
 
-      enumInfo= (unsigned char *)malloc( infoSize );
-      if ( enumInfo )
+      pthread_mutex_lock( &ctx->mutex );
+      pthread_mutex_lock( &client->mutex );
+      if ( watermark && !client->dataRequestWatermark )
       {
-         unsigned char *p= enumInfo;
-         for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
-              it != ctx->clients.end();
-              ++it )
-         {
-            AudsrvClient *clientIter= (*it);
-
-            pthread_mutex_lock( &clientIter->mutex );
-            if ( clientIter->sessionType != AUDSRV_SESSION_Observer )
-            {
-               TRACE1("client pid %d type %d name(%s)", clientIter->ucred.pid, clientIter->sessionType, name );
-               p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
-               p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
-               p += audsrv_conn_put_u32( p, clientIter->ucred.pid );
-               p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
-               p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
-               p += audsrv_conn_put_u16( p, clientIter->sessionType );
-               namelen= strlen(clientIter->sessionName);
-               name= namelen ? clientIter->sessionName : "no-name";
-               p += audsrv_conn_put_u32( p, AUDSRV_MSG_STRING_LEN(name) );
-               p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
-               p += audsrv_conn_put_string( p, name );
-            }
-            pthread_mutex_unlock( &clientIter->mutex );
-         }
+         ++ctx->dataRequestClientCount;
       }
-      else
+      else if ( !watermark && client->dataRequestWatermark )
       {
-         ERROR("No memory for enum session response");
+         --ctx->dataRequestClientCount;
       }
+      client->dataRequestWatermark= watermark;
+      client->dataRequestCredit= 0;
+      pthread_mutex_unlock( &client->mutex );
 
-      audsrv_send_enum_session_results( client, token, sessionCount, enumInfo, infoSize );
-
-      if ( enumInfo )
+      if ( watermark && !ctx->dataRequestThreadStarted )
       {
-         free( enumInfo );
+         if ( !pthread_create( &ctx->dataRequestThreadId, NULL, audsrv_data_request_thread, ctx ) )
+         {
+            ctx->dataRequestThreadStarted= true;
+         }
+         else
+         {
+            ERROR("unable to create data request thread");
+         }
       }
-
+      pthread_cond_signal( &ctx->dataRequestCond );
       pthread_mutex_unlock( &ctx->mutex );
    }
 
 exit:
+
    return msglen;
 }
 
-static int audsrv_process_getstatus( AudsrvClient *client, unsigned msglen, unsigned version )
+static int audsrv_process_select_session( AudsrvClient *client, unsigned msglen, unsigned version )
 {
-   TRACE1("msg: getstatus version %d", version);
+   TRACE2("msg: selectsession version %d", version);
 
-   if ( version <= AUDSRV_MSG_GetStatus_Version )
+   if ( version <= AUDSRV_MSG_SelectSession_Version )
    {
-      unsigned long long token;
       unsigned len, type;
-      char name[AUDSRV_MAX_SESSION_NAME_LEN+1];
-      char *sessionName= 0;
-      bool haveStatus= false;
-      AudSrvSessionStatus status, *pStatus= 0;
-      AudsrvContext *ctx= client->ctx;
-
-      pStatus= &status;
-      memset( &status, 0, sizeof(status) );
+      unsigned sessionId;
 
       len= audsrv_conn_get_u32( client->conn );
       type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_U64 )
+
+      if ( type != AUDSRV_TYPE_U32 )
       {
-         ERROR("expecting type %d (U64) not type %d for getstatus arg 1 (token)", AUDSRV_TYPE_U64, type );
+         ERROR("expecting type %d (U32) not type %d for selectsession arg 1 (sessionId)", AUDSRV_TYPE_U32, type );
          goto exit;
       }
-      
-      token= audsrv_conn_get_u64( client->conn );
+
+      sessionId= audsrv_conn_get_u32( client->conn );
+
+      TRACE2("msg: selectsession sessionId %u", sessionId);
+
+      if ( sessionId && !audsrv_find_sub_session( client, sessionId ) )
+      {
+         audsrv_create_sub_session( client, sessionId );
+      }
+      client->recvSessionId= sessionId;
+   }
+
+exit:
+
+   return msglen;
+}
+
+static int audsrv_process_release_session( AudsrvClient *client, unsigned msglen, unsigned version )
+{
+   TRACE1("msg: releasesession version %d", version);
+
+   if ( version <= AUDSRV_MSG_ReleaseSession_Version )
+   {
+      unsigned len, type;
+      unsigned sessionId;
+      AudsrvClient *sub;
 
       len= audsrv_conn_get_u32( client->conn );
       type= audsrv_conn_get_u32( client->conn );
-      
-      if ( type != AUDSRV_TYPE_String )
+
+      if ( type != AUDSRV_TYPE_U32 )
       {
-         ERROR("expecting type %d (string) not type %d for getstatus arg 2 (sessionName)", AUDSRV_TYPE_String, type );
+         ERROR("expecting type %d (U32) not type %d for releasesession arg 1 (sessionId)", AUDSRV_TYPE_U32, type );
          goto exit;
       }
-      if ( len > AUDSRV_MAX_SESSION_NAME_LEN )
+
+      sessionId= audsrv_conn_get_u32( client->conn );
+
+      TRACE1("msg: releasesession sessionId %u", sessionId);
+
+      sub= audsrv_find_sub_session( client, sessionId );
+      if ( sub )
       {
-         ERROR("sessionName too long (%d) for audio getstatus", len );
-         goto exit;
+         audsrv_release_sub_session( client, sub );
       }
-      
-      if ( len )
+      else
       {
-         audsrv_conn_get_string( client->conn, name );
-         sessionName= name;
+         // Sub-sessions that never sent anything were never created
+         TRACE1("releasesession: client %p has no sub-session %u", client, sessionId);
       }
+   }
 
-      if ( sessionName )
-      {
-         TRACE1("msg: getstatus sessionName (%s)", sessionName);
+exit:
 
-         pthread_mutex_lock( &ctx->mutex );
-         for( std::vector<AudsrvClient*>::iterator it= ctx->clients.begin();
-              it != ctx->clients.end();
-              ++it )
-         {
-            AudsrvClient *clientIter= (*it);
+   return msglen;
+}
 
-            pthread_mutex_lock( &clientIter->mutex );
-            if ( !strcmp( sessionName, clientIter->sessionName ) )
-            {
-               if ( clientIter->soc )
-               {
-                  if ( AudioServerSocGetStatus( ctx->soc, clientIter->soc, &status ) )
-                  {
-                     status.ready= true;
-                  }
-                  haveStatus= true;
-               }
-               else
-               {
-                  ERROR("msg: getstatus: no soc");
-               }
-            }
-            pthread_mutex_unlock( &clientIter->mutex );
-         }
-         pthread_mutex_unlock( &ctx->mutex );
-      }
-      else
+static void audsrv_eos_callback( void *userData )
+{
+   AudsrvClient *client= (AudsrvClient*)userData;
+   
+   if ( client )
+   {
+      TRACE1("audsrv_eos_callback: client %p", client);
+      audsrv_send_eos_detected( client );
+   }
+}
+
+static void audsrv_first_audio_callback( void *userData )
+{
+   AudsrvClient *client= (AudsrvClient*)userData;
+   
+   if ( client )
+   {
+      TRACE1("audsrv_first_audio_callback: client %p", client);
+      audsrv_send_first_audio( client );
+   }
+}
+
+static void audsrv_pts_error_callback( void *userData, unsigned count )
+{
+   AudsrvClient *client= (AudsrvClient*)userData;
+   
+   if ( client )
+   {
+      TRACE1("audsrv_pts_error_callback: client %p count %u", client, count);
+      audsrv_send_pts_error( client, count );
+   }
+}
+
+static void audsrv_underflow_callback( void *userData, unsigned count, unsigned bufferedBytes, unsigned queuedFrames )
+{
+   AudsrvClient *client= (AudsrvClient*)userData;
+   
+   if ( client )
+   {
+      TRACE1("audsrv_underflow_callback: client %p count %u bufferedBytes %u queuedFrames %u", 
+              client, count, bufferedBytes, queuedFrames);
+      audsrv_send_underflow( client, count, bufferedBytes, queuedFrames );
+   }
+}
+
+// Called on SoC threads: the handle is queued for the client thread to send
+static void audsrv_handle_release_callback( void *userData, unsigned long long dataHandle )
+{
+   AudsrvClient *client= (AudsrvClient*)userData;
+   bool wake= false;
+
+   if ( client )
+   {
+      TRACE3("audsrv_handle_release_callback: client %p handle %llx", client, dataHandle);
+
+      pthread_mutex_lock( &client->mutex );
+      if ( client->handleReleaseEnabled )
       {
-         if ( client->soc )
-         {   
-            if ( AudioServerSocGetStatus( ctx->soc, client->soc, &status ) )
+         if ( client->releasedHandleCount >= client->releasedHandleCapacity )
+         {
+            int capacity= (client->releasedHandleCapacity ? 2*client->releasedHandleCapacity : AUDSRV_MAX_RELEASED_HANDLES);
+            unsigned long long *handles= (unsigned long long*)realloc( client->releasedHandles, capacity*sizeof(unsigned long long) );
+            if ( handles )
             {
-               status.ready= true;
+               client->releasedHandles= handles;
+               client->releasedHandleCapacity= capacity;
             }
-            haveStatus= true;
+         }
+         if ( client->releasedHandleCount < client->releasedHandleCapacity )
+         {
+            client->releasedHandles[client->releasedHandleCount++]= dataHandle;
+
+            // Send a full batch now rather than waiting for the period to end
+            wake= (client->releasedHandleCount == AUDSRV_MAX_RELEASED_HANDLES);
          }
          else
          {
-            if ( !AudioServerSocGetStatus( ctx->soc, 0, &status ) )
-            {
-               ERROR("msg: getstatus: failed to get global status");
-            }
+            ERROR("unable to queue released handle %llx for client %p", dataHandle, client);
          }
       }
+      pthread_mutex_unlock( &client->mutex );
 
-      if ( haveStatus )
+      if ( wake )
       {
-         if ( sessionName )
-         {
-            strcpy( status.sessionName, sessionName );
-         }
-         else
+         eventfd_write( (client->parent ? client->parent : client)->fdWake, 1 );
+      }
+   }
+}
+
+static void audsrv_capture_callback( void *userData, AudSrvCaptureParameters *params, unsigned char *data, int datalen )
+{
+   AudsrvClient *client= (AudsrvClient*)userData;
+   
+   if ( client )
+   {
+      TRACE1("audsrv_capture_callback: client %p data %p datalen %u", client, data, datalen);
+      
+      if ( params->version != client->captureParams.version )
+      {
+         client->captureParams= *params;
+         audsrv_send_capture_params( client );
+      }
+
+      if ( client->captureRing )
+      {
+         audsrv_capture_ring_write( client, data, datalen );
+         return;
+      }
+
+      while( datalen > 0 )
+      {
+         int sendlen= datalen;
+         if (sendlen > AUDSRV_MAX_CAPTURE_DATA_SIZE)
          {
-            strcpy( status.sessionName, client->sessionName );
+            sendlen= AUDSRV_MAX_CAPTURE_DATA_SIZE;
          }
+         audsrv_send_capture_data( client, data, sendlen );
+         data += sendlen;
+         datalen -= sendlen;
       }
+   }
+}
 
-      audsrv_send_getstatus_results( client, token, pStatus );
+// The capture ring is a memfd holding an AudsrvCaptureRing header followed by the data area,
+// mapped by both server and client, plus an eventfd signalled as data is written.  Both
+// descriptors are handed to the client with the capture ring message.
+static bool audsrv_create_capture_ring( AudsrvClient *client, unsigned ringSize )
+{
+   bool result= false;
+   long pageSize= sysconf( _SC_PAGESIZE );
+   unsigned mapSize;
+   void *map;
+   int fd= -1, fdEvent= -1;
+
+   if ( ringSize > AUDSRV_CAPTURE_RING_MAX_SIZE )
+   {
+      ringSize= AUDSRV_CAPTURE_RING_MAX_SIZE;
    }
+   mapSize= ((sizeof(AudsrvCaptureRing)+ringSize+pageSize-1)/pageSize)*pageSize;
 
-exit:   
+   fd= memfd_create( "audsrv-capture", MFD_CLOEXEC );
+   if ( fd < 0 )
+   {
+      ERROR("unable to create capture ring: errno %d", errno);
+      goto exit;
+   }
 
-   return msglen;
-}
+   if ( ftruncate( fd, mapSize ) < 0 )
+   {
+      ERROR("unable to size capture ring (%u bytes): errno %d", mapSize, errno);
+      goto exit;
+   }
 
-static void audsrv_eos_callback( void *userData )
-{
-   AudsrvClient *client= (AudsrvClient*)userData;
-   
-   if ( client )
+   map= mmap( NULL, mapSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+   if ( map == MAP_FAILED )
    {
-      TRACE1("audsrv_eos_callback: client %p", client);
-      audsrv_send_eos_detected( client );
+      ERROR("unable to map capture ring: errno %d", errno);
+      goto exit;
+   }
+
+   fdEvent= eventfd( 0, EFD_CLOEXEC|EFD_NONBLOCK );
+   if ( fdEvent < 0 )
+   {
+      ERROR("unable to create capture ring eventfd: errno %d", errno);
+      munmap( map, mapSize );
+      goto exit;
+   }
+
+   pthread_mutex_lock( &client->mutex );
+   client->captureRing= (AudsrvCaptureRing*)map;
+   client->captureRing->magic= AUDSRV_CAPTURE_RING_MAGIC;
+   client->captureRing->size= mapSize-sizeof(AudsrvCaptureRing);
+   client->captureRingMapSize= mapSize;
+   client->captureRingFd= fd;
+   client->captureRingEventFd= fdEvent;
+   client->captureOverrunBytes= 0;
+   // Resend parameters so the client learns the position from which they apply
+   client->captureParams.version= (unsigned)-1;
+   pthread_mutex_unlock( &client->mutex );
+
+   INFO("client %p capture ring size %u", client, mapSize-(unsigned)sizeof(AudsrvCaptureRing));
+
+   fd= -1;
+   result= true;
+
+exit:
+   if ( fd >= 0 )
+   {
+      close( fd );
    }
+
+   return result;
 }
 
-static void audsrv_first_audio_callback( void *userData )
+// The data ring is a client supplied memfd holding an AudSrvDataRing header followed by the
+// data area.  It must be sealed against shrinking so the client cannot fault the server by
+// truncating it while mapped.
+static bool audsrv_map_data_ring( AudsrvClient *client, int fd )
 {
-   AudsrvClient *client= (AudsrvClient*)userData;
-   
-   if ( client )
+   bool result= false;
+   struct stat st;
+   int seals;
+   void *map;
+   AudSrvDataRing *ring;
+
+   seals= fcntl( fd, F_GET_SEALS );
+   if ( (seals < 0) || !(seals & F_SEAL_SHRINK) )
    {
-      TRACE1("audsrv_first_audio_callback: client %p", client);
-      audsrv_send_first_audio( client );
+      ERROR("client %p data ring is not sealed against shrinking", client);
+      goto exit;
+   }
+
+   if ( (fstat( fd, &st ) < 0) ||
+        (st.st_size < (off_t)sizeof(AudSrvDataRing)) ||
+        (st.st_size > (off_t)(sizeof(AudSrvDataRing)+AUDSRV_DATA_RING_MAX_SIZE)) )
+   {
+      ERROR("client %p data ring has bad size", client);
+      goto exit;
+   }
+
+   map= mmap( NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+   if ( map == MAP_FAILED )
+   {
+      ERROR("unable to map data ring: errno %d", errno);
+      goto exit;
+   }
+
+   ring= (AudSrvDataRing*)map;
+   if ( (ring->magic != AUDSRV_DATA_RING_MAGIC) || (ring->size > st.st_size-sizeof(AudSrvDataRing)) )
+   {
+      ERROR("client %p data ring has bad header: magic %X size %u", client, ring->magic, ring->size);
+      munmap( map, st.st_size );
+      goto exit;
    }
+
+   pthread_mutex_lock( &client->mutex );
+   client->dataRing= ring;
+   client->dataRingMapSize= st.st_size;
+   client->dataRingSize= ring->size;
+   pthread_mutex_unlock( &client->mutex );
+
+   INFO("client %p data ring size %u", client, client->dataRingSize);
+
+   result= true;
+
+exit:
+
+   return result;
 }
 
-static void audsrv_pts_error_callback( void *userData, unsigned count )
+static void audsrv_unmap_data_ring( AudsrvClient *client )
 {
-   AudsrvClient *client= (AudsrvClient*)userData;
-   
-   if ( client )
+   pthread_mutex_lock( &client->mutex );
+   if ( client->dataRing )
    {
-      TRACE1("audsrv_pts_error_callback: client %p count %u", client, count);
-      audsrv_send_pts_error( client, count );
+      munmap( client->dataRing, client->dataRingMapSize );
+      client->dataRing= 0;
+      client->dataRingMapSize= 0;
+      client->dataRingSize= 0;
    }
+   pthread_mutex_unlock( &client->mutex );
 }
 
-static void audsrv_underflow_callback( void *userData, unsigned count, unsigned bufferedBytes, unsigned queuedFrames )
+static void audsrv_destroy_capture_ring( AudsrvClient *client )
 {
-   AudsrvClient *client= (AudsrvClient*)userData;
-   
-   if ( client )
+   pthread_mutex_lock( &client->mutex );
+   if ( client->captureRing )
    {
-      TRACE1("audsrv_underflow_callback: client %p count %u bufferedBytes %u queuedFrames %u", 
-              client, count, bufferedBytes, queuedFrames);
-      audsrv_send_underflow( client, count, bufferedBytes, queuedFrames );
+      munmap( client->captureRing, client->captureRingMapSize );
+      client->captureRing= 0;
+      client->captureRingMapSize= 0;
+      client->captureOverrunBytes= 0;
+      client->captureParams.version= (unsigned)-1;
+   }
+   if ( client->captureRingFd >= 0 )
+   {
+      close( client->captureRingFd );
+      client->captureRingFd= -1;
+   }
+   if ( client->captureRingEventFd >= 0 )
+   {
+      close( client->captureRingEventFd );
+      client->captureRingEventFd= -1;
    }
+   pthread_mutex_unlock( &client->mutex );
 }
 
-static void audsrv_capture_callback( void *userData, AudSrvCaptureParameters *params, unsigned char *data, int datalen )
+// Data that does not fit in the space the client has left free is dropped whole, so the ring
+// only ever holds complete capture buffers.  A run of drops is reported once writing resumes.
+static void audsrv_capture_ring_write( AudsrvClient *client, unsigned char *data, int datalen )
 {
-   AudsrvClient *client= (AudsrvClient*)userData;
-   
-   if ( client )
+   unsigned long long overrunPosition= 0;
+   unsigned overrunBytes= 0;
+
+   pthread_mutex_lock( &client->mutex );
+   if ( client->captureRing && (datalen > 0) )
    {
-      TRACE1("audsrv_capture_callback: client %p data %p datalen %u", client, data, datalen);
-      
-      if ( params->version != client->captureParams.version )
+      AudsrvCaptureRing *ring= client->captureRing;
+      unsigned char *base= AUDSRV_CAPTURE_RING_DATA(ring);
+      unsigned size= ring->size;
+      unsigned long long writePos= ring->writePos;
+      unsigned long long readPos= ring->readPos;
+      unsigned long long used;
+
+      used= ((readPos <= writePos) ? writePos-readPos : size);
+      if ( used > size )
       {
-         client->captureParams= *params;
-         audsrv_send_capture_params( client );
+         used= size;
       }
 
-      while( datalen > 0 )
+      if ( (unsigned long long)datalen > size-used )
       {
-         int sendlen= datalen;
-         if (sendlen > AUDSRV_MAX_CAPTURE_DATA_SIZE)
+         if ( !client->captureOverrunBytes )
          {
-            sendlen= AUDSRV_MAX_CAPTURE_DATA_SIZE;
+            client->captureOverrunPosition= writePos;
+         }
+         client->captureOverrunBytes += datalen;
+         TRACE2("client %p capture ring full: dropped %d bytes", client, datalen);
+      }
+      else
+      {
+         unsigned offset= (unsigned)(writePos % size);
+         unsigned copylen= size-offset;
+
+         if ( copylen > (unsigned)datalen )
+         {
+            copylen= datalen;
+         }
+         memcpy( base+offset, data, copylen );
+         if ( copylen < (unsigned)datalen )
+         {
+            memcpy( base, data+copylen, datalen-copylen );
+         }
+
+         // Publish the data before the position that makes it visible
+         __sync_synchronize();
+         ring->writePos= writePos+datalen;
+
+         eventfd_write( client->captureRingEventFd, 1 );
+
+         if ( client->captureOverrunBytes )
+         {
+            overrunPosition= client->captureOverrunPosition;
+            overrunBytes= client->captureOverrunBytes;
+            client->captureOverrunBytes= 0;
          }
-         audsrv_send_capture_data( client, data, sendlen );
-         data += sendlen;
-         datalen -= sendlen;
       }
    }
+   pthread_mutex_unlock( &client->mutex );
+
+   if ( overrunBytes )
+   {
+      audsrv_send_capture_overrun( client, overrunPosition, overrunBytes );
+   }
+}
+
+static void audsrv_capture_overrun_flush( AudsrvClient *client )
+{
+   unsigned long long overrunPosition;
+   unsigned overrunBytes;
+
+   pthread_mutex_lock( &client->mutex );
+   overrunPosition= client->captureOverrunPosition;
+   overrunBytes= client->captureOverrunBytes;
+   client->captureOverrunBytes= 0;
+   pthread_mutex_unlock( &client->mutex );
+
+   if ( overrunBytes )
+   {
+      audsrv_send_capture_overrun( client, overrunPosition, overrunBytes );
+   }
 }
 
 static void audsrv_distribute_session_event( AudsrvContext *ctx, int event, AudsrvClient *clientSubject )
@@ -2300,6 +4841,10 @@ static void audsrv_send_session_event( AudsrvClient *client, int event, AudsrvCl
       namelen= strlen(clientSubject->sessionName);
       name= namelen ? clientSubject->sessionName : "no-name";
       paramLen += AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_STRING_LEN(name);
+      if ( client->sessionEventVersion >= AUDSRV_MSG_EnableSessionEvent_Version_Handle )
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN+AUDSRV_MSG_U32_LEN); //client session handle
+      }
 
       msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
       
@@ -2312,7 +4857,7 @@ static void audsrv_send_session_event( AudsrvClient *client, int event, AudsrvCl
 
       p += audsrv_conn_put_u32( p, paramLen );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_SessionEvent );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_SessionEvent_Version );
+      p += audsrv_conn_put_u32( p, (client->sessionEventVersion >= AUDSRV_MSG_EnableSessionEvent_Version_Handle ? AUDSRV_MSG_SessionEvent_Version_Handle : AUDSRV_MSG_SessionEvent_Version_Name) );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
       p += audsrv_conn_put_u32( p, event );
@@ -2327,6 +4872,12 @@ static void audsrv_send_session_event( AudsrvClient *client, int event, AudsrvCl
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_STRING_LEN(name) );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
       p += audsrv_conn_put_string( p, name );
+      if ( client->sessionEventVersion >= AUDSRV_MSG_EnableSessionEvent_Version_Handle )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+         p += audsrv_conn_put_u32( p, clientSubject->sessionHandle );
+      }
       
       sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
       
@@ -2549,6 +5100,10 @@ static bool audsrv_send_capture_params( AudsrvClient *client )
       paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // bitsPerSample
       paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // sampleRate
       paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // outputDelay
+      if ( client->captureRing )
+      {
+         paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // position
+      }
 
       msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
       
@@ -2561,7 +5116,7 @@ static bool audsrv_send_capture_params( AudsrvClient *client )
 
       p += audsrv_conn_put_u32( p, paramLen );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureParameters );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureParameters_Version );
+      p += audsrv_conn_put_u32( p, (client->captureRing ? AUDSRV_MSG_CaptureParameters_Version_Ring : AUDSRV_MSG_CaptureParameters_Version_Callback) );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
       p += audsrv_conn_put_u32( p, client->captureParams.version );
@@ -2577,6 +5132,17 @@ static bool audsrv_send_capture_params( AudsrvClient *client )
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
       p += audsrv_conn_put_u32( p, client->captureParams.outputDelay );
+      if ( client->captureRing )
+      {
+         AudsrvCaptureRing *ring= client->captureRing;
+
+         ring->paramsVersion= client->captureParams.version;
+         ring->paramsPos= ring->writePos;
+         __sync_synchronize();
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+         p += audsrv_conn_put_u64( p, ring->paramsPos );
+      }
 
       sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
       
@@ -2607,47 +5173,150 @@ static bool audsrv_send_capture_data( AudsrvClient *client, unsigned char *data,
       p= client->conn->sendbuff;
       paramLen= 0;
 
-      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + datalen); // buffer
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + datalen); // buffer
+
+      // Don't include payload data length since it doesn't occupy space
+      // in our work buffer
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen - datalen;
+      
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("captureData msg too large");
+         pthread_mutex_unlock( &client->mutex );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureData );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureData_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_BUFFER_LEN(datalen) );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_Buffer );
+
+      sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, data, datalen );
+      
+      result= (sendLen == msgLen+datalen);
+
+      pthread_mutex_unlock( &client->mutex );
+   }   
+
+exit:
+   TRACE1("audsrv_send_capture_data: client %p result %d", client, result );
+
+   return result;
+}
+
+static bool audsrv_send_capture_done( AudsrvClient *client )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   
+   TRACE1("audsrv_send_capture_done: client %p", client );
+   
+   if ( client )
+   {
+      pthread_mutex_lock( &client->mutex );
+
+      p= client->conn->sendbuff;
+      paramLen= 0;
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+      
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("capture done msg too large");
+         pthread_mutex_unlock( &client->mutex );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureDone );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureDone_Version );
+
+      sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
+      
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &client->mutex );
+   }   
+
+exit:
+   TRACE1("audsrv_send_capture_done: client %p result %d", client, result );
+
+   return result;
+}
+
+static bool audsrv_send_capture_ring( AudsrvClient *client, unsigned long long token, int ringResult )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+   unsigned ringSize;
+
+   TRACE1("audsrv_send_capture_ring: client %p token %llx result %d", client, token, ringResult );
+
+   if ( client )
+   {
+      pthread_mutex_lock( &client->mutex );
+
+      ringSize= (client->captureRing ? client->captureRing->size : 0);
+
+      p= client->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // result
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // ringSize
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureRing );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureRing_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+      p += audsrv_conn_put_u64( p, token );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, ringResult );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, ringSize );
+
+      if ( ringSize )
+      {
+         int fds[2];
 
-      // Don't include payload data length since it doesn't occupy space
-      // in our work buffer
-      msgLen= AUDSRV_MSG_HDR_LEN + paramLen - datalen;
-      
-      if ( msgLen > AUDSRV_MAX_MSG )
+         fds[0]= client->captureRingFd;
+         fds[1]= client->captureRingEventFd;
+         sendLen= audsrv_conn_send_fds( client->conn, client->conn->sendbuff, msgLen, fds, 2 );
+      }
+      else
       {
-         ERROR("captureData msg too large");
-         pthread_mutex_unlock( &client->mutex );
-         goto exit;
+         sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
       }
 
-      p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureData );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureData_Version );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_BUFFER_LEN(datalen) );
-      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_Buffer );
-
-      sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, data, datalen );
-      
-      result= (sendLen == msgLen+datalen);
+      result= (sendLen == msgLen);
 
       pthread_mutex_unlock( &client->mutex );
-   }   
+   }
 
-exit:
-   TRACE1("audsrv_send_capture_data: client %p result %d", client, result );
+   TRACE1("audsrv_send_capture_ring: client %p result %d", client, result );
 
    return result;
 }
 
-static bool audsrv_send_capture_done( AudsrvClient *client )
+static bool audsrv_send_capture_overrun( AudsrvClient *client, unsigned long long position, unsigned droppedBytes )
 {
    bool result= false;
    unsigned char *p;
    int msgLen, paramLen;
    int sendLen;
-   
-   TRACE1("audsrv_send_capture_done: client %p", client );
-   
+
+   TRACE1("audsrv_send_capture_overrun: client %p position %llu dropped %u", client, position, droppedBytes );
+
    if ( client )
    {
       pthread_mutex_lock( &client->mutex );
@@ -2655,33 +5324,34 @@ static bool audsrv_send_capture_done( AudsrvClient *client )
       p= client->conn->sendbuff;
       paramLen= 0;
 
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // position
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // droppedBytes
+
       msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
-      
-      if ( msgLen > AUDSRV_MAX_MSG )
-      {
-         ERROR("capture done msg too large");
-         pthread_mutex_unlock( &client->mutex );
-         goto exit;
-      }
 
       p += audsrv_conn_put_u32( p, paramLen );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureDone );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureDone_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureOverrun );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_CaptureOverrun_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+      p += audsrv_conn_put_u64( p, position );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, droppedBytes );
 
       sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
-      
+
       result= (sendLen == msgLen);
 
       pthread_mutex_unlock( &client->mutex );
-   }   
+   }
 
-exit:
-   TRACE1("audsrv_send_capture_done: client %p result %d", client, result );
+   TRACE1("audsrv_send_capture_overrun: client %p result %d", client, result );
 
    return result;
 }
 
-static bool audsrv_send_enum_session_results( AudsrvClient *client, unsigned long long token, int sessionCount, unsigned char *data, int datalen )
+static bool audsrv_send_enum_session_results( AudsrvClient *client, unsigned version, unsigned long long token, int sessionCount, unsigned char *data, int datalen )
 {
    bool result= false;
    unsigned char *p;
@@ -2718,7 +5388,7 @@ static bool audsrv_send_enum_session_results( AudsrvClient *client, unsigned lon
 
       p += audsrv_conn_put_u32( p, paramLen );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnumSessionsResults );
-      p += audsrv_conn_put_u32( p, AUDSRV_MSG_EnumSessionsResults_Version );
+      p += audsrv_conn_put_u32( p, version );
       p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
       p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
       p += audsrv_conn_put_u64( p, token );
@@ -2742,6 +5412,77 @@ exit:
    return result;
 }
 
+static bool audsrv_send_getlatency_results( AudsrvClient *client, unsigned long long token, int latencyResult, AudSrvLatency *latency )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+
+   TRACE1("audsrv_send_getlatency_results: client %p", client );
+
+   if ( client )
+   {
+      pthread_mutex_lock( &client->mutex );
+
+      p= client->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // token
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // latencyResult
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // timestamp
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // serverBytes
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // serverFrames
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // socBytes
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // socFrames
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // sampleRate
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // outputDelay
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetLatencyResults );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_GetLatencyResults_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+      p += audsrv_conn_put_u64( p, token );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, latencyResult );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+      p += audsrv_conn_put_u64( p, latency->timestamp );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, latency->serverBytes );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, latency->serverFrames );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, latency->socBytes );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, latency->socFrames );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, latency->sampleRate );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, latency->outputDelay );
+
+      sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
+
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &client->mutex );
+   }
+
+   TRACE1("audsrv_send_getlatency_results: client %p result %d", client, result );
+
+   return result;
+}
+
 static bool audsrv_send_getstatus_results( AudsrvClient *client, unsigned long long token, AudSrvSessionStatus *status )
 {
    bool result= false;
@@ -2845,6 +5586,200 @@ exit:
    return result;
 }
 
+static bool audsrv_send_session_handle( AudsrvClient *client, unsigned reason, unsigned sessionHandle, const char *sessionName )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen, nameLen;
+   int sendLen;
+
+   TRACE1("audsrv_send_session_handle: client %p reason %u handle %X", client, reason, sessionHandle );
+
+   if ( client )
+   {
+      pthread_mutex_lock( &client->mutex );
+
+      p= client->conn->sendbuff;
+      paramLen= 0;
+
+      nameLen= AUDSRV_MSG_STRING_LEN(sessionName);
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U16_LEN); // reason
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // sessionHandle
+      paramLen += AUDSRV_MSG_TYPE_HDR_LEN+nameLen;
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("session handle msg too large");
+         pthread_mutex_unlock( &client->mutex );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_SessionHandle );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_SessionHandle_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U16_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U16 );
+      p += audsrv_conn_put_u16( p, reason );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, sessionHandle );
+      p += audsrv_conn_put_u32( p, nameLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_String );
+      p += audsrv_conn_put_string( p, sessionName );
+
+      sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
+
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &client->mutex );
+   }
+
+exit:
+   TRACE1("audsrv_send_session_handle: client %p result %d", client, result );
+
+   return result;
+}
+
+static bool audsrv_send_handle_release( AudsrvClient *client, int count, unsigned long long *dataHandles )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+
+   TRACE2("audsrv_send_handle_release: client %p count %d", client, count );
+
+   if ( client )
+   {
+      pthread_mutex_lock( &client->mutex );
+
+      p= client->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // count
+      paramLen += count*(AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U64_LEN); // dataHandles
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_HandleRelease );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_HandleRelease_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, count );
+      for( int i= 0; i < count; ++i )
+      {
+         p += audsrv_conn_put_u32( p, AUDSRV_MSG_U64_LEN );
+         p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U64 );
+         p += audsrv_conn_put_u64( p, dataHandles[i] );
+      }
+
+      sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
+
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &client->mutex );
+   }
+
+   TRACE2("audsrv_send_handle_release: client %p result %d", client, result );
+
+   return result;
+}
+
+static bool audsrv_send_flush_ack( AudsrvClient *client, unsigned generation )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+
+   TRACE1("audsrv_send_flush_ack: client %p generation %u", client, generation );
+
+   if ( client )
+   {
+      pthread_mutex_lock( &client->mutex );
+
+      p= client->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // generation
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_FlushAck );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_FlushAck_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, generation );
+
+      sendLen= audsrv_conn_send( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
+
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &client->mutex );
+   }
+
+   TRACE1("audsrv_send_flush_ack: client %p result %d", client, result );
+
+   return result;
+}
+
+static bool audsrv_send_data_request( AudsrvClient *client, unsigned credit, unsigned bufferedBytes )
+{
+   bool result= false;
+   unsigned char *p;
+   int msgLen, paramLen;
+   int sendLen;
+
+   TRACE2("audsrv_send_data_request: client %p credit %u bufferedBytes %u", client, credit, bufferedBytes );
+
+   if ( client )
+   {
+      pthread_mutex_lock( &client->mutex );
+
+      p= client->conn->sendbuff;
+      paramLen= 0;
+
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // credit
+      paramLen += (AUDSRV_MSG_TYPE_HDR_LEN + AUDSRV_MSG_U32_LEN); // bufferedBytes
+
+      msgLen= AUDSRV_MSG_HDR_LEN + paramLen;
+
+      if ( msgLen > AUDSRV_MAX_MSG )
+      {
+         ERROR("data request msg too large");
+         pthread_mutex_unlock( &client->mutex );
+         goto exit;
+      }
+
+      p += audsrv_conn_put_u32( p, paramLen );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DataRequest );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_DataRequest_Version );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, credit );
+      p += audsrv_conn_put_u32( p, AUDSRV_MSG_U32_LEN );
+      p += audsrv_conn_put_u32( p, AUDSRV_TYPE_U32 );
+      p += audsrv_conn_put_u32( p, bufferedBytes );
+
+      // Sent from the data request thread with ctx->mutex held, so never wait on a client
+      // that is not reading: the request is dropped instead
+      sendLen= audsrv_conn_send_nonblocking( client->conn, client->conn->sendbuff, msgLen, NULL, 0 );
+
+      result= (sendLen == msgLen);
+
+      pthread_mutex_unlock( &client->mutex );
+   }
+
+exit:
+   TRACE2("audsrv_send_data_request: client %p result %d", client, result );
+
+   return result;
+}
+
 /** @} */
 /** @} */
 
@@ -0,0 +1,353 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2017 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/**
+* @defgroup audioserver
+* @{
+* @defgroup audsrv-pcm
+* @{
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDSRV_PCM_NEON
+#endif
+
+#include "audioserver.h"
+#include "audsrv-logger.h"
+#include "audsrv-pcm.h"
+
+#define AUDSRV_PCM_SAMPLE_SIZE (4)
+#define AUDSRV_PCM_DITHER_SIZE (4096)
+#define AUDSRV_PCM_DITHER_MASK (AUDSRV_PCM_DITHER_SIZE-1)
+#define AUDSRV_PCM_VECTOR (8)
+
+// Samples are scaled into 16 bit LSB units: S24_32LE is shifted into the top of the word and
+// then handled as S32LE
+#define AUDSRV_PCM_SCALE_S32 (1.0f/65536.0f)
+#define AUDSRV_PCM_SCALE_F32 (32768.0f)
+
+// Adding this offset makes every clamped value positive so truncation rounds to nearest
+#define AUDSRV_PCM_ROUND_OFFSET (32768.5f)
+
+struct _AudsrvPcm
+{
+   unsigned format;
+   bool isFloat;
+   bool isS24;
+   float scale;
+   unsigned char carry[AUDSRV_PCM_SAMPLE_SIZE];
+   unsigned carryLen;
+   short *buffer;
+   unsigned bufferCapacity;
+   unsigned ditherPos;
+   // The table is followed by a copy of its first AUDSRV_PCM_VECTOR entries so a vector load
+   // never has to wrap
+   float dither[AUDSRV_PCM_DITHER_SIZE+AUDSRV_PCM_VECTOR];
+};
+
+static void audsrv_pcm_init_dither( AudsrvPcm *pcm )
+{
+   unsigned seed= 0x12345678;
+   float r1, r2;
+   int i;
+
+   // Triangular PDF noise of +/-1 LSB: the sum of two uniform values in [-0.5,0.5)
+   for( i= 0; i < AUDSRV_PCM_DITHER_SIZE; ++i )
+   {
+      seed= seed*1664525 + 1013904223;
+      r1= ((seed >> 8) & 0xFFFF) / 65536.0f - 0.5f;
+      seed= seed*1664525 + 1013904223;
+      r2= ((seed >> 8) & 0xFFFF) / 65536.0f - 0.5f;
+      pcm->dither[i]= r1 + r2;
+   }
+   for( i= 0; i < AUDSRV_PCM_VECTOR; ++i )
+   {
+      pcm->dither[AUDSRV_PCM_DITHER_SIZE+i]= pcm->dither[i];
+   }
+}
+
+static short audsrv_pcm_convert_sample( AudsrvPcm *pcm, unsigned char *in )
+{
+   float f;
+   int v;
+
+   // Servers run on little endian hosts so the wire order is the native order
+   if ( pcm->isFloat )
+   {
+      memcpy( &f, in, sizeof(f) );
+   }
+   else
+   {
+      memcpy( &v, in, sizeof(v) );
+      if ( pcm->isS24 )
+      {
+         v= (int)((unsigned)v << 8);
+      }
+      f= (float)v;
+   }
+
+   f= f*pcm->scale + pcm->dither[pcm->ditherPos];
+   pcm->ditherPos= ((pcm->ditherPos+1) & AUDSRV_PCM_DITHER_MASK);
+
+   // Written so that NaN clamps low, as the vector paths do
+   if ( !(f >= -32768.0f) )
+   {
+      f= -32768.0f;
+   }
+   else if ( f > 32767.0f )
+   {
+      f= 32767.0f;
+   }
+
+   return (short)((int)(f + AUDSRV_PCM_ROUND_OFFSET) - 32768);
+}
+
+static void audsrv_pcm_convert_samples( AudsrvPcm *pcm, unsigned char *in, short *out, unsigned count )
+{
+   unsigned i= 0;
+
+   #if defined(__SSE2__)
+   {
+      __m128 scale= _mm_set1_ps( pcm->scale );
+      __m128 low= _mm_set1_ps( -32768.0f );
+      __m128 high= _mm_set1_ps( 32767.0f );
+      __m128i v0, v1;
+      __m128 f0, f1;
+      float *dither;
+
+      for( ; i+AUDSRV_PCM_VECTOR <= count; i += AUDSRV_PCM_VECTOR )
+      {
+         v0= _mm_loadu_si128( (__m128i*)(in+i*AUDSRV_PCM_SAMPLE_SIZE) );
+         v1= _mm_loadu_si128( (__m128i*)(in+(i+4)*AUDSRV_PCM_SAMPLE_SIZE) );
+         if ( pcm->isFloat )
+         {
+            f0= _mm_castsi128_ps( v0 );
+            f1= _mm_castsi128_ps( v1 );
+         }
+         else
+         {
+            if ( pcm->isS24 )
+            {
+               v0= _mm_slli_epi32( v0, 8 );
+               v1= _mm_slli_epi32( v1, 8 );
+            }
+            f0= _mm_cvtepi32_ps( v0 );
+            f1= _mm_cvtepi32_ps( v1 );
+         }
+
+         dither= pcm->dither+pcm->ditherPos;
+         f0= _mm_add_ps( _mm_mul_ps( f0, scale ), _mm_loadu_ps( dither ) );
+         f1= _mm_add_ps( _mm_mul_ps( f1, scale ), _mm_loadu_ps( dither+4 ) );
+         pcm->ditherPos= ((pcm->ditherPos+AUDSRV_PCM_VECTOR) & AUDSRV_PCM_DITHER_MASK);
+
+         // max returns its second operand for NaN so NaN clamps low
+         f0= _mm_min_ps( _mm_max_ps( f0, low ), high );
+         f1= _mm_min_ps( _mm_max_ps( f1, low ), high );
+
+         _mm_storeu_si128( (__m128i*)(out+i), _mm_packs_epi32( _mm_cvtps_epi32( f0 ), _mm_cvtps_epi32( f1 ) ) );
+      }
+   }
+   #elif defined(AUDSRV_PCM_NEON)
+   {
+      float32x4_t scale= vdupq_n_f32( pcm->scale );
+      float32x4_t low= vdupq_n_f32( -32768.0f );
+      float32x4_t high= vdupq_n_f32( 32767.0f );
+      float32x4_t offset= vdupq_n_f32( AUDSRV_PCM_ROUND_OFFSET );
+      int32x4_t bias= vdupq_n_s32( 32768 );
+      int32x4_t v0, v1;
+      float32x4_t f0, f1;
+      float *dither;
+
+      for( ; i+AUDSRV_PCM_VECTOR <= count; i += AUDSRV_PCM_VECTOR )
+      {
+         v0= vreinterpretq_s32_u8( vld1q_u8( in+i*AUDSRV_PCM_SAMPLE_SIZE ) );
+         v1= vreinterpretq_s32_u8( vld1q_u8( in+(i+4)*AUDSRV_PCM_SAMPLE_SIZE ) );
+         if ( pcm->isFloat )
+         {
+            f0= vreinterpretq_f32_s32( v0 );
+            f1= vreinterpretq_f32_s32( v1 );
+         }
+         else
+         {
+            if ( pcm->isS24 )
+            {
+               v0= vshlq_n_s32( v0, 8 );
+               v1= vshlq_n_s32( v1, 8 );
+            }
+            f0= vcvtq_f32_s32( v0 );
+            f1= vcvtq_f32_s32( v1 );
+         }
+
+         dither= pcm->dither+pcm->ditherPos;
+         f0= vmlaq_f32( vld1q_f32( dither ), f0, scale );
+         f1= vmlaq_f32( vld1q_f32( dither+4 ), f1, scale );
+         pcm->ditherPos= ((pcm->ditherPos+AUDSRV_PCM_VECTOR) & AUDSRV_PCM_DITHER_MASK);
+
+         f0= vminq_f32( vmaxq_f32( f0, low ), high );
+         f1= vminq_f32( vmaxq_f32( f1, low ), high );
+
+         // vcvtq truncates so round through the positive offset range
+         v0= vsubq_s32( vcvtq_s32_f32( vaddq_f32( f0, offset ) ), bias );
+         v1= vsubq_s32( vcvtq_s32_f32( vaddq_f32( f1, offset ) ), bias );
+
+         vst1q_s16( out+i, vcombine_s16( vqmovn_s32( v0 ), vqmovn_s32( v1 ) ) );
+      }
+   }
+   #endif
+
+   for( ; i < count; ++i )
+   {
+      out[i]= audsrv_pcm_convert_sample( pcm, in+i*AUDSRV_PCM_SAMPLE_SIZE );
+   }
+}
+
+AudsrvPcm* audsrv_pcm_create( unsigned format )
+{
+   AudsrvPcm *pcm= 0;
+
+   switch( format )
+   {
+      case AUDSRV_PCM_FORMAT_S24_32LE:
+      case AUDSRV_PCM_FORMAT_S32LE:
+      case AUDSRV_PCM_FORMAT_F32LE:
+         break;
+      default:
+         ERROR("no conversion for pcm format %u", format);
+         goto exit;
+   }
+
+   pcm= (AudsrvPcm*)calloc( 1, sizeof(AudsrvPcm) );
+   if ( !pcm )
+   {
+      ERROR("unable to allocate pcm converter");
+      goto exit;
+   }
+
+   pcm->format= format;
+   pcm->isFloat= (format == AUDSRV_PCM_FORMAT_F32LE);
+   pcm->isS24= (format == AUDSRV_PCM_FORMAT_S24_32LE);
+   pcm->scale= (pcm->isFloat ? AUDSRV_PCM_SCALE_F32 : AUDSRV_PCM_SCALE_S32);
+
+   audsrv_pcm_init_dither( pcm );
+
+exit:
+
+   return pcm;
+}
+
+void audsrv_pcm_destroy( AudsrvPcm *pcm )
+{
+   if ( pcm )
+   {
+      if ( pcm->buffer )
+      {
+         free( pcm->buffer );
+         pcm->buffer= 0;
+      }
+      free( pcm );
+   }
+}
+
+unsigned audsrv_pcm_get_format( AudsrvPcm *pcm )
+{
+   return (pcm ? pcm->format : AUDSRV_PCM_FORMAT_S16LE);
+}
+
+void audsrv_pcm_reset( AudsrvPcm *pcm )
+{
+   if ( pcm )
+   {
+      pcm->carryLen= 0;
+   }
+}
+
+unsigned audsrv_pcm_convert( AudsrvPcm *pcm, unsigned char *data, unsigned len, unsigned char **out )
+{
+   unsigned outlen= 0;
+   unsigned count, fill;
+   short *dest;
+
+   count= (pcm->carryLen+len)/AUDSRV_PCM_SAMPLE_SIZE;
+   if ( count > pcm->bufferCapacity )
+   {
+      short *buffer= (short*)realloc( pcm->buffer, count*sizeof(short) );
+      if ( !buffer )
+      {
+         ERROR("unable to allocate pcm conversion buffer of %u samples", count);
+         goto exit;
+      }
+      pcm->buffer= buffer;
+      pcm->bufferCapacity= count;
+   }
+   dest= pcm->buffer;
+
+   if ( pcm->carryLen )
+   {
+      fill= AUDSRV_PCM_SAMPLE_SIZE-pcm->carryLen;
+      if ( fill > len )
+      {
+         fill= len;
+      }
+      memcpy( pcm->carry+pcm->carryLen, data, fill );
+      pcm->carryLen += fill;
+      data += fill;
+      len -= fill;
+      if ( pcm->carryLen == AUDSRV_PCM_SAMPLE_SIZE )
+      {
+         *(dest++)= audsrv_pcm_convert_sample( pcm, pcm->carry );
+         pcm->carryLen= 0;
+      }
+   }
+
+   count= len/AUDSRV_PCM_SAMPLE_SIZE;
+   audsrv_pcm_convert_samples( pcm, data, dest, count );
+   dest += count;
+
+   pcm->carryLen += len-count*AUDSRV_PCM_SAMPLE_SIZE;
+   memcpy( pcm->carry, data+count*AUDSRV_PCM_SAMPLE_SIZE, len-count*AUDSRV_PCM_SAMPLE_SIZE );
+
+   outlen= (dest-pcm->buffer)*sizeof(short);
+
+exit:
+
+   *out= (unsigned char*)pcm->buffer;
+
+   return outlen;
+}
+
+unsigned audsrv_pcm_input_bytes( unsigned format, unsigned bytes )
+{
+   if ( format != AUDSRV_PCM_FORMAT_S16LE )
+   {
+      bytes= (bytes/sizeof(short))*AUDSRV_PCM_SAMPLE_SIZE;
+   }
+
+   return bytes;
+}
+
+/** @} */
+/** @} */
+
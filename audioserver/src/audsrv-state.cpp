@@ -0,0 +1,345 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2017 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/**
+* @defgroup audioserver
+* @{
+* @defgroup audsrv-state
+* @{
+**/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "audioserver.h"
+#include "audsrv-logger.h"
+#include "audsrv-state.h"
+
+#define AUDSRV_STATE_MAGIC (0x41535354) // 'ASST'
+#define AUDSRV_STATE_VERSION (1)
+#define AUDSRV_STATE_MAX_ENTRIES (32)
+#define AUDSRV_STATE_SUFFIX ".state"
+#define AUDSRV_STATE_MODE (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)
+
+#define LEVEL_DENOMINATOR (1000000)
+
+typedef struct _AudsrvStateRecord
+{
+   unsigned checksum;
+   unsigned flags;
+   unsigned level;
+   unsigned muted;
+   unsigned sequence;
+   char sessionName[AUDSRV_MAX_SESSION_NAME_LEN+1];
+} AudsrvStateRecord;
+
+typedef struct _AudsrvStateFile
+{
+   unsigned magic;
+   unsigned version;
+   unsigned size;
+   unsigned sequence;
+   AudsrvStateRecord global;
+   AudsrvStateRecord sessions[AUDSRV_STATE_MAX_ENTRIES];
+} AudsrvStateFile;
+
+struct _AudsrvState
+{
+   pthread_mutex_t mutex;
+   int fd;
+   AudsrvStateFile *file;
+};
+
+static unsigned audsrv_state_checksum( AudsrvStateRecord *record )
+{
+   // FNV-1a over everything following the checksum field
+   unsigned char *p= (unsigned char*)record + sizeof(record->checksum);
+   int len= sizeof(AudsrvStateRecord) - sizeof(record->checksum);
+   unsigned hash= 2166136261U;
+
+   for( int i= 0; i < len; ++i )
+   {
+      hash ^= p[i];
+      hash *= 16777619U;
+   }
+
+   return hash;
+}
+
+static bool audsrv_state_record_valid( AudsrvStateRecord *record )
+{
+   bool valid= false;
+
+   if ( record->flags )
+   {
+      valid= ((record->checksum == audsrv_state_checksum( record )) &&
+              (record->level <= LEVEL_DENOMINATOR) &&
+              (memchr( record->sessionName, 0, sizeof(record->sessionName) ) != 0));
+   }
+
+   return valid;
+}
+
+static void audsrv_state_record_commit( AudsrvState *state, AudsrvStateRecord *record )
+{
+   record->sequence= ++state->file->sequence;
+   record->checksum= audsrv_state_checksum( record );
+}
+
+static AudsrvStateRecord* audsrv_state_find( AudsrvState *state, const char *sessionName, bool create )
+{
+   AudsrvStateRecord *record= 0;
+   AudsrvStateRecord *oldest= 0;
+
+   if ( !sessionName )
+   {
+      return &state->file->global;
+   }
+
+   for( int i= 0; i < AUDSRV_STATE_MAX_ENTRIES; ++i )
+   {
+      AudsrvStateRecord *iter= &state->file->sessions[i];
+
+      if ( iter->flags )
+      {
+         if ( !strcmp( iter->sessionName, sessionName ) )
+         {
+            record= iter;
+            break;
+         }
+         if ( !oldest || (oldest->flags && (iter->sequence < oldest->sequence)) )
+         {
+            oldest= iter;
+         }
+      }
+      else if ( !oldest || oldest->flags )
+      {
+         oldest= iter;
+      }
+   }
+
+   if ( !record && create && oldest )
+   {
+      // Reuse a free record or else the least recently updated one
+      record= oldest;
+      memset( record, 0, sizeof(AudsrvStateRecord) );
+      strncpy( record->sessionName, sessionName, AUDSRV_MAX_SESSION_NAME_LEN );
+      record->level= LEVEL_DENOMINATOR;
+   }
+
+   return record;
+}
+
+AudsrvState* audsrv_state_open( const char *serverName )
+{
+   AudsrvState *state= 0;
+   const char *workDir;
+   char name[256];
+   struct stat st;
+   bool reset= false;
+   void *map;
+   int discarded= 0;
+
+   workDir= getenv("XDG_RUNTIME_DIR");
+   if ( !workDir )
+   {
+      ERROR("XDG_RUNTIME_DIR is not set: mixer state will not be persisted");
+      goto exit;
+   }
+
+   if ( snprintf( name, sizeof(name), "%s/%s%s", workDir, serverName, AUDSRV_STATE_SUFFIX ) >= (int)sizeof(name) )
+   {
+      ERROR("state file name too long: mixer state will not be persisted");
+      goto exit;
+   }
+
+   state= (AudsrvState*)calloc( 1, sizeof(AudsrvState) );
+   if ( !state )
+   {
+      ERROR("unable to allocate state");
+      goto exit;
+   }
+   pthread_mutex_init( &state->mutex, 0 );
+
+   state->fd= open( name, O_RDWR|O_CREAT|O_CLOEXEC, AUDSRV_STATE_MODE );
+   if ( state->fd < 0 )
+   {
+      ERROR("unable to open state file (%s) errno %d", name, errno );
+      goto error;
+   }
+
+   if ( fstat( state->fd, &st ) < 0 )
+   {
+      ERROR("unable to stat state file (%s) errno %d", name, errno );
+      goto error;
+   }
+
+   if ( st.st_size != sizeof(AudsrvStateFile) )
+   {
+      if ( ftruncate( state->fd, sizeof(AudsrvStateFile) ) < 0 )
+      {
+         ERROR("unable to size state file (%s) errno %d", name, errno );
+         goto error;
+      }
+      reset= true;
+   }
+
+   map= mmap( NULL, sizeof(AudsrvStateFile), PROT_READ|PROT_WRITE, MAP_SHARED, state->fd, 0 );
+   if ( map == MAP_FAILED )
+   {
+      ERROR("unable to map state file (%s) errno %d", name, errno );
+      goto error;
+   }
+   state->file= (AudsrvStateFile*)map;
+
+   if ( !reset )
+   {
+      reset= ((state->file->magic != AUDSRV_STATE_MAGIC) ||
+              (state->file->version != AUDSRV_STATE_VERSION) ||
+              (state->file->size != sizeof(AudsrvStateFile)));
+   }
+
+   if ( reset )
+   {
+      INFO("initializing state file (%s)", name);
+      memset( state->file, 0, sizeof(AudsrvStateFile) );
+      state->file->magic= AUDSRV_STATE_MAGIC;
+      state->file->version= AUDSRV_STATE_VERSION;
+      state->file->size= sizeof(AudsrvStateFile);
+   }
+   else
+   {
+      if ( state->file->global.flags && !audsrv_state_record_valid( &state->file->global ) )
+      {
+         memset( &state->file->global, 0, sizeof(AudsrvStateRecord) );
+         ++discarded;
+      }
+      for( int i= 0; i < AUDSRV_STATE_MAX_ENTRIES; ++i )
+      {
+         AudsrvStateRecord *record= &state->file->sessions[i];
+         if ( record->flags && !audsrv_state_record_valid( record ) )
+         {
+            memset( record, 0, sizeof(AudsrvStateRecord) );
+            ++discarded;
+         }
+      }
+      INFO("restored state file (%s): discarded %d corrupt records", name, discarded);
+   }
+
+exit:
+
+   return state;
+
+error:
+
+   audsrv_state_close( state );
+
+   return 0;
+}
+
+void audsrv_state_close( AudsrvState *state )
+{
+   if ( state )
+   {
+      if ( state->file )
+      {
+         munmap( state->file, sizeof(AudsrvStateFile) );
+         state->file= 0;
+      }
+      if ( state->fd >= 0 )
+      {
+         close( state->fd );
+         state->fd= -1;
+      }
+      pthread_mutex_destroy( &state->mutex );
+      free( state );
+   }
+}
+
+unsigned audsrv_state_get( AudsrvState *state, const char *sessionName, float *volume, bool *muted )
+{
+   unsigned flags= 0;
+
+   if ( state )
+   {
+      pthread_mutex_lock( &state->mutex );
+      AudsrvStateRecord *record= audsrv_state_find( state, sessionName, false );
+      if ( record )
+      {
+         flags= record->flags;
+         if ( volume )
+         {
+            *volume= (float)record->level/(float)LEVEL_DENOMINATOR;
+         }
+         if ( muted )
+         {
+            *muted= (record->muted ? true : false);
+         }
+      }
+      pthread_mutex_unlock( &state->mutex );
+   }
+
+   return flags;
+}
+
+void audsrv_state_set_volume( AudsrvState *state, const char *sessionName, float volume )
+{
+   if ( state && (!sessionName || sessionName[0]) )
+   {
+      pthread_mutex_lock( &state->mutex );
+      AudsrvStateRecord *record= audsrv_state_find( state, sessionName, true );
+      if ( record )
+      {
+         if ( volume < 0.0 ) volume= 0.0;
+         if ( volume > 1.0 ) volume= 1.0;
+         record->level= (unsigned)(LEVEL_DENOMINATOR * volume);
+         record->flags |= AUDSRV_STATE_Volume;
+         audsrv_state_record_commit( state, record );
+      }
+      pthread_mutex_unlock( &state->mutex );
+   }
+}
+
+void audsrv_state_set_mute( AudsrvState *state, const char *sessionName, bool muted )
+{
+   if ( state && (!sessionName || sessionName[0]) )
+   {
+      pthread_mutex_lock( &state->mutex );
+      AudsrvStateRecord *record= audsrv_state_find( state, sessionName, true );
+      if ( record )
+      {
+         record->muted= (muted ? 1 : 0);
+         record->flags |= AUDSRV_STATE_Mute;
+         audsrv_state_record_commit( state, record );
+      }
+      pthread_mutex_unlock( &state->mutex );
+   }
+}
+
+/** @} */
+/** @} */
+
@@ -29,6 +29,7 @@
 #endif
 
 #include "gstaudsrvsink.h"
+#include "gstaudsrvsrc.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -36,16 +37,55 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 
 #define GST_PACKAGE_ORIGIN "http://gstreamer.net/"
 
-#ifndef SOC_SPECIFIC_CAPS
-  #define SOC_SPECIFIC_CAPS ""
+#ifdef USE_GST1
+  // The server converts these to S16LE so decoders producing them need no audioconvert
+  #define AUDSRV_SINK_PCM_CAPS \
+          "audio/x-raw, format=(string){ S24_32LE, S32LE, F32LE }, layout=(string)interleaved, " \
+          "rate=(int)[ 1, MAX ], channels=(int)[ 1, 8 ]"
+  #ifdef SOC_SPECIFIC_CAPS
+    #define AUDSRV_SINK_SOC_CAPS SOC_SPECIFIC_CAPS "; "
+  #else
+    #define AUDSRV_SINK_SOC_CAPS ""
+  #endif
+#else
+  #define AUDSRV_SINK_PCM_CAPS ""
+  #ifdef SOC_SPECIFIC_CAPS
+    #define AUDSRV_SINK_SOC_CAPS SOC_SPECIFIC_CAPS
+  #else
+    #define AUDSRV_SINK_SOC_CAPS ""
+  #endif
 #endif
 
+// AudioSync pacing: STC is sampled every check interval and a sync is sent once the
+// current interval has elapsed.  The interval starts at the minimum, doubles each time a
+// sync finds the STC where the drift estimate predicted, and falls back to the minimum
+// when the prediction error exceeds the threshold.  Times are in microseconds.
+#define AUDSRV_SINK_SYNC_CHECK_INTERVAL (100000LL)
+#define AUDSRV_SINK_SYNC_MIN_INTERVAL (200000LL)
+#define AUDSRV_SINK_SYNC_MAX_INTERVAL (10000000LL)
+#define AUDSRV_SINK_SYNC_ERROR_THRESHOLD (2000.0)
+
+// Gap or overlap in timestamps tolerated between buffers that are aggregated
+#define AUDSRV_SINK_AGGREGATE_TOLERANCE (GST_MSECOND)
+
+// Delays before the max-latency timer tries again when the streaming thread holds the stream
+// lock.  The delay doubles on each failure so a pipeline paused with data aggregated is cheap.
+#define AUDSRV_SINK_AGGREGATE_RETRY_MIN (5000LL)
+#define AUDSRV_SINK_AGGREGATE_RETRY_MAX (100000LL)
+
+// Default bound on data queued for the render thread in async-render mode
+#define AUDSRV_SINK_DEFAULT_QUEUE_TIME (200*GST_MSECOND)
+
 #define AUDSRV_SINK_CAPS \
-        SOC_SPECIFIC_CAPS
+        AUDSRV_SINK_SOC_CAPS AUDSRV_SINK_PCM_CAPS
 
 static GstStaticPadTemplate gst_audsrv_sink_pad_template =
 GST_STATIC_PAD_TEMPLATE ("sink",
@@ -64,20 +104,14 @@ enum
    PROP_SESSION,
    PROP_SESSION_TYPE,
    PROP_SESSION_PRIVATE,
-   PROP_SESSION_NAME
+   PROP_SESSION_NAME,
+   PROP_AGGREGATE_TIME,
+   PROP_MAX_LATENCY,
+   PROP_DUMP_PACKETS,
+   PROP_ASYNC_RENDER,
+   PROP_RENDER_QUEUE_TIME
 };
 
-static long long getCurrentTimeMillis(void)
-{
-   struct timeval tv;
-   long long utcCurrentTimeMillis;
-
-   gettimeofday(&tv,0);
-   utcCurrentTimeMillis= tv.tv_sec*1000LL+(tv.tv_usec/1000LL);
-
-   return utcCurrentTimeMillis;
-}
-
 static long long getCurrentTimeMicro()
 {
    struct timeval tv;
@@ -124,6 +158,8 @@ static GstStateChangeReturn gst_audsrv_sink_change_state(GstElement *element, Gs
 static gboolean gst_audsrv_sink_start(GstBaseSink *bsink);
 static gboolean gst_audsrv_sink_stop(GstBaseSink *bsink);
 static GstFlowReturn gst_audsrv_sink_render(GstBaseSink *bsink, GstBuffer *buf);
+static gboolean gst_audsrv_sink_unlock(GstBaseSink *bsink);
+static gboolean gst_audsrv_sink_unlock_stop(GstBaseSink *bsink);
 #ifdef USE_GST1
 static gboolean gst_audsrv_sink_event(GstPad *pad, GstObject *parent, GstEvent *event);
 static gboolean gst_audsrv_sink_sink_query(GstPad *pad, GstObject *parent, GstQuery *query);
@@ -133,7 +169,52 @@ static gboolean gst_audsrv_sink_sink_query(GstPad *pad, GstQuery *query);
 #endif
 static gboolean gst_audsrv_sink_query(GstElement *element, GstQuery *query);
 static gboolean gst_audsrv_sink_prepare_to_render( GstAudsrvSink *sink, GstBuffer *buffer );
+static gboolean gst_audsrv_sink_aggregate_buffer( GstAudsrvSink *sink, GstBuffer *buffer, guint8 *data, guint size );
+static void gst_audsrv_sink_sync_reset( GstAudsrvSink *sink );
+static void gst_audsrv_sink_update_sync( GstAudsrvSink *sink );
+static gboolean gst_audsrv_sink_aggregate_flush( GstAudsrvSink *sink );
+static void gst_audsrv_sink_aggregate_discard( GstAudsrvSink *sink );
+static long long gst_audsrv_sink_aggregate_deadline( GstAudsrvSink *sink );
+static void gst_audsrv_sink_aggregate_timer_arm( GstAudsrvSink *sink, long long deadline );
+static void gst_audsrv_sink_aggregate_timer_stop( GstAudsrvSink *sink );
+static void gst_audsrv_sink_trace_init( GstAudsrvSink *sink );
+static void gst_audsrv_sink_trace_term( GstAudsrvSink *sink );
+static void gst_audsrv_sink_trace_packet( GstAudsrvSink *sink, guint8 *data, guint size );
+static void gst_audsrv_sink_trace_caps( GstAudsrvSink *sink, GstCaps *caps );
+static void gst_audsrv_sink_trace_trigger( GstAudsrvSink *sink, guint count );
+static gboolean gst_audsrv_sink_render_buffer( GstAudsrvSink *sink, GstBuffer *buffer );
+static gboolean gst_audsrv_sink_send_data( GstAudsrvSink *sink, guint8 *data, guint size );
+static gboolean gst_audsrv_sink_queue_start( GstAudsrvSink *sink );
+static void gst_audsrv_sink_queue_stop( GstAudsrvSink *sink );
+static GstFlowReturn gst_audsrv_sink_queue_buffer( GstAudsrvSink *sink, GstBuffer *buffer );
+static void gst_audsrv_sink_queue_drain( GstAudsrvSink *sink );
+static void gst_audsrv_sink_queue_flush( GstAudsrvSink *sink );
+static void gst_audsrv_sink_queue_resume( GstAudsrvSink *sink );
+static gboolean gst_audsrv_sink_queue_send_ready( GstAudsrvSink *sink );
+static gboolean gst_audsrv_sink_queue_wait_writable( GstAudsrvSink *sink );
+#ifdef USE_GST1
+static gboolean gst_audsrv_sink_propose_allocation(GstBaseSink *bsink, GstQuery *query);
+static GstBufferPool* gst_audsrv_sink_pool_new( void );
+static guint gst_audsrv_sink_pool_buffer_size( GstCaps *caps );
+static guint gst_audsrv_sink_pool_max_buffers( GstBufferPool *pool, guint size );
+static int gst_audsrv_sink_pool_get_fd( GstBufferPool *pool );
+static gboolean gst_audsrv_sink_pool_commit( GstAudsrvSink *sink, guint8 *data, guint size );
+static void gst_audsrv_sink_pool_detach( GstAudsrvSink *sink );
+static GstClock* gst_audsrv_sink_provide_clock( GstElement *element );
+static GstClock* gst_audsrv_sink_clock_new( void );
+static guint64 gst_audsrv_sink_caps_byte_rate( GstCaps *caps );
+static void gst_audsrv_sink_set_pcm_format( GstAudsrvSink *sink, GstCaps *caps );
+static void gst_audsrv_sink_clock_set_byte_rate( GstAudsrvSink *sink, guint64 byteRate );
+static void gst_audsrv_sink_clock_set_running( GstAudsrvSink *sink, gboolean running );
+static void gst_audsrv_sink_clock_reset( GstAudsrvSink *sink );
+static void gst_audsrv_sink_clock_submitted( GstAudsrvSink *sink, guint size );
+static void gst_audsrv_sink_clock_start_timestamp( GstAudsrvSink *sink, GstClockTime timestamp );
+static gboolean gst_audsrv_sink_clock_get_position( GstAudsrvSink *sink, GstClockTime *position );
+static gboolean gst_audsrv_sink_clock_get_latency( GstAudsrvSink *sink, GstClockTime *latency );
+#endif
 static void audsrv_eos_detected( void *userData );
+static void audsrv_discontinuity( void *userData, bool connected );
+static void audsrv_flush_ack( void *userData, unsigned generation );
 
 static void
 gst_audsrv_sink_class_init(GstAudsrvSinkClass *klass)
@@ -152,11 +233,19 @@ gst_audsrv_sink_class_init(GstAudsrvSinkClass *klass)
 
    gstelement_class->change_state= gst_audsrv_sink_change_state;
    gstelement_class->query= gst_audsrv_sink_query;
+   #ifdef USE_GST1
+   gstelement_class->provide_clock= gst_audsrv_sink_provide_clock;
+   #endif
 
    gstbasesink_class->get_times= 0;
    gstbasesink_class->start= gst_audsrv_sink_start;
    gstbasesink_class->stop= gst_audsrv_sink_stop;
    gstbasesink_class->render= gst_audsrv_sink_render;
+   gstbasesink_class->unlock= gst_audsrv_sink_unlock;
+   gstbasesink_class->unlock_stop= gst_audsrv_sink_unlock_stop;
+   #ifdef USE_GST1
+   gstbasesink_class->propose_allocation= gst_audsrv_sink_propose_allocation;
+   #endif
 
    g_object_class_install_property(gobject_class, PROP_MUTE,
       g_param_spec_boolean("mute", "mute", "Mute this audio stream",
@@ -191,6 +280,36 @@ gst_audsrv_sink_class_init(GstAudsrvSinkClass *klass)
            NULL, 
            (GParamFlags)G_PARAM_WRITABLE));
 
+   g_object_class_install_property(gobject_class, PROP_AGGREGATE_TIME,
+      g_param_spec_uint64("aggregate-time", "aggregate time",
+          "Coalesce contiguous buffers into submissions of this duration in ns (0 = disabled)",
+          0, G_MAXUINT64, 0,
+          (GParamFlags)G_PARAM_READWRITE));
+
+   g_object_class_install_property(gobject_class, PROP_MAX_LATENCY,
+      g_param_spec_uint64("max-latency", "max latency",
+          "Longest time in ns data may be held for aggregation (0 = no limit)",
+          0, G_MAXUINT64, 0,
+          (GParamFlags)G_PARAM_READWRITE));
+
+   g_object_class_install_property(gobject_class, PROP_DUMP_PACKETS,
+      g_param_spec_uint("dump-packets", "dump packets",
+          "Write this many of the most recent packets to a trace file (needs AUDSRVSINK_DUMP_PACKETS)",
+          0, G_MAXUINT, 0,
+          (GParamFlags)G_PARAM_WRITABLE));
+
+   g_object_class_install_property(gobject_class, PROP_ASYNC_RENDER,
+      g_param_spec_boolean("async-render", "async render",
+          "Pass data to audio server from a dedicated thread so upstream never waits on the connection",
+          FALSE,
+          (GParamFlags)G_PARAM_READWRITE));
+
+   g_object_class_install_property(gobject_class, PROP_RENDER_QUEUE_TIME,
+      g_param_spec_uint64("render-queue-time", "render queue time",
+          "Duration in ns of data queued for the render thread before upstream waits (async-render only)",
+          GST_MSECOND, G_MAXUINT64, AUDSRV_SINK_DEFAULT_QUEUE_TIME,
+          (GParamFlags)G_PARAM_READWRITE));
+
    GST_DEBUG_CATEGORY_INIT(gst_audsrv_sink_debug, "audsrvsink", 0, "audsrvsink element");
 
    #ifdef USE_GST1
@@ -223,18 +342,22 @@ gst_audsrv_sink_init (GstAudsrvSink *sink, GstAudsrvSinkClass *g_class)
    gst_base_sink_set_async_enabled(GST_BASE_SINK(sink), FALSE);
    sink->caps= NULL;
    sink->mayDumpPackets= FALSE;
-   sink->dumpingPackets= FALSE;
-   sink->dumpPacketCount= 0;
-   sink->dumpPacketLimit= 10;
+   sink->trace= 0;
    sink->asyncStateChange= FALSE;
    sink->ownSession= FALSE;
    sink->sessionType= AUDSRV_SESSION_Primary;
    sink->sessionPrivate= FALSE;
    sink->sessionName= 0;
    sink->audsrv= 0;
+   #ifdef USE_GST1
+   sink->pool= NULL;
+   sink->clock= gst_audsrv_sink_clock_new();
+   GST_OBJECT_FLAG_SET( sink, GST_ELEMENT_FLAG_PROVIDE_CLOCK );
+   #endif
    if ( getenv("AUDSRVSINK_DUMP_PACKETS") )
    {
       sink->mayDumpPackets= TRUE;
+      gst_audsrv_sink_trace_init( sink );
    }
    sink->readyToRender= FALSE;
    sink->playing= FALSE;
@@ -244,13 +367,25 @@ gst_audsrv_sink_init (GstAudsrvSink *sink, GstAudsrvSinkClass *g_class)
    sink->peerPad= NULL;
    sink->mute= FALSE;
    sink->volume= 1.0;
-   sink->lastSyncTime= -1LL;
+   gst_audsrv_sink_sync_reset( sink );
    sink->audioOnly= FALSE;
    sink->isFlushing= FALSE;
    sink->eosDetected= FALSE;
    sink->haveFirstAudioTime= FALSE;
    sink->firstAudioTime= 0LL;
    sink->position= 0LL;
+   sink->asyncRender= FALSE;
+   sink->renderQueueTime= AUDSRV_SINK_DEFAULT_QUEUE_TIME;
+   sink->queue= 0;
+   sink->aggregateTime= 0;
+   sink->maxLatency= 0;
+   sink->aggregateData= 0;
+   sink->aggregateSize= 0;
+   sink->aggregateCapacity= 0;
+   sink->aggregateDuration= 0;
+   sink->aggregateNextTimestamp= GST_CLOCK_TIME_NONE;
+   sink->aggregateStartTime= 0LL;
+   sink->aggregateTimer= 0;
    sink->wavParams.codec= 0;
    sink->wavParams.channelCount= 0;
    sink->wavParams.sampleRate= 0;
@@ -272,6 +407,12 @@ static void gst_audsrv_sink_term(GstAudsrvSink *sink)
 {
    sink->initialized= FALSE;
 
+   gst_audsrv_sink_queue_stop( sink );
+
+   #ifdef USE_GST1
+   gst_audsrv_sink_pool_detach( sink );
+   #endif
+
    if ( sink->audsrv && sink->ownSession )
    {
       AudioServerDisconnect( sink->audsrv );
@@ -280,6 +421,16 @@ static void gst_audsrv_sink_term(GstAudsrvSink *sink)
    
    gst_audsrv_sink_soc_term( sink );
 
+   gst_audsrv_sink_trace_term( sink );
+
+   #ifdef USE_GST1
+   if ( sink->clock )
+   {
+      gst_object_unref( sink->clock );
+      sink->clock= NULL;
+   }
+   #endif
+
    if ( sink->caps )
    {
       gst_caps_unref( sink->caps );
@@ -294,6 +445,11 @@ static void gst_audsrv_sink_term(GstAudsrvSink *sink)
    {
       free( sink->sessionName );
    }
+   if ( sink->aggregateData )
+   {
+      free( sink->aggregateData );
+      sink->aggregateData= 0;
+   }
 }
 
 static void
@@ -387,6 +543,21 @@ gst_audsrv_sink_set_property(GObject *object,
             }
          }
          break;
+      case PROP_AGGREGATE_TIME:
+         sink->aggregateTime= g_value_get_uint64(value);
+         break;
+      case PROP_MAX_LATENCY:
+         sink->maxLatency= g_value_get_uint64(value);
+         break;
+      case PROP_DUMP_PACKETS:
+         gst_audsrv_sink_trace_trigger( sink, g_value_get_uint(value) );
+         break;
+      case PROP_ASYNC_RENDER:
+         sink->asyncRender= g_value_get_boolean(value);
+         break;
+      case PROP_RENDER_QUEUE_TIME:
+         sink->renderQueueTime= g_value_get_uint64(value);
+         break;
       default:
          if ( !gst_audsrv_sink_soc_set_property(object, prop_id, value, pspec) )
          {
@@ -419,6 +590,18 @@ gst_audsrv_sink_get_property(GObject *object,
       case PROP_SESSION_PRIVATE:
          g_value_set_boolean(value, sink->sessionPrivate);
          break;
+      case PROP_AGGREGATE_TIME:
+         g_value_set_uint64(value, sink->aggregateTime);
+         break;
+      case PROP_MAX_LATENCY:
+         g_value_set_uint64(value, sink->maxLatency);
+         break;
+      case PROP_ASYNC_RENDER:
+         g_value_set_boolean(value, sink->asyncRender);
+         break;
+      case PROP_RENDER_QUEUE_TIME:
+         g_value_set_uint64(value, sink->renderQueueTime);
+         break;
       default:
          if ( !gst_audsrv_sink_soc_get_property(object, prop_id, value, pspec) )
          {
@@ -478,6 +661,9 @@ gst_audsrv_sink_change_state(GstElement *element, GstStateChange transition)
          sink->eosDetected= FALSE;
          if ( gst_audsrv_sink_soc_paused_to_playing( sink, &passToDefault ) )
          {
+            #ifdef USE_GST1
+            gst_audsrv_sink_clock_set_running( sink, TRUE );
+            #endif
             if ( sink->readyToRender )
             {
                if ( !AudioServerPause( sink->audsrv, false ) )
@@ -494,6 +680,9 @@ gst_audsrv_sink_change_state(GstElement *element, GstStateChange transition)
       case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
          if ( gst_audsrv_sink_soc_playing_to_paused( sink, &passToDefault ) )
          {
+            #ifdef USE_GST1
+            gst_audsrv_sink_clock_set_running( sink, FALSE );
+            #endif
             if ( !AudioServerPause( sink->audsrv, true ) )
             {
                GST_ERROR("AudioServerPause true failed");
@@ -505,6 +694,13 @@ gst_audsrv_sink_change_state(GstElement *element, GstStateChange transition)
          }
          break;
       case GST_STATE_CHANGE_PAUSED_TO_READY:
+         // Nothing may send aggregated data while it is discarded
+         gst_audsrv_sink_aggregate_timer_stop( sink );
+         gst_audsrv_sink_queue_flush( sink );
+         gst_audsrv_sink_aggregate_discard( sink );
+         #ifdef USE_GST1
+         gst_audsrv_sink_clock_reset( sink );
+         #endif
          if ( gst_audsrv_sink_soc_paused_to_ready( sink, &passToDefault ) )
          {
             if ( sink->audsrv )
@@ -582,6 +778,9 @@ gst_audsrv_sink_start(GstBaseSink *bsink)
             goto exit;
          }
          sink->ownSession= TRUE;
+
+         AudioServerSetDiscontinuityCallback( sink->audsrv, audsrv_discontinuity, sink );
+         AudioServerSetFlushAckCallback( sink->audsrv, audsrv_flush_ack, sink );
          
          sessionType= sink->sessionType;
          if ( !AudioServerInitSession( sink->audsrv, sessionType, sink->sessionPrivate, sink->sessionName ) )
@@ -595,6 +794,11 @@ gst_audsrv_sink_start(GstBaseSink *bsink)
       if ( sink->audsrv )
       {
          result= TRUE;
+         if ( sink->asyncRender && !gst_audsrv_sink_queue_start( sink ) )
+         {
+            GST_ERROR("unable to start render thread");
+            result= FALSE;
+         }
       }
       else
       {
@@ -614,6 +818,13 @@ gst_audsrv_sink_stop(GstBaseSink *bsink)
    
    if ( sink )
    {
+      gst_audsrv_sink_queue_stop( sink );
+      gst_audsrv_sink_aggregate_timer_stop( sink );
+
+      #ifdef USE_GST1
+      gst_audsrv_sink_pool_detach( sink );
+      #endif
+
       if ( sink->audsrv && sink->ownSession )
       {
          AudioServerDisconnect( sink->audsrv );
@@ -628,11 +839,6 @@ static GstFlowReturn
 gst_audsrv_sink_render(GstBaseSink *bsink, GstBuffer *buffer)
 {
    GstAudsrvSink *sink= GST_AUDSRV_SINK(bsink);
-   #ifdef USE_GST1
-   GstMapInfo map;
-   #endif
-   guint size;
-   guint8 *data;
    
    if ( sink )
    {
@@ -676,7 +882,33 @@ gst_audsrv_sink_render(GstBaseSink *bsink, GstBuffer *buffer)
          }
       }
       
-      if ( sink->readyToRender && !sink->expectFakeBuffers )
+      if ( sink->readyToRender )
+      {
+         if ( sink->queue )
+         {
+            return gst_audsrv_sink_queue_buffer( sink, buffer );
+         }
+         if ( !gst_audsrv_sink_render_buffer( sink, buffer ) )
+         {
+            return GST_FLOW_ERROR;
+         }
+      }
+   }
+   
+   return GST_FLOW_OK;
+}
+
+static gboolean gst_audsrv_sink_render_buffer( GstAudsrvSink *sink, GstBuffer *buffer )
+{
+   #ifdef USE_GST1
+   GstMapInfo map;
+   #endif
+   guint size;
+   guint8 *data;
+
+   if ( sink->readyToRender )
+   {
+      if ( !sink->expectFakeBuffers )
       {
          #ifdef USE_GST1
          gst_buffer_map (buffer, &map, GST_MAP_READ);
@@ -687,10 +919,17 @@ gst_audsrv_sink_render(GstBaseSink *bsink, GstBuffer *buffer)
          data= GST_BUFFER_DATA(buffer);
          #endif
          
-         if ( !gst_audsrv_sink_process_buffer( sink, data, size ) )
+         #ifdef USE_GST1
+         gst_audsrv_sink_clock_start_timestamp( sink, GST_BUFFER_TIMESTAMP(buffer) );
+         #endif
+
+         if ( !gst_audsrv_sink_aggregate_buffer( sink, buffer, data, size ) )
          {
             GST_ERROR( "Error processing buffer" );
-            return GST_FLOW_ERROR;
+            #ifdef USE_GST1
+            gst_buffer_unmap (buffer, &map);
+            #endif
+            return FALSE;
          }         
 
          #ifdef USE_GST1
@@ -698,13 +937,30 @@ gst_audsrv_sink_render(GstBaseSink *bsink, GstBuffer *buffer)
          #endif
       }
       
-      if ( sink->readyToRender )
-      {
-         gst_audsrv_sink_soc_render( sink, buffer );
-      }
+      gst_audsrv_sink_soc_render( sink, buffer );
    }
    
-   return GST_FLOW_OK;
+   return TRUE;
+}
+
+static gboolean
+gst_audsrv_sink_unlock(GstBaseSink *bsink)
+{
+   GstAudsrvSink *sink= GST_AUDSRV_SINK(bsink);
+
+   gst_audsrv_sink_queue_flush( sink );
+
+   return TRUE;
+}
+
+static gboolean
+gst_audsrv_sink_unlock_stop(GstBaseSink *bsink)
+{
+   GstAudsrvSink *sink= GST_AUDSRV_SINK(bsink);
+
+   gst_audsrv_sink_queue_resume( sink );
+
+   return TRUE;
 }
 
 #ifdef USE_GST1
@@ -725,6 +981,8 @@ static gboolean gst_audsrv_sink_event(GstPad *pad, GstEvent *event)
          {
             GstCaps *caps;
             
+            gst_audsrv_sink_queue_drain( sink );
+
             gst_event_parse_caps(event, &caps);
             
             if ( sink->caps )
@@ -735,6 +993,8 @@ static gboolean gst_audsrv_sink_event(GstPad *pad, GstEvent *event)
             sink->caps= gst_caps_copy( caps );
             if ( sink->caps )
             {
+               gst_audsrv_sink_trace_caps( sink, sink->caps );
+
                const GstStructure *str;
                gchar *capsAsString;
                const gchar *type= 0;
@@ -756,11 +1016,27 @@ static gboolean gst_audsrv_sink_event(GstPad *pad, GstEvent *event)
                      gst_audsrv_sink_soc_set_type( sink, type );
                   }
                }
+
+               #ifdef USE_GST1
+               gst_audsrv_sink_set_pcm_format( sink, sink->caps );
+
+               // Tunnelled data never passes through the server so its progress can't be reported
+               gst_audsrv_sink_clock_set_byte_rate( sink, (sink->tunnelData ? 0 : gst_audsrv_sink_caps_byte_rate( sink->caps )) );
+               #endif
             }
          }
          break;
       case GST_EVENT_FLUSH_START:
          sink->isFlushing= TRUE;
+         // Drop queued data now rather than wait for it to drain to the server
+         gst_audsrv_sink_queue_flush( sink );
+         #ifdef USE_GST1
+         // Release upstream if it is waiting for the server to free a ring slot
+         if ( sink->pool )
+         {
+            gst_buffer_pool_set_flushing( sink->pool, TRUE );
+         }
+         #endif
          sink->eosDetected= FALSE;
          sink->haveFirstAudioTime= FALSE;
          gst_audsrv_sink_soc_flush( sink );
@@ -771,13 +1047,31 @@ static gboolean gst_audsrv_sink_event(GstPad *pad, GstEvent *event)
             {
                GST_ERROR("AudioServerFlush failed");
             }
+            else if ( AudioServerGetFlushGeneration( sink->audsrv, &sink->flushGeneration ) )
+            {
+               // The server drops data older than this generation and acks once it has flushed
+               sink->flushStartTime= getCurrentTimeMicro();
+               sink->flushAckPending= TRUE;
+            }
          }
          passToDefault= TRUE;
          break;
       case GST_EVENT_FLUSH_STOP:
+         // Discard before the render thread resumes so it cannot send the old data
+         gst_audsrv_sink_aggregate_discard( sink );
+         gst_audsrv_sink_queue_resume( sink );
+         #ifdef USE_GST1
+         if ( sink->pool )
+         {
+            gst_buffer_pool_set_flushing( sink->pool, FALSE );
+         }
+         #endif
          sink->isFlushing= FALSE;
          sink->eosDetected= FALSE;
-         sink->lastSyncTime= -1LL;            
+         gst_audsrv_sink_sync_reset( sink );
+         #ifdef USE_GST1
+         gst_audsrv_sink_clock_reset( sink );
+         #endif
          passToDefault= TRUE;
          break;
       #ifdef USE_GST1
@@ -788,6 +1082,7 @@ static gboolean gst_audsrv_sink_event(GstPad *pad, GstEvent *event)
          {
             #ifdef USE_GST1
             const GstSegment *segment;
+            gst_audsrv_sink_queue_drain( sink );
             gst_event_parse_segment(event, &segment);
             sink->segment.format= segment->format;
             sink->segment.rate= segment->rate;
@@ -804,16 +1099,21 @@ static gboolean gst_audsrv_sink_event(GstPad *pad, GstEvent *event)
             gdouble rate, applied_rate;
             GstFormat format;
             gint64 start, stop, position;
+            gst_audsrv_sink_queue_drain( sink );
             gst_event_parse_new_segment_full(event, &update, &rate, &applied_rate, &format, &start, &stop, &position);
             gst_segment_set_newsegment_full( &sink->segment, update, rate, applied_rate, format, start, stop, position);
             #endif
             
             gst_audsrv_sink_soc_segment( sink );
+
+            // Re-establish sync quickly across a segment boundary
+            gst_audsrv_sink_sync_reset( sink );
             
             passToDefault= TRUE;
          }
          break;
       case GST_EVENT_EOS:
+         gst_audsrv_sink_queue_drain( sink );
          if ( !sink->eosDetected && sink->audsrv )
          {
             if ( !AudioServerEnableEOSDetection( sink->audsrv, audsrv_eos_detected, sink ) )
@@ -889,10 +1189,20 @@ gst_audsrv_sink_sink_query (
             struct_name = gst_structure_get_name(query_structure);
             GST_DEBUG_OBJECT(parent, "GST_QUERY_CUSTOM %s\n", struct_name);
 
+#ifdef USE_GST1
+            GstClockTime position;
+            if (struct_name && !strcasecmp(struct_name, "get_current_pts") &&
+                gst_audsrv_sink_clock_get_position(sink, &position)) {
+                // Answered from the cached playback report in 90kHz units
+                guint64 pts= gst_util_uint64_scale(position, 90000, GST_SECOND);
+                GST_DEBUG_OBJECT(parent, "GST_QUERY_CUSTOM: %s: %" G_GUINT64_FORMAT "\n", struct_name, pts);
+                gst_structure_set(gst_query_writable_structure(query), "current-pts", G_TYPE_UINT64, pts, NULL);
+                return TRUE;
+            }
+#endif
             if (struct_name &&
                 (!strcasecmp(struct_name, "get_decoder_status") ||
                  !strcasecmp(struct_name, "get_current_pts"))) {
-                //TODO: Determine if this is possible without rasising a API call to AudioServer
                 GST_DEBUG_OBJECT(parent, "GST_QUERY_CUSTOM: %s\n", struct_name);
                 return FALSE;
             }
@@ -940,6 +1250,14 @@ static gboolean gst_audsrv_sink_query(GstElement *element, GstQuery *query)
                if ( sink->audioOnly )
                {
                   gint64 position;
+                  #ifdef USE_GST1
+                  GstClockTime rendered;
+                  if ( gst_audsrv_sink_clock_get_position( sink, &rendered ) )
+                  {
+                     sink->position= gst_segment_to_stream_time( &sink->segment, GST_FORMAT_TIME, rendered );
+                  }
+                  else
+                  #endif
                   gst_audsrv_sink_soc_update_position( sink );
                   position= sink->position;
                   GST_DEBUG_OBJECT(sink, "POSITION: %" GST_TIME_FORMAT, GST_TIME_ARGS (position));
@@ -955,6 +1273,35 @@ static gboolean gst_audsrv_sink_query(GstElement *element, GstQuery *query)
          }
          break;
 
+      #ifdef USE_GST1
+      case GST_QUERY_LATENCY:
+         {
+            GstClockTime latency, minLatency, maxLatency;
+            gboolean live;
+
+            // The sink renders without sync so the base class would report it as not live
+            if ( !gst_pad_peer_query( GST_BASE_SINK_PAD(sink), query ) )
+            {
+               return GST_ELEMENT_CLASS(parent_class)->query(element, query);
+            }
+            gst_query_parse_latency( query, &live, &minLatency, &maxLatency );
+
+            // Add the measured depth of the server and SoC queues for live upstream
+            if ( live && gst_audsrv_sink_clock_get_latency( sink, &latency ) )
+            {
+               minLatency += latency;
+               if ( GST_CLOCK_TIME_IS_VALID(maxLatency) )
+               {
+                  maxLatency += latency;
+               }
+               GST_DEBUG_OBJECT(sink, "LATENCY: adding %" GST_TIME_FORMAT, GST_TIME_ARGS(latency));
+               gst_query_set_latency( query, live, minLatency, maxLatency );
+            }
+            return TRUE;
+         }
+         break;
+      #endif
+
       case GST_QUERY_CUSTOM:
       case GST_QUERY_DURATION:
       case GST_QUERY_SEEKING:
@@ -985,79 +1332,34 @@ static gboolean gst_audsrv_sink_prepare_to_render( GstAudsrvSink *sink, GstBuffe
 gboolean gst_audsrv_sink_process_buffer( GstAudsrvSink *sink, guint8 *data, guint size )
 {
    gboolean result= FALSE;
-   long long stc, now, diff;
    
-   if ( sink->mayDumpPackets )
+   if ( sink->trace )
    {
-      FILE *pFile= fopen("/opt/audtrigger", "rt");
-      if ( pFile )
-      {
-         unsigned n;
-
-         if ( fscanf( pFile, "%u", &n ) == 1 )
-         {
-            sink->dumpPacketLimit= n;
-         }
-         sink->dumpingPackets= TRUE;
-         sink->dumpPacketCount= 0;            
-         fclose(pFile);
-         remove("/opt/audtrigger");
-         remove("/opt/aud-caps.txt");
-         if ( sink->caps )
-         {
-            pFile= fopen("/opt/aud-caps.txt", "wt");
-            if ( pFile )
-            {
-               gchar *capsAsString= gst_caps_to_string(sink->caps);
-               fprintf( pFile, "%s", capsAsString );
-               g_free( capsAsString );
-               fclose(pFile);
-            }
-         }
-      }
-      if ( sink->dumpingPackets )
-      {
-         if ( sink->dumpPacketCount < sink->dumpPacketLimit )
-         {
-            char work[64];
-            
-            sprintf( work, "/opt/aud-packet-%d.dat", ++sink->dumpPacketCount );
-            pFile= fopen( work, "wb" );
-            if ( pFile )
-            {
-               fwrite( data, 1, size, pFile );
-               fclose( pFile );
-            }
-            printf("audsrvsink: %lld: wrote packet %d\n", getCurrentTimeMillis(), sink->dumpPacketCount );
-         }
-         else
-         {
-            sink->dumpingPackets= FALSE;
-         }
-      }
+      gst_audsrv_sink_trace_packet( sink, data, size );
    }
 
    if ( !sink->tunnelData )
    {
-      now= getCurrentTimeMicro();
-      diff= now-sink->lastSyncTime;
-      if ( (sink->lastSyncTime < 0) || (diff >= 1000000LL) )
+      gst_audsrv_sink_update_sync( sink );
+   
+      #ifdef USE_GST1
+      if ( gst_audsrv_sink_pool_commit( sink, data, size ) )
       {
-         stc= gst_audsrv_sink_soc_get_stc( sink );
-         if ( AudioServerAudioSync( sink->audsrv, now, stc ) )
-         {
-            sink->lastSyncTime= now;
-         }
-         else
-         {
-            GST_ERROR("AudioServerAudioSync failed");
-         }
+         result= TRUE;
       }
-   
-      if ( AudioServerAudioData( sink->audsrv, data, size ) )
+      else
+      #endif
+      if ( gst_audsrv_sink_send_data( sink, data, size ) )
       {
          result= TRUE;
       }
+
+      #ifdef USE_GST1
+      if ( result )
+      {
+         gst_audsrv_sink_clock_submitted( sink, size );
+      }
+      #endif
    }
    else
    {
@@ -1067,55 +1369,2059 @@ gboolean gst_audsrv_sink_process_buffer( GstAudsrvSink *sink, guint8 *data, guin
    return result;
 }
 
-gboolean gst_audsrv_sink_process_buffer_handle( GstAudsrvSink *sink, guint64 handle )
+/*
+ * Trace of recent packets, kept when AUDSRVSINK_DUMP_PACKETS is set.  The streaming
+ * thread copies each packet into the next slot of a preallocated ring, overwriting
+ * the oldest, without taking locks or touching the filesystem.  Each slot carries a
+ * sequence count that is odd while the slot is being written so the dump thread can
+ * discard slots that change under it.  A dump is requested with the dump-packets
+ * property or, as before, by writing a packet count to /opt/audtrigger, which the dump
+ * thread checks periodically.  A dump writes the most recent packets to one file: a
+ * header and index of GstAudsrvSinkTraceEntry records followed by the packet data.
+ */
+#define AUDSRV_SINK_TRACE_SLOTS (64)
+#define AUDSRV_SINK_TRACE_SLOT_SIZE (16*1024)
+#define AUDSRV_SINK_TRACE_DEFAULT_COUNT (10)
+#define AUDSRV_SINK_TRACE_POLL_INTERVAL (1)
+#define AUDSRV_SINK_TRACE_MAGIC (0x41535452) // 'ASTR'
+#define AUDSRV_SINK_TRACE_TRIGGER_FILE "/opt/audtrigger"
+#define AUDSRV_SINK_TRACE_CAPS_FILE "/opt/aud-caps.txt"
+
+typedef struct _GstAudsrvSinkTraceEntry
 {
-   gboolean result= FALSE;
+   guint64 timeMicros;
+   guint32 packetNumber;
+   guint32 size;
+   guint32 storedSize;
+   guint32 offset;
+} GstAudsrvSinkTraceEntry;
+
+typedef struct _GstAudsrvSinkTraceSlot
+{
+   volatile gint seq;
+   guint32 packetNumber;
+   long long timeMicros;
+   guint size;
+   guint8 data[AUDSRV_SINK_TRACE_SLOT_SIZE];
+} GstAudsrvSinkTraceSlot;
 
-   if ( AudioServerAudioDataHandle( sink->audsrv, handle ) )
+typedef struct _GstAudsrvSinkTrace
+{
+   volatile gint writeCount;
+   GstAudsrvSinkTraceSlot *slots;
+   pthread_t thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   bool threadStarted;
+   bool stopRequested;
+   guint dumpRequested;
+   int dumpCount;
+   gchar *capsString;
+   GstAudsrvSinkTraceEntry index[AUDSRV_SINK_TRACE_SLOTS];
+   guint8 scratch[AUDSRV_SINK_TRACE_SLOT_SIZE];
+} GstAudsrvSinkTrace;
+
+static void gst_audsrv_sink_trace_dump( GstAudsrvSinkTrace *trace, guint count )
+{
+   guint32 header[4];
+   guint end, start, n, i;
+   guint32 offset;
+   FILE *pFile;
+   char work[64];
+   gchar *capsString;
+   gboolean error= FALSE;
+
+   end= (guint)g_atomic_int_get( &trace->writeCount );
+   count= MIN( count, AUDSRV_SINK_TRACE_SLOTS );
+   count= MIN( count, end );
+   start= end-count;
+
+   sprintf( work, "/opt/aud-packets-%d.dat", ++trace->dumpCount );
+   pFile= fopen( work, "wb" );
+   if ( !pFile )
    {
-      result= TRUE;
+      GST_ERROR("unable to open packet trace file %s: errno %d", work, errno);
+      return;
    }
-   
-   return result;
-}
 
-static void audsrv_eos_detected( void *userData )
-{
-   GstAudsrvSink *sink= (GstAudsrvSink*)userData;
-   
-   sink->eosDetected= TRUE;
+   // Reserve the header and index then fill them in once the packets are known
+   header[0]= AUDSRV_SINK_TRACE_MAGIC;
+   header[1]= 1;
+   header[2]= 0;
+   header[3]= 0;
+   offset= sizeof(header)+count*sizeof(GstAudsrvSinkTraceEntry);
+   if ( fseek( pFile, offset, SEEK_SET ) != 0 )
+   {
+      error= TRUE;
+   }
 
-   GstPad *pad= GST_BASE_SINK_PAD(sink);
-   #ifdef USE_GST1
-   GstObject *parent= gst_pad_get_parent(pad);
-   gst_audsrv_sink_event(pad, parent, gst_event_new_eos());
-   gst_object_unref(parent);
-   #else
-   gst_audsrv_sink_event(pad, gst_event_new_eos());
-   #endif
-}
+   n= 0;
+   for( i= start; (i < end) && !error; ++i )
+   {
+      GstAudsrvSinkTraceSlot *slot= &trace->slots[i % AUDSRV_SINK_TRACE_SLOTS];
+      GstAudsrvSinkTraceEntry *entry= &trace->index[n];
+      gint seq;
 
-#define readLE16( p ) ((p)[0]|((p)[1]<<8))
-#define readLE32( p ) ((p)[0]|((p)[1]<<8)|((p)[2]<<16)|((p)[3]<<24))
+      seq= g_atomic_int_get( &slot->seq );
+      if ( seq & 1 )
+      {
+         continue;
+      }
+      entry->packetNumber= slot->packetNumber;
+      entry->timeMicros= slot->timeMicros;
+      entry->size= slot->size;
+      entry->storedSize= MIN( slot->size, AUDSRV_SINK_TRACE_SLOT_SIZE );
+      memcpy( trace->scratch, slot->data, entry->storedSize );
+      if ( (g_atomic_int_get( &slot->seq ) != seq) || (entry->packetNumber != i) )
+      {
+         // Overwritten by the streaming thread while being copied
+         continue;
+      }
+      entry->offset= offset;
+      if ( fwrite( trace->scratch, 1, entry->storedSize, pFile ) != entry->storedSize )
+      {
+         error= TRUE;
+         break;
+      }
+      offset += entry->storedSize;
+      ++n;
+   }
 
-static bool getWavInfo( unsigned char *data, int dataLen, int *codec, int *channelCount, int *sampleRate, int *bitsPerSample, int *offsetData )
-{
-   bool isWav= false;
-   unsigned char *chunkHdr;
-   unsigned char *subChunkHdr;
-   unsigned char *work;
-   int subChunkSize;
+   if ( !error )
+   {
+      header[2]= n;
+      if ( (fseek( pFile, 0, SEEK_SET ) != 0) ||
+           (fwrite( header, 1, sizeof(header), pFile ) != sizeof(header)) ||
+           (fwrite( trace->index, sizeof(GstAudsrvSinkTraceEntry), n, pFile ) != n) )
+      {
+         error= TRUE;
+      }
+   }
+   if ( fclose( pFile ) != 0 )
+   {
+      error= TRUE;
+   }
+   if ( error )
+   {
+      // Don't leave a truncated trace behind for the parser to choke on
+      GST_ERROR("unable to write packet trace file %s: errno %d", work, errno);
+      remove( work );
+      return;
+   }
 
-   if ( dataLen >= 12 )
+   pthread_mutex_lock( &trace->mutex );
+   capsString= g_strdup( trace->capsString );
+   pthread_mutex_unlock( &trace->mutex );
+   if ( capsString )
    {
-      chunkHdr= &data[0];   
-      if ( 
-           (strncmp( "RIFF", (const char*)&chunkHdr[0], 4 ) == 0) &&
-           (strncmp( "WAVE", (const char*)&chunkHdr[8], 4 ) == 0)
-         )
+      pFile= fopen( AUDSRV_SINK_TRACE_CAPS_FILE, "wt" );
+      if ( pFile )
       {
-         *offsetData= 12;
-         for( ; ; )
+         fprintf( pFile, "%s", capsString );
+         fclose( pFile );
+      }
+      g_free( capsString );
+   }
+
+   GST_INFO("wrote %u packets to %s", n, work);
+}
+
+static void* gst_audsrv_sink_trace_thread( void *arg )
+{
+   GstAudsrvSinkTrace *trace= (GstAudsrvSinkTrace*)arg;
+   struct timespec deadline;
+   guint count;
+
+   pthread_mutex_lock( &trace->mutex );
+   while( !trace->stopRequested )
+   {
+      if ( !trace->dumpRequested )
+      {
+         clock_gettime( CLOCK_MONOTONIC, &deadline );
+         deadline.tv_sec += AUDSRV_SINK_TRACE_POLL_INTERVAL;
+         pthread_cond_timedwait( &trace->cond, &trace->mutex, &deadline );
+         if ( trace->stopRequested )
+         {
+            break;
+         }
+      }
+      count= trace->dumpRequested;
+      trace->dumpRequested= 0;
+      pthread_mutex_unlock( &trace->mutex );
+
+      if ( !count )
+      {
+         FILE *pFile= fopen( AUDSRV_SINK_TRACE_TRIGGER_FILE, "rt" );
+         if ( pFile )
+         {
+            unsigned n;
+
+            count= AUDSRV_SINK_TRACE_DEFAULT_COUNT;
+            if ( fscanf( pFile, "%u", &n ) == 1 )
+            {
+               count= n;
+            }
+            fclose( pFile );
+            remove( AUDSRV_SINK_TRACE_TRIGGER_FILE );
+         }
+      }
+
+      if ( count )
+      {
+         gst_audsrv_sink_trace_dump( trace, count );
+      }
+
+      pthread_mutex_lock( &trace->mutex );
+   }
+   pthread_mutex_unlock( &trace->mutex );
+
+   return NULL;
+}
+
+static void gst_audsrv_sink_trace_init( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkTrace *trace;
+   pthread_condattr_t attr;
+
+   trace= (GstAudsrvSinkTrace*)calloc( 1, sizeof(GstAudsrvSinkTrace) );
+   if ( !trace )
+   {
+      GST_ERROR("unable to allocate packet trace");
+      return;
+   }
+   trace->slots= (GstAudsrvSinkTraceSlot*)calloc( AUDSRV_SINK_TRACE_SLOTS, sizeof(GstAudsrvSinkTraceSlot) );
+   if ( !trace->slots )
+   {
+      GST_ERROR("unable to allocate packet trace ring");
+      free( trace );
+      return;
+   }
+   pthread_mutex_init( &trace->mutex, 0 );
+   pthread_condattr_init( &attr );
+   pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+   pthread_cond_init( &trace->cond, &attr );
+   pthread_condattr_destroy( &attr );
+
+   if ( pthread_create( &trace->thread, NULL, gst_audsrv_sink_trace_thread, trace ) == 0 )
+   {
+      trace->threadStarted= true;
+   }
+   else
+   {
+      GST_ERROR("unable to start packet trace thread");
+   }
+
+   sink->trace= trace;
+}
+
+static void gst_audsrv_sink_trace_term( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkTrace *trace= sink->trace;
+
+   if ( trace )
+   {
+      sink->trace= 0;
+      if ( trace->threadStarted )
+      {
+         pthread_mutex_lock( &trace->mutex );
+         trace->stopRequested= true;
+         pthread_cond_signal( &trace->cond );
+         pthread_mutex_unlock( &trace->mutex );
+         pthread_join( trace->thread, NULL );
+      }
+      pthread_cond_destroy( &trace->cond );
+      pthread_mutex_destroy( &trace->mutex );
+      g_free( trace->capsString );
+      free( trace->slots );
+      free( trace );
+   }
+}
+
+// Called on the streaming thread for every packet: no locks, no syscalls
+static void gst_audsrv_sink_trace_packet( GstAudsrvSink *sink, guint8 *data, guint size )
+{
+   GstAudsrvSinkTrace *trace= sink->trace;
+   guint packetNumber= (guint)g_atomic_int_get( &trace->writeCount );
+   GstAudsrvSinkTraceSlot *slot= &trace->slots[packetNumber % AUDSRV_SINK_TRACE_SLOTS];
+
+   g_atomic_int_inc( &slot->seq );
+   slot->packetNumber= packetNumber;
+   slot->timeMicros= getCurrentTimeMicro();
+   slot->size= size;
+   memcpy( slot->data, data, MIN( size, AUDSRV_SINK_TRACE_SLOT_SIZE ) );
+   g_atomic_int_inc( &slot->seq );
+
+   g_atomic_int_inc( &trace->writeCount );
+}
+
+static void gst_audsrv_sink_trace_caps( GstAudsrvSink *sink, GstCaps *caps )
+{
+   GstAudsrvSinkTrace *trace= sink->trace;
+   gchar *capsString;
+
+   if ( trace )
+   {
+      capsString= gst_caps_to_string( caps );
+      pthread_mutex_lock( &trace->mutex );
+      g_free( trace->capsString );
+      trace->capsString= capsString;
+      pthread_mutex_unlock( &trace->mutex );
+   }
+}
+
+static void gst_audsrv_sink_trace_trigger( GstAudsrvSink *sink, guint count )
+{
+   GstAudsrvSinkTrace *trace= sink->trace;
+
+   if ( !trace )
+   {
+      GST_WARNING_OBJECT(sink, "packet trace not enabled: set AUDSRVSINK_DUMP_PACKETS");
+      return;
+   }
+
+   if ( count )
+   {
+      pthread_mutex_lock( &trace->mutex );
+      trace->dumpRequested= count;
+      pthread_cond_signal( &trace->cond );
+      pthread_mutex_unlock( &trace->mutex );
+   }
+}
+
+/*
+ * Render queue for async-render mode.  Render hands buffers to a bounded queue and
+ * returns; a dedicated thread takes them in order through the normal data path.  The
+ * queue is bounded by the duration of the data it holds so upstream waits only when
+ * the server falls that far behind.  The thread submits with non-blocking writes, and
+ * sends control messages only once the connection can take them at once, so that a flush
+ * can abandon a send instead of waiting for the connection to drain.  Serialized events
+ * wait for the queue to empty to keep their order with data.
+ */
+#define AUDSRV_SINK_QUEUE_MAX_BUFFERS (256)
+#define AUDSRV_SINK_QUEUE_WRITABLE_TIMEOUT (10)
+#define AUDSRV_SINK_QUEUE_BUSY_RETRY (1000)
+
+typedef struct _GstAudsrvSinkQueue
+{
+   pthread_t thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t condData;
+   pthread_cond_t condSpace;
+   bool stopRequested;
+   volatile bool flushing;
+   bool busy;
+   gboolean failed;
+   GstBuffer *buffers[AUDSRV_SINK_QUEUE_MAX_BUFFERS];
+   int head;
+   int count;
+   GstClockTime duration;
+} GstAudsrvSinkQueue;
+
+static GstClockTime gst_audsrv_sink_queue_buffer_duration( GstBuffer *buffer )
+{
+   GstClockTime duration= GST_BUFFER_DURATION(buffer);
+
+   return (GST_CLOCK_TIME_IS_VALID(duration) ? duration : 0);
+}
+
+static void* gst_audsrv_sink_queue_thread( void *arg )
+{
+   GstAudsrvSink *sink= (GstAudsrvSink*)arg;
+   GstAudsrvSinkQueue *queue= sink->queue;
+   GstBuffer *buffer;
+   gboolean ok;
+   long long deadline;
+
+   pthread_mutex_lock( &queue->mutex );
+   for( ; ; )
+   {
+      while( !queue->stopRequested && (queue->count == 0) )
+      {
+         // Aggregated data is sent from here once it has been held for max-latency
+         deadline= ((queue->busy || queue->flushing) ? 0 : gst_audsrv_sink_aggregate_deadline( sink ));
+         if ( !deadline )
+         {
+            pthread_cond_wait( &queue->condData, &queue->mutex );
+         }
+         else if ( getCurrentTimeMicro() < deadline )
+         {
+            struct timespec abstime;
+
+            abstime.tv_sec= deadline / 1000000LL;
+            abstime.tv_nsec= (deadline % 1000000LL)*1000LL;
+            pthread_cond_timedwait( &queue->condData, &queue->mutex, &abstime );
+         }
+         else
+         {
+            queue->busy= true;
+            pthread_mutex_unlock( &queue->mutex );
+
+            ok= gst_audsrv_sink_aggregate_flush( sink );
+
+            pthread_mutex_lock( &queue->mutex );
+            if ( !ok && !queue->flushing )
+            {
+               queue->failed= TRUE;
+            }
+            queue->busy= false;
+            pthread_cond_broadcast( &queue->condSpace );
+         }
+      }
+      if ( queue->stopRequested )
+      {
+         break;
+      }
+      buffer= queue->buffers[queue->head];
+      queue->buffers[queue->head]= NULL;
+      queue->head= (queue->head+1) % AUDSRV_SINK_QUEUE_MAX_BUFFERS;
+      --queue->count;
+      queue->busy= true;
+      pthread_mutex_unlock( &queue->mutex );
+
+      ok= gst_audsrv_sink_render_buffer( sink, buffer );
+
+      pthread_mutex_lock( &queue->mutex );
+      queue->duration -= MIN( queue->duration, gst_audsrv_sink_queue_buffer_duration( buffer ) );
+      if ( !ok && !queue->flushing )
+      {
+         queue->failed= TRUE;
+      }
+      queue->busy= false;
+      pthread_cond_broadcast( &queue->condSpace );
+      pthread_mutex_unlock( &queue->mutex );
+
+      gst_buffer_unref( buffer );
+
+      pthread_mutex_lock( &queue->mutex );
+   }
+   pthread_mutex_unlock( &queue->mutex );
+
+   return NULL;
+}
+
+static gboolean gst_audsrv_sink_queue_start( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkQueue *queue;
+
+   if ( sink->queue )
+   {
+      return TRUE;
+   }
+
+   queue= (GstAudsrvSinkQueue*)calloc( 1, sizeof(GstAudsrvSinkQueue) );
+   if ( !queue )
+   {
+      return FALSE;
+   }
+   pthread_mutex_init( &queue->mutex, 0 );
+   pthread_cond_init( &queue->condData, 0 );
+   pthread_cond_init( &queue->condSpace, 0 );
+
+   sink->queue= queue;
+   if ( pthread_create( &queue->thread, NULL, gst_audsrv_sink_queue_thread, sink ) != 0 )
+   {
+      sink->queue= 0;
+      pthread_cond_destroy( &queue->condSpace );
+      pthread_cond_destroy( &queue->condData );
+      pthread_mutex_destroy( &queue->mutex );
+      free( queue );
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+static void gst_audsrv_sink_queue_stop( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkQueue *queue= sink->queue;
+
+   if ( queue )
+   {
+      gst_audsrv_sink_queue_flush( sink );
+
+      pthread_mutex_lock( &queue->mutex );
+      queue->stopRequested= true;
+      pthread_cond_signal( &queue->condData );
+      pthread_mutex_unlock( &queue->mutex );
+      pthread_join( queue->thread, NULL );
+
+      sink->queue= 0;
+      pthread_cond_destroy( &queue->condSpace );
+      pthread_cond_destroy( &queue->condData );
+      pthread_mutex_destroy( &queue->mutex );
+      free( queue );
+   }
+}
+
+static GstFlowReturn gst_audsrv_sink_queue_buffer( GstAudsrvSink *sink, GstBuffer *buffer )
+{
+   GstAudsrvSinkQueue *queue= sink->queue;
+   GstFlowReturn result= GST_FLOW_OK;
+   int tail;
+
+   pthread_mutex_lock( &queue->mutex );
+   while( !queue->flushing && !queue->failed &&
+          ((queue->count == AUDSRV_SINK_QUEUE_MAX_BUFFERS) ||
+           (queue->count && (queue->duration >= sink->renderQueueTime))) )
+   {
+      pthread_cond_wait( &queue->condSpace, &queue->mutex );
+   }
+   if ( queue->flushing )
+   {
+      result= GST_FLOW_FLUSHING;
+   }
+   else if ( queue->failed )
+   {
+      GST_ERROR( "Error processing buffer" );
+      result= GST_FLOW_ERROR;
+   }
+   else
+   {
+      tail= (queue->head+queue->count) % AUDSRV_SINK_QUEUE_MAX_BUFFERS;
+      queue->buffers[tail]= gst_buffer_ref( buffer );
+      ++queue->count;
+      queue->duration += gst_audsrv_sink_queue_buffer_duration( buffer );
+      pthread_cond_signal( &queue->condData );
+   }
+   pthread_mutex_unlock( &queue->mutex );
+
+   return result;
+}
+
+// Wait until everything queued has been passed on, then send any aggregated data
+static void gst_audsrv_sink_queue_drain( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkQueue *queue= sink->queue;
+
+   if ( queue )
+   {
+      pthread_mutex_lock( &queue->mutex );
+      while( !queue->flushing && !queue->failed && (queue->count || queue->busy) )
+      {
+         pthread_cond_wait( &queue->condSpace, &queue->mutex );
+      }
+      // Hold off the render thread while aggregated data is sent from here
+      queue->busy= true;
+      pthread_mutex_unlock( &queue->mutex );
+   }
+
+   gst_audsrv_sink_aggregate_flush( sink );
+
+   if ( queue )
+   {
+      pthread_mutex_lock( &queue->mutex );
+      queue->busy= false;
+      pthread_cond_broadcast( &queue->condSpace );
+      pthread_mutex_unlock( &queue->mutex );
+   }
+}
+
+// Drop all queued data, release a waiting render and wait for any send in progress to give up
+static void gst_audsrv_sink_queue_flush( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkQueue *queue= sink->queue;
+   GstBuffer *dropped[AUDSRV_SINK_QUEUE_MAX_BUFFERS];
+   int count, i;
+
+   if ( queue )
+   {
+      pthread_mutex_lock( &queue->mutex );
+      queue->flushing= true;
+      count= queue->count;
+      for( i= 0; i < count; ++i )
+      {
+         int index= (queue->head+i) % AUDSRV_SINK_QUEUE_MAX_BUFFERS;
+         dropped[i]= queue->buffers[index];
+         queue->buffers[index]= NULL;
+      }
+      queue->count= 0;
+      queue->duration= 0;
+      pthread_cond_broadcast( &queue->condSpace );
+      while( queue->busy )
+      {
+         pthread_cond_wait( &queue->condSpace, &queue->mutex );
+      }
+      pthread_mutex_unlock( &queue->mutex );
+
+      if ( count )
+      {
+         GST_DEBUG_OBJECT(sink, "dropped %d queued buffers", count);
+      }
+      for( i= 0; i < count; ++i )
+      {
+         gst_buffer_unref( dropped[i] );
+      }
+   }
+}
+
+static void gst_audsrv_sink_queue_resume( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkQueue *queue= sink->queue;
+
+   if ( queue )
+   {
+      pthread_mutex_lock( &queue->mutex );
+      queue->flushing= false;
+      queue->failed= FALSE;
+      pthread_mutex_unlock( &queue->mutex );
+   }
+}
+
+// In async mode check that a message can be sent without blocking a flush: the queue is
+// not flushing and the connection takes data at once.  Always TRUE otherwise.
+static gboolean gst_audsrv_sink_queue_send_ready( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkQueue *queue= sink->queue;
+
+   if ( queue )
+   {
+      return ( !queue->flushing && AudioServerWaitWritable( sink->audsrv, 0 ) );
+   }
+
+   return TRUE;
+}
+
+// In async mode wait until a message can be sent without blocking.  Returns FALSE if the
+// queue starts flushing first.  Always TRUE otherwise.
+static gboolean gst_audsrv_sink_queue_wait_writable( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkQueue *queue= sink->queue;
+
+   if ( queue )
+   {
+      for( ; ; )
+      {
+         if ( queue->flushing )
+         {
+            return FALSE;
+         }
+         if ( AudioServerWaitWritable( sink->audsrv, AUDSRV_SINK_QUEUE_WRITABLE_TIMEOUT ) )
+         {
+            break;
+         }
+         // Not writable returns at once while another thread is sending on the connection
+         g_usleep( AUDSRV_SINK_QUEUE_BUSY_RETRY );
+      }
+   }
+
+   return TRUE;
+}
+
+// Pass data to the server.  On the render thread sends never block so a flush can cut them short.
+static gboolean gst_audsrv_sink_send_data( GstAudsrvSink *sink, guint8 *data, guint size )
+{
+   GstAudsrvSinkQueue *queue= sink->queue;
+   int rc;
+
+   if ( !queue )
+   {
+      return AudioServerAudioData( sink->audsrv, data, size );
+   }
+
+   while( size )
+   {
+      if ( queue->flushing )
+      {
+         GST_DEBUG_OBJECT(sink, "abandoning %u bytes on flush", size);
+         break;
+      }
+      rc= AudioServerAudioDataNonBlocking( sink->audsrv, data, size );
+      if ( rc < 0 )
+      {
+         return FALSE;
+      }
+      if ( rc == 0 )
+      {
+         gst_audsrv_sink_queue_wait_writable( sink );
+         continue;
+      }
+      data += rc;
+      size -= rc;
+   }
+
+   return TRUE;
+}
+
+static void gst_audsrv_sink_sync_reset( GstAudsrvSink *sink )
+{
+   sink->lastSyncTime= -1LL;
+   sink->lastSyncCheck= -1LL;
+   sink->syncInterval= AUDSRV_SINK_SYNC_MIN_INTERVAL;
+   sink->syncSampleCount= 0;
+}
+
+// Fit stc = a + slope*time over the retained samples and return the difference in
+// microseconds between stc and the fit's prediction for now.  Needs at least two samples.
+static bool gst_audsrv_sink_sync_error( GstAudsrvSink *sink, long long now, long long stc, double *errorUs )
+{
+   bool result= false;
+   int n= sink->syncSampleCount;
+   double meanTime= 0.0, meanStc= 0.0, cov= 0.0, var= 0.0;
+   double slope, predicted;
+   long long t0, s0;
+
+   if ( n >= 2 )
+   {
+      // Work relative to the oldest sample to keep precision
+      t0= sink->syncSampleTime[0];
+      s0= sink->syncSampleStc[0];
+      for( int i= 0; i < n; ++i )
+      {
+         meanTime += (double)(sink->syncSampleTime[i]-t0);
+         meanStc += (double)(sink->syncSampleStc[i]-s0);
+      }
+      meanTime /= n;
+      meanStc /= n;
+      for( int i= 0; i < n; ++i )
+      {
+         double dt= (double)(sink->syncSampleTime[i]-t0)-meanTime;
+         double ds= (double)(sink->syncSampleStc[i]-s0)-meanStc;
+         cov += dt*ds;
+         var += dt*dt;
+      }
+      if ( (var > 0.0) && (cov > 0.0) )
+      {
+         slope= cov/var;
+         predicted= meanStc+slope*((double)(now-t0)-meanTime);
+         *errorUs= ((double)(stc-s0)-predicted)/slope;
+         result= true;
+      }
+   }
+
+   return result;
+}
+
+// Send AudioServerAudioSync adaptively: often while the drift estimate is forming after
+// start or a discontinuity, rarely once predictions hold, and at once when they fail.
+static void gst_audsrv_sink_update_sync( GstAudsrvSink *sink )
+{
+   long long now, stc;
+   double errorUs;
+   bool send= false;
+
+   now= getCurrentTimeMicro();
+   if ( (sink->lastSyncTime >= 0) && (now-sink->lastSyncCheck < AUDSRV_SINK_SYNC_CHECK_INTERVAL) )
+   {
+      return;
+   }
+   sink->lastSyncCheck= now;
+
+   stc= gst_audsrv_sink_soc_get_stc( sink );
+
+   if ( sink->lastSyncTime < 0 )
+   {
+      send= true;
+   }
+   else if ( gst_audsrv_sink_sync_error( sink, now, stc, &errorUs ) &&
+             ((errorUs > AUDSRV_SINK_SYNC_ERROR_THRESHOLD) || (errorUs < -AUDSRV_SINK_SYNC_ERROR_THRESHOLD)) )
+   {
+      GST_DEBUG_OBJECT(sink, "stc off prediction by %f us: resyncing", errorUs);
+      sink->syncSampleCount= 0;
+      sink->syncInterval= AUDSRV_SINK_SYNC_MIN_INTERVAL;
+      send= true;
+   }
+   else if ( now-sink->lastSyncTime >= sink->syncInterval )
+   {
+      send= true;
+      if ( sink->syncSampleCount >= 2 )
+      {
+         sink->syncInterval= MIN( 2*sink->syncInterval, AUDSRV_SINK_SYNC_MAX_INTERVAL );
+      }
+   }
+
+   if ( sink->syncSampleCount == AUDSRV_SINK_SYNC_SAMPLES )
+   {
+      memmove( &sink->syncSampleTime[0], &sink->syncSampleTime[1], (AUDSRV_SINK_SYNC_SAMPLES-1)*sizeof(long long) );
+      memmove( &sink->syncSampleStc[0], &sink->syncSampleStc[1], (AUDSRV_SINK_SYNC_SAMPLES-1)*sizeof(long long) );
+      --sink->syncSampleCount;
+   }
+   sink->syncSampleTime[sink->syncSampleCount]= now;
+   sink->syncSampleStc[sink->syncSampleCount]= stc;
+   ++sink->syncSampleCount;
+
+   // Skipped while the connection is full in async mode: retried at the next check
+   if ( send && gst_audsrv_sink_queue_send_ready( sink ) )
+   {
+      if ( AudioServerAudioSync( sink->audsrv, now, stc ) )
+      {
+         sink->lastSyncTime= now;
+      }
+      else
+      {
+         GST_ERROR("AudioServerAudioSync failed");
+      }
+   }
+}
+
+// Coalesce contiguous buffers into one submission of about aggregate-time.  Data is sent
+// early on a discontinuity, at segment, caps and EOS boundaries, or once it has been held
+// for max-latency.
+static gboolean gst_audsrv_sink_aggregate_buffer( GstAudsrvSink *sink, GstBuffer *buffer, guint8 *data, guint size )
+{
+   gboolean result= TRUE;
+   GstClockTime timestamp= GST_BUFFER_TIMESTAMP(buffer);
+   GstClockTime duration= GST_BUFFER_DURATION(buffer);
+   GstClockTime target;
+   long long now;
+   gboolean bypass, started;
+
+   bypass= (!sink->aggregateTime || sink->tunnelData || !GST_CLOCK_TIME_IS_VALID(duration));
+   #ifdef USE_GST1
+   // Data already in the shared ring is committed in place rather than copied
+   bypass= (bypass || (sink->pool && (buffer->pool == sink->pool)));
+   #endif
+
+   if ( bypass )
+   {
+      result= gst_audsrv_sink_aggregate_flush( sink );
+      if ( !gst_audsrv_sink_process_buffer( sink, data, size ) )
+      {
+         result= FALSE;
+      }
+      goto exit;
+   }
+
+   if ( sink->aggregateSize )
+   {
+      gboolean contiguous= TRUE;
+
+      if ( GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DISCONT) )
+      {
+         contiguous= FALSE;
+      }
+      else if ( GST_CLOCK_TIME_IS_VALID(timestamp) && GST_CLOCK_TIME_IS_VALID(sink->aggregateNextTimestamp) )
+      {
+         GstClockTimeDiff diff= GST_CLOCK_DIFF(sink->aggregateNextTimestamp, timestamp);
+         if ( (diff > (GstClockTimeDiff)AUDSRV_SINK_AGGREGATE_TOLERANCE) || (diff < -(GstClockTimeDiff)AUDSRV_SINK_AGGREGATE_TOLERANCE) )
+         {
+            contiguous= FALSE;
+         }
+      }
+      if ( !contiguous )
+      {
+         result= gst_audsrv_sink_aggregate_flush( sink );
+      }
+   }
+
+   if ( sink->aggregateSize+size > sink->aggregateCapacity )
+   {
+      guint capacity= 2*(sink->aggregateSize+size);
+      guint8 *newData= (guint8*)realloc( sink->aggregateData, capacity );
+      if ( !newData )
+      {
+         GST_ERROR("unable to grow aggregation buffer to %u bytes", capacity);
+         if ( !gst_audsrv_sink_aggregate_flush( sink ) || !gst_audsrv_sink_process_buffer( sink, data, size ) )
+         {
+            result= FALSE;
+         }
+         goto exit;
+      }
+      sink->aggregateData= newData;
+      sink->aggregateCapacity= capacity;
+   }
+
+   now= getCurrentTimeMicro();
+   started= !sink->aggregateSize;
+   if ( started )
+   {
+      sink->aggregateStartTime= now;
+      sink->aggregateDuration= 0;
+   }
+   memcpy( sink->aggregateData+sink->aggregateSize, data, size );
+   sink->aggregateSize += size;
+   sink->aggregateDuration += duration;
+   if ( GST_CLOCK_TIME_IS_VALID(timestamp) )
+   {
+      sink->aggregateNextTimestamp= timestamp+duration;
+   }
+   else if ( GST_CLOCK_TIME_IS_VALID(sink->aggregateNextTimestamp) )
+   {
+      sink->aggregateNextTimestamp += duration;
+   }
+
+   target= sink->aggregateTime;
+   if ( sink->maxLatency && (sink->maxLatency < target) )
+   {
+      target= sink->maxLatency;
+   }
+   if ( (sink->aggregateDuration >= target) ||
+        (sink->maxLatency && ((now-sink->aggregateStartTime)*GST_USECOND >= sink->maxLatency)) )
+   {
+      if ( !gst_audsrv_sink_aggregate_flush( sink ) )
+      {
+         result= FALSE;
+      }
+   }
+   else if ( started && sink->maxLatency && !sink->queue )
+   {
+      // Don't rely on the next buffer arriving in time to send this
+      gst_audsrv_sink_aggregate_timer_arm( sink, gst_audsrv_sink_aggregate_deadline( sink ) );
+   }
+
+exit:
+
+   return result;
+}
+
+static gboolean gst_audsrv_sink_aggregate_flush( GstAudsrvSink *sink )
+{
+   gboolean result= TRUE;
+
+   if ( sink->aggregateSize )
+   {
+      if ( sink->isFlushing )
+      {
+         GST_DEBUG_OBJECT(sink, "dropping %u aggregated bytes while flushing", sink->aggregateSize);
+      }
+      else
+      {
+         GST_LOG_OBJECT(sink, "submitting %u aggregated bytes (%" GST_TIME_FORMAT ")",
+                        sink->aggregateSize, GST_TIME_ARGS(sink->aggregateDuration));
+         result= gst_audsrv_sink_process_buffer( sink, sink->aggregateData, sink->aggregateSize );
+      }
+   }
+   gst_audsrv_sink_aggregate_discard( sink );
+
+   return result;
+}
+
+static void gst_audsrv_sink_aggregate_discard( GstAudsrvSink *sink )
+{
+   sink->aggregateSize= 0;
+   sink->aggregateDuration= 0;
+   sink->aggregateNextTimestamp= GST_CLOCK_TIME_NONE;
+}
+
+// Time by which aggregated data must be sent to honour max-latency, or 0 if there is no limit
+static long long gst_audsrv_sink_aggregate_deadline( GstAudsrvSink *sink )
+{
+   long long deadline= 0;
+
+   if ( sink->aggregateSize && sink->maxLatency )
+   {
+      deadline= sink->aggregateStartTime + (long long)(sink->maxLatency/GST_USECOND);
+   }
+
+   return deadline;
+}
+
+/*
+ * Max-latency timer
+ *
+ * With synchronous rendering aggregated data would otherwise wait for the next buffer to
+ * be checked against max-latency, however late that buffer is.  A thread sends it once
+ * the limit is reached, taking the stream lock so it does not race the streaming thread.
+ * The lock is only tried: when the streaming thread holds it, the buffer it is handling
+ * will check the limit itself, so the timer just looks again a little later.  With async
+ * rendering the render thread applies the limit instead.
+ */
+typedef struct _GstAudsrvSinkAggregateTimer
+{
+   pthread_t thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   bool stopRequested;
+   long long deadline;
+   long long retryInterval;
+} GstAudsrvSinkAggregateTimer;
+
+// Returns FALSE if the stream lock could not be taken
+static gboolean gst_audsrv_sink_aggregate_expire( GstAudsrvSink *sink )
+{
+   GstPad *pad= GST_BASE_SINK_PAD(sink);
+   long long deadline;
+
+   if ( !GST_PAD_STREAM_TRYLOCK(pad) )
+   {
+      return FALSE;
+   }
+
+   deadline= gst_audsrv_sink_aggregate_deadline( sink );
+   if ( deadline && (getCurrentTimeMicro() >= deadline) )
+   {
+      GST_LOG_OBJECT(sink, "max-latency reached with %u bytes aggregated", sink->aggregateSize);
+      if ( !gst_audsrv_sink_aggregate_flush( sink ) )
+      {
+         GST_ERROR("unable to send aggregated data");
+      }
+   }
+
+   GST_PAD_STREAM_UNLOCK(pad);
+
+   return TRUE;
+}
+
+static void* gst_audsrv_sink_aggregate_timer_thread( void *arg )
+{
+   GstAudsrvSink *sink= (GstAudsrvSink*)arg;
+   GstAudsrvSinkAggregateTimer *timer= sink->aggregateTimer;
+   struct timespec deadline;
+   long long now, remaining;
+   gboolean expired;
+
+   pthread_mutex_lock( &timer->mutex );
+   while( !timer->stopRequested )
+   {
+      if ( !timer->deadline )
+      {
+         pthread_cond_wait( &timer->cond, &timer->mutex );
+         continue;
+      }
+
+      now= getCurrentTimeMicro();
+      remaining= timer->deadline-now;
+      if ( remaining > 0 )
+      {
+         clock_gettime( CLOCK_MONOTONIC, &deadline );
+         deadline.tv_sec += remaining / 1000000LL;
+         deadline.tv_nsec += (remaining % 1000000LL)*1000LL;
+         if ( deadline.tv_nsec >= 1000000000LL )
+         {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000LL;
+         }
+         pthread_cond_timedwait( &timer->cond, &timer->mutex, &deadline );
+         continue;
+      }
+
+      timer->deadline= 0;
+      pthread_mutex_unlock( &timer->mutex );
+
+      expired= gst_audsrv_sink_aggregate_expire( sink );
+
+      pthread_mutex_lock( &timer->mutex );
+      if ( !expired && !timer->deadline )
+      {
+         timer->deadline= now+timer->retryInterval;
+         timer->retryInterval= MIN( 2*timer->retryInterval, AUDSRV_SINK_AGGREGATE_RETRY_MAX );
+      }
+   }
+   pthread_mutex_unlock( &timer->mutex );
+
+   return NULL;
+}
+
+// Called on the streaming thread.  The timer thread is started on first use.
+static void gst_audsrv_sink_aggregate_timer_arm( GstAudsrvSink *sink, long long deadline )
+{
+   GstAudsrvSinkAggregateTimer *timer= sink->aggregateTimer;
+
+   if ( !timer )
+   {
+      pthread_condattr_t attr;
+
+      timer= (GstAudsrvSinkAggregateTimer*)calloc( 1, sizeof(GstAudsrvSinkAggregateTimer) );
+      if ( !timer )
+      {
+         GST_ERROR("unable to allocate max-latency timer");
+         return;
+      }
+      pthread_mutex_init( &timer->mutex, 0 );
+      pthread_condattr_init( &attr );
+      pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+      pthread_cond_init( &timer->cond, &attr );
+      pthread_condattr_destroy( &attr );
+
+      sink->aggregateTimer= timer;
+      if ( pthread_create( &timer->thread, NULL, gst_audsrv_sink_aggregate_timer_thread, sink ) != 0 )
+      {
+         GST_ERROR("unable to start max-latency timer thread");
+         sink->aggregateTimer= 0;
+         pthread_cond_destroy( &timer->cond );
+         pthread_mutex_destroy( &timer->mutex );
+         free( timer );
+         return;
+      }
+   }
+
+   pthread_mutex_lock( &timer->mutex );
+   timer->deadline= deadline;
+   timer->retryInterval= AUDSRV_SINK_AGGREGATE_RETRY_MIN;
+   pthread_cond_signal( &timer->cond );
+   pthread_mutex_unlock( &timer->mutex );
+}
+
+static void gst_audsrv_sink_aggregate_timer_stop( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkAggregateTimer *timer= sink->aggregateTimer;
+
+   if ( timer )
+   {
+      pthread_mutex_lock( &timer->mutex );
+      timer->stopRequested= true;
+      pthread_cond_signal( &timer->cond );
+      pthread_mutex_unlock( &timer->mutex );
+      pthread_join( timer->thread, NULL );
+
+      sink->aggregateTimer= 0;
+      pthread_cond_destroy( &timer->cond );
+      pthread_mutex_destroy( &timer->mutex );
+      free( timer );
+   }
+}
+
+gboolean gst_audsrv_sink_process_buffer_handle( GstAudsrvSink *sink, guint64 handle )
+{
+   gboolean result= FALSE;
+
+   if ( AudioServerAudioDataHandle( sink->audsrv, handle ) )
+   {
+      result= TRUE;
+   }
+   
+   return result;
+}
+
+#ifdef USE_GST1
+/*
+ * Buffer pool whose memory lies in a ring shared with the audio server.  Upstream
+ * elements that take the pool write PCM straight into the ring and render passes
+ * only the offset.  The ring is divided into fixed slots, one per buffer, and a
+ * slot is handed out again only once the server has consumed its last commit.
+ */
+#define AUDSRV_SINK_RING_SIZE (1024*1024)
+#define AUDSRV_SINK_POOL_FRAMES (2048)
+#define AUDSRV_SINK_POOL_DEFAULT_SIZE (16*1024)
+#define AUDSRV_SINK_POOL_ALIGN (64)
+#define AUDSRV_SINK_POOL_WAIT_WARNING (200)
+
+typedef struct _GstAudsrvSinkPool
+{
+   GstBufferPool parent;
+   GMutex mutex;
+   int fd;
+   AudSrvDataRing *ring;
+   unsigned mapSize;
+   unsigned slotSize;
+   unsigned slotCount;
+   gboolean *slotAllocated;
+   guint64 *slotSequence;
+   gboolean detached;
+   gboolean flushing;
+} GstAudsrvSinkPool;
+
+typedef struct _GstAudsrvSinkPoolClass
+{
+   GstBufferPoolClass parent_class;
+} GstAudsrvSinkPoolClass;
+
+GType gst_audsrv_sink_pool_get_type( void );
+G_DEFINE_TYPE (GstAudsrvSinkPool, gst_audsrv_sink_pool, GST_TYPE_BUFFER_POOL);
+
+static GQuark gst_audsrv_sink_pool_slot_quark( void )
+{
+   return g_quark_from_static_string("audsrvsink-pool-slot");
+}
+
+static void gst_audsrv_sink_pool_finalize( GObject *object )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)object;
+
+   if ( pool->ring )
+   {
+      munmap( pool->ring, pool->mapSize );
+      pool->ring= 0;
+   }
+   if ( pool->fd >= 0 )
+   {
+      close( pool->fd );
+      pool->fd= -1;
+   }
+   g_free( pool->slotAllocated );
+   g_free( pool->slotSequence );
+   g_mutex_clear( &pool->mutex );
+
+   G_OBJECT_CLASS(gst_audsrv_sink_pool_parent_class)->finalize(object);
+}
+
+static gboolean gst_audsrv_sink_pool_set_config( GstBufferPool *bpool, GstStructure *config )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)bpool;
+   GstCaps *caps;
+   guint size, minBuffers, maxBuffers;
+   unsigned slotSize, slotCount;
+
+   if ( !gst_buffer_pool_config_get_params( config, &caps, &size, &minBuffers, &maxBuffers ) )
+   {
+      GST_ERROR("invalid pool config");
+      return FALSE;
+   }
+
+   slotSize= ((size+AUDSRV_SINK_POOL_ALIGN-1)/AUDSRV_SINK_POOL_ALIGN)*AUDSRV_SINK_POOL_ALIGN;
+   slotCount= (slotSize ? pool->ring->size/slotSize : 0);
+   if ( !slotCount )
+   {
+      GST_ERROR("buffer size %u does not fit ring of %u bytes", size, pool->ring->size);
+      return FALSE;
+   }
+   if ( !maxBuffers || (maxBuffers > slotCount) )
+   {
+      maxBuffers= slotCount;
+   }
+   if ( minBuffers > maxBuffers )
+   {
+      GST_ERROR("pool needs %u buffers of %u bytes but ring holds %u", minBuffers, size, slotCount);
+      return FALSE;
+   }
+
+   g_mutex_lock( &pool->mutex );
+   g_free( pool->slotAllocated );
+   g_free( pool->slotSequence );
+   pool->slotSize= slotSize;
+   pool->slotCount= slotCount;
+   pool->slotAllocated= g_new0( gboolean, slotCount );
+   pool->slotSequence= g_new0( guint64, slotCount );
+   g_mutex_unlock( &pool->mutex );
+
+   gst_buffer_pool_config_set_params( config, caps, size, minBuffers, maxBuffers );
+
+   return GST_BUFFER_POOL_CLASS(gst_audsrv_sink_pool_parent_class)->set_config(bpool, config);
+}
+
+static GstFlowReturn gst_audsrv_sink_pool_alloc_buffer( GstBufferPool *bpool, GstBuffer **buffer, GstBufferPoolAcquireParams *params )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)bpool;
+   GstStructure *config;
+   guint size;
+   int slot= -1;
+
+   AUDSRV_UNUSED(params);
+
+   config= gst_buffer_pool_get_config( bpool );
+   gst_buffer_pool_config_get_params( config, NULL, &size, NULL, NULL );
+   gst_structure_free( config );
+
+   g_mutex_lock( &pool->mutex );
+   for( unsigned i= 0; i < pool->slotCount; ++i )
+   {
+      if ( !pool->slotAllocated[i] )
+      {
+         pool->slotAllocated[i]= TRUE;
+         slot= i;
+         break;
+      }
+   }
+   g_mutex_unlock( &pool->mutex );
+
+   if ( slot < 0 )
+   {
+      GST_ERROR("no free ring slot");
+      return GST_FLOW_ERROR;
+   }
+
+   *buffer= gst_buffer_new_wrapped_full( (GstMemoryFlags)0,
+                                         AUDSRV_DATA_RING_DATA(pool->ring)+slot*pool->slotSize,
+                                         pool->slotSize, 0, size, NULL, NULL );
+   gst_mini_object_set_qdata( GST_MINI_OBJECT_CAST(*buffer), gst_audsrv_sink_pool_slot_quark(),
+                              GINT_TO_POINTER(slot+1), NULL );
+
+   return GST_FLOW_OK;
+}
+
+static void gst_audsrv_sink_pool_free_buffer( GstBufferPool *bpool, GstBuffer *buffer )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)bpool;
+   int slot;
+
+   slot= GPOINTER_TO_INT(gst_mini_object_get_qdata( GST_MINI_OBJECT_CAST(buffer), gst_audsrv_sink_pool_slot_quark() ))-1;
+
+   g_mutex_lock( &pool->mutex );
+   if ( (slot >= 0) && (slot < (int)pool->slotCount) )
+   {
+      pool->slotAllocated[slot]= FALSE;
+   }
+   g_mutex_unlock( &pool->mutex );
+
+   GST_BUFFER_POOL_CLASS(gst_audsrv_sink_pool_parent_class)->free_buffer(bpool, buffer);
+}
+
+static GstFlowReturn gst_audsrv_sink_pool_acquire_buffer( GstBufferPool *bpool, GstBuffer **buffer, GstBufferPoolAcquireParams *params )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)bpool;
+   GstFlowReturn ret;
+   gint64 warnTime;
+   guint64 sequence;
+   gboolean detached, flushing;
+   int slot;
+
+   ret= GST_BUFFER_POOL_CLASS(gst_audsrv_sink_pool_parent_class)->acquire_buffer(bpool, buffer, params);
+   if ( ret == GST_FLOW_OK )
+   {
+      // Wait until the server has consumed the last commit made from this slot.  Handing the
+      // slot out any earlier would let upstream overwrite audio the server has yet to play.
+      slot= GPOINTER_TO_INT(gst_mini_object_get_qdata( GST_MINI_OBJECT_CAST(*buffer), gst_audsrv_sink_pool_slot_quark() ))-1;
+      warnTime= g_get_monotonic_time() + AUDSRV_SINK_POOL_WAIT_WARNING*1000LL;
+      for( ; ; )
+      {
+         g_mutex_lock( &pool->mutex );
+         sequence= ((slot >= 0) && (slot < (int)pool->slotCount)) ? pool->slotSequence[slot] : 0;
+         detached= pool->detached;
+         flushing= pool->flushing;
+         g_mutex_unlock( &pool->mutex );
+
+         if ( detached || (pool->ring->consumed >= sequence) )
+         {
+            break;
+         }
+         if ( flushing || (params && (params->flags & GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT)) )
+         {
+            GST_BUFFER_POOL_CLASS(gst_audsrv_sink_pool_parent_class)->release_buffer(bpool, *buffer);
+            *buffer= NULL;
+            ret= (flushing ? GST_FLOW_FLUSHING : GST_FLOW_EOS);
+            break;
+         }
+         if ( warnTime && (g_get_monotonic_time() >= warnTime) )
+         {
+            GST_WARNING("ring slot %d not yet released by server: waiting", slot);
+            warnTime= 0;
+         }
+         g_usleep( 1000 );
+      }
+   }
+
+   return ret;
+}
+
+static void gst_audsrv_sink_pool_flush_start( GstBufferPool *bpool )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)bpool;
+
+   g_mutex_lock( &pool->mutex );
+   pool->flushing= TRUE;
+   g_mutex_unlock( &pool->mutex );
+}
+
+static void gst_audsrv_sink_pool_flush_stop( GstBufferPool *bpool )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)bpool;
+
+   g_mutex_lock( &pool->mutex );
+   pool->flushing= FALSE;
+   g_mutex_unlock( &pool->mutex );
+}
+
+static void gst_audsrv_sink_pool_class_init( GstAudsrvSinkPoolClass *klass )
+{
+   GObjectClass *gobject_class= G_OBJECT_CLASS(klass);
+   GstBufferPoolClass *pool_class= GST_BUFFER_POOL_CLASS(klass);
+
+   gobject_class->finalize= gst_audsrv_sink_pool_finalize;
+   pool_class->set_config= gst_audsrv_sink_pool_set_config;
+   pool_class->alloc_buffer= gst_audsrv_sink_pool_alloc_buffer;
+   pool_class->free_buffer= gst_audsrv_sink_pool_free_buffer;
+   pool_class->acquire_buffer= gst_audsrv_sink_pool_acquire_buffer;
+   pool_class->flush_start= gst_audsrv_sink_pool_flush_start;
+   pool_class->flush_stop= gst_audsrv_sink_pool_flush_stop;
+}
+
+static void gst_audsrv_sink_pool_init( GstAudsrvSinkPool *pool )
+{
+   g_mutex_init( &pool->mutex );
+   pool->fd= -1;
+   pool->ring= 0;
+   pool->mapSize= 0;
+   pool->slotSize= 0;
+   pool->slotCount= 0;
+   pool->slotAllocated= 0;
+   pool->slotSequence= 0;
+   pool->detached= FALSE;
+   pool->flushing= FALSE;
+}
+
+static GstBufferPool* gst_audsrv_sink_pool_new( void )
+{
+   GstAudsrvSinkPool *pool= 0;
+   unsigned mapSize= sizeof(AudSrvDataRing)+AUDSRV_SINK_RING_SIZE;
+   void *map;
+   int fd;
+
+   fd= memfd_create( "audsrvsink-pool", MFD_CLOEXEC|MFD_ALLOW_SEALING );
+   if ( fd < 0 )
+   {
+      GST_ERROR("unable to create data ring: errno %d", errno);
+      goto exit;
+   }
+
+   if ( (ftruncate( fd, mapSize ) < 0) ||
+        (fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL ) < 0) )
+   {
+      GST_ERROR("unable to size and seal data ring: errno %d", errno);
+      close( fd );
+      goto exit;
+   }
+
+   map= mmap( NULL, mapSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+   if ( map == MAP_FAILED )
+   {
+      GST_ERROR("unable to map data ring: errno %d", errno);
+      close( fd );
+      goto exit;
+   }
+
+   pool= (GstAudsrvSinkPool*)g_object_new( gst_audsrv_sink_pool_get_type(), NULL );
+   pool->fd= fd;
+   pool->ring= (AudSrvDataRing*)map;
+   pool->mapSize= mapSize;
+   pool->ring->magic= AUDSRV_DATA_RING_MAGIC;
+   pool->ring->size= AUDSRV_SINK_RING_SIZE;
+   pool->ring->consumed= 0;
+
+exit:
+
+   return (GstBufferPool*)pool;
+}
+
+static int gst_audsrv_sink_pool_get_fd( GstBufferPool *bpool )
+{
+   return ((GstAudsrvSinkPool*)bpool)->fd;
+}
+
+static guint gst_audsrv_sink_pool_max_buffers( GstBufferPool *bpool, guint size )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)bpool;
+   guint slotSize= ((size+AUDSRV_SINK_POOL_ALIGN-1)/AUDSRV_SINK_POOL_ALIGN)*AUDSRV_SINK_POOL_ALIGN;
+
+   return (slotSize ? pool->ring->size/slotSize : 0);
+}
+
+// Size pool buffers to hold AUDSRV_SINK_POOL_FRAMES frames of the negotiated PCM format
+static guint gst_audsrv_sink_pool_buffer_size( GstCaps *caps )
+{
+   guint size= AUDSRV_SINK_POOL_DEFAULT_SIZE;
+   GstStructure *str;
+   const gchar *format;
+   gint channels= 0;
+   int bits= 0;
+
+   str= gst_caps_get_structure( caps, 0 );
+   format= gst_structure_get_string( str, "format" );
+   if ( format && gst_structure_get_int( str, "channels", &channels ) && (channels > 0) )
+   {
+      const char *width= format+1;
+      const char *container= strchr( format, '_' );
+
+      // Packed formats such as S24_32LE name their container width after the underscore
+      bits= atoi( container ? container+1 : width );
+      if ( bits > 0 )
+      {
+         size= AUDSRV_SINK_POOL_FRAMES*channels*((bits+7)/8);
+      }
+   }
+
+   return size;
+}
+
+static gboolean gst_audsrv_sink_propose_allocation(GstBaseSink *bsink, GstQuery *query)
+{
+   GstAudsrvSink *sink= GST_AUDSRV_SINK(bsink);
+   GstCaps *caps= NULL;
+   gboolean needPool= FALSE;
+   const gchar *type;
+   guint size, maxBuffers;
+
+   gst_query_parse_allocation( query, &caps, &needPool );
+
+   if ( !caps || !needPool || !sink->audsrv || sink->tunnelData )
+   {
+      return TRUE;
+   }
+
+   type= gst_structure_get_name( gst_caps_get_structure( caps, 0 ) );
+   if ( !type || strcmp( type, "audio/x-raw" ) )
+   {
+      return TRUE;
+   }
+
+   if ( !sink->pool )
+   {
+      sink->pool= gst_audsrv_sink_pool_new();
+      if ( !sink->pool )
+      {
+         return TRUE;
+      }
+
+      if ( !AudioServerEnableDataRing( sink->audsrv, gst_audsrv_sink_pool_get_fd( sink->pool ) ) )
+      {
+         GST_ERROR("AudioServerEnableDataRing failed");
+         gst_object_unref( sink->pool );
+         sink->pool= NULL;
+         return TRUE;
+      }
+   }
+
+   size= gst_audsrv_sink_pool_buffer_size( caps );
+   maxBuffers= gst_audsrv_sink_pool_max_buffers( sink->pool, size );
+   if ( maxBuffers )
+   {
+      GST_DEBUG_OBJECT(sink, "proposing ring pool: size %u max buffers %u", size, maxBuffers);
+      gst_query_add_allocation_pool( query, sink->pool, size, 0, maxBuffers );
+   }
+
+   return TRUE;
+}
+
+// Pass data already in the ring by offset.  Returns FALSE if the data must be copied instead.
+static gboolean gst_audsrv_sink_pool_commit( GstAudsrvSink *sink, guint8 *data, guint size )
+{
+   gboolean result= FALSE;
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)sink->pool;
+   unsigned char *base;
+   unsigned long long sequence;
+   unsigned offset;
+
+   if ( pool )
+   {
+      base= AUDSRV_DATA_RING_DATA(pool->ring);
+      if ( (data >= base) && (size <= pool->ring->size) && ((unsigned)(data-base) <= pool->ring->size-size) )
+      {
+         offset= data-base;
+         // When a flush cuts the wait short the copy path abandons the data
+         if ( gst_audsrv_sink_queue_wait_writable( sink ) &&
+              AudioServerAudioDataRing( sink->audsrv, offset, size, &sequence ) )
+         {
+            g_mutex_lock( &pool->mutex );
+            if ( pool->slotSize && (offset/pool->slotSize < pool->slotCount) )
+            {
+               pool->slotSequence[offset/pool->slotSize]= sequence;
+            }
+            g_mutex_unlock( &pool->mutex );
+            result= TRUE;
+         }
+      }
+   }
+
+   return result;
+}
+
+// Release the pool from the session.  Upstream may still hold buffers from it; they stay
+// valid until returned but no longer wait on the server.
+static void gst_audsrv_sink_pool_detach( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkPool *pool= (GstAudsrvSinkPool*)sink->pool;
+
+   if ( pool )
+   {
+      g_mutex_lock( &pool->mutex );
+      pool->detached= TRUE;
+      g_mutex_unlock( &pool->mutex );
+
+      if ( sink->audsrv && !sink->ownSession )
+      {
+         AudioServerEnableDataRing( sink->audsrv, -1 );
+      }
+
+      gst_object_unref( sink->pool );
+      sink->pool= NULL;
+   }
+}
+
+/*
+ * Clock following the audio actually played out.  Each report from
+ * AudioServerGetLatency gives the amount of submitted data still queued, from
+ * which the rendered position is derived.  Between reports the position is
+ * extrapolated from the monotonic clock and the clock is slewed towards it by
+ * at most AUDSRV_SINK_CLOCK_MAX_SLEW so that sinks slaved to it see no steps.
+ * Where the byte rate of the stream is unknown the clock runs at system rate.
+ * All times are in ns except where named in micros.
+ */
+#define AUDSRV_SINK_CLOCK_POLL_INTERVAL (50000LL)
+#define AUDSRV_SINK_CLOCK_SLEW_TIME (GST_SECOND)
+#define AUDSRV_SINK_CLOCK_MAX_SLEW (0.05)
+#define AUDSRV_SINK_CLOCK_RESYNC_THRESHOLD (100*GST_MSECOND)
+#define AUDSRV_SINK_CLOCK_MAX_LEAD (20*GST_MSECOND)
+
+typedef struct _GstAudsrvSinkClock
+{
+   GstSystemClock parent;
+   GMutex mutex;
+   gboolean running;
+   guint generation;
+   guint requestGeneration;
+   gboolean requestPending;
+   long long lastRequestTime;
+   guint64 byteRate;
+   guint64 submittedBytes;
+   GstClockTime base;
+   GstClockTime startTimestamp;
+   gboolean haveLatency;
+   GstClockTime latency;
+   gboolean haveReport;
+   gboolean reportAdvancing;
+   GstClockTime reportPosition;
+   long long reportTime;
+   long long lastNow;
+   GstClockTime lastTime;
+} GstAudsrvSinkClock;
+
+typedef struct _GstAudsrvSinkClockClass
+{
+   GstSystemClockClass parent_class;
+} GstAudsrvSinkClockClass;
+
+GType gst_audsrv_sink_clock_get_type( void );
+G_DEFINE_TYPE (GstAudsrvSinkClock, gst_audsrv_sink_clock, GST_TYPE_SYSTEM_CLOCK);
+
+static long long getMonotonicTimeMicro()
+{
+   struct timespec tm;
+
+   clock_gettime( CLOCK_MONOTONIC, &tm );
+
+   return tm.tv_sec*1000000LL+tm.tv_nsec/1000LL;
+}
+
+// Must be called with the clock mutex held
+static GstClockTime gst_audsrv_sink_clock_update_unlocked( GstAudsrvSinkClock *clock )
+{
+   long long now= getMonotonicTimeMicro();
+   GstClockTime elapsed;
+
+   if ( clock->lastNow < 0 )
+   {
+      clock->lastNow= now;
+   }
+   elapsed= (now > clock->lastNow) ? (now-clock->lastNow)*GST_USECOND : 0;
+
+   if ( clock->running )
+   {
+      GstClockTime predicted= clock->lastTime+elapsed;
+      GstClockTime next= predicted;
+
+      if ( clock->byteRate )
+      {
+         GstClockTime target= clock->base;
+         GstClockTime limit= clock->base+gst_util_uint64_scale( clock->submittedBytes, GST_SECOND, clock->byteRate );
+
+         if ( clock->haveReport )
+         {
+            target += clock->reportPosition;
+            if ( clock->reportAdvancing && (now > clock->reportTime) )
+            {
+               target += (now-clock->reportTime)*GST_USECOND;
+            }
+         }
+         target= MIN( target, limit );
+
+         if ( target > predicted+AUDSRV_SINK_CLOCK_RESYNC_THRESHOLD )
+         {
+            next= target;
+         }
+         else
+         {
+            double error= (double)GST_CLOCK_DIFF( predicted, target );
+            double slew= error*((double)elapsed/AUDSRV_SINK_CLOCK_SLEW_TIME);
+            double maxSlew= elapsed*AUDSRV_SINK_CLOCK_MAX_SLEW;
+
+            slew= CLAMP( slew, -maxSlew, maxSlew );
+            next= predicted+(GstClockTimeDiff)slew;
+
+            // Hold back while output is stalled rather than run ahead of it
+            if ( next > target+AUDSRV_SINK_CLOCK_MAX_LEAD )
+            {
+               next= MAX( clock->lastTime, target+AUDSRV_SINK_CLOCK_MAX_LEAD );
+            }
+         }
+      }
+
+      clock->lastTime= MAX( next, clock->lastTime );
+   }
+   clock->lastNow= now;
+
+   return clock->lastTime;
+}
+
+static GstClockTime gst_audsrv_sink_clock_get_internal_time( GstClock *gclock )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)gclock;
+   GstClockTime time;
+
+   g_mutex_lock( &clock->mutex );
+   time= gst_audsrv_sink_clock_update_unlocked( clock );
+   g_mutex_unlock( &clock->mutex );
+
+   return time;
+}
+
+static void gst_audsrv_sink_clock_finalize( GObject *object )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)object;
+
+   g_mutex_clear( &clock->mutex );
+
+   G_OBJECT_CLASS(gst_audsrv_sink_clock_parent_class)->finalize( object );
+}
+
+static void gst_audsrv_sink_clock_class_init( GstAudsrvSinkClockClass *klass )
+{
+   GObjectClass *gobject_class= G_OBJECT_CLASS(klass);
+   GstClockClass *clock_class= GST_CLOCK_CLASS(klass);
+
+   gobject_class->finalize= gst_audsrv_sink_clock_finalize;
+   clock_class->get_internal_time= gst_audsrv_sink_clock_get_internal_time;
+}
+
+static void gst_audsrv_sink_clock_init( GstAudsrvSinkClock *clock )
+{
+   g_mutex_init( &clock->mutex );
+   clock->running= FALSE;
+   clock->generation= 0;
+   clock->requestGeneration= 0;
+   clock->requestPending= FALSE;
+   clock->lastRequestTime= 0LL;
+   clock->byteRate= 0;
+   clock->submittedBytes= 0;
+   clock->base= 0;
+   clock->startTimestamp= GST_CLOCK_TIME_NONE;
+   clock->haveLatency= FALSE;
+   clock->latency= 0;
+   clock->haveReport= FALSE;
+   clock->reportAdvancing= FALSE;
+   clock->reportPosition= 0;
+   clock->reportTime= 0LL;
+   clock->lastNow= -1LL;
+   clock->lastTime= 0;
+}
+
+static GstClock* gst_audsrv_sink_clock_new( void )
+{
+   return (GstClock*)g_object_new( gst_audsrv_sink_clock_get_type(), "name", "audsrvsinkclock", NULL );
+}
+
+static GstClock* gst_audsrv_sink_provide_clock( GstElement *element )
+{
+   GstAudsrvSink *sink= GST_AUDSRV_SINK(element);
+
+   return (sink->clock ? (GstClock*)gst_object_ref( sink->clock ) : NULL);
+}
+
+// Bytes per second of a raw PCM format, or 0 if the caps don't describe one
+static guint64 gst_audsrv_sink_caps_byte_rate( GstCaps *caps )
+{
+   guint64 byteRate= 0;
+   GstStructure *str;
+   const gchar *format;
+   gint rate= 0, channels= 0;
+   int bits;
+
+   str= gst_caps_get_structure( caps, 0 );
+   if ( str && gst_structure_has_name( str, "audio/x-raw" ) )
+   {
+      format= gst_structure_get_string( str, "format" );
+      if ( format &&
+           gst_structure_get_int( str, "rate", &rate ) && (rate > 0) &&
+           gst_structure_get_int( str, "channels", &channels ) && (channels > 0) )
+      {
+         const char *container= strchr( format, '_' );
+
+         bits= atoi( container ? container+1 : format+1 );
+         if ( bits > 0 )
+         {
+            byteRate= (guint64)rate*channels*((bits+7)/8);
+         }
+      }
+   }
+
+   return byteRate;
+}
+
+// Tell the server which sample format follows so it can convert wide PCM for the SoC
+static void gst_audsrv_sink_set_pcm_format( GstAudsrvSink *sink, GstCaps *caps )
+{
+   GstStructure *str;
+   const gchar *format;
+   unsigned pcmFormat= AUDSRV_PCM_FORMAT_S16LE;
+
+   str= gst_caps_get_structure( caps, 0 );
+   if ( sink->audsrv && !sink->tunnelData && str && gst_structure_has_name( str, "audio/x-raw" ) )
+   {
+      format= gst_structure_get_string( str, "format" );
+      if ( format )
+      {
+         if ( !strcmp( format, "S24_32LE" ) )
+         {
+            pcmFormat= AUDSRV_PCM_FORMAT_S24_32LE;
+         }
+         else if ( !strcmp( format, "S32LE" ) )
+         {
+            pcmFormat= AUDSRV_PCM_FORMAT_S32LE;
+         }
+         else if ( !strcmp( format, "F32LE" ) )
+         {
+            pcmFormat= AUDSRV_PCM_FORMAT_F32LE;
+         }
+      }
+
+      GST_DEBUG_OBJECT(sink, "pcm format %s (%u)", (format ? format : "none"), pcmFormat);
+
+      // Sent for every raw format so a session reused after wide PCM returns to S16LE
+      if ( !AudioServerSetPcmFormat( sink->audsrv, pcmFormat ) )
+      {
+         GST_ERROR("AudioServerSetPcmFormat %u failed", pcmFormat);
+      }
+   }
+}
+
+static void gst_audsrv_sink_clock_set_byte_rate( GstAudsrvSink *sink, guint64 byteRate )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)sink->clock;
+
+   if ( clock )
+   {
+      g_mutex_lock( &clock->mutex );
+      if ( byteRate != clock->byteRate )
+      {
+         // Data already submitted was measured at the old rate: restart from here
+         clock->base= gst_audsrv_sink_clock_update_unlocked( clock );
+         clock->submittedBytes= 0;
+         clock->startTimestamp= GST_CLOCK_TIME_NONE;
+         clock->haveReport= FALSE;
+         clock->reportAdvancing= FALSE;
+         clock->byteRate= byteRate;
+         ++clock->generation;
+      }
+      g_mutex_unlock( &clock->mutex );
+   }
+}
+
+static void gst_audsrv_sink_clock_set_running( GstAudsrvSink *sink, gboolean running )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)sink->clock;
+
+   if ( clock )
+   {
+      g_mutex_lock( &clock->mutex );
+      gst_audsrv_sink_clock_update_unlocked( clock );
+      clock->running= running;
+      g_mutex_unlock( &clock->mutex );
+   }
+}
+
+// Queued data has been discarded: continue the clock from its current time
+static void gst_audsrv_sink_clock_reset( GstAudsrvSink *sink )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)sink->clock;
+
+   if ( clock )
+   {
+      g_mutex_lock( &clock->mutex );
+      clock->base= gst_audsrv_sink_clock_update_unlocked( clock );
+      clock->submittedBytes= 0;
+      clock->startTimestamp= GST_CLOCK_TIME_NONE;
+      clock->haveReport= FALSE;
+      clock->reportAdvancing= FALSE;
+      ++clock->generation;
+      g_mutex_unlock( &clock->mutex );
+   }
+}
+
+static void audsrv_clock_latency( void *userData, int result, AudSrvLatency *latency )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)userData;
+
+   g_mutex_lock( &clock->mutex );
+   clock->requestPending= FALSE;
+   if ( (result == 0) && latency && clock->byteRate && (clock->requestGeneration == clock->generation) )
+   {
+      guint64 queued= (guint64)latency->clientBytes+latency->serverBytes+latency->socBytes;
+      guint64 rendered= (clock->submittedBytes > queued) ? clock->submittedBytes-queued : 0;
+      GstClockTime position= gst_util_uint64_scale( rendered, GST_SECOND, clock->byteRate );
+      GstClockTime delay= latency->outputDelay*GST_USECOND;
+
+      position= (position > delay) ? position-delay : 0;
+
+      clock->latency= gst_util_uint64_scale( (guint64)latency->serverBytes+latency->socBytes, GST_SECOND, clock->byteRate )+delay;
+      clock->haveLatency= TRUE;
+
+      // Only extrapolate once output is seen to be moving
+      clock->reportAdvancing= (clock->haveReport && (position > clock->reportPosition));
+      clock->reportPosition= position;
+      clock->reportTime= latency->timestamp;
+      clock->haveReport= TRUE;
+   }
+   g_mutex_unlock( &clock->mutex );
+
+   gst_object_unref( clock );
+}
+
+// Note the timestamp of the first data submitted since the last reset
+static void gst_audsrv_sink_clock_start_timestamp( GstAudsrvSink *sink, GstClockTime timestamp )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)sink->clock;
+
+   if ( clock && GST_CLOCK_TIME_IS_VALID(timestamp) )
+   {
+      g_mutex_lock( &clock->mutex );
+      if ( !GST_CLOCK_TIME_IS_VALID(clock->startTimestamp) )
+      {
+         clock->startTimestamp= timestamp;
+      }
+      g_mutex_unlock( &clock->mutex );
+   }
+}
+
+// Timestamp of the sample now being played, extrapolated from the last report
+static gboolean gst_audsrv_sink_clock_get_position( GstAudsrvSink *sink, GstClockTime *position )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)sink->clock;
+   gboolean result= FALSE;
+   GstClockTime rendered, limit;
+   long long now;
+
+   if ( clock )
+   {
+      now= getMonotonicTimeMicro();
+
+      g_mutex_lock( &clock->mutex );
+      if ( clock->haveReport && GST_CLOCK_TIME_IS_VALID(clock->startTimestamp) )
+      {
+         rendered= clock->reportPosition;
+         if ( clock->running && clock->reportAdvancing && (now > clock->reportTime) )
+         {
+            rendered += (now-clock->reportTime)*GST_USECOND;
+         }
+         limit= gst_util_uint64_scale( clock->submittedBytes, GST_SECOND, clock->byteRate );
+         *position= clock->startTimestamp+MIN( rendered, limit );
+         result= TRUE;
+      }
+      g_mutex_unlock( &clock->mutex );
+   }
+
+   return result;
+}
+
+// Measured time from the server receiving data to it being heard
+static gboolean gst_audsrv_sink_clock_get_latency( GstAudsrvSink *sink, GstClockTime *latency )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)sink->clock;
+   gboolean result= FALSE;
+
+   if ( clock )
+   {
+      g_mutex_lock( &clock->mutex );
+      if ( clock->haveLatency )
+      {
+         *latency= clock->latency;
+         result= TRUE;
+      }
+      g_mutex_unlock( &clock->mutex );
+   }
+
+   return result;
+}
+
+// Account for data passed to the server and request a fresh position report when due
+static void gst_audsrv_sink_clock_submitted( GstAudsrvSink *sink, guint size )
+{
+   GstAudsrvSinkClock *clock= (GstAudsrvSinkClock*)sink->clock;
+   gboolean request= FALSE;
+   long long now;
+
+   if ( clock )
+   {
+      now= getMonotonicTimeMicro();
+
+      g_mutex_lock( &clock->mutex );
+      clock->submittedBytes += size;
+      if ( clock->byteRate && !clock->requestPending &&
+           (now-clock->lastRequestTime >= AUDSRV_SINK_CLOCK_POLL_INTERVAL) )
+      {
+         clock->requestPending= TRUE;
+         clock->requestGeneration= clock->generation;
+         clock->lastRequestTime= now;
+         request= TRUE;
+      }
+      g_mutex_unlock( &clock->mutex );
+
+      if ( request && !gst_audsrv_sink_queue_send_ready( sink ) )
+      {
+         // Asked again after a later submission
+         g_mutex_lock( &clock->mutex );
+         clock->requestPending= FALSE;
+         g_mutex_unlock( &clock->mutex );
+         request= FALSE;
+      }
+
+      if ( request )
+      {
+         gst_object_ref( clock );
+         if ( !AudioServerGetLatency( sink->audsrv, audsrv_clock_latency, clock ) )
+         {
+            GST_WARNING_OBJECT(sink, "AudioServerGetLatency failed");
+            g_mutex_lock( &clock->mutex );
+            clock->requestPending= FALSE;
+            g_mutex_unlock( &clock->mutex );
+            gst_object_unref( clock );
+         }
+      }
+   }
+}
+#endif
+
+static void audsrv_eos_detected( void *userData )
+{
+   GstAudsrvSink *sink= (GstAudsrvSink*)userData;
+   
+   sink->eosDetected= TRUE;
+
+   GstPad *pad= GST_BASE_SINK_PAD(sink);
+   #ifdef USE_GST1
+   GstObject *parent= gst_pad_get_parent(pad);
+   gst_audsrv_sink_event(pad, parent, gst_event_new_eos());
+   gst_object_unref(parent);
+   #else
+   gst_audsrv_sink_event(pad, gst_event_new_eos());
+   #endif
+}
+
+static void audsrv_discontinuity( void *userData, bool connected )
+{
+   GstAudsrvSink *sink= (GstAudsrvSink*)userData;
+
+   // The client library restores the session itself; audio sent while disconnected is lost
+   if ( connected )
+   {
+      GST_WARNING_OBJECT(sink, "reconnected to audio server: session restored");
+   }
+   else
+   {
+      GST_WARNING_OBJECT(sink, "lost connection to audio server");
+   }
+}
+
+static void audsrv_flush_ack( void *userData, unsigned generation )
+{
+   GstAudsrvSink *sink= (GstAudsrvSink*)userData;
+
+   // An ack for an earlier flush is superseded by the one still outstanding
+   if ( sink->flushAckPending && (generation == sink->flushGeneration) )
+   {
+      sink->flushAckPending= FALSE;
+      GST_DEBUG_OBJECT(sink, "flush %u acknowledged after %lld us",
+                       generation, getCurrentTimeMicro()-sink->flushStartTime );
+   }
+}
+
+#define readLE16( p ) ((p)[0]|((p)[1]<<8))
+#define readLE32( p ) ((p)[0]|((p)[1]<<8)|((p)[2]<<16)|((p)[3]<<24))
+
+static bool getWavInfo( unsigned char *data, int dataLen, int *codec, int *channelCount, int *sampleRate, int *bitsPerSample, int *offsetData )
+{
+   bool isWav= false;
+   unsigned char *chunkHdr;
+   unsigned char *subChunkHdr;
+   unsigned char *work;
+   int subChunkSize;
+
+   if ( dataLen >= 12 )
+   {
+      chunkHdr= &data[0];   
+      if ( 
+           (strncmp( "RIFF", (const char*)&chunkHdr[0], 4 ) == 0) &&
+           (strncmp( "WAVE", (const char*)&chunkHdr[8], 4 ) == 0)
+         )
+      {
+         *offsetData= 12;
+         for( ; ; )
          {
             if ( dataLen >= *offsetData+8 )
             {
@@ -1183,6 +3489,13 @@ gboolean gst_audsrv_sink_parse_wav( GstAudsrvSink *sink, GstBuffer *buffer )
          sink->wavParams.signedData= true;
          sink->wavParams.sampleRate= wavSampleRate;
 
+         #ifdef USE_GST1
+         if ( !sink->tunnelData )
+         {
+            gst_audsrv_sink_clock_set_byte_rate( sink, (guint64)wavSampleRate*wavChannelCount*((wavBitsPerSample+7)/8) );
+         }
+         #endif
+
          result= TRUE;
       }
 
@@ -1200,6 +3513,11 @@ audsrvsink_init(GstPlugin *plugin)
   gst_element_register(plugin, "audsrvsink", GST_RANK_NONE,
       gst_audsrv_sink_get_type());
 
+  #ifdef USE_GST1
+  gst_element_register(plugin, "audsrvsrc", GST_RANK_NONE,
+      gst_audsrv_src_get_type());
+  #endif
+
   return TRUE;
 }
 
@@ -54,6 +54,8 @@ typedef struct _GstAudsrvSinkClass GstAudsrvSinkClass;
 
 #define PROP_SOC_BASE (100)
 
+#define AUDSRV_SINK_SYNC_SAMPLES (8)
+
 #include "gstaudsrvsink-soc.h"
 
 typedef struct _GstAudsrvWavParams
@@ -73,9 +75,7 @@ struct _GstAudsrvSink
    GstCaps *caps;
    gboolean initialized;
    gboolean mayDumpPackets;
-   gboolean dumpingPackets;
-   int dumpPacketCount;
-   int dumpPacketLimit;
+   struct _GstAudsrvSinkTrace *trace;
    gboolean asyncStateChange;
    gboolean ownSession;
    guint sessionType;
@@ -90,19 +90,44 @@ struct _GstAudsrvSink
    gboolean audioOnly;
    gboolean isFlushing;
    gboolean eosDetected;
+   guint flushGeneration;
+   volatile gboolean flushAckPending;
+   long long flushStartTime;
 
    GstAudsrvWavParams wavParams;
    
    gboolean mute;
    float volume;
    long long lastSyncTime;
+   long long lastSyncCheck;
+   long long syncInterval;
+   int syncSampleCount;
+   long long syncSampleTime[AUDSRV_SINK_SYNC_SAMPLES];
+   long long syncSampleStc[AUDSRV_SINK_SYNC_SAMPLES];
    gboolean haveFirstAudioTime;
    long long firstAudioTime;
    GstSegment segment;
    gint64 position;
+
+   guint64 aggregateTime;
+   guint64 maxLatency;
+   gboolean asyncRender;
+   guint64 renderQueueTime;
+   struct _GstAudsrvSinkQueue *queue;
+   guint8 *aggregateData;
+   guint aggregateSize;
+   guint aggregateCapacity;
+   GstClockTime aggregateDuration;
+   GstClockTime aggregateNextTimestamp;
+   long long aggregateStartTime;
+   struct _GstAudsrvSinkAggregateTimer *aggregateTimer;
    
    AudSrv audsrv;
    AudSrvAudioInfo audioInfo;
+   #ifdef USE_GST1
+   GstBufferPool *pool;
+   GstClock *clock;
+   #endif
 
    struct _GstAudsrvSinkSoc soc;
 };
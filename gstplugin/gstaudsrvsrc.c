@@ -0,0 +1,646 @@
+/*
+ * Copyright (C) 2016 RDK Management
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+/**
+* @defgroup audioserver
+* @{
+* @defgroup audsrvsrc
+* @{
+**/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstaudsrvsrc.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#ifdef USE_GST1
+
+/*
+ * Source element for audio server capture sessions.  Captured data is taken from
+ * the shared capture ring with AudioServerCaptureRead directly into buffers from a
+ * pool preallocated once caps are known, so there is no allocation per chunk.  Caps
+ * follow the capture parameters and are renegotiated when they change.  Buffers are
+ * timestamped from the sample count, anchored to the running time of the first read
+ * and re-anchored after data is lost to an overrun.
+ */
+#define AUDSRV_SRC_DEFAULT_LATENCY_TIME (10000)
+#define AUDSRV_SRC_DEFAULT_BUFFER_COUNT (8)
+#define AUDSRV_SRC_DEFAULT_RING_SIZE (256*1024)
+#define AUDSRV_SRC_ENABLE_RING_TIMEOUT (2000)
+#define AUDSRV_SRC_POLL_TIMEOUT (50)
+
+#define AUDSRV_SRC_CAPS \
+        "audio/x-raw, " \
+        "format = (string) { U8, S16LE, S24LE, S32LE }, " \
+        "layout = (string) interleaved, " \
+        "rate = (int) [ 1, MAX ], " \
+        "channels = (int) [ 1, MAX ]"
+
+static GstStaticPadTemplate gst_audsrv_src_pad_template =
+GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS(AUDSRV_SRC_CAPS));
+
+GST_DEBUG_CATEGORY (gst_audsrv_src_debug);
+#define GST_CAT_DEFAULT gst_audsrv_src_debug
+
+enum
+{
+   PROP_0,
+   PROP_SESSION_NAME,
+   PROP_CAPTURE_SESSION,
+   PROP_LATENCY_TIME,
+   PROP_BUFFER_COUNT,
+   PROP_RING_SIZE
+};
+
+#define gst_audsrv_src_parent_class parent_class
+G_DEFINE_TYPE (GstAudsrvSrc, gst_audsrv_src, GST_TYPE_PUSH_SRC);
+
+static void gst_audsrv_src_finalize(GObject *object);
+static void gst_audsrv_src_set_property(GObject *object,
+    guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_audsrv_src_get_property(GObject *object,
+    guint prop_id, GValue *value, GParamSpec *pspec);
+static gboolean gst_audsrv_src_start(GstBaseSrc *bsrc);
+static gboolean gst_audsrv_src_stop(GstBaseSrc *bsrc);
+static gboolean gst_audsrv_src_unlock(GstBaseSrc *bsrc);
+static gboolean gst_audsrv_src_unlock_stop(GstBaseSrc *bsrc);
+static gboolean gst_audsrv_src_negotiate(GstBaseSrc *bsrc);
+static gboolean gst_audsrv_src_decide_allocation(GstBaseSrc *bsrc, GstQuery *query);
+static gboolean gst_audsrv_src_query(GstBaseSrc *bsrc, GstQuery *query);
+static GstFlowReturn gst_audsrv_src_fill(GstPushSrc *psrc, GstBuffer *buffer);
+static void audsrv_capture_overrun( void *userData, unsigned long long position, unsigned droppedBytes );
+
+static void
+gst_audsrv_src_class_init(GstAudsrvSrcClass *klass)
+{
+   GObjectClass *gobject_class= G_OBJECT_CLASS(klass);
+   GstElementClass *gstelement_class= GST_ELEMENT_CLASS(klass);
+   GstBaseSrcClass *gstbasesrc_class= GST_BASE_SRC_CLASS(klass);
+   GstPushSrcClass *gstpushsrc_class= GST_PUSH_SRC_CLASS(klass);
+
+   gobject_class->finalize= gst_audsrv_src_finalize;
+   gobject_class->set_property= gst_audsrv_src_set_property;
+   gobject_class->get_property= gst_audsrv_src_get_property;
+
+   gstbasesrc_class->start= gst_audsrv_src_start;
+   gstbasesrc_class->stop= gst_audsrv_src_stop;
+   gstbasesrc_class->unlock= gst_audsrv_src_unlock;
+   gstbasesrc_class->unlock_stop= gst_audsrv_src_unlock_stop;
+   gstbasesrc_class->negotiate= gst_audsrv_src_negotiate;
+   gstbasesrc_class->decide_allocation= gst_audsrv_src_decide_allocation;
+   gstbasesrc_class->query= gst_audsrv_src_query;
+   gstpushsrc_class->fill= gst_audsrv_src_fill;
+
+   g_object_class_install_property(gobject_class, PROP_SESSION_NAME,
+       g_param_spec_string ("session-name", "session name",
+           "name used to identify this capture session",
+           NULL,
+           (GParamFlags)G_PARAM_READWRITE));
+
+   g_object_class_install_property(gobject_class, PROP_CAPTURE_SESSION,
+       g_param_spec_string ("capture-session", "capture session",
+           "name of the private session to capture (NULL = main mixed output)",
+           NULL,
+           (GParamFlags)G_PARAM_READWRITE));
+
+   g_object_class_install_property(gobject_class, PROP_LATENCY_TIME,
+      g_param_spec_int64("latency-time", "latency time",
+          "Duration of audio in each buffer in microseconds",
+          1000, G_MAXINT64, AUDSRV_SRC_DEFAULT_LATENCY_TIME,
+          (GParamFlags)G_PARAM_READWRITE));
+
+   g_object_class_install_property(gobject_class, PROP_BUFFER_COUNT,
+      g_param_spec_uint("buffer-count", "buffer count",
+          "Number of buffers preallocated for captured data",
+          2, 64, AUDSRV_SRC_DEFAULT_BUFFER_COUNT,
+          (GParamFlags)G_PARAM_READWRITE));
+
+   g_object_class_install_property(gobject_class, PROP_RING_SIZE,
+      g_param_spec_uint("ring-size", "ring size",
+          "Size in bytes of the ring shared with the server for captured data",
+          4096, 16*1024*1024, AUDSRV_SRC_DEFAULT_RING_SIZE,
+          (GParamFlags)G_PARAM_READWRITE));
+
+   GST_DEBUG_CATEGORY_INIT(gst_audsrv_src_debug, "audsrvsrc", 0, "audsrvsrc element");
+
+   gst_element_class_add_pad_template(gstelement_class,
+      gst_static_pad_template_get(&gst_audsrv_src_pad_template));
+   gst_element_class_set_static_metadata (gstelement_class, "Audio Server Source",
+      "Source/Audio",
+      "Captures audio data from audio server",
+      "Comcast");
+}
+
+static void
+gst_audsrv_src_init (GstAudsrvSrc *src)
+{
+   gst_base_src_set_live(GST_BASE_SRC(src), TRUE);
+   gst_base_src_set_format(GST_BASE_SRC(src), GST_FORMAT_TIME);
+   src->sessionName= 0;
+   src->captureSessionName= 0;
+   src->latencyTime= AUDSRV_SRC_DEFAULT_LATENCY_TIME;
+   src->bufferCount= AUDSRV_SRC_DEFAULT_BUFFER_COUNT;
+   src->ringSize= AUDSRV_SRC_DEFAULT_RING_SIZE;
+   src->audsrv= 0;
+   src->captureFd= -1;
+   src->flushing= FALSE;
+   memset( &src->params, 0, sizeof(src->params) );
+   src->frameSize= 0;
+   src->blockSize= 0;
+   src->sampleOffset= 0;
+   src->nextTimestamp= GST_CLOCK_TIME_NONE;
+   src->droppedBytes= 0;
+}
+
+static void
+gst_audsrv_src_finalize(GObject *object)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(object);
+
+   g_free( src->sessionName );
+   g_free( src->captureSessionName );
+
+   G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+static void
+gst_audsrv_src_set_property(GObject *object,
+    guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(object);
+
+   switch (prop_id)
+   {
+      case PROP_SESSION_NAME:
+      case PROP_CAPTURE_SESSION:
+         {
+            const gchar *str= g_value_get_string(value);
+            gchar **target= (prop_id == PROP_SESSION_NAME) ? &src->sessionName : &src->captureSessionName;
+
+            if ( str && (strlen(str) > AUDSRV_MAX_SESSION_NAME_LEN) )
+            {
+               GST_ERROR("session name is too long: %d, max %d", strlen(str), AUDSRV_MAX_SESSION_NAME_LEN);
+            }
+            else
+            {
+               g_free( *target );
+               *target= g_strdup(str);
+            }
+         }
+         break;
+      case PROP_LATENCY_TIME:
+         src->latencyTime= g_value_get_int64(value);
+         break;
+      case PROP_BUFFER_COUNT:
+         src->bufferCount= g_value_get_uint(value);
+         break;
+      case PROP_RING_SIZE:
+         src->ringSize= g_value_get_uint(value);
+         break;
+      default:
+         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+         break;
+   }
+}
+
+static void
+gst_audsrv_src_get_property(GObject *object,
+    guint prop_id, GValue *value, GParamSpec *pspec)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(object);
+
+   switch (prop_id)
+   {
+      case PROP_SESSION_NAME:
+         g_value_set_string(value, src->sessionName);
+         break;
+      case PROP_CAPTURE_SESSION:
+         g_value_set_string(value, src->captureSessionName);
+         break;
+      case PROP_LATENCY_TIME:
+         g_value_set_int64(value, src->latencyTime);
+         break;
+      case PROP_BUFFER_COUNT:
+         g_value_set_uint(value, src->bufferCount);
+         break;
+      case PROP_RING_SIZE:
+         g_value_set_uint(value, src->ringSize);
+         break;
+      default:
+         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+         break;
+   }
+}
+
+static gboolean
+gst_audsrv_src_start(GstBaseSrc *bsrc)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(bsrc);
+   const char *serverName= getenv("AUDSRV_NAME");
+   int rc;
+
+   src->audsrv= AudioServerConnect( serverName );
+   if ( !src->audsrv )
+   {
+      GST_ERROR("failed to connect to audio server: name (%s)", (serverName ? serverName : "null") );
+      goto error;
+   }
+
+   if ( !AudioServerInitSession( src->audsrv, AUDSRV_SESSION_Capture, false, src->sessionName ) )
+   {
+      GST_ERROR("AudioServerInitSession failed: name (%s)", src->sessionName );
+      goto error;
+   }
+
+   AudioServerSetCaptureOverrunCallback( src->audsrv, audsrv_capture_overrun, src );
+
+   rc= AudioServerEnableCaptureRing( src->audsrv, src->ringSize, AUDSRV_SRC_ENABLE_RING_TIMEOUT );
+   if ( rc != 0 )
+   {
+      GST_ERROR("AudioServerEnableCaptureRing failed: ringSize %u result %d", src->ringSize, rc );
+      goto error;
+   }
+
+   src->captureFd= AudioServerGetCaptureFd( src->audsrv );
+
+   if ( !AudioServerStartCapture( src->audsrv, src->captureSessionName, NULL, NULL, src ) )
+   {
+      GST_ERROR("AudioServerStartCapture failed: session (%s)", src->captureSessionName );
+      goto error;
+   }
+
+   memset( &src->params, 0, sizeof(src->params) );
+   src->frameSize= 0;
+   src->blockSize= 0;
+   src->sampleOffset= 0;
+   src->nextTimestamp= GST_CLOCK_TIME_NONE;
+   src->droppedBytes= 0;
+
+   return TRUE;
+
+error:
+   if ( src->audsrv )
+   {
+      AudioServerDisconnect( src->audsrv );
+      src->audsrv= 0;
+   }
+   src->captureFd= -1;
+
+   return FALSE;
+}
+
+static gboolean
+gst_audsrv_src_stop(GstBaseSrc *bsrc)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(bsrc);
+
+   if ( src->audsrv )
+   {
+      AudioServerStopCapture( src->audsrv, NULL, NULL );
+      AudioServerDisconnect( src->audsrv );
+      src->audsrv= 0;
+   }
+   src->captureFd= -1;
+
+   return TRUE;
+}
+
+static gboolean
+gst_audsrv_src_unlock(GstBaseSrc *bsrc)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(bsrc);
+
+   src->flushing= TRUE;
+
+   return TRUE;
+}
+
+static gboolean
+gst_audsrv_src_unlock_stop(GstBaseSrc *bsrc)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(bsrc);
+
+   src->flushing= FALSE;
+
+   return TRUE;
+}
+
+static GstCaps* gst_audsrv_src_caps_from_params( AudSrvCaptureParameters *params )
+{
+   GstCaps *caps= NULL;
+   const gchar *format= NULL;
+
+   switch( params->bitsPerSample )
+   {
+      case 8: format= "U8"; break;
+      case 16: format= "S16LE"; break;
+      case 24: format= "S24LE"; break;
+      case 32: format= "S32LE"; break;
+      default: break;
+   }
+
+   if ( format && params->numChannels && params->sampleRate )
+   {
+      caps= gst_caps_new_simple( "audio/x-raw",
+                                 "format", G_TYPE_STRING, format,
+                                 "layout", G_TYPE_STRING, "interleaved",
+                                 "rate", G_TYPE_INT, (gint)params->sampleRate,
+                                 "channels", G_TYPE_INT, (gint)params->numChannels,
+                                 NULL );
+   }
+
+   return caps;
+}
+
+// Parameters of the next data in the capture ring, without consuming any of it
+static gboolean gst_audsrv_src_peek_params( GstAudsrvSrc *src, AudSrvCaptureParameters *params )
+{
+   unsigned char dummy;
+
+   return (AudioServerCaptureRead( src->audsrv, &dummy, 0, params ) >= 0);
+}
+
+// Wait for the capture fd to signal, giving up early when unlocked
+static void gst_audsrv_src_wait( GstAudsrvSrc *src )
+{
+   struct pollfd pfd;
+
+   pfd.fd= src->captureFd;
+   pfd.events= POLLIN;
+   pfd.revents= 0;
+   poll( &pfd, 1, AUDSRV_SRC_POLL_TIMEOUT );
+}
+
+static gboolean gst_audsrv_src_set_params( GstAudsrvSrc *src, AudSrvCaptureParameters *params )
+{
+   gboolean result= FALSE;
+   GstCaps *caps;
+   guint frames;
+
+   caps= gst_audsrv_src_caps_from_params( params );
+   if ( !caps )
+   {
+      GST_ERROR("unsupported capture parameters: channels %u bits %u rate %u",
+                params->numChannels, params->bitsPerSample, params->sampleRate );
+      goto exit;
+   }
+
+   src->params= *params;
+   src->frameSize= params->numChannels*((params->bitsPerSample+7)/8);
+   frames= (guint)gst_util_uint64_scale( params->sampleRate, src->latencyTime, G_USEC_PER_SEC );
+   src->blockSize= MAX( frames, 1 )*src->frameSize;
+   gst_base_src_set_blocksize( GST_BASE_SRC(src), src->blockSize );
+
+   GST_DEBUG_OBJECT(src, "capture params: channels %u bits %u rate %u block %u",
+                    params->numChannels, params->bitsPerSample, params->sampleRate, src->blockSize );
+
+   result= gst_base_src_set_caps( GST_BASE_SRC(src), caps );
+   gst_caps_unref( caps );
+
+exit:
+   return result;
+}
+
+static gboolean
+gst_audsrv_src_negotiate(GstBaseSrc *bsrc)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(bsrc);
+   AudSrvCaptureParameters params;
+
+   // Caps can only be fixed once the server has reported the capture format
+   for( ; ; )
+   {
+      if ( !gst_audsrv_src_peek_params( src, &params ) )
+      {
+         GST_ERROR("capture ring not available");
+         return FALSE;
+      }
+      if ( params.sampleRate )
+      {
+         break;
+      }
+      if ( src->flushing )
+      {
+         return FALSE;
+      }
+      gst_audsrv_src_wait( src );
+   }
+
+   return gst_audsrv_src_set_params( src, &params );
+}
+
+static gboolean
+gst_audsrv_src_decide_allocation(GstBaseSrc *bsrc, GstQuery *query)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(bsrc);
+   GstBufferPool *pool= NULL;
+   guint size= 0, min= 0, max= 0;
+
+   // Always use a pool so buffers for captured data are allocated up front
+   if ( gst_query_get_n_allocation_pools( query ) > 0 )
+   {
+      gst_query_parse_nth_allocation_pool( query, 0, &pool, &size, &min, &max );
+      if ( !pool )
+      {
+         pool= gst_buffer_pool_new();
+      }
+      size= MAX( size, src->blockSize );
+      min= MAX( min, src->bufferCount );
+      if ( max && (max < min) )
+      {
+         max= min;
+      }
+      gst_query_set_nth_allocation_pool( query, 0, pool, size, min, max );
+   }
+   else
+   {
+      pool= gst_buffer_pool_new();
+      gst_query_add_allocation_pool( query, pool, src->blockSize, src->bufferCount, 0 );
+   }
+   gst_object_unref( pool );
+
+   return GST_BASE_SRC_CLASS(parent_class)->decide_allocation(bsrc, query);
+}
+
+static gboolean
+gst_audsrv_src_query(GstBaseSrc *bsrc, GstQuery *query)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(bsrc);
+
+   switch (GST_QUERY_TYPE(query))
+   {
+      case GST_QUERY_LATENCY:
+         if ( src->frameSize && src->params.sampleRate )
+         {
+            GstClockTime minLatency, maxLatency;
+
+            // A block must fill before it is pushed; the ring bounds how far we may fall behind
+            minLatency= gst_util_uint64_scale( src->blockSize/src->frameSize, GST_SECOND, src->params.sampleRate );
+            maxLatency= gst_util_uint64_scale( src->ringSize/src->frameSize, GST_SECOND, src->params.sampleRate );
+            GST_DEBUG_OBJECT(src, "LATENCY: min %" GST_TIME_FORMAT " max %" GST_TIME_FORMAT,
+                             GST_TIME_ARGS(minLatency), GST_TIME_ARGS(maxLatency));
+            gst_query_set_latency( query, TRUE, minLatency, MAX( minLatency, maxLatency ) );
+            return TRUE;
+         }
+         return FALSE;
+      default:
+         return GST_BASE_SRC_CLASS(parent_class)->query(bsrc, query);
+   }
+}
+
+static GstFlowReturn
+gst_audsrv_src_fill(GstPushSrc *psrc, GstBuffer *buffer)
+{
+   GstAudsrvSrc *src= GST_AUDSRV_SRC(psrc);
+   AudSrvCaptureParameters params;
+   GstMapInfo map;
+   GstClockTime duration;
+   guint64 dropped;
+   gboolean discont= FALSE;
+   guint frames;
+   int len, rc;
+
+   for( ; ; )
+   {
+      if ( src->flushing )
+      {
+         return GST_FLOW_FLUSHING;
+      }
+
+      if ( !gst_audsrv_src_peek_params( src, &params ) )
+      {
+         GST_ERROR("capture ring not available");
+         return GST_FLOW_ERROR;
+      }
+
+      if ( (params.sampleRate != src->params.sampleRate) ||
+           (params.numChannels != src->params.numChannels) ||
+           (params.bitsPerSample != src->params.bitsPerSample) )
+      {
+         if ( !gst_audsrv_src_set_params( src, &params ) )
+         {
+            return GST_FLOW_NOT_NEGOTIATED;
+         }
+         gst_pad_mark_reconfigure( GST_BASE_SRC_PAD(src) );
+         src->nextTimestamp= GST_CLOCK_TIME_NONE;
+      }
+
+      if ( !gst_buffer_map( buffer, &map, GST_MAP_WRITE ) )
+      {
+         GST_ERROR("unable to map buffer");
+         return GST_FLOW_ERROR;
+      }
+      len= (int)((MIN( map.size, src->blockSize )/src->frameSize)*src->frameSize);
+      rc= (len > 0) ? AudioServerCaptureRead( src->audsrv, map.data, len, NULL ) : -1;
+      gst_buffer_unmap( buffer, &map );
+
+      if ( rc < 0 )
+      {
+         GST_ERROR("AudioServerCaptureRead failed: len %d", len);
+         return GST_FLOW_ERROR;
+      }
+      if ( rc > 0 )
+      {
+         break;
+      }
+
+      gst_audsrv_src_wait( src );
+   }
+
+   gst_buffer_resize( buffer, 0, rc );
+
+   GST_OBJECT_LOCK(src);
+   dropped= src->droppedBytes;
+   src->droppedBytes= 0;
+   GST_OBJECT_UNLOCK(src);
+
+   frames= rc/src->frameSize;
+   duration= gst_util_uint64_scale( frames, GST_SECOND, src->params.sampleRate );
+
+   if ( dropped && GST_CLOCK_TIME_IS_VALID(src->nextTimestamp) )
+   {
+      guint64 droppedFrames= dropped/src->frameSize;
+
+      GST_WARNING_OBJECT(src, "capture overrun: %" G_GUINT64_FORMAT " bytes lost", dropped);
+      src->nextTimestamp += gst_util_uint64_scale( droppedFrames, GST_SECOND, src->params.sampleRate );
+      src->sampleOffset += droppedFrames;
+      discont= TRUE;
+   }
+
+   if ( !GST_CLOCK_TIME_IS_VALID(src->nextTimestamp) )
+   {
+      GstClock *clock= gst_element_get_clock( GST_ELEMENT(src) );
+      GstClockTime now= 0;
+
+      // Data just read was captured over the preceding buffer duration
+      if ( clock )
+      {
+         GstClockTime time= gst_clock_get_time( clock );
+         GstClockTime base= GST_ELEMENT_CAST(src)->base_time;
+
+         now= (time > base) ? time-base : 0;
+         gst_object_unref( clock );
+      }
+      src->nextTimestamp= (now > duration) ? now-duration : 0;
+      discont= TRUE;
+   }
+
+   GST_BUFFER_PTS(buffer)= src->nextTimestamp;
+   GST_BUFFER_DTS(buffer)= GST_CLOCK_TIME_NONE;
+   GST_BUFFER_DURATION(buffer)= duration;
+   GST_BUFFER_OFFSET(buffer)= src->sampleOffset;
+   GST_BUFFER_OFFSET_END(buffer)= src->sampleOffset+frames;
+   if ( discont )
+   {
+      GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+   }
+
+   src->nextTimestamp += duration;
+   src->sampleOffset += frames;
+
+   return GST_FLOW_OK;
+}
+
+static void audsrv_capture_overrun( void *userData, unsigned long long position, unsigned droppedBytes )
+{
+   GstAudsrvSrc *src= (GstAudsrvSrc*)userData;
+
+   (void)position;
+
+   GST_OBJECT_LOCK(src);
+   src->droppedBytes += droppedBytes;
+   GST_OBJECT_UNLOCK(src);
+}
+
+#endif
+
+/** @} */
+/** @} */
+
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 RDK Management
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+/**
+* @defgroup audioserver
+* @{
+* @defgroup audsrvsrc
+* @{
+**/
+
+
+#ifndef __GST_AUDSRVSRC_H__
+#define __GST_AUDSRVSRC_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstpushsrc.h>
+
+#include "audioserver.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_AUDSRV_SRC \
+  (gst_audsrv_src_get_type())
+#define GST_AUDSRV_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_AUDSRV_SRC,GstAudsrvSrc))
+#define GST_AUDSRV_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_AUDSRV_SRC,GstAudsrvSrcClass))
+#define GST_IS_AUDSRV_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_AUDSRV_SRC))
+#define GST_IS_AUDSRV_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_AUDSRV_SRC))
+
+typedef struct _GstAudsrvSrc GstAudsrvSrc;
+typedef struct _GstAudsrvSrcClass GstAudsrvSrcClass;
+
+struct _GstAudsrvSrc
+{
+   GstPushSrc parent;
+   gchar *sessionName;
+   gchar *captureSessionName;
+   gint64 latencyTime;
+   guint bufferCount;
+   guint ringSize;
+
+   AudSrv audsrv;
+   int captureFd;
+   volatile gboolean flushing;
+   AudSrvCaptureParameters params;
+   guint frameSize;
+   guint blockSize;
+   guint64 sampleOffset;
+   GstClockTime nextTimestamp;
+   guint64 droppedBytes;
+};
+
+struct _GstAudsrvSrcClass
+{
+   GstPushSrcClass parent_class;
+};
+
+GType gst_audsrv_src_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_AUDSRVSRC_H__ */
+
+
+/** @} */
+/** @} */